@@ -0,0 +1,271 @@
+/**
+ * In-process attribute cache; see attrcache.h.
+ *
+ * The table is a fixed array of hash chains split into shards, each with its
+ * own lock, so lookups from different worker threads rarely contend.  Every
+ * invalidation bumps its shard's generation: an lstat() that was already in
+ * flight when the file changed sees the generation move and does not put its
+ * stale result into the cache.
+ */
+
+#include "attrcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_SHARDS  64		// must divide ATTR_CACHE_BUCKETS
+
+struct attr_entry {
+	uint32_t hash;
+	int error;			// 0, or -ENOENT for a negative entry
+	struct stat st;
+	int64_t expires;		// CLOCK_MONOTONIC, nanoseconds
+	struct attr_entry *next;
+	char path[];
+};
+
+struct attr_shard {
+	pthread_mutex_t lock;
+	unsigned generation;
+};
+
+static struct attr_entry *attr_buckets[ATTR_CACHE_BUCKETS];
+static struct attr_shard attr_shards[ATTR_CACHE_SHARDS] = {
+	[0 ... ATTR_CACHE_SHARDS - 1] = { PTHREAD_MUTEX_INITIALIZER, 0 }
+};
+static int64_t attr_timeout = 0;	// nanoseconds; 0 is off
+static int attr_dirfd = AT_FDCWD;
+
+void attr_cache_init(double timeout)
+{
+	attr_timeout = timeout > 0 ? (int64_t) (timeout * 1e9) : 0;
+}
+
+void attr_cache_dir(int dirfd)
+{
+	attr_dirfd = dirfd;
+}
+
+static int64_t attr_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// FNV-1a
+static uint32_t attr_hash(const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *path != '\0'; path++)
+		h = (h ^ (unsigned char) *path) * 16777619u;
+	return h;
+}
+
+static struct attr_shard *attr_shard(uint32_t hash)
+{
+	return &attr_shards[(hash % ATTR_CACHE_BUCKETS) % ATTR_CACHE_SHARDS];
+}
+
+/*
+ * Unlink path's entry from its chain, freeing expired entries met on the way
+ * so the table never holds much more than what was looked up recently.
+ * Called with the shard lock held.
+ */
+static struct attr_entry *attr_take(uint32_t hash, const char *path,
+				    int64_t now)
+{
+	struct attr_entry **p = &attr_buckets[hash % ATTR_CACHE_BUCKETS];
+	struct attr_entry *found = NULL;
+	struct attr_entry *e;
+
+	while ((e = *p) != NULL) {
+		if (found == NULL && e->hash == hash &&
+		    strcmp(e->path, path) == 0) {
+			*p = e->next;
+			found = e;
+		} else if (e->expires <= now) {
+			*p = e->next;
+			free(e);
+		} else {
+			p = &e->next;
+		}
+	}
+	return found;
+}
+
+int attr_cache_on(void)
+{
+	return attr_timeout != 0;
+}
+
+double attr_cache_timeout(void)
+{
+	return attr_timeout / 1e9;
+}
+
+// lstat() of path, or of name in dirfd if dirfd is not -1
+static int attr_stat(int dirfd, const char *name, const char *path,
+		     struct stat *st)
+{
+	int res;
+
+	if (dirfd == -1)
+		res = fstatat(attr_dirfd, path, st, AT_SYMLINK_NOFOLLOW);
+	else
+		res = fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+	return res == -1 ? -errno : 0;
+}
+
+// attr_cache_lstat(), where the lstat() can be done relative to dirfd
+static int attr_lstat(int dirfd, const char *name, const char *path,
+		      struct stat *st)
+{
+	uint32_t hash = attr_hash(path);
+	struct attr_shard *shard = attr_shard(hash);
+	struct attr_entry *e;
+	unsigned generation;
+	int64_t now;
+	int res;
+
+	if (attr_timeout == 0)
+		return attr_stat(dirfd, name, path, st);
+
+	now = attr_now();
+	pthread_mutex_lock(&shard->lock);
+	e = attr_take(hash, path, now);
+	if (e != NULL && e->expires > now) {
+		// Put it back at the front, where it will be found soonest
+		e->next = attr_buckets[hash % ATTR_CACHE_BUCKETS];
+		attr_buckets[hash % ATTR_CACHE_BUCKETS] = e;
+		res = e->error;
+		if (res == 0)
+			*st = e->st;
+		pthread_mutex_unlock(&shard->lock);
+		return res;
+	}
+	generation = shard->generation;
+	pthread_mutex_unlock(&shard->lock);
+	free(e);
+
+	res = attr_stat(dirfd, name, path, st);
+	if (res != 0 && res != -ENOENT)
+		return res;
+
+	e = malloc(sizeof(*e) + strlen(path) + 1);
+	if (e == NULL)
+		return res;
+	e->hash = hash;
+	e->error = res;
+	if (res == 0)
+		e->st = *st;
+	strcpy(e->path, path);
+
+	pthread_mutex_lock(&shard->lock);
+	if (shard->generation != generation) {
+		// The file changed while we were looking at it
+		pthread_mutex_unlock(&shard->lock);
+		free(e);
+		return res;
+	}
+	now = attr_now();
+	free(attr_take(hash, path, now));
+	e->expires = now + attr_timeout;
+	e->next = attr_buckets[hash % ATTR_CACHE_BUCKETS];
+	attr_buckets[hash % ATTR_CACHE_BUCKETS] = e;
+	pthread_mutex_unlock(&shard->lock);
+
+	return res;
+}
+
+int attr_cache_lstat(const char *path, struct stat *st)
+{
+	return attr_lstat(-1, NULL, path, st);
+}
+
+int attr_cache_lstatat(int dirfd, const char *name, const char *path,
+		       struct stat *st)
+{
+	return attr_lstat(dirfd, name, path, st);
+}
+
+int attr_cache_access(const char *path, int mask)
+{
+	struct stat st;
+
+	if (mask == F_OK)
+		return attr_cache_lstat(path, &st);
+	return faccessat(attr_dirfd, path, mask, 0) == -1 ? -errno : 0;
+}
+
+void attr_cache_invalidate(const char *path)
+{
+	uint32_t hash = attr_hash(path);
+	struct attr_shard *shard = attr_shard(hash);
+
+	if (attr_timeout == 0)
+		return;
+
+	pthread_mutex_lock(&shard->lock);
+	shard->generation++;
+	free(attr_take(hash, path, attr_now()));
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void attr_cache_invalidate_entry(const char *path)
+{
+	char *parent;
+	char *slash;
+
+	attr_cache_invalidate(path);
+
+	// The parent's link count and times change too
+	parent = strdup(path);
+	if (parent == NULL) {
+		attr_cache_invalidate_all();
+		return;
+	}
+	slash = strrchr(parent, '/');
+	if (slash != NULL) {
+		// A directory may be looked up with its slash too
+		slash[1] = '\0';
+		attr_cache_invalidate(parent);
+		slash[0] = '\0';
+		attr_cache_invalidate(parent);
+	} else if (path[0] != '\0' && strcmp(path, ".") != 0) {
+		// A relative path's parent is the directory it is relative to
+		attr_cache_invalidate(".");
+	}
+	free(parent);
+}
+
+void attr_cache_invalidate_all(void)
+{
+	struct attr_entry *e;
+	int i;
+
+	if (attr_timeout == 0)
+		return;
+
+	for (i = 0; i < ATTR_CACHE_SHARDS; i++)
+		pthread_mutex_lock(&attr_shards[i].lock);
+	for (i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+		while ((e = attr_buckets[i]) != NULL) {
+			attr_buckets[i] = e->next;
+			free(e);
+		}
+	}
+	for (i = ATTR_CACHE_SHARDS - 1; i >= 0; i--) {
+		attr_shards[i].generation++;
+		pthread_mutex_unlock(&attr_shards[i].lock);
+	}
+}
@@ -0,0 +1,53 @@
+/**
+ * A small in-process cache of lstat() results, keyed by storage path, shared
+ * by the file systems.  The kernel already caches attributes for as long as
+ * attr_timeout/entry_timeout allow, but every lookup it does make still costs
+ * us an lstat() of the storage directory; this answers those from memory.
+ * Relative paths are looked up in the directory given to attr_cache_dir().
+ *
+ * Results (including "no such file") are kept for the timeout given to
+ * attr_cache_init(), and are dropped early whenever the file system changes
+ * the file itself.  Changes made to the storage directory behind our back
+ * show up once the timeout runs out.
+ */
+
+#ifndef ATTRCACHE_H
+#define ATTRCACHE_H
+
+#include <sys/stat.h>
+
+// Sets how long, in seconds, results are kept; 0 turns the cache off
+void attr_cache_init(double timeout);
+
+// Sets the directory that relative paths are looked up in (AT_FDCWD at first)
+void attr_cache_dir(int dirfd);
+
+// Whether the cache is on at all
+int attr_cache_on(void);
+
+// How long results are kept, in seconds, as set by attr_cache_init()
+double attr_cache_timeout(void);
+
+// lstat() through the cache: 0, or -errno
+int attr_cache_lstat(const char *path, struct stat *st);
+
+/*
+ * The same for name in the open directory dirfd, whose own path path is: on
+ * a miss it is looked up relative to dirfd, without walking path again
+ */
+int attr_cache_lstatat(int dirfd, const char *name, const char *path,
+		       struct stat *st);
+
+// access() through the cache, which can only answer existence (F_OK) checks
+int attr_cache_access(const char *path, int mask);
+
+// Forget what we know about path after changing its attributes or contents
+void attr_cache_invalidate(const char *path);
+
+// Likewise after creating or removing path, which also changes its parent
+void attr_cache_invalidate_entry(const char *path);
+
+// Forget everything, e.g. after renaming a directory
+void attr_cache_invalidate_all(void);
+
+#endif /* ATTRCACHE_H */
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Run the standard fsbench workloads against the raw storage directory (as a
+# baseline) and against each file system mounted on top of it, printing one
+# tab-separated result per line:
+#   <commit> <filesystem> <workload> <parameter> <metric> <value>
+# Please run it within the root directory that contains the built binaries
+# (make bench builds them and saves the results in bench.tsv)
+# USAGE: ./bench.sh [MiB per file] [files] [versions] [filesystems...]
+
+SIZE_MB="${1:-64}"
+FILES="${2:-2000}"
+ROUNDS="${3:-1000}"
+shift $(( $# < 3 ? $# : 3 ))
+FILESYSTEMS="${*:-mirrorfs caesarfs versfs cryptfs inodefs}"
+
+COMMIT="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+WORKDIR="$(mktemp -d)"
+STGDIR="${WORKDIR}/stg"
+MOUNTDIR="${WORKDIR}/mnt"
+KEYFILE="${WORKDIR}/key"
+mkdir -p "${STGDIR}" "${MOUNTDIR}"
+# A throwaway key for cryptfs, as 32 raw bytes
+head -c 32 /dev/urandom > "${KEYFILE}"
+
+cleanup() {
+	fusermount -u "${MOUNTDIR}" 2>/dev/null
+	rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+# Mount a file system over the (empty) storage directory and wait for it
+mount_fs() {
+	local extra_args=""
+	[ "$1" = caesarfs ] && extra_args="3"
+	[ "$1" = cryptfs ] && extra_args="${KEYFILE}"
+	"./$1" "${STGDIR}" "${MOUNTDIR}" ${extra_args} 2>/dev/null
+	for _ in $(seq 50); do
+		mountpoint -q "${MOUNTDIR}" && return 0
+		sleep 0.1
+	done
+	echo "Failed to mount $1" >&2
+	exit 1
+}
+
+run() {
+	./fsbench "$1" "$2" "${SIZE_MB}" "${FILES}" "${ROUNDS}" |
+		sed "s/^/${COMMIT}\t/"
+}
+
+printf '# commit\tfilesystem\tworkload\tparameter\tmetric\tvalue\n'
+run "${STGDIR}" raw
+for FS in ${FILESYSTEMS}; do
+	rm -rf "${STGDIR:?}"/*
+	mount_fs "${FS}"
+	run "${MOUNTDIR}" "${FS}"
+	fusermount -u "${MOUNTDIR}"
+done
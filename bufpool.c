@@ -0,0 +1,112 @@
+/**
+ * Per-thread buffer pool; see bufpool.h.
+ *
+ * Every buffer is preceded by a small header giving its size class, so
+ * bufpool_put() knows where it goes.  A thread's cached buffers are freed
+ * when the thread exits.
+ */
+
+#include "bufpool.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define BUFPOOL_MIN_SHIFT 12		// 4 KiB
+#define BUFPOOL_MAX_SHIFT 20		// 1 MiB
+#define BUFPOOL_CLASSES   (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+#define BUFPOOL_KEEP      2		// buffers kept per class and thread
+#define BUFPOOL_LARGE     BUFPOOL_CLASSES	// the class of malloc()ed ones
+
+// Keeps the data that follows as aligned as malloc() would
+union bufpool_header {
+	int class;
+	max_align_t align;
+};
+
+struct bufpool_cache {
+	union bufpool_header *free[BUFPOOL_CLASSES][BUFPOOL_KEEP];
+	int count[BUFPOOL_CLASSES];
+};
+
+static pthread_key_t bufpool_key;
+static pthread_once_t bufpool_key_once = PTHREAD_ONCE_INIT;
+static __thread struct bufpool_cache *bufpool_self = NULL;
+
+static void bufpool_release(void *p)
+{
+	struct bufpool_cache *cache = p;
+	int c, i;
+
+	for (c = 0; c < BUFPOOL_CLASSES; c++)
+		for (i = 0; i < cache->count[c]; i++)
+			free(cache->free[c][i]);
+	free(cache);
+}
+
+static void bufpool_make_key(void)
+{
+	pthread_key_create(&bufpool_key, bufpool_release);
+}
+
+static struct bufpool_cache *bufpool_cache(void)
+{
+	if (bufpool_self != NULL)
+		return bufpool_self;
+
+	pthread_once(&bufpool_key_once, bufpool_make_key);
+	bufpool_self = calloc(1, sizeof(*bufpool_self));
+	if (bufpool_self != NULL)
+		pthread_setspecific(bufpool_key, bufpool_self);
+	return bufpool_self;
+}
+
+// The smallest class that holds size bytes, or BUFPOOL_LARGE
+static int bufpool_class(size_t size)
+{
+	int c = 0;
+
+	while (c < BUFPOOL_CLASSES &&
+	       ((size_t) 1 << (BUFPOOL_MIN_SHIFT + c)) < size)
+		c++;
+	return c;
+}
+
+void *bufpool_get(size_t size)
+{
+	struct bufpool_cache *cache;
+	union bufpool_header *h;
+	int c = bufpool_class(size);
+
+	if (c != BUFPOOL_LARGE && (cache = bufpool_cache()) != NULL &&
+	    cache->count[c] > 0) {
+		h = cache->free[c][--cache->count[c]];
+		return h + 1;
+	}
+
+	if (c != BUFPOOL_LARGE)
+		size = (size_t) 1 << (BUFPOOL_MIN_SHIFT + c);
+	if (size > SIZE_MAX - sizeof(*h))
+		return NULL;
+	h = malloc(sizeof(*h) + size);
+	if (h == NULL)
+		return NULL;
+	h->class = c;
+	return h + 1;
+}
+
+void bufpool_put(void *buf)
+{
+	struct bufpool_cache *cache;
+	union bufpool_header *h;
+
+	if (buf == NULL)
+		return;
+	h = (union bufpool_header *) buf - 1;
+	if (h->class != BUFPOOL_LARGE && (cache = bufpool_cache()) != NULL &&
+	    cache->count[h->class] < BUFPOOL_KEEP) {
+		cache->free[h->class][cache->count[h->class]++] = h;
+		return;
+	}
+	free(h);
+}
@@ -0,0 +1,23 @@
+/**
+ * Per-thread pool of the data buffers that requests need for a moment: the
+ * encoded copy of a write, the sealed blocks of a crypt request, the chunk
+ * a version copy goes through.  Sizes are rounded up to a power of two from
+ * 4 KiB to 1 MiB, and each thread keeps a couple of buffers of every size it
+ * has used, so a busy thread stops going to malloc() (and faulting in fresh
+ * pages) for them at all.  Larger buffers come straight from malloc().
+ *
+ * A buffer may be handed back by a different thread than took it.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+// A buffer of at least size bytes, or NULL if out of memory
+void *bufpool_get(size_t size);
+
+// Gives a buffer from bufpool_get() back; NULL is ignored
+void bufpool_put(void *buf);
+
+#endif /* BUFPOOL_H */
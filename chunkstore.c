@@ -0,0 +1,742 @@
+/**
+ * Content-addressed chunks; see chunkstore.h.
+ *
+ * The index is a hash table of every chunk in the packs, under chunk_lock,
+ * which also orders appends to the newest pack and the updates of reference
+ * counts.  Reading a chunk's data only holds chunk_packs_lock, for reading,
+ * so that its pack is not unlinked under it.  Compacting moves chunks from
+ * pack to pack a batch at a time under chunk_lock, and holds chunk_packs_lock
+ * for writing only for the last of them and the unlink.
+ */
+
+#ifdef linux
+/* For pread()/pwrite() */
+#define _XOPEN_SOURCE 700
+#endif
+
+#include "chunkstore.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "bufpool.h"
+#include "compress.h"
+
+#define CHUNK_MAGIC 0x4b4e4843u		// "CHNK"
+#define CHUNK_BATCH (1024 * 1024)	// moved at a time by chunk_compact()
+// A boundary every 8 KiB past CHUNK_MIN, on average
+#define CHUNK_MASK  ((((uint64_t) 1 << 13) - 1) << 51)
+
+// What comes before every chunk in a pack
+struct chunk_record {
+	unsigned char id[CHUNK_ID_SIZE];
+	uint32_t size;		// of the chunk
+	uint32_t stored;	// bytes that follow, fewer if compressed
+	uint32_t refs;
+	uint32_t magic;
+};
+
+struct chunk_entry {
+	unsigned char id[CHUNK_ID_SIZE];
+	uint32_t size;
+	uint32_t stored;
+	uint32_t refs;
+	int pack;
+	off_t offset;		// of its record
+	struct chunk_entry *next;
+};
+
+struct chunk_pack {
+	int fd;			// -1 once unlinked, or if there never was one
+	off_t size;
+	off_t garbage;		// bytes of the records nothing refers to
+	int dirty;		// written to since the last chunk_sync()
+};
+
+static int chunk_dir = -1;
+static int chunk_flags = 0;
+static uint64_t chunk_gear[256];
+
+static struct chunk_entry **chunk_index = NULL;
+static size_t chunk_index_size = 0;
+static size_t chunk_count = 0;
+static struct chunk_pack *chunk_packs = NULL;	// by number, from 1
+static int chunk_npacks = 0;			// the newest is the last
+static int chunk_dir_dirty = 0;			// a pack was made since
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t chunk_packs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t chunk_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t chunk_compact_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The same random numbers every time, or no boundary would be found again
+static void chunk_gear_init(void)
+{
+	uint64_t x = 0;
+	uint64_t z;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		// splitmix64
+		z = (x += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		chunk_gear[i] = z ^ (z >> 31);
+	}
+}
+
+size_t chunk_cut(const unsigned char *data, size_t size)
+{
+	size_t end = size < CHUNK_MAX ? size : CHUNK_MAX;
+	uint64_t h = 0;
+	size_t i;
+
+	if (end <= CHUNK_MIN)
+		return end;
+
+	// Each byte is shifted out of the hash 64 bytes later
+	for (i = CHUNK_MIN - 64; i < CHUNK_MIN; i++)
+		h = (h << 1) + chunk_gear[data[i]];
+	for (; i < end; i++) {
+		h = (h << 1) + chunk_gear[data[i]];
+		if ((h & CHUNK_MASK) == 0)
+			return i + 1;
+	}
+	return end;
+}
+
+static void chunk_hash(const void *data, size_t size,
+		       unsigned char id[CHUNK_ID_SIZE])
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+
+	EVP_Digest(data, size, md, NULL, EVP_blake2b512(), NULL);
+	memcpy(id, md, CHUNK_ID_SIZE);
+}
+
+static size_t chunk_bucket(const unsigned char id[CHUNK_ID_SIZE])
+{
+	size_t b;
+
+	// The name is a hash already
+	memcpy(&b, id, sizeof(b));
+	return b & (chunk_index_size - 1);
+}
+
+static void chunk_index_grow(void)
+{
+	size_t new_size = chunk_index_size ? chunk_index_size * 2 : 4096;
+	struct chunk_entry **old = chunk_index;
+	size_t old_size = chunk_index_size;
+	struct chunk_entry *e, *next;
+	size_t i;
+
+	chunk_index = calloc(new_size, sizeof(*chunk_index));
+	if (chunk_index == NULL) {
+		chunk_index = old;	// just longer chains
+		return;
+	}
+	chunk_index_size = new_size;
+	for (i = 0; i < old_size; i++) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = chunk_index[chunk_bucket(e->id)];
+			chunk_index[chunk_bucket(e->id)] = e;
+		}
+	}
+	free(old);
+}
+
+static struct chunk_entry *chunk_find(const unsigned char id[CHUNK_ID_SIZE])
+{
+	struct chunk_entry *e;
+
+	if (chunk_index_size == 0)
+		return NULL;
+	for (e = chunk_index[chunk_bucket(id)]; e != NULL; e = e->next)
+		if (memcmp(e->id, id, CHUNK_ID_SIZE) == 0)
+			return e;
+	return NULL;
+}
+
+// A new entry for id in the index, or NULL if out of memory
+static struct chunk_entry *chunk_insert(const unsigned char id[CHUNK_ID_SIZE])
+{
+	struct chunk_entry *e;
+
+	if (chunk_count >= chunk_index_size)
+		chunk_index_grow();
+	if (chunk_index_size == 0)
+		return NULL;
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return NULL;
+	memcpy(e->id, id, CHUNK_ID_SIZE);
+	e->next = chunk_index[chunk_bucket(id)];
+	chunk_index[chunk_bucket(id)] = e;
+	chunk_count++;
+	return e;
+}
+
+static void chunk_remove(struct chunk_entry *e)
+{
+	struct chunk_entry **p = &chunk_index[chunk_bucket(e->id)];
+
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	chunk_count--;
+	free(e);
+}
+
+static off_t chunk_record_size(const struct chunk_entry *e)
+{
+	return sizeof(struct chunk_record) + e->stored;
+}
+
+// Whether r cannot be the record of a chunk
+static int chunk_record_bad(const struct chunk_record *r)
+{
+	return r->magic != CHUNK_MAGIC || r->size == 0 ||
+	       r->size > CHUNK_MAX || r->stored > r->size;
+}
+
+// pwrite() all of size bytes: 0, or -errno (-EIO if it wrote fewer)
+static int chunk_pwrite(int fd, const void *buf, size_t size, off_t offset)
+{
+	ssize_t n = pwrite(fd, buf, size, offset);
+
+	if (n == (ssize_t) size)
+		return 0;
+	return n == -1 ? -errno : -EIO;
+}
+
+// Writes out the reference count of e, and counts it as garbage at none
+static int chunk_save_refs(struct chunk_entry *e)
+{
+	if (e->refs == 0)
+		chunk_packs[e->pack].garbage += chunk_record_size(e);
+	chunk_packs[e->pack].dirty = 1;
+	return chunk_pwrite(chunk_packs[e->pack].fd, &e->refs, sizeof(e->refs),
+			    e->offset + offsetof(struct chunk_record, refs));
+}
+
+// Opens (or with O_CREAT, makes) pack n: 0, or -errno
+static int chunk_pack_open(int n, int flags)
+{
+	struct chunk_pack *packs;
+	char name[32];
+	struct stat st;
+	int fd;
+
+	if (n >= chunk_npacks) {
+		packs = realloc(chunk_packs, (n + 1) * sizeof(*packs));
+		if (packs == NULL)
+			return -ENOMEM;
+		chunk_packs = packs;
+		for (; chunk_npacks <= n; chunk_npacks++) {
+			chunk_packs[chunk_npacks].fd = -1;
+			chunk_packs[chunk_npacks].dirty = 0;
+		}
+	}
+
+	snprintf(name, sizeof(name), "%d.pack", n);
+	fd = openat(chunk_dir, name, flags |
+		    (chunk_flags & CHUNK_WRITE ? O_RDWR : O_RDONLY), 0644);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -errno;
+	}
+	chunk_packs[n].fd = fd;
+	chunk_packs[n].size = st.st_size;
+	chunk_packs[n].garbage = 0;
+	chunk_packs[n].dirty = 0;
+	if (flags & O_CREAT)
+		chunk_dir_dirty = 1;
+	return 0;
+}
+
+/*
+ * Index the chunks of pack n.  One found again in a later pack was being
+ * moved there by chunk_compact() when it stopped: the later one counts.
+ */
+static int chunk_pack_load(int n)
+{
+	struct chunk_pack *p = &chunk_packs[n];
+	struct chunk_record r;
+	struct chunk_entry *e;
+	off_t pos = 0;
+
+	while (pos < p->size) {
+		if (pread(p->fd, &r, sizeof(r), pos) != sizeof(r) ||
+		    chunk_record_bad(&r) ||
+		    pos + (off_t) sizeof(r) + r.stored > p->size) {
+			// The end of a pack being appended to (at a crash, if
+			// we are the ones to write to it)
+			if ((chunk_flags & CHUNK_WRITE) &&
+			    ftruncate(p->fd, pos) == -1)
+				return -errno;
+			p->size = pos;
+			break;
+		}
+
+		// Counted as garbage already if nothing referred to it
+		e = chunk_find(r.id);
+		if (e != NULL && e->refs != 0)
+			chunk_packs[e->pack].garbage += chunk_record_size(e);
+		else if (e == NULL)
+			e = chunk_insert(r.id);
+		if (e == NULL)
+			return -ENOMEM;
+		e->size = r.size;
+		e->stored = r.stored;
+		e->refs = r.refs;
+		e->pack = n;
+		e->offset = pos;
+		if (e->refs == 0)
+			p->garbage += chunk_record_size(e);
+		pos += chunk_record_size(e);
+	}
+	return 0;
+}
+
+static int chunk_cmp(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+int chunk_store_open(int dirfd, const char *path, int flags)
+{
+	struct dirent *de;
+	int *numbers = NULL;
+	int count = 0, room = 0;
+	int res = 0;
+	int fd, i;
+	DIR *dp;
+
+	if ((flags & CHUNK_WRITE) && mkdirat(dirfd, path, 0755) == -1 &&
+	    errno != EEXIST)
+		return -errno;
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return -errno;
+	dp = fdopendir(dup(fd));
+	if (dp == NULL) {
+		close(fd);
+		return -errno;
+	}
+
+	pthread_mutex_lock(&chunk_lock);
+	chunk_dir = fd;
+	chunk_flags = flags;
+	if (!compress_supported())
+		chunk_flags &= ~CHUNK_COMPRESS;
+	chunk_gear_init();
+
+	// Oldest first, so that a chunk found twice ends up where it is newest
+	while ((de = readdir(dp)) != NULL) {
+		char *end;
+		long n = strtol(de->d_name, &end, 10);
+
+		if (end == de->d_name || strcmp(end, ".pack") != 0 || n <= 0 ||
+		    n > 1 << 30)
+			continue;
+		if (count == room) {
+			int *more = realloc(numbers, (room + 64) * sizeof(int));
+			if (more == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			numbers = more;
+			room += 64;
+		}
+		numbers[count++] = n;
+	}
+	closedir(dp);
+	if (res == 0 && count > 0)
+		qsort(numbers, count, sizeof(int), chunk_cmp);
+	for (i = 0; i < count && res == 0; i++) {
+		res = chunk_pack_open(numbers[i], 0);
+		if (res == 0)
+			res = chunk_pack_load(numbers[i]);
+	}
+	if (res == 0 && count == 0 && (flags & CHUNK_WRITE))
+		res = chunk_pack_open(1, O_CREAT | O_EXCL);
+	if (res < 0)
+		chunk_dir = -1;
+	pthread_mutex_unlock(&chunk_lock);
+
+	free(numbers);
+	return res;
+}
+
+int chunk_store_on(void)
+{
+	return chunk_dir != -1;
+}
+
+/*
+ * Appends a record and the data that goes with it to the newest pack,
+ * starting another if it is full: where it went, in e
+ */
+static int chunk_append(struct chunk_entry *e, const void *data)
+{
+	struct chunk_record r;
+	struct chunk_pack *p = &chunk_packs[chunk_npacks - 1];
+	off_t size = chunk_record_size(e);
+	int res;
+
+	if (p->size > 0 && p->size + size > CHUNK_PACK_SIZE) {
+		res = chunk_pack_open(chunk_npacks, O_CREAT | O_EXCL);
+		if (res < 0)
+			return res;
+		p = &chunk_packs[chunk_npacks - 1];
+	}
+
+	// The data first, so that the record only ever comes after it
+	p->dirty = 1;
+	memcpy(r.id, e->id, CHUNK_ID_SIZE);
+	r.size = e->size;
+	r.stored = e->stored;
+	r.refs = e->refs;
+	r.magic = CHUNK_MAGIC;
+	res = chunk_pwrite(p->fd, data, e->stored, p->size + sizeof(r));
+	if (res == 0)
+		res = chunk_pwrite(p->fd, &r, sizeof(r), p->size);
+	if (res < 0) {
+		if (ftruncate(p->fd, p->size) == -1)
+			p->size += size;	// skipped at the next load
+		return res;
+	}
+	e->pack = chunk_npacks - 1;
+	e->offset = p->size;
+	p->size += size;
+	return 0;
+}
+
+int chunk_put(const void *data, size_t size, struct chunk_ref *ref)
+{
+	struct chunk_entry *e;
+	char *packed = NULL;
+	const void *stored = data;
+	size_t len = 0;
+	int res = 0;
+
+	if (size == 0 || size > CHUNK_MAX)
+		return -EINVAL;
+	if (!(chunk_flags & CHUNK_WRITE))
+		return -EROFS;
+	memset(ref, 0, sizeof(*ref));
+	chunk_hash(data, size, ref->id);
+	ref->size = size;
+
+	pthread_rwlock_rdlock(&chunk_packs_lock);
+	pthread_mutex_lock(&chunk_lock);
+	e = chunk_find(ref->id);
+	if (e != NULL) {
+		// Garbage that is wanted again is not garbage any more
+		if (e->refs++ == 0)
+			chunk_packs[e->pack].garbage -= chunk_record_size(e);
+		res = chunk_save_refs(e);
+		pthread_mutex_unlock(&chunk_lock);
+		pthread_rwlock_unlock(&chunk_packs_lock);
+		return res;
+	}
+	pthread_mutex_unlock(&chunk_lock);
+
+	// Compressed outside the lock; another thread may store it meanwhile
+	if (chunk_flags & CHUNK_COMPRESS) {
+		packed = bufpool_get(size);
+		if (packed == NULL) {
+			pthread_rwlock_unlock(&chunk_packs_lock);
+			return -ENOMEM;
+		}
+		len = compress_block(data, size, packed);
+		if (len > 0)
+			stored = packed;
+	}
+
+	pthread_mutex_lock(&chunk_lock);
+	e = chunk_find(ref->id);
+	if (e != NULL) {
+		if (e->refs++ == 0)
+			chunk_packs[e->pack].garbage -= chunk_record_size(e);
+		res = chunk_save_refs(e);
+	} else {
+		e = chunk_insert(ref->id);
+		if (e == NULL) {
+			res = -ENOMEM;
+		} else {
+			e->size = size;
+			e->stored = len > 0 ? len : size;
+			e->refs = 1;
+			res = chunk_append(e, stored);
+			if (res < 0)
+				chunk_remove(e);
+		}
+	}
+	pthread_mutex_unlock(&chunk_lock);
+	pthread_rwlock_unlock(&chunk_packs_lock);
+
+	bufpool_put(packed);
+	return res;
+}
+
+int chunk_sync(void)
+{
+	int *fds = NULL;
+	int i, n = 0;
+	int dir;
+	int res = 0;
+
+	// One at a time, so that a chunk_sync() that finds nothing left to do
+	// is not done before the one that took it on
+	pthread_mutex_lock(&chunk_sync_lock);
+	pthread_rwlock_rdlock(&chunk_packs_lock);
+	pthread_mutex_lock(&chunk_lock);
+	if (chunk_npacks > 0)
+		fds = malloc(chunk_npacks * sizeof(*fds));
+	for (i = 0; i < chunk_npacks && fds != NULL; i++) {
+		if (chunk_packs[i].dirty) {
+			chunk_packs[i].dirty = 0;
+			fds[n++] = chunk_packs[i].fd;
+		}
+	}
+	if (chunk_npacks > 0 && fds == NULL)
+		res = -ENOMEM;
+	dir = chunk_dir_dirty;
+	chunk_dir_dirty = 0;
+	pthread_mutex_unlock(&chunk_lock);
+
+	// The packs stay open while chunk_packs_lock is held
+	for (i = 0; i < n && res == 0; i++)
+		if (fdatasync(fds[i]) == -1)
+			res = -errno;
+	if (res == 0 && dir && fsync(chunk_dir) == -1)
+		res = -errno;
+	if (res < 0) {
+		pthread_mutex_lock(&chunk_lock);
+		for (i = 0; i < chunk_npacks; i++)
+			chunk_packs[i].dirty = chunk_packs[i].fd != -1;
+		chunk_dir_dirty = 1;
+		pthread_mutex_unlock(&chunk_lock);
+	}
+	pthread_rwlock_unlock(&chunk_packs_lock);
+	pthread_mutex_unlock(&chunk_sync_lock);
+	free(fds);
+	return res;
+}
+
+int chunk_get(const struct chunk_ref *ref, void *buf)
+{
+	struct chunk_entry *e;
+	char *packed = NULL;
+	uint32_t size = 0, stored = 0;
+	off_t offset = 0;
+	int fd = -1;
+	int res = 0;
+
+	pthread_rwlock_rdlock(&chunk_packs_lock);
+	pthread_mutex_lock(&chunk_lock);
+	e = chunk_find(ref->id);
+	if (e != NULL) {
+		size = e->size;
+		stored = e->stored;
+		fd = chunk_packs[e->pack].fd;
+		offset = e->offset + sizeof(struct chunk_record);
+	}
+	pthread_mutex_unlock(&chunk_lock);
+
+	if (e == NULL || size != ref->size) {
+		res = -EIO;		// not what the file said it held
+	} else if (stored == size) {
+		if (pread(fd, buf, size, offset) != (ssize_t) size)
+			res = -EIO;
+	} else {
+		packed = bufpool_get(stored);
+		if (packed == NULL)
+			res = -ENOMEM;
+		else if (pread(fd, packed, stored, offset) != (ssize_t) stored)
+			res = -EIO;
+		else
+			res = compress_unblock(packed, stored, buf, size);
+	}
+	pthread_rwlock_unlock(&chunk_packs_lock);
+
+	bufpool_put(packed);
+	return res;
+}
+
+void chunk_unref(const struct chunk_ref *ref)
+{
+	struct chunk_entry *e;
+
+	pthread_rwlock_rdlock(&chunk_packs_lock);
+	pthread_mutex_lock(&chunk_lock);
+	e = chunk_find(ref->id);
+	if (e != NULL && e->refs > 0 && (chunk_flags & CHUNK_WRITE)) {
+		e->refs--;
+		chunk_save_refs(e);
+	}
+	pthread_mutex_unlock(&chunk_lock);
+	pthread_rwlock_unlock(&chunk_packs_lock);
+}
+
+// Syncs the packs written to, and the directory if a pack was made, with
+// chunk_lock held: 0, or -errno
+static int chunk_sync_locked(void)
+{
+	int n;
+
+	for (n = 1; n < chunk_npacks; n++) {
+		if (!chunk_packs[n].dirty)
+			continue;
+		if (fdatasync(chunk_packs[n].fd) == -1)
+			return -errno;
+		chunk_packs[n].dirty = 0;
+	}
+	if (chunk_dir_dirty) {
+		if (fsync(chunk_dir) == -1)
+			return -errno;
+		chunk_dir_dirty = 0;
+	}
+	return 0;
+}
+
+// Moves e, with its record in buf, into the newest pack if it is still in
+// pack n at offset pos and wanted: 0, or -errno
+static int chunk_move(struct chunk_entry *e, int n, off_t pos, const char *buf)
+{
+	if (e == NULL || e->pack != n || e->offset != pos || e->refs == 0)
+		return 0;
+	return chunk_append(e, buf + sizeof(struct chunk_record));
+}
+
+off_t chunk_compact(void (*pace)(off_t bytes))
+{
+	struct chunk_record r;
+	struct chunk_entry *e, *next;
+	char *buf;
+	off_t pos = 0, end = 0, len, at;
+	off_t freed = 0;
+	char name[32];
+	int best = -1;
+	int fd = -1;
+	size_t i;
+	int n, res = 0;
+
+	if (!chunk_store_on() || !(chunk_flags & CHUNK_WRITE))
+		return 0;
+	buf = bufpool_get(CHUNK_BATCH);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	// Only one compaction closes packs, so best stays open until it does;
+	// nothing else is appended to it, as it is not the newest
+	pthread_mutex_lock(&chunk_compact_lock);
+	pthread_rwlock_rdlock(&chunk_packs_lock);
+	pthread_mutex_lock(&chunk_lock);
+	for (n = 1; n < chunk_npacks - 1; n++)
+		if (chunk_packs[n].fd != -1 && chunk_packs[n].size > 0 &&
+		    chunk_packs[n].garbage * 2 >= chunk_packs[n].size &&
+		    (best == -1 ||
+		     chunk_packs[n].garbage > chunk_packs[best].garbage))
+			best = n;
+	if (best != -1) {
+		fd = chunk_packs[best].fd;
+		end = chunk_packs[best].size;
+	}
+	pthread_mutex_unlock(&chunk_lock);
+	if (best == -1) {
+		pthread_rwlock_unlock(&chunk_packs_lock);
+		pthread_mutex_unlock(&chunk_compact_lock);
+		bufpool_put(buf);
+		return 0;
+	}
+
+	// Into the newest pack, record and all, with the count as it is then,
+	// a batch at a time: read without chunk_lock, then moved with it
+	while (pos < end && res == 0) {
+		len = end - pos < CHUNK_BATCH ? end - pos : CHUNK_BATCH;
+		if (pread(fd, buf, len, pos) != len) {
+			res = -EIO;
+			break;
+		}
+		pthread_mutex_lock(&chunk_lock);
+		for (at = 0; at + (off_t) sizeof(r) <= len && res == 0;
+		     at += sizeof(r) + r.stored) {
+			memcpy(&r, buf + at, sizeof(r));
+			if (chunk_record_bad(&r)) {
+				res = -EIO;
+				break;
+			}
+			if (at + (off_t) sizeof(r) + r.stored > len) {
+				if (at == 0)
+					res = -EIO;	// past the end
+				break;		// the start of the next batch
+			}
+			res = chunk_move(chunk_find(r.id), best, pos + at,
+					 buf + at);
+		}
+		pthread_mutex_unlock(&chunk_lock);
+		pos += at;
+
+		pthread_rwlock_unlock(&chunk_packs_lock);
+		if (pace != NULL)
+			pace(len);
+		pthread_rwlock_rdlock(&chunk_packs_lock);
+	}
+	pthread_rwlock_unlock(&chunk_packs_lock);
+
+	// What moved is durable where it went before it goes where it was
+	if (res == 0)
+		res = chunk_sync();
+
+	// A chunk wanted again after its record went by is moved now, and
+	// what nothing wants is forgotten
+	pthread_rwlock_wrlock(&chunk_packs_lock);
+	pthread_mutex_lock(&chunk_lock);
+	for (i = 0; i < chunk_index_size && res == 0; i++) {
+		for (e = chunk_index[i]; e != NULL && res == 0; e = next) {
+			off_t size = chunk_record_size(e);
+
+			next = e->next;
+			if (e->pack != best)
+				continue;
+			if (e->refs == 0) {
+				chunk_remove(e);
+				continue;
+			}
+			if (pread(fd, buf, size, e->offset) != size)
+				res = -EIO;
+			else
+				res = chunk_move(e, best, e->offset, buf);
+		}
+	}
+	if (res == 0)
+		res = chunk_sync_locked();
+	if (res == 0) {
+		snprintf(name, sizeof(name), "%d.pack", best);
+		if (unlinkat(chunk_dir, name, 0) == -1)
+			res = -errno;
+		close(fd);
+		chunk_packs[best].fd = -1;
+		chunk_packs[best].dirty = 0;
+		freed = chunk_packs[best].size;
+	}
+	pthread_mutex_unlock(&chunk_lock);
+	pthread_rwlock_unlock(&chunk_packs_lock);
+	pthread_mutex_unlock(&chunk_compact_lock);
+
+	bufpool_put(buf);
+	return res < 0 ? res : freed;
+}
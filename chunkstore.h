@@ -0,0 +1,95 @@
+/**
+ * A content-addressed store of chunks of file data, shared by every file of
+ * a storage directory, which keeps each distinct chunk once however many
+ * files and versions hold it.
+ *
+ * Data is cut into chunks where its content says (chunk_cut()): a boundary
+ * falls wherever a rolling hash of the last bytes has some bits clear, so
+ * inserting or removing bytes only moves the boundaries around the change,
+ * and the chunks before and after it are found again.  A chunk is named by
+ * its BLAKE2b hash, cut to CHUNK_ID_SIZE bytes.
+ *
+ * Chunks are appended to pack files of about CHUNK_PACK_SIZE bytes each
+ * ("<n>.pack" in the store's directory), LZ4-compressed if the store was
+ * opened so and that makes them any smaller, each after a record giving its
+ * name, its sizes and how many references to it there are.  The names are
+ * indexed in memory when the store is opened, which reads the record of
+ * every chunk (and cuts off a record that a crash left half written).
+ * chunk_put() of data that is already there only counts one more reference
+ * to it; chunk_unref() counts one less, and at none the chunk is garbage,
+ * which chunk_compact() gets rid of by moving what is left of a pack into
+ * the newest one, syncing what it wrote, and unlinking it.  What chunk_put()
+ * writes is durable once chunk_sync() returns, so a list of chunks is synced
+ * after them; a crash can then leave a reference counted that nothing holds,
+ * which only keeps its chunk for good, never the other way round.
+ *
+ * All functions are safe to call from several threads at once.
+ */
+
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CHUNK_ID_SIZE   32
+#define CHUNK_MIN       (4 * 1024)	// for chunk_cut(), but the last
+#define CHUNK_MAX       (64 * 1024)
+#define CHUNK_PACK_SIZE (64 * 1024 * 1024)
+
+// What a file holding a chunk keeps of it
+struct chunk_ref {
+	unsigned char id[CHUNK_ID_SIZE];
+	uint32_t size;
+	uint32_t reserved;
+};
+
+#define CHUNK_WRITE    1	// for chunk_store_open(): to put chunks, ...
+#define CHUNK_COMPRESS 2	// ... and to compress them
+
+/*
+ * Opens the store in the directory path (relative to dirfd), as flags say,
+ * creating it if need be to write: 0, or -errno.  A store opened only to
+ * read chunks can be read while another process writes to it.
+ */
+int chunk_store_open(int dirfd, const char *path, int flags);
+
+// Whether a store is open
+int chunk_store_on(void);
+
+/*
+ * Where the first chunk of the size bytes at data ends: at most CHUNK_MAX,
+ * and size if no boundary falls before it (which is only the end of a chunk
+ * if data is all there is left)
+ */
+size_t chunk_cut(const unsigned char *data, size_t size);
+
+/*
+ * Stores size bytes (at most CHUNK_MAX) as a chunk, or takes one more
+ * reference to the chunk that already holds them, and fills in ref: 0, or
+ * -errno
+ */
+int chunk_put(const void *data, size_t size, struct chunk_ref *ref);
+
+// Reads the chunk ref names into buf, of at least ref->size bytes: 0, or -errno
+int chunk_get(const struct chunk_ref *ref, void *buf);
+
+// Gives back a reference to a chunk, taken by chunk_put()
+void chunk_unref(const struct chunk_ref *ref);
+
+/*
+ * Makes what has been put so far durable, with one fdatasync() of each pack
+ * written to since the last call, whoever wrote it: 0, or -errno
+ */
+int chunk_sync(void);
+
+/*
+ * Moves the chunks left in the pack with the most garbage into the newest,
+ * if garbage is at least half of it, and unlinks it: the size it had, 0 if
+ * no pack had enough garbage, or -errno.  pace, unless NULL, is called with
+ * no lock held after each batch read, with the bytes it was.
+ */
+off_t chunk_compact(void (*pace)(off_t bytes));
+
+#endif /* CHUNKSTORE_H */
@@ -0,0 +1,149 @@
+/**
+ * Byte-shift kernels for caesarfs.  See cipher.h.
+ */
+
+#include "cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CIPHER_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#define CIPHER_NEON
+#include <arm_neon.h>
+#endif
+
+// Kept scalar on purpose so the benchmark compares like with like
+__attribute__((optimize("no-tree-vectorize")))
+static void shift_scalar(unsigned char *buf, size_t size, unsigned char shift)
+{
+	size_t i;
+
+	for (i = 0; i < size; i += 1)
+		buf[i] += shift;
+}
+
+#ifdef CIPHER_X86
+__attribute__((target("sse2")))
+static void shift_sse2(unsigned char *buf, size_t size, unsigned char shift)
+{
+	__m128i k = _mm_set1_epi8((char) shift);
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		_mm_storeu_si128((__m128i *) (buf + i), _mm_add_epi8(v, k));
+	}
+	shift_scalar(buf + i, size - i, shift);
+}
+
+__attribute__((target("avx2")))
+static void shift_avx2(unsigned char *buf, size_t size, unsigned char shift)
+{
+	__m256i k = _mm256_set1_epi8((char) shift);
+	size_t i = 0;
+
+	// Two vectors per iteration to keep both load ports busy
+	for (; i + 64 <= size; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (buf + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (buf + i + 32));
+		_mm256_storeu_si256((__m256i *) (buf + i), _mm256_add_epi8(a, k));
+		_mm256_storeu_si256((__m256i *) (buf + i + 32),
+				    _mm256_add_epi8(b, k));
+	}
+	for (; i + 32 <= size; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (buf + i));
+		_mm256_storeu_si256((__m256i *) (buf + i), _mm256_add_epi8(a, k));
+	}
+	shift_scalar(buf + i, size - i, shift);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void shift_avx512(unsigned char *buf, size_t size, unsigned char shift)
+{
+	__m512i k = _mm512_set1_epi8((char) shift);
+	size_t i = 0;
+
+	for (; i + 64 <= size; i += 64) {
+		__m512i v = _mm512_loadu_si512((const void *) (buf + i));
+		_mm512_storeu_si512((void *) (buf + i), _mm512_add_epi8(v, k));
+	}
+	// The tail is done with a masked load/store rather than a scalar loop
+	if (i < size) {
+		__mmask64 m = ~0ULL >> (64 - (size - i));
+		__m512i v = _mm512_maskz_loadu_epi8(m, buf + i);
+		_mm512_mask_storeu_epi8(buf + i, m, _mm512_add_epi8(v, k));
+	}
+}
+
+static int has_sse2(void)   { return __builtin_cpu_supports("sse2"); }
+static int has_avx2(void)   { return __builtin_cpu_supports("avx2"); }
+static int has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+	       __builtin_cpu_supports("avx512bw");
+}
+#endif /* CIPHER_X86 */
+
+#ifdef CIPHER_NEON
+static void shift_neon(unsigned char *buf, size_t size, unsigned char shift)
+{
+	uint8x16_t k = vdupq_n_u8(shift);
+	size_t i = 0;
+
+	for (; i + 32 <= size; i += 32) {
+		uint8x16_t a = vld1q_u8(buf + i);
+		uint8x16_t b = vld1q_u8(buf + i + 16);
+		vst1q_u8(buf + i, vaddq_u8(a, k));
+		vst1q_u8(buf + i + 16, vaddq_u8(b, k));
+	}
+	for (; i + 16 <= size; i += 16)
+		vst1q_u8(buf + i, vaddq_u8(vld1q_u8(buf + i), k));
+	shift_scalar(buf + i, size - i, shift);
+}
+#endif /* CIPHER_NEON */
+
+static const struct cipher_impl impls[] = {
+#ifdef CIPHER_X86
+	{ "avx512", has_avx512, shift_avx512 },
+	{ "avx2",   has_avx2,   shift_avx2   },
+	{ "sse2",   has_sse2,   shift_sse2   },
+#endif
+#ifdef CIPHER_NEON
+	{ "neon",   NULL,       shift_neon   },
+#endif
+	{ "scalar", NULL,       shift_scalar },
+	{ NULL,     NULL,       NULL         },
+};
+
+static const struct cipher_impl *selected = &impls[sizeof(impls) /
+						   sizeof(impls[0]) - 2];
+
+void cipher_init(void)
+{
+	const struct cipher_impl *impl;
+
+#ifdef CIPHER_X86
+	__builtin_cpu_init();
+#endif
+	for (impl = impls; impl->name != NULL; impl++) {
+		if (impl->supported == NULL || impl->supported()) {
+			selected = impl;
+			return;
+		}
+	}
+}
+
+const char *cipher_name(void)
+{
+	return selected->name;
+}
+
+void cipher_shift(unsigned char *buf, size_t size, unsigned char shift)
+{
+	selected->shift(buf, size, shift);
+}
+
+const struct cipher_impl *cipher_impls(void)
+{
+	return impls;
+}
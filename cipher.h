@@ -0,0 +1,31 @@
+/**
+ * The byte-shift kernel behind caesarfs's Caesar cipher.  There is a plain C
+ * version plus SIMD versions for the instruction sets we know about; the
+ * fastest one the CPU supports is picked at run time by cipher_init().
+ */
+
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stddef.h>
+
+struct cipher_impl {
+	const char *name;
+	int (*supported)(void);		// NULL if always available
+	void (*shift)(unsigned char *buf, size_t size, unsigned char shift);
+};
+
+// Picks the fastest supported kernel; call once before cipher_shift()
+void cipher_init(void);
+
+// Name of the kernel cipher_init() picked
+const char *cipher_name(void);
+
+// Adds shift to every byte of buf in place (mod 256).  Subtract by passing
+// the negated shift.
+void cipher_shift(unsigned char *buf, size_t size, unsigned char shift);
+
+// Every kernel compiled in, fastest first, terminated by a NULL name
+const struct cipher_impl *cipher_impls(void);
+
+#endif /* CIPHER_H */
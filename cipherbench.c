@@ -0,0 +1,80 @@
+/**
+ * Microbenchmark for the caesarfs shift kernels.  Runs every kernel the CPU
+ * supports over the same buffer and reports its throughput in GB/s.
+ *
+ * USAGE: ./cipherbench [buffer MiB] [passes]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cipher.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = (argc > 1 ? atoi(argv[1]) : 64) * (size_t) 1024 * 1024;
+	int passes = argc > 2 ? atoi(argv[2]) : 20;
+	const struct cipher_impl *impl;
+	unsigned char *buf = malloc(size);
+	unsigned char *expect = malloc(size);
+	size_t i;
+
+	if (buf == NULL || expect == NULL || passes <= 0) {
+	  fprintf(stderr, "USAGE: %s [buffer MiB] [passes]\n", argv[0]);
+	  return 1;
+	}
+
+	// Something other than a constant to shift
+	for (i = 0; i < size; i += 1)
+		expect[i] = (unsigned char) (i * 31 + 7);
+
+	cipher_init();
+	printf("%-8s %10s   (selected: %s, %zu MiB x %d passes)\n",
+	       "kernel", "GB/s", cipher_name(), size >> 20, passes);
+
+	for (impl = cipher_impls(); impl->name != NULL; impl++) {
+		double start, elapsed;
+		int p;
+
+		if (impl->supported != NULL && !impl->supported()) {
+			printf("%-8s %10s\n", impl->name, "n/a");
+			continue;
+		}
+
+		// Check it agrees with plain arithmetic, tail included
+		memcpy(buf, expect, size);
+		impl->shift(buf, size - 3, 200);
+		for (i = 0; i < size; i += 1) {
+			unsigned char want = i < size - 3 ?
+				(unsigned char) (expect[i] + 200) : expect[i];
+			if (buf[i] != want) {
+				printf("%-8s    MISMATCH at byte %zu\n",
+				       impl->name, i);
+				return 1;
+			}
+		}
+
+		impl->shift(buf, size, 1);	// warm up
+		start = now();
+		for (p = 0; p < passes; p += 1)
+			impl->shift(buf, size, (unsigned char) p);
+		elapsed = now() - start;
+
+		printf("%-8s %10.2f\n", impl->name,
+		       (double) size * passes / elapsed / 1e9);
+	}
+
+	free(buf);
+	free(expect);
+	return 0;
+}
@@ -0,0 +1,287 @@
+/**
+ * Block-compressed files; see compress.h.
+ *
+ * compress_copy() compresses one block at a time through two bounded
+ * buffers, writing the blocks as it goes and the offset table, whose size
+ * is known from the start, last.
+ */
+
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#define COMPRESS_BOUND LZ4_COMPRESSBOUND(COMPRESS_BLOCK_SIZE)
+#else
+#define COMPRESS_BOUND COMPRESS_BLOCK_SIZE
+#endif
+
+int compress_supported(void)
+{
+#ifdef HAVE_LZ4
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+// Like pread(), but only ever short at the end of the file
+static ssize_t compress_read_full(int fd, void *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pread(fd, (char *) buf + done, size - done,
+				  offset + done);
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+#ifdef HAVE_LZ4
+// pwrite() all of size bytes, going on after a short write: 0, or -errno
+static int compress_write_full(int fd, const void *buf, size_t size,
+			       off_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pwrite(fd, (const char *) buf + done, size - done,
+				   offset + done);
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		done += n;
+	}
+	return 0;
+}
+#endif
+
+int compress_copy(int in_fd, off_t size, int out_fd)
+{
+#ifdef HAVE_LZ4
+	struct compress_header header;
+	uint32_t blocks = (size + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+	size_t index_size = (blocks + 1) * sizeof(uint64_t);
+	uint64_t *index = malloc(index_size);
+	char *block = malloc(COMPRESS_BLOCK_SIZE);
+	char *packed = malloc(COMPRESS_BOUND);
+	off_t pos = sizeof(header) + index_size;
+	uint32_t i;
+	int res = 0;
+
+	if (index == NULL || block == NULL || packed == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < blocks; i++) {
+		off_t offset = (off_t) i * COMPRESS_BLOCK_SIZE;
+		size_t want = size - offset < COMPRESS_BLOCK_SIZE ?
+			      size - offset : COMPRESS_BLOCK_SIZE;
+		const char *data = packed;
+		ssize_t n = compress_read_full(in_fd, block, want, offset);
+		int len;
+
+		if (n < 0 || (size_t) n != want) {
+			res = n < 0 ? n : -EIO;	// shorter than it claimed
+			goto out;
+		}
+
+		// Blocks that do not shrink are kept as they are
+		len = LZ4_compress_default(block, packed, want, COMPRESS_BOUND);
+		if (len <= 0 || (size_t) len >= want) {
+			data = block;
+			len = want;
+		}
+		res = compress_write_full(out_fd, data, len, pos);
+		if (res < 0)
+			goto out;
+		index[i] = pos;
+		pos += len;
+	}
+	index[blocks] = pos;
+
+	memcpy(header.magic, COMPRESS_MAGIC, sizeof(header.magic));
+	header.size = size;
+	header.block_size = COMPRESS_BLOCK_SIZE;
+	header.blocks = blocks;
+	res = compress_write_full(out_fd, &header, sizeof(header), 0);
+	if (res == 0)
+		res = compress_write_full(out_fd, index, index_size,
+					  sizeof(header));
+
+out:
+	free(packed);
+	free(block);
+	free(index);
+	return res;
+#else
+	(void) in_fd;
+	(void) size;
+	(void) out_fd;
+	return -ENOTSUP;
+#endif
+}
+
+int compress_open(struct compress_file *z, int fd)
+{
+	struct compress_header *h = &z->header;
+	size_t index_size;
+	ssize_t n;
+
+	memset(z, 0, sizeof(*z));
+	z->fd = fd;
+	z->cached = -1;
+
+	n = compress_read_full(fd, h, sizeof(*h), 0);
+	if (n < 0)
+		return n;
+	if (n != sizeof(*h) ||
+	    memcmp(h->magic, COMPRESS_MAGIC, sizeof(h->magic)) != 0)
+		return -EINVAL;
+	if (h->block_size == 0 || h->block_size > COMPRESS_BLOCK_SIZE ||
+	    (uint64_t) h->blocks * h->block_size < h->size)
+		return -EIO;
+
+	index_size = (h->blocks + 1) * sizeof(uint64_t);
+	z->index = malloc(index_size);
+	z->block = malloc(h->block_size);
+	z->packed = malloc(COMPRESS_BOUND);
+	if (z->index == NULL || z->block == NULL || z->packed == NULL) {
+		compress_close(z);
+		return -ENOMEM;
+	}
+	n = compress_read_full(fd, z->index, index_size, sizeof(*h));
+	if (n < 0 || (size_t) n != index_size) {
+		compress_close(z);
+		return n < 0 ? n : -EIO;
+	}
+	return 0;
+}
+
+// Makes z->block hold block i
+static int compress_load(struct compress_file *z, uint32_t i)
+{
+	const struct compress_header *h = &z->header;
+	uint64_t offset = (uint64_t) i * h->block_size;
+	size_t want = h->size - offset < h->block_size ?
+		      h->size - offset : h->block_size;
+	uint64_t len = z->index[i + 1] - z->index[i];
+	ssize_t n;
+
+	if (z->cached == i)
+		return 0;
+	z->cached = -1;
+
+	if (z->index[i + 1] < z->index[i] || len > COMPRESS_BOUND)
+		return -EIO;
+
+	// A block stored as it is says so by not being any smaller
+	if (len == want) {
+		n = compress_read_full(z->fd, z->block, want, z->index[i]);
+		if (n < 0)
+			return n;
+		if ((size_t) n != want)
+			return -EIO;
+		z->cached = i;
+		return 0;
+	}
+
+#ifdef HAVE_LZ4
+	n = compress_read_full(z->fd, z->packed, len, z->index[i]);
+	if (n < 0)
+		return n;
+	if ((uint64_t) n != len ||
+	    LZ4_decompress_safe(z->packed, z->block, len, want) !=
+	    (int) want)
+		return -EIO;
+	z->cached = i;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+ssize_t compress_pread(struct compress_file *z, void *buf, size_t size,
+		       off_t offset)
+{
+	const struct compress_header *h = &z->header;
+	size_t done = 0;
+	int res;
+
+	if (offset < 0)
+		return -EINVAL;
+	if ((uint64_t) offset >= h->size)
+		return 0;
+	if (size > h->size - offset)
+		size = h->size - offset;
+
+	while (done < size) {
+		uint64_t pos = offset + done;
+		uint32_t i = pos / h->block_size;
+		size_t skip = pos - (uint64_t) i * h->block_size;
+		size_t n = h->block_size - skip;
+
+		res = compress_load(z, i);
+		if (res < 0)
+			return res;
+		if (n > size - done)
+			n = size - done;
+		memcpy((char *) buf + done, z->block + skip, n);
+		done += n;
+	}
+	return done;
+}
+
+void compress_close(struct compress_file *z)
+{
+	free(z->packed);
+	free(z->block);
+	free(z->index);
+	z->packed = NULL;
+	z->block = NULL;
+	z->index = NULL;
+	z->cached = -1;
+}
+
+size_t compress_block(const void *src, size_t size, void *dst)
+{
+#ifdef HAVE_LZ4
+	int len;
+
+	if (size < 2)
+		return 0;
+	len = LZ4_compress_default(src, dst, size, size - 1);
+	return len > 0 ? (size_t) len : 0;
+#else
+	(void) src;
+	(void) size;
+	(void) dst;
+	return 0;
+#endif
+}
+
+int compress_unblock(const void *src, size_t len, void *dst, size_t size)
+{
+#ifdef HAVE_LZ4
+	if (LZ4_decompress_safe(src, dst, len, size) != (int) size)
+		return -EIO;
+	return 0;
+#else
+	(void) src;
+	(void) len;
+	(void) dst;
+	(void) size;
+	return -ENOTSUP;
+#endif
+}
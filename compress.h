@@ -0,0 +1,72 @@
+/**
+ * Block-compressed files with random access.
+ *
+ * The data is cut into fixed-size blocks (COMPRESS_BLOCK_SIZE) that are each
+ * compressed on their own with LZ4, and a table of where every block starts
+ * is kept at the front of the file:
+ *
+ *   header | offset of block 0 ... offset of block n-1, end | blocks
+ *
+ * so compress_pread() only has to read and decompress the blocks that the
+ * range it is asked for touches.  A block that does not get any smaller is
+ * stored as it is.
+ *
+ * LZ4 is only used if it was found at build time (HAVE_LZ4); without it
+ * compress_copy() and reading compressed data fail with ENOTSUP.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define COMPRESS_MAGIC      "SFSLZ4B1"
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+
+struct compress_header {
+	char     magic[8];
+	uint64_t size;		// size of the data once decompressed
+	uint32_t block_size;
+	uint32_t blocks;
+};
+
+// An open compressed file
+struct compress_file {
+	int fd;
+	struct compress_header header;
+	uint64_t *index;	// blocks + 1 file offsets
+	char *block;		// the last block decompressed, ...
+	int64_t cached;		// ... and its number, or -1
+	char *packed;		// room for one compressed block
+};
+
+// Whether compress_copy() can be used at all
+int compress_supported(void);
+
+// Writes the first size bytes of in_fd to out_fd, compressed: 0, or -errno
+int compress_copy(int in_fd, off_t size, int out_fd);
+
+/*
+ * Starts reading fd: 0, -EINVAL if fd does not hold compressed data, or
+ * another -errno.  fd stays the caller's to close.
+ */
+int compress_open(struct compress_file *z, int fd);
+
+// pread() of the decompressed data: the number of bytes read, or -errno
+ssize_t compress_pread(struct compress_file *z, void *buf, size_t size,
+		       off_t offset);
+
+void compress_close(struct compress_file *z);
+
+/*
+ * Compresses the size bytes at src on their own into dst, which has room for
+ * size bytes too: the length they came to, or 0 if they would not get any
+ * smaller (or there is no LZ4)
+ */
+size_t compress_block(const void *src, size_t size, void *dst);
+
+// Decompresses what compress_block() made of size bytes: 0, or -errno
+int compress_unblock(const void *src, size_t len, void *dst, size_t size);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,1073 @@
+/**
+ * The passthrough engine shared by every smartfs mode.  Each operation here
+ * simply carries out the same action on the storage directory; a mode takes
+ * the whole table from core_operations() and replaces the entries it needs
+ * to behave differently.  This is also where the event loop lives.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef linux
+/* For pread()/pwrite()/utimensat(), and copy_file_range() */
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
+#endif
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include "attrcache.h"
+#include "bufpool.h"
+#include "parallel.h"
+#include "smartfs.h"
+#include "trace.h"
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+char* storage_dir = NULL;
+int storage_fd = AT_FDCWD;
+
+/*
+ * Every operation works on the storage directory through storage_fd, opened
+ * once at mount, with the *at() calls: a mount path only loses its leading
+ * slash to become the storage path, so nothing is copied (or has to fit in a
+ * buffer) on the way.
+ */
+const char *storage_rel(const char *path)
+{
+	while (*path == '/')
+		path++;
+	return *path != '\0' ? path : ".";
+}
+
+void invalidate_attrs(const char *path)
+{
+	attr_cache_invalidate(storage_rel(path));
+}
+
+/*
+ * A name a mode keeps its own data under in the storage directory (versfs's
+ * version stores), which is not part of the mount: it is left out of
+ * listings, cannot be looked up, and cannot be created.
+ */
+static const char *core_hidden = NULL;
+static size_t core_hidden_len = 0;
+
+void core_hide_name(const char *name)
+{
+	core_hidden = name;
+	core_hidden_len = strlen(name);
+}
+
+int core_is_hidden(const char *path)
+{
+	const char *p = path;
+
+	if (core_hidden == NULL)
+		return 0;
+	while ((p = strstr(p, core_hidden)) != NULL) {
+		if (p > path && p[-1] == '/' &&
+		    (p[core_hidden_len] == '\0' || p[core_hidden_len] == '/'))
+			return 1;
+		p += core_hidden_len;
+	}
+	return 0;
+}
+
+/*
+ * Data layers
+ *
+ * File data passes through every layer on its way to the storage directory
+ * (in the order they were added) and back again on its way out (in reverse).
+ * Layers work in place, so however many there are, a write is encoded in a
+ * single buffer, usually the FUSE request itself, and a read is decoded in
+ * the reply.  Large requests are cut into chunks that are run through the
+ * layers side by side on the transform pool (parallel.h).
+ */
+
+#define CORE_MAX_LAYERS 8
+
+static const struct smartfs_layer *core_layers[CORE_MAX_LAYERS];
+static int core_nlayers = 0;
+
+int core_add_layer(const struct smartfs_layer *layer)
+{
+	if (core_nlayers == CORE_MAX_LAYERS)
+		return -1;
+	core_layers[core_nlayers++] = layer;
+	return 0;
+}
+
+int core_layered(void)
+{
+	return core_nlayers > 0;
+}
+
+// Runs size bytes at buf, copied from src first unless it is NULL, through
+// the layers on one thread
+static void core_transform_serial(char *buf, const char *src, size_t size,
+				  off_t offset, int encode)
+{
+	int i;
+
+	if (src != NULL)
+		memcpy(buf, src, size);
+	if (encode)
+		for (i = 0; i < core_nlayers; i++)
+			core_layers[i]->encode((unsigned char *) buf, size,
+					       offset);
+	else
+		for (i = core_nlayers - 1; i >= 0; i--)
+			core_layers[i]->decode((unsigned char *) buf, size,
+					       offset);
+}
+
+struct core_transform {
+	char *buf;
+	const char *src;
+	size_t size;
+	off_t offset;
+	int encode;
+};
+
+static void core_transform_chunk(void *arg, size_t i)
+{
+	struct core_transform *t = arg;
+	size_t start = i * PARALLEL_CHUNK;
+	size_t size = t->size - start < PARALLEL_CHUNK ? t->size - start :
+		      PARALLEL_CHUNK;
+
+	core_transform_serial(t->buf + start,
+			      t->src != NULL ? t->src + start : NULL, size,
+			      t->offset + start, t->encode);
+}
+
+static void core_transform(char *buf, const char *src, size_t size,
+			   off_t offset, int encode)
+{
+	struct core_transform t = { buf, src, size, offset, encode };
+
+	if (!parallel_worth(size) || core_nlayers == 0) {
+		core_transform_serial(buf, src, size, offset, encode);
+		return;
+	}
+	parallel_run((size + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK,
+		     core_transform_chunk, &t);
+}
+
+void core_encode(char *buf, size_t size, off_t offset)
+{
+	core_transform(buf, NULL, size, offset, 1);
+}
+
+void core_decode(char *buf, size_t size, off_t offset)
+{
+	core_transform(buf, NULL, size, offset, 0);
+}
+
+ssize_t core_pread(int fd, char *buf, size_t size, off_t offset)
+{
+	ssize_t res;
+
+	res = pread(fd, buf, size, offset);
+	if (res == -1)
+		return -errno;
+
+	core_decode(buf, res, offset);
+	return res;
+}
+
+const char *core_encode_copy(const char *buf, size_t size, off_t offset,
+			     char **copy)
+{
+	*copy = NULL;
+	if (!core_layered())
+		return buf;
+
+	*copy = bufpool_get(size);
+	if (*copy == NULL)
+		return NULL;
+	// Each chunk is copied by the thread that encodes it
+	core_transform(*copy, buf, size, offset, 1);
+	return *copy;
+}
+
+/*
+ * FUSE hands write_buf the request buffer itself, which is ours to modify,
+ * so the data can be encoded in place with no copy.  Only data that arrives
+ * in a pipe (FUSE_BUF_IS_FD) or in pieces has to be pulled into memory first.
+ */
+ssize_t core_encode_bufvec(struct fuse_bufvec *buf, off_t offset,
+			   char **data, char **copy)
+{
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+	ssize_t res;
+
+	*copy = NULL;
+	if (buf->count == 1 && buf->off == 0 &&
+	    !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		*data = buf->buf[0].mem;
+	} else {
+		*copy = bufpool_get(size);
+		if (*copy == NULL)
+			return -ENOMEM;
+		mem.buf[0].mem = *copy;
+		res = fuse_buf_copy(&mem, buf, 0);
+		if (res < 0) {
+			bufpool_put(*copy);
+			*copy = NULL;
+			return res;
+		}
+		size = res;
+		*data = *copy;
+	}
+
+	core_encode(*data, size, offset);
+	return size;
+}
+
+#define CORE_COPY_CHUNK (1024 * 1024)
+
+int core_copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off,
+		    off_t length)
+{
+	char *buf;
+	ssize_t n, written;
+	int res = 0;
+
+	while (length > 0) {
+		size_t want = length < (1 << 30) ? length : (1 << 30);
+
+		// Both offsets move on by however much was copied
+		n = copy_file_range(in_fd, &in_off, out_fd, &out_off, want, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno != EXDEV && errno != ENOSYS &&
+		    errno != EINVAL && errno != EOPNOTSUPP)
+			return -errno;
+		if (n == -1)
+			break;		// not between these two files
+		if (n == 0)
+			return -EIO;
+		length -= n;
+	}
+	if (length == 0)
+		return 0;
+
+	buf = bufpool_get(CORE_COPY_CHUNK);
+	if (buf == NULL)
+		return -ENOMEM;
+	while (length > 0) {
+		size_t want = length < CORE_COPY_CHUNK ? length : CORE_COPY_CHUNK;
+
+		n = pread(in_fd, buf, want, in_off);
+		if (n == -1) {
+			res = -errno;
+			break;
+		}
+		if (n == 0) {
+			res = -EIO;	// the source is shorter than it claimed
+			break;
+		}
+		written = pwrite(out_fd, buf, n, out_off);
+		if (written != n) {
+			res = written == -1 ? -errno : -EIO;
+			break;
+		}
+		in_off  += n;
+		out_off += n;
+		length  -= n;
+	}
+	bufpool_put(buf);
+	return res;
+}
+
+static int core_getattr(const char *path, struct stat *stbuf)
+{
+	int res;
+	
+	if (core_is_hidden(path))
+		return -ENOENT;
+	path = storage_rel(path);
+	res = attr_cache_lstat(path, stbuf);
+
+	return res;
+}
+
+static int core_access(const char *path, int mask)
+{
+	int res;
+
+	if (core_is_hidden(path))
+		return -ENOENT;
+	path = storage_rel(path);
+	res = attr_cache_access(path, mask);
+
+	return res;
+}
+
+static int core_readlink(const char *path, char *buf, size_t size)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = readlinkat(storage_fd, path, buf, size - 1);
+	if (res == -1)
+		return -errno;
+
+	buf[res] = '\0';
+	return 0;
+}
+
+
+/*
+ * Directories are listed a page at a time: the directory stays open between
+ * readdir calls, and each entry is handed over with the telldir() position
+ * after it, so FUSE can ask for the next page from there.  With the
+ * attribute cache on, each entry's attributes are looked up as it is listed
+ * (relative to the open directory, without walking its path again), so the
+ * getattr calls that usually follow a listing are answered from memory.
+ */
+
+struct core_dir {
+	DIR *dp;
+	struct dirent *entry;	// read, but not yet taken by FUSE
+	off_t offset;		// where entry came from
+	char path[];		// storage path of the directory
+};
+
+static struct core_dir *core_dir(struct fuse_file_info *fi)
+{
+	return (struct core_dir *) (uintptr_t) fi->fh;
+}
+
+static int core_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct core_dir *d;
+	int fd;
+	int res;
+
+	path = storage_rel(path);
+	d = malloc(sizeof(*d) + strlen(path) + 1);
+	if (d == NULL)
+		return -ENOMEM;
+
+	strcpy(d->path, path);
+	fd = openat(storage_fd, path, O_RDONLY | O_DIRECTORY);
+	d->dp = fd != -1 ? fdopendir(fd) : NULL;
+	if (d->dp == NULL) {
+		res = -errno;
+		if (fd != -1)
+			close(fd);
+		free(d);
+		return res;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+
+	fi->fh = (uintptr_t) d;
+	return 0;
+}
+
+static int core_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	struct core_dir *d = core_dir(fi);
+	int root = strcmp(d->path, ".") == 0;
+
+	(void) path;
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	for (;;) {
+		struct stat st, full;
+		off_t next;
+
+		if (d->entry == NULL) {
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				break;
+		}
+		next = telldir(d->dp);
+
+		if (core_hidden != NULL &&
+		    strcmp(d->entry->d_name, core_hidden) == 0) {
+			d->entry = NULL;
+			d->offset = next;
+			continue;
+		}
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		if (attr_cache_on() && strcmp(d->entry->d_name, ".") != 0 &&
+		    strcmp(d->entry->d_name, "..") != 0) {
+			char entry_path[strlen(d->path) +
+					strlen(d->entry->d_name) + 2];
+
+			if (root)
+				strcpy(entry_path, d->entry->d_name);
+			else
+				sprintf(entry_path, "%s/%s", d->path,
+					d->entry->d_name);
+			if (attr_cache_lstatat(dirfd(d->dp), d->entry->d_name,
+					       entry_path, &full) == 0)
+				st = full;
+		}
+
+		if (filler(buf, d->entry->d_name, &st, next))
+			break;
+		d->entry = NULL;
+		d->offset = next;
+	}
+
+	return 0;
+}
+
+static int core_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct core_dir *d = core_dir(fi);
+
+	(void) path;
+	closedir(d->dp);
+	free(d);
+	return 0;
+}
+
+static int core_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	if (core_is_hidden(path))
+		return -EPERM;
+
+	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
+	   is more portable */
+	path = storage_rel(path);
+	if (S_ISREG(mode)) {
+		res = openat(storage_fd, path, O_CREAT | O_EXCL | O_WRONLY,
+			     mode);
+		if (res >= 0)
+			res = close(res);
+	} else if (S_ISFIFO(mode))
+		res = mkfifoat(storage_fd, path, mode);
+	else
+		res = mknodat(storage_fd, path, mode, rdev);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate_entry(path);
+
+	return 0;
+}
+
+static int core_mkdir(const char *path, mode_t mode)
+{
+	int res;
+
+	if (core_is_hidden(path))
+		return -EPERM;
+	path = storage_rel(path);
+	res = mkdirat(storage_fd, path, mode);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate_entry(path);
+
+	return 0;
+}
+
+static int core_unlink(const char *path)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = unlinkat(storage_fd, path, 0);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate_entry(path);
+
+	return 0;
+}
+
+static int core_rmdir(const char *path)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = unlinkat(storage_fd, path, AT_REMOVEDIR);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate_entry(path);
+
+	return 0;
+}
+
+static int core_symlink(const char *from, const char *to)
+{
+	int res;
+	char target[strlen(storage_dir) + strlen(from) + 1];
+
+	if (core_is_hidden(to))
+		return -EPERM;
+	// The link points into the storage directory, as it always has
+	sprintf(target, "%s%s", storage_dir, from);
+	to = storage_rel(to);
+	res = symlinkat(target, storage_fd, to);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate_entry(to);
+
+	return 0;
+}
+
+static int core_rename(const char *from, const char *to)
+{
+	int res;
+
+	if (core_is_hidden(to))
+		return -EPERM;
+	from = storage_rel(from);
+	to   = storage_rel(to  );
+
+	// Everything below a directory moves with it
+	struct stat st;
+	int is_dir = attr_cache_lstat(from, &st) == 0 &&
+		     S_ISDIR(st.st_mode);
+
+	res = renameat(storage_fd, from, storage_fd, to);
+	if (res == -1)
+		return -errno;
+
+	if (is_dir) {
+		attr_cache_invalidate_all();
+	} else {
+		attr_cache_invalidate_entry(from);
+		attr_cache_invalidate_entry(to);
+	}
+
+	return 0;
+}
+
+static int core_link(const char *from, const char *to)
+{
+	int res;
+
+	if (core_is_hidden(to))
+		return -EPERM;
+	from = storage_rel(from);
+	to   = storage_rel(to  );
+	res = linkat(storage_fd, from, storage_fd, to, 0);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate(from);
+	attr_cache_invalidate_entry(to);
+
+	return 0;
+}
+
+static int core_chmod(const char *path, mode_t mode)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = fchmodat(storage_fd, path, mode, 0);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate(path);
+
+	return 0;
+}
+
+static int core_chown(const char *path, uid_t uid, gid_t gid)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = fchownat(storage_fd, path, uid, gid, AT_SYMLINK_NOFOLLOW);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate(path);
+
+	return 0;
+}
+
+int core_truncate_at(int dirfd, const char *path, off_t size)
+{
+	int fd;
+	int res = 0;
+
+	// (which would wait for a reader if it were a FIFO)
+	fd = openat(dirfd, path, O_WRONLY | O_NONBLOCK);
+	if (fd == -1)
+		return -errno;
+	if (ftruncate(fd, size) == -1)
+		res = -errno;
+	close(fd);
+	return res;
+}
+
+static int core_truncate(const char *path, off_t size)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = core_truncate_at(storage_fd, path, size);
+	if (res < 0)
+		return res;
+
+	attr_cache_invalidate(path);
+
+	return 0;
+}
+
+#ifdef HAVE_UTIMENSAT
+static int core_utimens(const char *path, const struct timespec ts[2])
+{
+	int res;
+
+	/* don't use utime/utimes since they follow symlinks */
+	path = storage_rel(path);
+	res = utimensat(storage_fd, path, ts, AT_SYMLINK_NOFOLLOW);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate(path);
+
+	return 0;
+}
+#endif
+
+static int core_open(const char *path, struct fuse_file_info *fi)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = openat(storage_fd, path, fi->flags);
+	if (res == -1)
+		return -errno;
+
+	// Keep the file open for the reads and writes that follow
+	fi->fh = res;
+
+	return 0;
+}
+
+static int core_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	TRACE(TRACE_DEBUG, "Reading from %s", path);
+
+	return core_pread(fi->fh, buf, size, offset);
+}
+
+/*
+ * Rather than copying the data through a buffer of our own, hand FUSE the
+ * backing descriptor and let it splice straight from the storage file to
+ * /dev/fuse.  Only used with no layers, which would need to see the data.
+ */
+static int core_read_buf(const char *path, struct fuse_bufvec **bufp,
+			   size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+
+	TRACE(TRACE_DEBUG, "Reading from %s", path);
+
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+	return 0;
+}
+
+static int core_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	const char *data;
+	char *copy;
+	int res;
+
+	TRACE(TRACE_DEBUG, "Writing to %s", path);
+
+	data = core_encode_copy(buf, size, offset, &copy);
+	if (data == NULL)
+		return -ENOMEM;
+
+	res = pwrite(fi->fh, data, size, offset);
+	if (res == -1)
+		res = -errno;
+	else
+		invalidate_attrs(path);
+
+	bufpool_put(copy);
+	return res;
+}
+
+// Likewise, splice written data from /dev/fuse into the storage file
+static int core_write_buf(const char *path, struct fuse_bufvec *buf,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	char *data, *copy;
+	ssize_t res;
+
+	TRACE(TRACE_DEBUG, "Writing to %s", path);
+
+	if (core_layered()) {
+		res = core_encode_bufvec(buf, offset, &data, &copy);
+		if (res >= 0) {
+			res = pwrite(fi->fh, data, res, offset);
+			if (res == -1)
+				res = -errno;
+		}
+		bufpool_put(copy);
+	} else {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fi->fh;
+		dst.buf[0].pos = offset;
+		res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	}
+
+	if (res > 0)
+		invalidate_attrs(path);
+	return res;
+}
+
+static int core_statfs(const char *path, struct statvfs *stbuf)
+{
+	int fd;
+	int res;
+
+	path = storage_rel(path);
+	fd = openat(storage_fd, path, O_PATH);
+	if (fd == -1)
+		return -errno;
+	res = fstatvfs(fd, stbuf);
+	if (res == -1)
+		res = -errno;
+	close(fd);
+	if (res < 0)
+		return res;
+
+	return 0;
+}
+
+static int core_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+	close(fi->fh);
+	return 0;
+}
+
+static int core_fsync(const char *path, int isdatasync,
+		     struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+	if (isdatasync)
+		res = fdatasync(fi->fh);
+	else
+		res = fsync(fi->fh);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static int core_fallocate(const char *path, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (mode)
+		return -EOPNOTSUPP;
+
+	res = -posix_fallocate(fi->fh, offset, length);
+	if (res == 0)
+		invalidate_attrs(path);
+	return res;
+}
+#endif
+
+#ifdef HAVE_SETXATTR
+/*
+ * There are no *at() forms of the xattr calls, so they name the file through
+ * storage_fd in /proc: "/proc/self/fd/<storage_fd>/<storage path>"
+ */
+#define CORE_PROC_PATH_SIZE(path) \
+	(sizeof("/proc/self/fd//") + 11 + strlen(path))
+
+static const char *core_proc_path(char *buf, const char *path)
+{
+	sprintf(buf, "/proc/self/fd/%d/%s", storage_fd, path);
+	return buf;
+}
+
+/* xattr operations are optional and can safely be left unimplemented */
+static int core_setxattr(const char *path, const char *name, const char *value,
+			size_t size, int flags)
+{
+	path = storage_rel(path);
+	char proc_path[CORE_PROC_PATH_SIZE(path)];
+	int res = lsetxattr(core_proc_path(proc_path, path), name, value, size,
+			    flags);
+	if (res == -1)
+		return -errno;
+	attr_cache_invalidate(path);
+	return 0;
+}
+
+static int core_getxattr(const char *path, const char *name, char *value,
+			size_t size)
+{
+	path = storage_rel(path);
+	char proc_path[CORE_PROC_PATH_SIZE(path)];
+	int res = lgetxattr(core_proc_path(proc_path, path), name, value, size);
+	if (res == -1)
+		return -errno;
+	return res;
+}
+
+static int core_listxattr(const char *path, char *list, size_t size)
+{
+	path = storage_rel(path);
+	char proc_path[CORE_PROC_PATH_SIZE(path)];
+	int res = llistxattr(core_proc_path(proc_path, path), list, size);
+	if (res == -1)
+		return -errno;
+	return res;
+}
+
+static int core_removexattr(const char *path, const char *name)
+{
+	path = storage_rel(path);
+	char proc_path[CORE_PROC_PATH_SIZE(path)];
+	int res = lremovexattr(core_proc_path(proc_path, path), name);
+	if (res == -1)
+		return -errno;
+	attr_cache_invalidate(path);
+	return 0;
+}
+#endif /* HAVE_SETXATTR */
+
+static void *core_init(struct fuse_conn_info *conn)
+{
+	// Let the kernel splice data to and from our read_buf/write_buf
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+				       FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+	return NULL;
+}
+
+/*
+ * Multithreaded event loop with a fixed number of workers.
+ *
+ * fuse_main() already runs multithreaded unless given -s, but libfuse then
+ * decides for itself how many threads to keep around.  With -t <threads>
+ * we start exactly that many workers instead, each pulling requests off the
+ * FUSE channel into its own buffer.
+ */
+
+struct worker_pool {
+	struct fuse_session *se;
+	sem_t finished;		// posted by each worker as it exits
+};
+
+static void *worker_loop(void *arg)
+{
+	struct worker_pool *pool = arg;
+	struct fuse_chan *ch = fuse_session_next_chan(pool->se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char *mem = malloc(bufsize);
+
+	if (mem == NULL) {
+		TRACE(TRACE_ERROR, "Failed to allocate worker buffer");
+		fuse_session_exit(pool->se);
+		sem_post(&pool->finished);
+		return NULL;
+	}
+
+	while (!fuse_session_exited(pool->se)) {
+		struct fuse_chan *tmpch = ch;
+		struct fuse_buf fbuf = {
+			.mem  = mem,
+			.size = bufsize,
+		};
+		int res;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		res = fuse_session_receive_buf(pool->se, &fbuf, &tmpch);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (res == -EINTR)
+			continue;
+		if (res <= 0) {
+			if (res < 0)
+				fuse_session_exit(pool->se);
+			break;
+		}
+		fuse_session_process_buf(pool->se, &fbuf, tmpch);
+	}
+
+	free(mem);
+	sem_post(&pool->finished);
+	return NULL;
+}
+
+static int run_workers(struct fuse_session *se, int workers)
+{
+	struct worker_pool pool;
+	pthread_t threads[workers];
+	sigset_t newset, oldset;
+	int started;
+	int i;
+
+	pool.se = se;
+	sem_init(&pool.finished, 0, 0);
+
+	// Leave signal handling (and so unmounting) to the main thread
+	sigemptyset(&newset);
+	sigaddset(&newset, SIGTERM);
+	sigaddset(&newset, SIGINT);
+	sigaddset(&newset, SIGHUP);
+	sigaddset(&newset, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+	for (started = 0; started < workers; started++)
+		if (pthread_create(&threads[started], NULL, worker_loop, &pool) != 0)
+			break;
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (started == 0) {
+		TRACE(TRACE_ERROR, "Failed to start worker threads");
+		sem_destroy(&pool.finished);
+		return -1;
+	}
+
+	// Signals interrupt the wait, after which we check for exit again
+	while (!fuse_session_exited(se))
+		sem_wait(&pool.finished);
+
+	for (i = 0; i < started; i++)
+		pthread_cancel(threads[i]);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	sem_destroy(&pool.finished);
+	fuse_session_reset(se);
+	return 0;
+}
+
+int core_serve(struct fuse_session *se, int multithreaded, int workers)
+{
+	if (!multithreaded)
+		return fuse_session_loop(se);
+	if (workers > 0)
+		return run_workers(se, workers);
+	return fuse_session_loop_mt(se);
+}
+
+// What fuse_main() does, but with our own multithreaded loop
+int core_run(int argc, char *argv[],
+		    const struct fuse_operations *op, int workers)
+{
+	struct fuse *fuse;
+	char *mountpoint;
+	int multithreaded;
+	int res;
+
+	fuse = fuse_setup(argc, argv, op, sizeof(*op), &mountpoint,
+			  &multithreaded, NULL);
+	if (fuse == NULL)
+		return 1;
+
+	if (!multithreaded)
+		res = fuse_loop(fuse);
+	else if (workers > 0)
+		res = run_workers(fuse_get_session(fuse), workers);
+	else
+		res = fuse_loop_mt(fuse);
+
+	fuse_teardown(fuse, mountpoint);
+	return res == -1 ? 1 : 0;
+}
+
+static const struct fuse_operations core_oper = {
+	.init		= core_init,
+	.getattr	= core_getattr,
+	.access		= core_access,
+	.readlink	= core_readlink,
+	.opendir	= core_opendir,
+	.readdir	= core_readdir,
+	.releasedir	= core_releasedir,
+	.mknod		= core_mknod,
+	.mkdir		= core_mkdir,
+	.symlink	= core_symlink,
+	.unlink		= core_unlink,
+	.rmdir		= core_rmdir,
+	.rename		= core_rename,
+	.link		= core_link,
+	.chmod		= core_chmod,
+	.chown		= core_chown,
+	.truncate	= core_truncate,
+#ifdef HAVE_UTIMENSAT
+	.utimens	= core_utimens,
+#endif
+	.open		= core_open,
+	.read		= core_read,
+	.read_buf	= core_read_buf,
+	.write		= core_write,
+	.write_buf	= core_write_buf,
+	.statfs		= core_statfs,
+	.release	= core_release,
+	.fsync		= core_fsync,
+#ifdef HAVE_POSIX_FALLOCATE
+	.fallocate	= core_fallocate,
+#endif
+#ifdef HAVE_SETXATTR
+	.setxattr	= core_setxattr,
+	.getxattr	= core_getxattr,
+	.listxattr	= core_listxattr,
+	.removexattr	= core_removexattr,
+#endif
+};
+
+void core_operations(struct fuse_operations *ops)
+{
+	*ops = core_oper;
+	if (core_layered())
+		ops->read_buf = NULL;	// the data has to pass through us
+}
@@ -0,0 +1,797 @@
+/**
+ * A user-level file system that stores files authenticated and encrypted
+ * with AES-256-GCM, which OpenSSL runs on AES-NI or the ARMv8 crypto
+ * extensions wherever the CPU has them.
+ *
+ * Each file is cut into blocks of CRYPT_BLOCK_SIZE bytes that are sealed on
+ * their own, so reading or writing at any offset only touches the blocks it
+ * covers.  In the storage file every block takes a slot of
+ *
+ *   nonce (12 bytes) | ciphertext (up to CRYPT_BLOCK_SIZE) | tag (16 bytes)
+ *
+ * with a fresh random nonce each time the block is written, and the block
+ * number as associated data so that blocks cannot be moved around within a
+ * file unnoticed.  Only the last block may be short.  A block that fails to
+ * authenticate reads as EIO.
+ *
+ * What is not protected: the names, sizes and layout of files, swapping a
+ * block for the same block of another file or an older copy of itself, and
+ * cutting whole blocks off the end of a file.
+ *
+ * The key file given after the mount point holds the 256-bit key, as 32 raw
+ * bytes or 64 hex digits ("openssl rand -hex 32 > key" makes one).
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef linux
+/* For pread()/pwrite() */
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "attrcache.h"
+#include "bufpool.h"
+#include "parallel.h"
+#include "smartfs.h"
+#include "trace.h"
+
+#define CRYPT_BLOCK_SIZE 4096
+#define CRYPT_NONCE_SIZE 12
+#define CRYPT_TAG_SIZE   16
+#define CRYPT_OVERHEAD   (CRYPT_NONCE_SIZE + CRYPT_TAG_SIZE)
+#define CRYPT_SLOT_SIZE  (CRYPT_BLOCK_SIZE + CRYPT_OVERHEAD)
+#define CRYPT_KEY_SIZE   32
+#define CRYPT_FILE_LOCKS 64		// stripes of per-file locks
+#define CRYPT_FILL_CHUNK (256 * CRYPT_BLOCK_SIZE)
+
+static unsigned char crypt_key[CRYPT_KEY_SIZE];
+
+/*
+ * Sizes
+ *
+ * The stored size of a file follows from its size and vice versa, so there
+ * is nothing to keep besides the blocks themselves.
+ */
+
+static off_t crypt_stored_size(off_t size)
+{
+	off_t rest = size % CRYPT_BLOCK_SIZE;
+
+	return size / CRYPT_BLOCK_SIZE * CRYPT_SLOT_SIZE +
+	       (rest ? rest + CRYPT_OVERHEAD : 0);
+}
+
+static off_t crypt_plain_size(off_t stored)
+{
+	off_t rest = stored % CRYPT_SLOT_SIZE;
+
+	return stored / CRYPT_SLOT_SIZE * CRYPT_BLOCK_SIZE +
+	       (rest > CRYPT_OVERHEAD ? rest - CRYPT_OVERHEAD : 0);
+}
+
+/*
+ * Sealing blocks
+ *
+ * Setting up a key schedule costs about as much as sealing a block, so each
+ * thread keeps a context per direction with the key already in it and only
+ * sets a new nonce per block.
+ */
+
+struct crypt_contexts {
+	EVP_CIPHER_CTX *seal;
+	EVP_CIPHER_CTX *open;
+};
+
+static pthread_key_t crypt_contexts_key;
+static pthread_once_t crypt_contexts_once = PTHREAD_ONCE_INIT;
+static __thread struct crypt_contexts *crypt_self = NULL;
+
+static void crypt_free_contexts(void *p)
+{
+	struct crypt_contexts *c = p;
+
+	EVP_CIPHER_CTX_free(c->seal);
+	EVP_CIPHER_CTX_free(c->open);
+	free(c);
+}
+
+static void crypt_make_key(void)
+{
+	pthread_key_create(&crypt_contexts_key, crypt_free_contexts);
+}
+
+static struct crypt_contexts *crypt_contexts(void)
+{
+	struct crypt_contexts *c;
+
+	if (crypt_self != NULL)
+		return crypt_self;
+
+	pthread_once(&crypt_contexts_once, crypt_make_key);
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return NULL;
+	c->seal = EVP_CIPHER_CTX_new();
+	c->open = EVP_CIPHER_CTX_new();
+	if (c->seal == NULL || c->open == NULL ||
+	    EVP_EncryptInit_ex(c->seal, EVP_aes_256_gcm(), NULL, crypt_key,
+			       NULL) != 1 ||
+	    EVP_DecryptInit_ex(c->open, EVP_aes_256_gcm(), NULL, crypt_key,
+			       NULL) != 1) {
+		crypt_free_contexts(c);
+		return NULL;
+	}
+	pthread_setspecific(crypt_contexts_key, c);
+	crypt_self = c;
+	return c;
+}
+
+// The associated data of block blk: its number, little-endian
+static void crypt_aad(uint64_t blk, unsigned char aad[8])
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		aad[i] = blk >> (8 * i);
+}
+
+/*
+ * Seals size bytes of block number blk into slot, whose nonce must already
+ * be filled in.  0, or -EIO.
+ */
+static int crypt_seal(const char *plain, size_t size, uint64_t blk,
+		      unsigned char *slot)
+{
+	struct crypt_contexts *c = crypt_contexts();
+	unsigned char *out = slot + CRYPT_NONCE_SIZE;
+	unsigned char aad[8];
+	int len;
+
+	crypt_aad(blk, aad);
+	if (c == NULL ||
+	    EVP_EncryptInit_ex(c->seal, NULL, NULL, NULL, slot) != 1 ||
+	    EVP_EncryptUpdate(c->seal, NULL, &len, aad, sizeof(aad)) != 1 ||
+	    EVP_EncryptUpdate(c->seal, out, &len,
+			      (const unsigned char *) plain, size) != 1 ||
+	    EVP_EncryptFinal_ex(c->seal, out + len, &len) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(c->seal, EVP_CTRL_GCM_GET_TAG, CRYPT_TAG_SIZE,
+				out + size) != 1)
+		return -EIO;
+	return 0;
+}
+
+// Opens the slot of block blk, holding size bytes, into plain: 0, or -EIO
+static int crypt_open_block(const unsigned char *slot, size_t size,
+			    uint64_t blk, char *plain)
+{
+	struct crypt_contexts *c = crypt_contexts();
+	const unsigned char *in = slot + CRYPT_NONCE_SIZE;
+	unsigned char aad[8];
+	int len;
+
+	crypt_aad(blk, aad);
+	if (c == NULL ||
+	    EVP_DecryptInit_ex(c->open, NULL, NULL, NULL, slot) != 1 ||
+	    EVP_DecryptUpdate(c->open, NULL, &len, aad, sizeof(aad)) != 1 ||
+	    EVP_DecryptUpdate(c->open, (unsigned char *) plain, &len, in,
+			      size) != 1 ||
+	    EVP_CIPHER_CTX_ctrl(c->open, EVP_CTRL_GCM_SET_TAG, CRYPT_TAG_SIZE,
+				(void *) (in + size)) != 1 ||
+	    EVP_DecryptFinal_ex(c->open, (unsigned char *) plain + len,
+				&len) != 1) {
+		TRACE(TRACE_ERROR, "Block %llu does not authenticate",
+		      (unsigned long long) blk);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Reading and writing
+ *
+ * A request is read or written with a single pread() or pwrite() of all the
+ * slots it covers.  A write that covers only part of a block has to open
+ * that block first; there are at most two of those per write, at either end.
+ * Both take the file's lock, shared for reads, so that a read never sees a
+ * block half rewritten.
+ */
+
+static pthread_rwlock_t crypt_file_locks[CRYPT_FILE_LOCKS] = {
+	[0 ... CRYPT_FILE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+struct crypt_handle {
+	int fd;
+	pthread_rwlock_t *lock;
+};
+
+static struct crypt_handle *crypt_fh(struct fuse_file_info *fi)
+{
+	return (struct crypt_handle *) (uintptr_t) fi->fh;
+}
+
+static pthread_rwlock_t *crypt_file_lock(const struct stat *st)
+{
+	return &crypt_file_locks[(st->st_ino ^ st->st_dev) % CRYPT_FILE_LOCKS];
+}
+
+// Like pread(), but only ever short at the end of the file
+static ssize_t crypt_read_full(int fd, void *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pread(fd, (char *) buf + done, size - done,
+				  offset + done);
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+// pwrite() all of size bytes, going on after a short write: 0, or -errno
+static int crypt_write_full(int fd, const void *buf, size_t size, off_t offset)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t n = pwrite(fd, (const char *) buf + done, size - done,
+				   offset + done);
+		if (n == -1)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Blocks are sealed and opened in batches of CRYPT_BATCH, several batches at
+ * once on the transform pool (parallel.h) when a request is large enough.
+ */
+
+#define CRYPT_BATCH (PARALLEL_CHUNK / CRYPT_BLOCK_SIZE)
+
+// A request's worth of blocks being sealed or opened
+struct crypt_job {
+	unsigned char *slots;	// the slot of block first, then the rest
+	char *buf;		// the data read, or to be written
+	off_t offset;		// where buf starts in the file
+	size_t size;
+	off_t end;		// where the file's data ends
+	uint64_t first, last;	// the blocks the request covers
+	const char *edges[2];	// first and last block merged for a write
+	int error;
+};
+
+/*
+ * Where block i meets the request: returns how many bytes the block holds,
+ * and sets which of those (from skip, want of them) are in the request.
+ */
+static size_t crypt_span(const struct crypt_job *j, uint64_t i, size_t *skip,
+			 size_t *want)
+{
+	off_t start = (off_t) i * CRYPT_BLOCK_SIZE;
+	off_t from = j->offset > start ? j->offset : start;
+	off_t to = j->offset + (off_t) j->size;
+
+	if (to > start + CRYPT_BLOCK_SIZE)
+		to = start + CRYPT_BLOCK_SIZE;
+	*skip = from - start;
+	*want = to - from;
+	return j->end - start < CRYPT_BLOCK_SIZE ? j->end - start :
+	       CRYPT_BLOCK_SIZE;
+}
+
+static void crypt_open_batch(void *arg, size_t k)
+{
+	struct crypt_job *j = arg;
+	char block[CRYPT_BLOCK_SIZE];
+	uint64_t i;
+
+	for (i = j->first + k * CRYPT_BATCH;
+	     i <= j->last && i < j->first + (k + 1) * CRYPT_BATCH; i++) {
+		unsigned char *slot = j->slots + (i - j->first) *
+				      CRYPT_SLOT_SIZE;
+		size_t skip, want;
+		size_t len = crypt_span(j, i, &skip, &want);
+		char *plain = j->buf + ((off_t) i * CRYPT_BLOCK_SIZE + skip -
+					j->offset);
+		int res;
+
+		// Whole blocks open straight into the caller's buffer
+		if (skip == 0 && want == len) {
+			res = crypt_open_block(slot, len, i, plain);
+		} else {
+			res = crypt_open_block(slot, len, i, block);
+			memcpy(plain, block + skip, want);
+		}
+		if (res < 0) {
+			__atomic_store_n(&j->error, res, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+static void crypt_seal_batch(void *arg, size_t k)
+{
+	struct crypt_job *j = arg;
+	uint64_t i;
+
+	for (i = j->first + k * CRYPT_BATCH;
+	     i <= j->last && i < j->first + (k + 1) * CRYPT_BATCH; i++) {
+		unsigned char *slot = j->slots + (i - j->first) *
+				      CRYPT_SLOT_SIZE;
+		size_t skip, want;
+		size_t len = crypt_span(j, i, &skip, &want);
+		const char *plain = j->buf + ((off_t) i * CRYPT_BLOCK_SIZE -
+					      j->offset);
+
+		if (i == j->first && j->edges[0] != NULL)
+			plain = j->edges[0];
+		else if (i == j->last && j->edges[1] != NULL)
+			plain = j->edges[1];
+		if (crypt_seal(plain, len, i, slot) < 0) {
+			__atomic_store_n(&j->error, -EIO, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+// Runs fn over every batch of the job: 0, or the first error
+static int crypt_batches(struct crypt_job *j, void (*fn)(void *, size_t))
+{
+	size_t batches = (j->last - j->first) / CRYPT_BATCH + 1;
+	size_t k;
+
+	if (parallel_worth((j->last - j->first + 1) * CRYPT_BLOCK_SIZE))
+		parallel_run(batches, fn, j);
+	else
+		for (k = 0; k < batches; k++)
+			fn(j, k);
+	return j->error;
+}
+
+static ssize_t crypt_pread(int fd, char *buf, size_t size, off_t offset)
+{
+	struct crypt_job j = { .buf = buf, .offset = offset };
+	ssize_t n;
+	int res;
+
+	if (size == 0)
+		return 0;
+	j.first = offset / CRYPT_BLOCK_SIZE;
+	j.last = (offset + size - 1) / CRYPT_BLOCK_SIZE;
+
+	j.slots = bufpool_get((j.last - j.first + 1) * CRYPT_SLOT_SIZE);
+	if (j.slots == NULL)
+		return -ENOMEM;
+	n = crypt_read_full(fd, j.slots, (j.last - j.first + 1) *
+			    CRYPT_SLOT_SIZE, j.first * CRYPT_SLOT_SIZE);
+	if (n < 0) {
+		bufpool_put(j.slots);
+		return n;
+	}
+
+	// The stored data ends wherever the read came up short
+	j.end = (off_t) j.first * CRYPT_BLOCK_SIZE + crypt_plain_size(n);
+	if (offset >= j.end) {
+		bufpool_put(j.slots);
+		return 0;
+	}
+	j.size = offset + (off_t) size > j.end ? (size_t) (j.end - offset) :
+		 size;
+	j.last = (offset + j.size - 1) / CRYPT_BLOCK_SIZE;
+
+	res = crypt_batches(&j, crypt_open_batch);
+	bufpool_put(j.slots);
+	if (res < 0)
+		return res;
+
+	core_decode(buf, j.size, offset);
+	return j.size;
+}
+
+/*
+ * Reads block blk of a file of the given size into block, or zeroes if the
+ * block is past the end.  Returns how many bytes it holds, or -errno.
+ */
+static ssize_t crypt_load(int fd, uint64_t blk, off_t size, char *block)
+{
+	unsigned char slot[CRYPT_SLOT_SIZE];
+	off_t start = (off_t) blk * CRYPT_BLOCK_SIZE;
+	size_t len;
+	ssize_t n;
+	int res;
+
+	memset(block, 0, CRYPT_BLOCK_SIZE);
+	if (start >= size)
+		return 0;
+	len = size - start < CRYPT_BLOCK_SIZE ? size - start : CRYPT_BLOCK_SIZE;
+
+	n = crypt_read_full(fd, slot, len + CRYPT_OVERHEAD,
+			    (off_t) blk * CRYPT_SLOT_SIZE);
+	if (n < 0)
+		return n;
+	if ((size_t) n != len + CRYPT_OVERHEAD)
+		return -EIO;
+	res = crypt_open_block(slot, len, blk, block);
+	return res < 0 ? res : (ssize_t) len;
+}
+
+/*
+ * Writes stored data of a file whose size is now size, with its lock held.
+ * offset must not be past the end.  Returns size, or -errno.
+ */
+static ssize_t crypt_store(int fd, const char *buf, size_t size, off_t offset,
+			   off_t file_size)
+{
+	struct crypt_job j = { .buf = (char *) buf, .offset = offset,
+			       .size = size };
+	char head[CRYPT_BLOCK_SIZE], tail[CRYPT_BLOCK_SIZE];
+	unsigned char *nonces;
+	size_t nslots, stored;
+	size_t skip, want, len;
+	uint64_t i;
+	ssize_t res;
+
+	j.first = offset / CRYPT_BLOCK_SIZE;
+	j.last = (offset + size - 1) / CRYPT_BLOCK_SIZE;
+	j.end = offset + (off_t) size > file_size ? offset + (off_t) size :
+		file_size;
+	nslots = j.last - j.first + 1;
+
+	// With room after the slots for their nonces: drawing them all at
+	// once is two orders of magnitude cheaper than one at a time
+	j.slots = bufpool_get(nslots * (CRYPT_SLOT_SIZE + CRYPT_NONCE_SIZE));
+	if (j.slots == NULL)
+		return -ENOMEM;
+	nonces = j.slots + nslots * CRYPT_SLOT_SIZE;
+	if (RAND_bytes(nonces, nslots * CRYPT_NONCE_SIZE) != 1) {
+		res = -EIO;
+		goto out;
+	}
+	for (i = 0; i < nslots; i++)
+		memcpy(j.slots + i * CRYPT_SLOT_SIZE,
+		       nonces + i * CRYPT_NONCE_SIZE, CRYPT_NONCE_SIZE);
+
+	// Keep whatever else the blocks at either end already hold
+	len = crypt_span(&j, j.first, &skip, &want);
+	if (want != len) {
+		res = crypt_load(fd, j.first, file_size, head);
+		if (res < 0)
+			goto out;
+		memcpy(head + skip, buf, want);
+		j.edges[0] = head;
+	}
+	len = crypt_span(&j, j.last, &skip, &want);
+	if (j.last != j.first && want != len) {
+		res = crypt_load(fd, j.last, file_size, tail);
+		if (res < 0)
+			goto out;
+		memcpy(tail, buf + ((off_t) j.last * CRYPT_BLOCK_SIZE - offset),
+		       want);
+		j.edges[1] = tail;
+	}
+
+	res = crypt_batches(&j, crypt_seal_batch);
+	if (res < 0)
+		goto out;
+
+	stored = (nslots - 1) * CRYPT_SLOT_SIZE + len + CRYPT_OVERHEAD;
+	res = crypt_write_full(fd, j.slots, stored, j.first * CRYPT_SLOT_SIZE);
+	if (res == 0)
+		res = size;
+
+out:
+	bufpool_put(j.slots);
+	return res;
+}
+
+// Extends a file of the given size with zeroes up to offset
+static int crypt_fill(int fd, off_t size, off_t offset)
+{
+	char *zeroes = calloc(1, CRYPT_FILL_CHUNK);
+	ssize_t res = 0;
+
+	if (zeroes == NULL)
+		return -ENOMEM;
+
+	while (size < offset && res >= 0) {
+		// Fill up to block boundaries, so no block is sealed twice
+		off_t end = (size / CRYPT_FILL_CHUNK + 1) * CRYPT_FILL_CHUNK;
+		if (end > offset)
+			end = offset;
+		res = crypt_store(fd, zeroes, end - size, size, size);
+		size = end;
+	}
+
+	free(zeroes);
+	return res < 0 ? res : 0;
+}
+
+static ssize_t crypt_pwrite(int fd, const char *buf, size_t size,
+			    off_t offset)
+{
+	struct stat st;
+	off_t file_size;
+	int res;
+
+	if (size == 0)
+		return 0;
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	file_size = crypt_plain_size(st.st_size);
+
+	if (offset > file_size) {
+		res = crypt_fill(fd, file_size, offset);
+		if (res < 0)
+			return res;
+		file_size = offset;
+	}
+	return crypt_store(fd, buf, size, offset, file_size);
+}
+
+// Cuts or extends a file to size, with its lock held
+static int crypt_resize(int fd, off_t size)
+{
+	char block[CRYPT_BLOCK_SIZE];
+	uint64_t blk = size / CRYPT_BLOCK_SIZE;
+	size_t rest = size % CRYPT_BLOCK_SIZE;
+	struct stat st;
+	off_t file_size;
+	ssize_t res;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	file_size = crypt_plain_size(st.st_size);
+
+	if (size > file_size)
+		return crypt_fill(fd, file_size, size);
+
+	// A block cut in two has to be sealed again at its new length
+	if (rest != 0 && size < file_size) {
+		res = crypt_load(fd, blk, file_size, block);
+		if (res < 0)
+			return res;
+		res = crypt_store(fd, block, rest, (off_t) blk *
+				  CRYPT_BLOCK_SIZE, size);
+		if (res < 0)
+			return res;
+	}
+	if (ftruncate(fd, crypt_stored_size(size)) == -1)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Operations
+ */
+
+static int crypt_getattr(const char *path, struct stat *stbuf)
+{
+	int res;
+
+	path = storage_rel(path);
+	res = attr_cache_lstat(path, stbuf);
+	if (res == 0 && S_ISREG(stbuf->st_mode))
+		stbuf->st_size = crypt_plain_size(stbuf->st_size);
+
+	return res;
+}
+
+static int crypt_truncate(const char *path, off_t size)
+{
+	struct stat st;
+	int fd;
+	int res;
+
+	path = storage_rel(path);
+	fd = openat(storage_fd, path, O_RDWR);
+	if (fd == -1)
+		return -errno;
+
+	res = fstat(fd, &st) == -1 ? -errno : 0;
+	if (res == 0) {
+		pthread_rwlock_wrlock(crypt_file_lock(&st));
+		res = crypt_resize(fd, size);
+		pthread_rwlock_unlock(crypt_file_lock(&st));
+	}
+	close(fd);
+
+	attr_cache_invalidate(path);
+
+	return res;
+}
+
+static int crypt_open(const char *path, struct fuse_file_info *fi)
+{
+	struct crypt_handle *h;
+	struct stat st;
+	// Partial blocks are read back before being written, and appends
+	// have to land on a slot boundary, which the kernel cannot know
+	int flags = fi->flags & ~O_APPEND;
+	int fd;
+	int res;
+
+	path = storage_rel(path);
+	if ((flags & O_ACCMODE) == O_WRONLY)
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	fd = openat(storage_fd, path, flags);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	h->fd = fd;
+	h->lock = crypt_file_lock(&st);
+
+	fi->fh = (uintptr_t) h;
+
+	return 0;
+}
+
+static int crypt_read(const char *path, char *buf, size_t size, off_t offset,
+		     struct fuse_file_info *fi)
+{
+	struct crypt_handle *h = crypt_fh(fi);
+	int res;
+
+	TRACE(TRACE_DEBUG, "Reading from %s", path);
+
+	pthread_rwlock_rdlock(h->lock);
+	res = crypt_pread(h->fd, buf, size, offset);
+	pthread_rwlock_unlock(h->lock);
+
+	return res;
+}
+
+static int crypt_write(const char *path, const char *buf, size_t size,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	struct crypt_handle *h = crypt_fh(fi);
+	const char *data;
+	char *copy;
+	int res;
+
+	TRACE(TRACE_DEBUG, "Writing to %s", path);
+
+	data = core_encode_copy(buf, size, offset, &copy);
+	if (data == NULL)
+		return -ENOMEM;
+
+	pthread_rwlock_wrlock(h->lock);
+	res = crypt_pwrite(h->fd, data, size, offset);
+	pthread_rwlock_unlock(h->lock);
+
+	bufpool_put(copy);
+	if (res > 0)
+		invalidate_attrs(path);
+	return res;
+}
+
+static int crypt_release(const char *path, struct fuse_file_info *fi)
+{
+	struct crypt_handle *h = crypt_fh(fi);
+
+	(void) path;
+	close(h->fd);
+	free(h);
+	return 0;
+}
+
+static int crypt_fsync(const char *path, int isdatasync,
+		      struct fuse_file_info *fi)
+{
+	struct crypt_handle *h = crypt_fh(fi);
+	int res;
+
+	(void) path;
+	if (isdatasync)
+		res = fdatasync(h->fd);
+	else
+		res = fsync(h->fd);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+// 32 raw bytes, or 64 hex digits and perhaps a newline
+static int crypt_read_key(const char *path)
+{
+	char text[CRYPT_KEY_SIZE * 2 + 2];
+	unsigned int byte;
+	FILE *f = fopen(path, "r");
+	size_t n;
+	int i;
+
+	if (f == NULL)
+		return -errno;
+	n = fread(text, 1, sizeof(text), f);
+	fclose(f);
+
+	if (n == CRYPT_KEY_SIZE) {
+		memcpy(crypt_key, text, CRYPT_KEY_SIZE);
+		return 0;
+	}
+	if (n < CRYPT_KEY_SIZE * 2 || n > CRYPT_KEY_SIZE * 2 + 1 ||
+	    (n == CRYPT_KEY_SIZE * 2 + 1 && text[n - 1] != '\n'))
+		return -EINVAL;
+	for (i = 0; i < CRYPT_KEY_SIZE; i++) {
+		char hex[3] = { text[2 * i], text[2 * i + 1], '\0' };
+		char *end;
+
+		byte = strtoul(hex, &end, 16);
+		if (*end != '\0')
+			return -EINVAL;
+		crypt_key[i] = byte;
+	}
+	return 0;
+}
+
+// The key file is the argument after the mount point
+static int crypt_setup(char *args[])
+{
+	int res = crypt_read_key(args[0]);
+
+	if (res < 0) {
+	  fprintf(stderr, "ERROR: Cannot read a %d-bit key from %s: %s\n",
+		  CRYPT_KEY_SIZE * 8, args[0],
+		  res == -EINVAL ? "Bad key" : strerror(-res));
+	  return -1;
+	}
+	TRACE(TRACE_INFO, "Sealing %d-byte blocks with AES-256-GCM",
+	      CRYPT_BLOCK_SIZE);
+	return 0;
+}
+
+static struct fuse_operations crypt_oper;
+
+static const struct fuse_operations *crypt_operations(void)
+{
+	core_operations(&crypt_oper);
+	crypt_oper.getattr	= crypt_getattr;
+	crypt_oper.truncate	= crypt_truncate;
+	crypt_oper.open		= crypt_open;
+	crypt_oper.read		= crypt_read;
+	crypt_oper.read_buf	= NULL;		// the data has to pass through us
+	crypt_oper.write	= crypt_write;
+	crypt_oper.write_buf	= NULL;
+	crypt_oper.release	= crypt_release;
+	crypt_oper.fsync	= crypt_fsync;
+	crypt_oper.fallocate	= NULL;		// it would store unsealed zeroes
+	return &crypt_oper;
+}
+
+const struct smartfs_mode crypt_mode = {
+	.name		= "crypt",
+	.args		= "<key file>",
+	.nargs		= 1,
+	.setup		= crypt_setup,
+	.operations	= crypt_operations,
+};
@@ -0,0 +1,282 @@
+/**
+ * Benchmark workloads for a directory, meant to be run against each file
+ * system's mount point and against the raw storage directory as a baseline
+ * (bench.sh does both).  Every result is printed as one tab-separated line:
+ *
+ *   <label> <workload> <parameter> <metric> <value>
+ *
+ * e.g. "versfs  seqwrite  64k  MB/s  812.4", so results from different runs
+ * and commits can be compared with standard text tools.
+ *
+ * USAGE: ./fsbench <directory> <label> [MiB per file] [files] [versions]
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char *dir;
+static const char *label;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *workload, const char *param,
+		   const char *metric, double value)
+{
+	printf("%s\t%s\t%s\t%s\t%.1f\n", label, workload, param, metric, value);
+	fflush(stdout);
+}
+
+static void die(const char *what)
+{
+	fprintf(stderr, "ERROR: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static void path_of(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "%s/%s", dir, name);
+}
+
+static void size_name(char *buf, size_t size, size_t bytes)
+{
+	if (bytes >= 1 << 20)
+		snprintf(buf, size, "%zum", bytes >> 20);
+	else
+		snprintf(buf, size, "%zuk", bytes >> 10);
+}
+
+// Drop what the page cache holds of a file, so reads reach the file system
+static void uncache(int fd)
+{
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static void seq(size_t file_size, size_t bs, char *buf)
+{
+	char path[4096], param[32];
+	double start, elapsed;
+	size_t done;
+	int fd;
+
+	path_of(path, sizeof(path), "seq.dat");
+	size_name(param, sizeof(param), bs);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		die(path);
+	start = now();
+	for (done = 0; done < file_size; done += bs)
+		if (write(fd, buf, bs) != (ssize_t) bs)
+			die("write");
+	if (fsync(fd) == -1)
+		die("fsync");
+	elapsed = now() - start;
+	close(fd);
+	result("seqwrite", param, "MB/s", file_size / elapsed / 1e6);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		die(path);
+	uncache(fd);
+	start = now();
+	for (done = 0; done < file_size; done += bs)
+		if (read(fd, buf, bs) != (ssize_t) bs)
+			die("read");
+	elapsed = now() - start;
+	close(fd);
+	result("seqread", param, "MB/s", file_size / elapsed / 1e6);
+}
+
+static void rnd(size_t file_size, size_t bs, char *buf)
+{
+	size_t blocks = file_size / bs;
+	size_t ops = blocks < 4096 ? blocks : 4096;
+	char path[4096], param[32];
+	double start, elapsed;
+	size_t i;
+	int fd;
+
+	path_of(path, sizeof(path), "seq.dat");
+	size_name(param, sizeof(param), bs);
+	srandom(42);
+
+	fd = open(path, O_RDWR);
+	if (fd == -1)
+		die(path);
+
+	uncache(fd);
+	start = now();
+	for (i = 0; i < ops; i++)
+		if (pread(fd, buf, bs, (random() % blocks) * bs) !=
+		    (ssize_t) bs)
+			die("pread");
+	elapsed = now() - start;
+	result("randread", param, "ops/s", ops / elapsed);
+	result("randread", param, "MB/s", ops * bs / elapsed / 1e6);
+
+	start = now();
+	for (i = 0; i < ops; i++)
+		if (pwrite(fd, buf, bs, (random() % blocks) * bs) !=
+		    (ssize_t) bs)
+			die("pwrite");
+	if (fsync(fd) == -1)
+		die("fsync");
+	elapsed = now() - start;
+	result("randwrite", param, "ops/s", ops / elapsed);
+	result("randwrite", param, "MB/s", ops * bs / elapsed / 1e6);
+
+	close(fd);
+}
+
+// Create, stat and then unlink a directory full of small files
+static void small_files(int files, char *buf)
+{
+	char path[4096], param[32];
+	double start;
+	struct stat st;
+	int i, fd;
+
+	path_of(path, sizeof(path), "small");
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		die(path);
+	snprintf(param, sizeof(param), "%d", files);
+
+	start = now();
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/small/f%d", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || write(fd, buf, 1024) != 1024)
+			die(path);
+		close(fd);
+	}
+	result("create", param, "ops/s", files / (now() - start));
+
+	start = now();
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/small/f%d", dir, i);
+		if (stat(path, &st) == -1)
+			die(path);
+	}
+	result("stat", param, "ops/s", files / (now() - start));
+
+	// A listing of the same directory, repeated to get a steady figure
+	path_of(path, sizeof(path), "small");
+	start = now();
+	for (i = 0; i < 10; i++) {
+		DIR *d = opendir(path);
+		if (d == NULL)
+			die(path);
+		while (readdir(d) != NULL)
+			;
+		closedir(d);
+	}
+	result("readdir", param, "entries/s", 10.0 * files / (now() - start));
+
+	start = now();
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/small/f%d", dir, i);
+		if (unlink(path) == -1)
+			die(path);
+	}
+	result("unlink", param, "ops/s", files / (now() - start));
+
+	path_of(path, sizeof(path), "small");
+	rmdir(path);
+}
+
+/*
+ * Open a 1 MiB file, rewrite 4 KiB of it and close it again, over and over.
+ * On versfs every round makes a version, so this shows whether a write gets
+ * slower as a file's history grows; elsewhere it is a baseline.
+ */
+static void versions(int rounds, char *buf)
+{
+	char path[4096], param[32];
+	double start;
+	int i, fd, window;
+
+	path_of(path, sizeof(path), "vers.dat");
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		die(path);
+	for (i = 0; i < 256; i++)
+		if (write(fd, buf, 4096) != 4096)
+			die("write");
+	close(fd);
+
+	for (window = 1; window <= rounds; window *= 10) {
+		int count = window - window / 10;
+
+		start = now();
+		for (i = 0; i < count; i++) {
+			fd = open(path, O_WRONLY);
+			if (fd == -1)
+				die(path);
+			buf[0]++;
+			if (pwrite(fd, buf, 4096,
+				   (off_t) (random() % 256) * 4096) != 4096)
+				die("pwrite");
+			close(fd);
+		}
+		snprintf(param, sizeof(param), "%d", window);
+		result("rewrite", param, "ops/s", count / (now() - start));
+	}
+
+	unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t file_size;
+	int files, rounds;
+	const size_t sizes[] = { 4096, 64 * 1024, 1024 * 1024 };
+	char *buf;
+	size_t i;
+
+	if (argc < 3) {
+	  fprintf(stderr, "USAGE: %s <directory> <label> [MiB per file] [files] [versions]\n", argv[0]);
+	  return 1;
+	}
+	dir = argv[1];
+	label = argv[2];
+	file_size = (argc > 3 ? atoi(argv[3]) : 64) * (size_t) 1024 * 1024;
+	files = argc > 4 ? atoi(argv[4]) : 2000;
+	rounds = argc > 5 ? atoi(argv[5]) : 1000;
+
+	buf = malloc(1024 * 1024);
+	if (buf == NULL || file_size < 1024 * 1024 || files <= 0 ||
+	    rounds <= 0) {
+	  fprintf(stderr, "ERROR: Bad arguments\n");
+	  return 1;
+	}
+	memset(buf, 'x', 1024 * 1024);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		seq(file_size, sizes[i], buf);
+	rnd(file_size, 4096, buf);
+	rnd(file_size, 64 * 1024, buf);
+	path_of(buf, 4096, "seq.dat");
+	unlink(buf);
+	memset(buf, 'x', 4096);
+
+	small_files(files, buf);
+	versions(rounds, buf);
+
+	free(buf);
+	return 0;
+}
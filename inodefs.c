@@ -0,0 +1,863 @@
+/**
+ * A user-level file system that mirrors the storage directory like mirrorfs,
+ * but on the low-level FUSE API, where requests name inodes rather than
+ * paths.  Under the other modes every request comes with the whole path of
+ * its file, which is put after the storage directory and walked again by the
+ * kernel, component by component, on every operation.  Here each inode the
+ * kernel knows about holds an O_PATH descriptor of its file, and everything is
+ * done relative to those (openat(), fstatat(), ...), so an operation costs
+ * the same however deep in the tree its file is, and renaming a directory
+ * touches nothing but the directory.
+ *
+ * The kernel counts its references to an inode: every reply with an entry
+ * (lookup, mknod, mkdir, symlink, link and create) adds one, and forget takes
+ * them away again.  The inode, and its descriptor, go once none are left.
+ *
+ * Data layers stack under it as under any mode (--mode inode,caesar).  The
+ * statistics of .smartfs and the attribute cache are for the path-based
+ * modes, which get them from the high-level API; -T still sets how long the
+ * kernel keeps attributes and lookups.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef linux
+/* For O_PATH, AT_EMPTY_PATH, pread()/pwrite() and utimensat() */
+#define _GNU_SOURCE
+#endif
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "attrcache.h"
+#include "bufpool.h"
+#include "smartfs.h"
+#include "trace.h"
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+/*
+ * Inode table
+ *
+ * The FUSE inode number of an inode is the address of its struct (except for
+ * the root, which is always FUSE_ROOT_ID), so finding the inode of a request
+ * takes no lookup at all.  The table is only there to give a file the kernel
+ * already knows the same inode again: it is keyed by device and inode number,
+ * guarded by inode_lock, and grows as vers_index does.
+ */
+
+struct inode {
+	int fd;			// O_PATH, of the file itself
+	dev_t dev;
+	ino_t ino;
+	uint64_t nlookup;	// references the kernel holds
+	struct inode *next;	// in its hash chain
+};
+
+static struct inode inode_root = { .fd = -1, .nlookup = 1 };
+static struct inode **inode_table = NULL;
+static size_t inode_table_size = 0;	// a power of two
+static size_t inode_count = 0;
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct inode *inode_get(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &inode_root;
+	return (struct inode *) (uintptr_t) ino;
+}
+
+static fuse_ino_t inode_id(struct inode *inode)
+{
+	if (inode == &inode_root)
+		return FUSE_ROOT_ID;
+	return (uintptr_t) inode;
+}
+
+static size_t inode_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev;
+
+	return h ^ (h >> 29);
+}
+
+static void inode_table_grow(void)
+{
+	size_t new_size = inode_table_size ? inode_table_size * 2 : 1024;
+	struct inode **new_table = calloc(new_size, sizeof(*new_table));
+	struct inode *inode, *next;
+	size_t i, b;
+
+	if (new_table == NULL)
+		return;	// keep using the old table, just with longer chains
+
+	for (i = 0; i < inode_table_size; i++)
+		for (inode = inode_table[i]; inode != NULL; inode = next) {
+			next = inode->next;
+			b = inode_hash(inode->dev, inode->ino) & (new_size - 1);
+			inode->next = new_table[b];
+			new_table[b] = inode;
+		}
+	free(inode_table);
+	inode_table = new_table;
+	inode_table_size = new_size;
+}
+
+/*
+ * The inode of the file that fd (an O_PATH descriptor) and st are of, with
+ * one more reference taken on it.  fd is taken over either way.  NULL if out
+ * of memory.
+ */
+static struct inode *inode_ref(int fd, const struct stat *st)
+{
+	struct inode *inode = NULL;
+	struct inode *found;
+	size_t b;
+
+	pthread_mutex_lock(&inode_lock);
+	if (inode_count >= inode_table_size)
+		inode_table_grow();
+	if (inode_table_size == 0) {
+		pthread_mutex_unlock(&inode_lock);
+		close(fd);
+		return NULL;
+	}
+
+	b = inode_hash(st->st_dev, st->st_ino) & (inode_table_size - 1);
+	for (found = inode_table[b]; found != NULL; found = found->next)
+		if (found->dev == st->st_dev && found->ino == st->st_ino)
+			break;
+	if (found != NULL) {
+		found->nlookup++;
+	} else {
+		inode = malloc(sizeof(*inode));
+		if (inode != NULL) {
+			inode->fd = fd;
+			inode->dev = st->st_dev;
+			inode->ino = st->st_ino;
+			inode->nlookup = 1;
+			inode->next = inode_table[b];
+			inode_table[b] = inode;
+			inode_count++;
+		}
+	}
+	pthread_mutex_unlock(&inode_lock);
+
+	if (inode == NULL)
+		close(fd);	// a duplicate, or nowhere to keep it
+	return found != NULL ? found : inode;
+}
+
+// Drops n of the kernel's references to inode
+static void inode_unref(struct inode *inode, uint64_t n)
+{
+	struct inode **p;
+	int gone = 0;
+
+	pthread_mutex_lock(&inode_lock);
+	inode->nlookup -= n < inode->nlookup ? n : inode->nlookup;
+	if (inode->nlookup == 0 && inode != &inode_root) {
+		p = &inode_table[inode_hash(inode->dev, inode->ino) &
+				 (inode_table_size - 1)];
+		while (*p != inode)
+			p = &(*p)->next;
+		*p = inode->next;
+		inode_count--;
+		gone = 1;
+	}
+	pthread_mutex_unlock(&inode_lock);
+
+	if (gone) {
+		close(inode->fd);
+		free(inode);
+	}
+}
+
+/*
+ * "/proc/self/fd/<fd>", for the calls that cannot work on an O_PATH
+ * descriptor itself (open(), chmod(), truncate(), the xattrs ...).  Note
+ * that these follow a symbolic link to what it points at.
+ */
+static void inode_proc_path(char *buf, size_t size, int fd)
+{
+	snprintf(buf, size, "/proc/self/fd/%d", fd);
+}
+
+static int inode_stat(struct inode *inode, struct stat *st)
+{
+	if (fstatat(inode->fd, "", st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)
+	    == -1)
+		return -errno;
+	return 0;
+}
+
+// Looks up name in parent, taking a reference on its inode for the kernel
+static int inode_entry(struct inode *parent, const char *name,
+		       struct fuse_entry_param *e)
+{
+	struct inode *inode;
+	int fd;
+	int res;
+
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = attr_cache_timeout();
+	e->entry_timeout = attr_cache_timeout();
+
+	fd = openat(parent->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)
+	    == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	inode = inode_ref(fd, &e->attr);
+	if (inode == NULL)
+		return -ENOMEM;
+	e->ino = inode_id(inode);
+	return 0;
+}
+
+// Replies to a request that made name in parent, which res says how it went
+static void inode_reply_made(fuse_req_t req, struct inode *parent,
+			     const char *name, int res)
+{
+	struct fuse_entry_param e;
+
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	res = inode_entry(parent, name, &e);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void inode_reply_attr(fuse_req_t req, struct inode *inode)
+{
+	struct stat st;
+	int res;
+
+	res = inode_stat(inode, &st);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &st, attr_cache_timeout());
+}
+
+static void inode_reply_res(fuse_req_t req, int res)
+{
+	fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void inode_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	int res;
+
+	res = inode_entry(inode_get(parent), name, &e);
+	if (res == -ENOENT && e.entry_timeout > 0) {
+		// The kernel remembers that it is not there, for as long
+		e.ino = 0;
+		fuse_reply_entry(req, &e);
+	} else if (res < 0) {
+		fuse_reply_err(req, -res);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void inode_forget(fuse_req_t req, fuse_ino_t ino,
+			 unsigned long nlookup)
+{
+	inode_unref(inode_get(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void inode_forget_multi(fuse_req_t req, size_t count,
+			       struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		inode_unref(inode_get(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void inode_getattr(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	(void) fi;
+	inode_reply_attr(req, inode_get(ino));
+}
+
+static void inode_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			  int to_set, struct fuse_file_info *fi)
+{
+	struct inode *inode = inode_get(ino);
+	char proc_path[64];
+	int fd = fi != NULL ? (int) fi->fh : -1;
+	int res = 0;
+
+	inode_proc_path(proc_path, sizeof(proc_path), inode->fd);
+
+	if (to_set & FUSE_SET_ATTR_MODE)
+		res = fd != -1 ? fchmod(fd, attr->st_mode) :
+				 chmod(proc_path, attr->st_mode);
+
+	if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid :
+							 (uid_t) -1;
+		gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid :
+							 (gid_t) -1;
+
+		res = fchownat(inode->fd, "", uid, gid,
+			       AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	}
+
+	if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+		res = fd != -1 ? ftruncate(fd, attr->st_size) :
+				 truncate(proc_path, attr->st_size);
+
+	if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec ts[2] = {
+			{ 0, UTIME_OMIT },
+			{ 0, UTIME_OMIT },
+		};
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			ts[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			ts[0] = attr->st_atim;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			ts[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			ts[1] = attr->st_mtim;
+		res = fd != -1 ? futimens(fd, ts) :
+				 utimensat(AT_FDCWD, proc_path, ts, 0);
+	}
+
+	if (res == -1)
+		fuse_reply_err(req, errno);
+	else
+		inode_reply_attr(req, inode);
+}
+
+static void inode_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char buf[PATH_MAX];
+	ssize_t res;
+
+	res = readlinkat(inode_get(ino)->fd, "", buf, sizeof(buf) - 1);
+	if (res == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+static void inode_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode, dev_t rdev)
+{
+	struct inode *dir = inode_get(parent);
+
+	inode_reply_made(req, dir, name, mknodat(dir->fd, name, mode, rdev));
+}
+
+static void inode_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode)
+{
+	struct inode *dir = inode_get(parent);
+
+	inode_reply_made(req, dir, name, mkdirat(dir->fd, name, mode));
+}
+
+static void inode_symlink(fuse_req_t req, const char *link,
+			  fuse_ino_t parent, const char *name)
+{
+	struct inode *dir = inode_get(parent);
+
+	inode_reply_made(req, dir, name, symlinkat(link, dir->fd, name));
+}
+
+static void inode_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+		       const char *newname)
+{
+	struct inode *dir = inode_get(newparent);
+	char proc_path[64];
+
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	inode_reply_made(req, dir, newname,
+			 linkat(AT_FDCWD, proc_path, dir->fd, newname,
+				AT_SYMLINK_FOLLOW));
+}
+
+static void inode_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	inode_reply_res(req, unlinkat(inode_get(parent)->fd, name, 0));
+}
+
+static void inode_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	inode_reply_res(req, unlinkat(inode_get(parent)->fd, name,
+				      AT_REMOVEDIR));
+}
+
+static void inode_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 fuse_ino_t newparent, const char *newname)
+{
+	inode_reply_res(req, renameat(inode_get(parent)->fd, name,
+				      inode_get(newparent)->fd, newname));
+}
+
+static void inode_open(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
+{
+	char proc_path[64];
+	int fd;
+
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	fd = open(proc_path, fi->flags & ~O_NOFOLLOW);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	// Keep the file open for the reads and writes that follow
+	fi->fh = fd;
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		close(fd);	// interrupted
+}
+
+static void inode_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, struct fuse_file_info *fi)
+{
+	struct inode *dir = inode_get(parent);
+	struct fuse_entry_param e;
+	int fd;
+	int res;
+
+	fd = openat(dir->fd, name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	res = inode_entry(dir, name, &e);
+	if (res < 0) {
+		close(fd);
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	fi->fh = fd;
+	if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+		close(fd);	// interrupted
+		inode_unref(inode_get(e.ino), 1);
+	}
+}
+
+/*
+ * With no layers, hand FUSE the backing descriptor and let it splice straight
+ * from the storage file to /dev/fuse; layers need to see the data
+ */
+static void inode_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	char *buf;
+	ssize_t res;
+
+	TRACE(TRACE_DEBUG, "Reading from inode %lu", ino);
+
+	if (!core_layered()) {
+		src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src.buf[0].fd = fi->fh;
+		src.buf[0].pos = offset;
+		fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	buf = bufpool_get(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	res = core_pread(fi->fh, buf, size, offset);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, buf, res);
+	bufpool_put(buf);
+}
+
+// Likewise, splice written data from /dev/fuse into the storage file
+static void inode_write_buf(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_bufvec *buf, off_t offset,
+			    struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	char *data, *copy;
+	ssize_t res;
+
+	TRACE(TRACE_DEBUG, "Writing to inode %lu", ino);
+
+	if (core_layered()) {
+		res = core_encode_bufvec(buf, offset, &data, &copy);
+		if (res >= 0) {
+			res = pwrite(fi->fh, data, res, offset);
+			if (res == -1)
+				res = -errno;
+		}
+		bufpool_put(copy);
+	} else {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fi->fh;
+		dst.buf[0].pos = offset;
+		res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	}
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
+static void inode_release(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	(void) ino;
+	close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void inode_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			struct fuse_file_info *fi)
+{
+	(void) ino;
+	inode_reply_res(req, datasync ? fdatasync(fi->fh) : fsync(fi->fh));
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static void inode_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			    off_t offset, off_t length,
+			    struct fuse_file_info *fi)
+{
+	(void) ino;
+	if (mode) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	fuse_reply_err(req, posix_fallocate(fi->fh, offset, length));
+}
+#endif
+
+/*
+ * Directories are listed a page at a time, as in the core: the directory
+ * stays open between readdir calls, and each entry goes with the telldir()
+ * position after it, where the next page starts.
+ */
+
+struct inode_dir {
+	DIR *dp;
+	struct dirent *entry;	// read, but not yet taken by FUSE
+	off_t offset;		// where entry came from
+};
+
+static struct inode_dir *inode_dir(struct fuse_file_info *fi)
+{
+	return (struct inode_dir *) (uintptr_t) fi->fh;
+}
+
+static void inode_opendir(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	struct inode_dir *d = malloc(sizeof(*d));
+	int fd;
+
+	if (d == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = openat(inode_get(ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+	d->dp = fd != -1 ? fdopendir(fd) : NULL;
+	if (d->dp == NULL) {
+		fuse_reply_err(req, errno);
+		if (fd != -1)
+			close(fd);
+		free(d);
+		return;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+
+	fi->fh = (uintptr_t) d;
+	if (fuse_reply_open(req, fi) == -ENOENT) {
+		closedir(d->dp);	// interrupted
+		free(d);
+	}
+}
+
+static void inode_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct inode_dir *d = inode_dir(fi);
+	char *buf = bufpool_get(size);
+	size_t used = 0;
+	size_t len;
+
+	(void) ino;
+
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	for (;;) {
+		struct stat st;
+		off_t next;
+
+		if (d->entry == NULL) {
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL)
+				break;
+		}
+		next = telldir(d->dp);
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		len = fuse_add_direntry(req, buf + used, size - used,
+					d->entry->d_name, &st, next);
+		if (len > size - used)
+			break;
+		used += len;
+		d->entry = NULL;
+		d->offset = next;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	bufpool_put(buf);
+}
+
+static void inode_releasedir(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+	struct inode_dir *d = inode_dir(fi);
+
+	(void) ino;
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void inode_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+			   struct fuse_file_info *fi)
+{
+	int fd = dirfd(inode_dir(fi)->dp);
+
+	(void) ino;
+	inode_reply_res(req, datasync ? fdatasync(fd) : fsync(fd));
+}
+
+static void inode_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+
+	if (fstatvfs(inode_get(ino)->fd, &stbuf) == -1)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &stbuf);
+}
+
+static void inode_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	char proc_path[64];
+
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	inode_reply_res(req, access(proc_path, mask));
+}
+
+#ifdef HAVE_SETXATTR
+/* xattr operations are optional and can safely be left unimplemented */
+static void inode_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			   const char *value, size_t size, int flags)
+{
+	char proc_path[64];
+
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	inode_reply_res(req, setxattr(proc_path, name, value, size, flags));
+}
+
+// A size of 0 asks how large the value is (or the list, for listxattr)
+static void inode_reply_xattr(fuse_req_t req, char *buf, size_t size,
+			      ssize_t res)
+{
+	if (res == -1)
+		fuse_reply_err(req, errno);
+	else if (size == 0)
+		fuse_reply_xattr(req, res);
+	else
+		fuse_reply_buf(req, buf, res);
+	free(buf);
+}
+
+static void inode_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			   size_t size)
+{
+	char proc_path[64];
+	char *buf = NULL;
+
+	if (size > 0 && (buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	inode_reply_xattr(req, buf, size, getxattr(proc_path, name, buf, size));
+}
+
+static void inode_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	char proc_path[64];
+	char *buf = NULL;
+
+	if (size > 0 && (buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	inode_reply_xattr(req, buf, size, listxattr(proc_path, buf, size));
+}
+
+static void inode_removexattr(fuse_req_t req, fuse_ino_t ino,
+			      const char *name)
+{
+	char proc_path[64];
+
+	inode_proc_path(proc_path, sizeof(proc_path), inode_get(ino)->fd);
+	inode_reply_res(req, removexattr(proc_path, name));
+}
+#endif /* HAVE_SETXATTR */
+
+static void inode_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	// Let the kernel splice data to and from our read/write_buf
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+				       FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+}
+
+static const struct fuse_lowlevel_ops inode_oper = {
+	.init		= inode_init,
+	.lookup		= inode_lookup,
+	.forget		= inode_forget,
+	.forget_multi	= inode_forget_multi,
+	.getattr	= inode_getattr,
+	.setattr	= inode_setattr,
+	.readlink	= inode_readlink,
+	.mknod		= inode_mknod,
+	.mkdir		= inode_mkdir,
+	.symlink	= inode_symlink,
+	.link		= inode_link,
+	.unlink		= inode_unlink,
+	.rmdir		= inode_rmdir,
+	.rename		= inode_rename,
+	.open		= inode_open,
+	.create		= inode_create,
+	.read		= inode_read,
+	.write_buf	= inode_write_buf,
+	.release	= inode_release,
+	.fsync		= inode_fsync,
+#ifdef HAVE_POSIX_FALLOCATE
+	.fallocate	= inode_fallocate,
+#endif
+	.opendir	= inode_opendir,
+	.readdir	= inode_readdir,
+	.releasedir	= inode_releasedir,
+	.fsyncdir	= inode_fsyncdir,
+	.statfs		= inode_statfs,
+	.access		= inode_access,
+#ifdef HAVE_SETXATTR
+	.setxattr	= inode_setxattr,
+	.getxattr	= inode_getxattr,
+	.listxattr	= inode_listxattr,
+	.removexattr	= inode_removexattr,
+#endif
+};
+
+// What fuse_main() does for the high-level modes, on a low-level session
+static int inode_run(int argc, char *argv[], int workers)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+	int res = -1;
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+			       &foreground) == -1)
+		return 1;
+
+	inode_root.fd = open(storage_dir, O_PATH | O_DIRECTORY);
+	if (inode_root.fd == -1) {
+		TRACE(TRACE_ERROR, "Could not open %s: %s", storage_dir,
+		      strerror(errno));
+		free(mountpoint);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	ch = fuse_mount(mountpoint, &args);
+	if (ch != NULL) {
+		se = fuse_lowlevel_new(&args, &inode_oper, sizeof(inode_oper),
+				       NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != -1)
+					res = core_serve(se, multithreaded,
+							 workers);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+
+	close(inode_root.fd);
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return res == -1 ? 1 : 0;
+}
+
+const struct smartfs_mode inode_mode = {
+	.name		= "inode",
+	.run		= inode_run,
+};
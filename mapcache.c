@@ -0,0 +1,584 @@
+/**
+ * Memory-mapped reads; see mapcache.h.
+ *
+ * Files are found by device and inode number in a small hash table, and the
+ * mapped ones are kept in a list from the most to the least recently opened,
+ * which is where mappings are taken away from when there are too many.  A
+ * file is in the table for as long as it is mapped or has handles open.
+ *
+ * The table, the list and how many handles each file has are guarded by
+ * mc_lock; what a file has mapped, and who is reading it, by the file's own
+ * lock, so reads never wait for opens of other files.  A mapping is only
+ * made or dropped with both held (mc_lock first).  One that is dropped while
+ * some reads are still copying out of it stays mapped until they are done,
+ * and whatever is about to change the file waits for that.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fuse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "attrcache.h"
+#include "mapcache.h"
+#include "smartfs.h"
+#include "trace.h"
+
+#define MC_BUCKETS 256			// of the table of files
+
+struct mc_file {
+	dev_t dev;
+	ino_t ino;
+	struct mc_file *next;		// in its bucket
+	int refs;			// handles open on it; under mc_lock
+	struct mc_file *newer;		// in the list, while mapped;
+	struct mc_file *older;		// under mc_lock
+
+	pthread_mutex_t lock;		// guards everything below
+	char *map;			// the whole file, or NULL
+	size_t size;
+	struct timespec mtime;		// of the file when it was mapped
+	char *old;			// a dropped mapping still being read
+	size_t old_size;
+	pthread_cond_t unmapped;	// signalled when old goes
+	int readers;			// copying out of map or old
+	int writers;			// handles that may change the file
+};
+
+struct mc_handle {
+	uint64_t fh;			// the next operations' own handle
+	struct mc_file *file;		// or NULL, if not a regular file
+	int writer;
+	int may_map;			// not tried to map its file yet; atomic
+};
+
+static size_t mc_limit = 0;
+static size_t mc_mapped = 0;		// of all files; under mc_lock
+static struct mc_file *mc_files[MC_BUCKETS];
+static struct mc_file *mc_newest = NULL, *mc_oldest = NULL;
+static pthread_mutex_t mc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The operations that are passed on to, as the mode had them
+static struct fuse_operations mc_next;
+
+void mapcache_init(size_t limit)
+{
+	mc_limit = limit;
+}
+
+int mapcache_on(void)
+{
+	return mc_limit > 0;
+}
+
+static struct mc_handle *mc_fh(struct fuse_file_info *fi)
+{
+	return (struct mc_handle *) (uintptr_t) fi->fh;
+}
+
+// fi as the next operations know it, in inner
+static struct fuse_file_info *mc_inner(struct fuse_file_info *fi,
+				       struct fuse_file_info *inner)
+{
+	*inner = *fi;
+	inner->fh = mc_fh(fi)->fh;
+	return inner;
+}
+
+static struct mc_file **mc_bucket(dev_t dev, ino_t ino)
+{
+	return &mc_files[(dev * 31 + ino) % MC_BUCKETS];
+}
+
+// The file with that device and inode number; under mc_lock
+static struct mc_file *mc_find(dev_t dev, ino_t ino)
+{
+	struct mc_file *f;
+
+	for (f = *mc_bucket(dev, ino); f != NULL; f = f->next)
+		if (f->dev == dev && f->ino == ino)
+			return f;
+	return NULL;
+}
+
+// Take a reference to the file st is about, adding it if need be; mc_lock
+static struct mc_file *mc_get(const struct stat *st)
+{
+	struct mc_file **bucket = mc_bucket(st->st_dev, st->st_ino);
+	struct mc_file *f;
+
+	f = mc_find(st->st_dev, st->st_ino);
+	if (f == NULL) {
+		f = calloc(1, sizeof(*f));
+		if (f == NULL)
+			return NULL;
+		f->dev = st->st_dev;
+		f->ino = st->st_ino;
+		pthread_mutex_init(&f->lock, NULL);
+		pthread_cond_init(&f->unmapped, NULL);
+		f->next = *bucket;
+		*bucket = f;
+	}
+	f->refs++;
+	return f;
+}
+
+// Take f out of the table if nothing is left to keep it there; mc_lock
+static void mc_forget(struct mc_file *f)
+{
+	struct mc_file **p;
+
+	if (f->refs > 0 || f->map != NULL)
+		return;
+	for (p = mc_bucket(f->dev, f->ino); *p != f; p = &(*p)->next)
+		;
+	*p = f->next;
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->unmapped);
+	free(f);
+}
+
+static void mc_unlink_lru(struct mc_file *f)
+{
+	if (f->newer != NULL)
+		f->newer->older = f->older;
+	else
+		mc_newest = f->older;
+	if (f->older != NULL)
+		f->older->newer = f->newer;
+	else
+		mc_oldest = f->newer;
+	f->newer = f->older = NULL;
+}
+
+static void mc_push_lru(struct mc_file *f)
+{
+	f->newer = NULL;
+	f->older = mc_newest;
+	if (mc_newest != NULL)
+		mc_newest->newer = f;
+	else
+		mc_oldest = f;
+	mc_newest = f;
+}
+
+// Unmap f's file, or leave that to its last reader; under both locks
+static void mc_drop(struct mc_file *f)
+{
+	if (f->map == NULL)
+		return;
+	mc_unlink_lru(f);
+	mc_mapped -= f->size;
+	if (f->readers > 0) {
+		// Nothing is mapped again before they are done with it
+		f->old = f->map;
+		f->old_size = f->size;
+	} else {
+		munmap(f->map, f->size);
+	}
+	f->map = NULL;
+}
+
+// Drop the mapping of the file st is about, if any; under mc_lock
+static void mc_drop_stat(const struct stat *st)
+{
+	struct mc_file *f = mc_find(st->st_dev, st->st_ino);
+
+	if (f == NULL)
+		return;
+	pthread_mutex_lock(&f->lock);
+	mc_drop(f);
+	pthread_mutex_unlock(&f->lock);
+	mc_forget(f);
+}
+
+// Get under the limit, unmapping from the least recently opened; mc_lock
+static void mc_evict(const struct mc_file *keep)
+{
+	struct mc_file *f, *newer;
+
+	for (f = mc_oldest; f != NULL && mc_mapped > mc_limit; f = newer) {
+		newer = f->newer;
+		if (f == keep)
+			continue;
+		pthread_mutex_lock(&f->lock);
+		mc_drop(f);
+		pthread_mutex_unlock(&f->lock);
+		mc_forget(f);
+	}
+}
+
+/*
+ * Map all of path into f: off the locks, since it takes several system
+ * calls, then installed unless the file was mapped or opened for writing
+ * meanwhile.  The size is the file's own, not what the attribute cache may
+ * still think it is.  Takes mc_lock itself.
+ */
+static void mc_map(struct mc_file *f, const char *path)
+{
+	struct stat st;
+	char *map = MAP_FAILED;
+	int busy;
+	int fd;
+
+	pthread_mutex_lock(&f->lock);
+	busy = f->map != NULL || f->old != NULL || f->writers > 0;
+	pthread_mutex_unlock(&f->lock);
+	if (busy)
+		return;
+
+	// A file larger than a quarter of the limit would drive out too much
+	fd = openat(storage_fd, storage_rel(path), O_RDONLY);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) == 0 && st.st_dev == f->dev && st.st_ino == f->ino &&
+	    st.st_size > 0 && (size_t) st.st_size <= mc_limit / 4)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	pthread_mutex_lock(&mc_lock);
+	pthread_mutex_lock(&f->lock);
+	if (f->map == NULL && f->old == NULL && f->writers == 0) {
+		f->map = map;
+		f->size = st.st_size;
+		f->mtime = st.st_mtim;
+		map = NULL;
+		mc_mapped += f->size;
+		mc_push_lru(f);
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (map == NULL)
+		mc_evict(f);
+	pthread_mutex_unlock(&mc_lock);
+
+	if (map != NULL)
+		munmap(map, st.st_size);
+}
+
+/*
+ * Whatever is mapped of the file at path (if a regular file), dropped
+ * before it is changed by a call that only has its path; if hold, nothing
+ * is mapped again until mc_release_path() of what this returns, and it also
+ * waits for the reads still copying out of the mapping, which would fault
+ * if the file were truncated under them
+ */
+static struct mc_file *mc_drop_path(const char *path, int hold)
+{
+	struct mc_file *f = NULL;
+	struct stat st;
+
+	if (attr_cache_lstat(storage_rel(path), &st) < 0 ||
+	    !S_ISREG(st.st_mode))
+		return NULL;
+	pthread_mutex_lock(&mc_lock);
+	if (hold) {
+		f = mc_get(&st);
+		if (f != NULL) {
+			pthread_mutex_lock(&f->lock);
+			f->writers++;
+			mc_drop(f);
+			pthread_mutex_unlock(&f->lock);
+		}
+	} else {
+		mc_drop_stat(&st);
+	}
+	pthread_mutex_unlock(&mc_lock);
+
+	if (f != NULL) {
+		pthread_mutex_lock(&f->lock);
+		while (f->old != NULL)
+			pthread_cond_wait(&f->unmapped, &f->lock);
+		pthread_mutex_unlock(&f->lock);
+	}
+	return f;
+}
+
+static void mc_release_path(struct mc_file *f)
+{
+	if (f == NULL)
+		return;
+	pthread_mutex_lock(&mc_lock);
+	pthread_mutex_lock(&f->lock);
+	f->writers--;
+	pthread_mutex_unlock(&f->lock);
+	f->refs--;
+	mc_forget(f);
+	pthread_mutex_unlock(&mc_lock);
+}
+
+static int mc_open(const char *path, struct fuse_file_info *fi)
+{
+	struct mc_handle *h;
+	struct mc_file *f;
+	struct stat st;
+	int stale;
+	int res;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL)
+		return -ENOMEM;
+	h->file = NULL;
+	h->may_map = 0;
+	h->writer = (fi->flags & O_ACCMODE) != O_RDONLY ||
+		    (fi->flags & O_TRUNC);
+
+	// Before an O_TRUNC can shorten the file under a mapping
+	if (h->writer)
+		h->file = mc_drop_path(path, 1);
+	res = mc_next.open(path, fi);
+	if (res < 0) {
+		mc_release_path(h->file);
+		free(h);
+		return res;
+	}
+	h->fh = fi->fh;
+	fi->fh = (uintptr_t) h;
+
+	if (h->writer || attr_cache_lstat(storage_rel(path), &st) < 0 ||
+	    !S_ISREG(st.st_mode))
+		return 0;
+
+	pthread_mutex_lock(&mc_lock);
+	f = h->file = mc_get(&st);
+	if (f == NULL) {
+		pthread_mutex_unlock(&mc_lock);
+		return 0;
+	}
+	pthread_mutex_lock(&f->lock);
+	if (f->map != NULL) {
+		// Changed since, behind our back: map it again
+		stale = f->size != (size_t) st.st_size ||
+			f->mtime.tv_sec != st.st_mtim.tv_sec ||
+			f->mtime.tv_nsec != st.st_mtim.tv_nsec;
+		if (stale) {
+			mc_drop(f);
+		} else {
+			mc_unlink_lru(f);
+			mc_push_lru(f);
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+	pthread_mutex_unlock(&mc_lock);
+
+	// Mapped on its first read, to leave opens just to look alone
+	h->may_map = 1;
+	return 0;
+}
+
+/*
+ * Copy what there is of size bytes at offset out of the mapping of f, and
+ * decode it: the bytes copied, or -1 if the file is not mapped or that is
+ * past the end of its mapping (which the file may have grown beyond).
+ */
+static ssize_t mc_copy(struct mc_file *f, char *buf, size_t size,
+		       off_t offset)
+{
+	const char *map;
+	size_t n;
+
+	if (f == NULL)
+		return -1;
+	pthread_mutex_lock(&f->lock);
+	if (f->map == NULL || offset >= (off_t) f->size) {
+		pthread_mutex_unlock(&f->lock);
+		return -1;
+	}
+	map = f->map;
+	n = f->size - offset < size ? f->size - offset : size;
+	f->readers++;
+	pthread_mutex_unlock(&f->lock);
+
+	memcpy(buf, map + offset, n);
+
+	pthread_mutex_lock(&f->lock);
+	if (--f->readers == 0 && f->old != NULL) {
+		munmap(f->old, f->old_size);
+		f->old = NULL;
+		pthread_cond_broadcast(&f->unmapped);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	core_decode(buf, n, offset);
+	return n;
+}
+
+// mc_copy(), mapping the file first if this handle has not tried yet
+static ssize_t mc_copy_handle(struct mc_handle *h, const char *path,
+			      char *buf, size_t size, off_t offset)
+{
+	ssize_t res;
+
+	res = mc_copy(h->file, buf, size, offset);
+	if (res < 0 && path != NULL &&
+	    __atomic_exchange_n(&h->may_map, 0, __ATOMIC_RELAXED)) {
+		mc_map(h->file, path);
+		res = mc_copy(h->file, buf, size, offset);
+	}
+	return res;
+}
+
+static int mc_read(const char *path, char *buf, size_t size, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+	ssize_t res;
+
+	res = mc_copy_handle(mc_fh(fi), path, buf, size, offset);
+	if (res >= 0) {
+		TRACE(TRACE_DEBUG, "Reading from %s (mapped)", path);
+		return res;
+	}
+	return mc_next.read(path, buf, size, offset, mc_inner(fi, &inner));
+}
+
+/*
+ * FUSE frees the memory of what read_buf hands it, so the mapping cannot be
+ * handed over itself: a mapped read is copied into a buffer of its own
+ */
+static int mc_read_buf(const char *path, struct fuse_bufvec **bufp,
+		       size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+	struct fuse_bufvec *src;
+	ssize_t res;
+
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].mem = malloc(size > 0 ? size : 1);
+	if (src->buf[0].mem == NULL) {
+		free(src);
+		return -ENOMEM;
+	}
+	res = mc_copy_handle(mc_fh(fi), path, src->buf[0].mem, size, offset);
+	if (res < 0) {
+		free(src->buf[0].mem);
+		free(src);
+		return mc_next.read_buf(path, bufp, size, offset,
+					mc_inner(fi, &inner));
+	}
+
+	TRACE(TRACE_DEBUG, "Reading from %s (mapped)", path);
+	src->buf[0].size = res;
+	*bufp = src;
+	return 0;
+}
+
+static int mc_write(const char *path, const char *buf, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+
+	return mc_next.write(path, buf, size, offset, mc_inner(fi, &inner));
+}
+
+static int mc_write_buf(const char *path, struct fuse_bufvec *buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+
+	return mc_next.write_buf(path, buf, offset, mc_inner(fi, &inner));
+}
+
+static int mc_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+
+	return mc_next.flush(path, mc_inner(fi, &inner));
+}
+
+static int mc_release(const char *path, struct fuse_file_info *fi)
+{
+	struct mc_handle *h = mc_fh(fi);
+	struct fuse_file_info inner;
+	int res;
+
+	res = mc_next.release(path, mc_inner(fi, &inner));
+
+	if (h->writer) {
+		mc_release_path(h->file);
+	} else if (h->file != NULL) {
+		pthread_mutex_lock(&mc_lock);
+		h->file->refs--;
+		mc_forget(h->file);
+		pthread_mutex_unlock(&mc_lock);
+	}
+	free(h);
+	return res;
+}
+
+static int mc_fsync(const char *path, int isdatasync,
+		    struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+
+	return mc_next.fsync(path, isdatasync, mc_inner(fi, &inner));
+}
+
+static int mc_fallocate(const char *path, int mode, off_t offset,
+			off_t length, struct fuse_file_info *fi)
+{
+	struct fuse_file_info inner;
+
+	return mc_next.fallocate(path, mode, offset, length,
+				 mc_inner(fi, &inner));
+}
+
+// A mapping must never reach past the end of its file
+static int mc_truncate(const char *path, off_t size)
+{
+	struct mc_file *f;
+	int res;
+
+	f = mc_drop_path(path, 1);
+	res = mc_next.truncate(path, size);
+	mc_release_path(f);
+	return res;
+}
+
+// The file renamed over, or unlinked, need not stay mapped once gone
+static int mc_rename(const char *from, const char *to)
+{
+	mc_drop_path(to, 0);
+	return mc_next.rename(from, to);
+}
+
+static int mc_unlink(const char *path)
+{
+	mc_drop_path(path, 0);
+	return mc_next.unlink(path);
+}
+
+void mapcache_operations(struct fuse_operations *ops)
+{
+	if (!mapcache_on())
+		return;
+
+	mc_next = *ops;
+	ops->open	= mc_open;
+	ops->read	= mc_read;
+	ops->read_buf	= mc_next.read_buf != NULL ? mc_read_buf : NULL;
+	ops->write	= mc_next.write != NULL ? mc_write : NULL;
+	ops->write_buf	= mc_next.write_buf != NULL ? mc_write_buf : NULL;
+	ops->flush	= mc_next.flush != NULL ? mc_flush : NULL;
+	ops->release	= mc_release;
+	ops->fsync	= mc_next.fsync != NULL ? mc_fsync : NULL;
+	ops->fallocate	= mc_next.fallocate != NULL ? mc_fallocate : NULL;
+	ops->truncate	= mc_truncate;
+	ops->rename	= mc_rename;
+	ops->unlink	= mc_unlink;
+}
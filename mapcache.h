@@ -0,0 +1,38 @@
+/**
+ * A cache of storage files mapped into memory, for read-mostly trees: a
+ * file is mapped whole the first time it is read through a read-only
+ * handle, and reads through the handles on it are copied out of the mapping
+ * (and decoded, if there are layers) with no system call at all.  Mappings
+ * outlive the handles, so a file that is opened, read and closed over and
+ * over is only ever mapped once.
+ *
+ * The mapped size of all files together is bounded by the limit given to
+ * mapcache_init(); past it the least recently opened files are unmapped.
+ * Opening a file for writing, truncating it, renaming over it or unlinking
+ * it through the mount drops its mapping, and none is made while it has a
+ * writer; changes made to the storage directory behind the mount's back are
+ * seen in the mapping, but a file must not be truncated there while mapped,
+ * which would make reading it fault.
+ *
+ * Include this after <fuse.h>.
+ */
+
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <stddef.h>
+
+// How many bytes of files to keep mapped, at most; 0 (the default) is off
+void mapcache_init(size_t limit);
+
+// Whether the cache is on
+int mapcache_on(void);
+
+/*
+ * Wraps the operations in ops that open files and read from them (and that
+ * change files or their names) in the cache, if it is on.  Call once, after
+ * any other wrapper of the file operations.
+ */
+void mapcache_operations(struct fuse_operations *ops);
+
+#endif /* MAPCACHE_H */
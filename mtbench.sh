@@ -0,0 +1,67 @@
+#!/bin/bash
+# Compare read/write throughput of a file system mounted single threaded
+# (-s) against the multithreaded mode (-t <threads>).
+# Please run it within the root directory that contains the built binaries
+# USAGE: ./mtbench.sh <mirrorfs|caesarfs|versfs> [threads] [jobs] [MiB per job]
+
+FS="${1:-mirrorfs}"
+THREADS="${2:-$(nproc)}"
+JOBS="${3:-$(nproc)}"
+SIZE_MB="${4:-256}"
+
+WORKDIR="$(mktemp -d)"
+STGDIR="${WORKDIR}/stg"
+MOUNTDIR="${WORKDIR}/mnt"
+mkdir -p "${STGDIR}" "${MOUNTDIR}"
+
+case "${FS}" in
+	caesarfs) EXTRA_ARGS="3" ;;
+	*)        EXTRA_ARGS="" ;;
+esac
+
+cleanup() {
+	fusermount -u "${MOUNTDIR}" 2>/dev/null
+	rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+# Mount with the given mode flags and wait for the mount to appear
+mount_fs() {
+	"./${FS}" "${STGDIR}" "${MOUNTDIR}" ${EXTRA_ARGS} "$@" 2>/dev/null
+	for _ in $(seq 50); do
+		mountpoint -q "${MOUNTDIR}" && return 0
+		sleep 0.1
+	done
+	echo "Failed to mount ${FS}" >&2
+	exit 1
+}
+
+# Run JOBS parallel dd's and print the aggregate MB/s
+run_jobs() {
+	local start end i
+	start=$(date +%s.%N)
+	for i in $(seq "${JOBS}"); do
+		"$@" "${i}" &
+	done
+	wait
+	end=$(date +%s.%N)
+	echo "${JOBS} ${SIZE_MB} ${start} ${end}" |
+		awk '{ printf "%.1f MB/s\n", $1 * $2 / ($4 - $3) }'
+}
+
+write_job() {
+	dd if=/dev/zero of="${MOUNTDIR}/bench.$1" bs=128k \
+		count=$((SIZE_MB * 8)) conv=notrunc status=none
+}
+
+read_job() {
+	dd if="${MOUNTDIR}/bench.$1" of=/dev/null bs=128k status=none
+}
+
+for MODE in "-s" "-t ${THREADS}"; do
+	mount_fs ${MODE}
+	echo "${FS} ${MODE} write: $(run_jobs write_job)"
+	echo "${FS} ${MODE} read:  $(run_jobs read_job)"
+	rm -f "${MOUNTDIR}"/bench.*
+	fusermount -u "${MOUNTDIR}"
+done
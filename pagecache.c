@@ -0,0 +1,612 @@
+/**
+ * The cache of decoded pages; see pagecache.h.
+ *
+ * A page goes to the shard its key hashes to, and within it to a bucket of
+ * a chained hash table; each shard has a fixed number of pages, allocated
+ * when mounting, which the clock hand goes round.  A read that misses reads
+ * the run of pages around what it asked for from the next operations in one
+ * call, and keeps all of them.
+ *
+ * Each shard also has a small table of files, which gives every file whose
+ * pages are kept a generation, along with the size and modification time
+ * it had: a read that finds the file has other ones (it was changed behind
+ * our back) starts a new generation, which leaves all of its old pages
+ * behind at once.  A change through the mount instead drops just the pages
+ * it touches, and then records the new size and time under the same
+ * generation, so the rest of the file stays cached.  Generations come from
+ * one counter and are never reused, so a file that loses its slot in the
+ * table to another cannot find its old pages again either, and a file made
+ * through the mount forgets the one its inode number last belonged to.
+ *
+ * Every drop of pages bumps pc_seq, and a page that was read is only kept
+ * if pc_seq is unchanged since before it was read: that way data a write
+ * has just replaced is never put back into the cache by a read that was
+ * under way at the time.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fuse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "attrcache.h"
+#include "bufpool.h"
+#include "pagecache.h"
+#include "smartfs.h"
+#include "stats.h"
+#include "trace.h"
+#include "writeback.h"
+
+#define PC_SHARDS 16
+#define PC_FILES  256		// in the table of each shard
+#define PC_RUN    16		// pages read from storage in one call, at most
+
+struct pc_file {
+	dev_t dev;
+	ino_t ino;
+	off_t size;			// as its pages were read
+	struct timespec mtime;
+	uint64_t gen;			// of its pages, or 0 for a free slot
+};
+
+struct pc_page {
+	dev_t dev;
+	ino_t ino;
+	off_t index;			// in the file, in pages
+	uint64_t gen;			// of the file, when the page was read
+	size_t len;			// less than a page at the end of the file
+	int used;
+	int referenced;			// read since the clock hand went by
+	int next;			// in its bucket, or -1
+};
+
+struct pc_shard {
+	pthread_mutex_t lock;		// guards all of the shard
+	struct pc_page *pages;
+	char *data;			// PAGECACHE_PAGE bytes for each page
+	int *buckets;			// the first page in each, or -1
+	int npages;			// and as many buckets
+	int hand;			// of the clock
+	struct pc_file *files;		// PC_FILES of them
+	uint64_t hits;
+	uint64_t misses;
+} __attribute__((aligned(64)));
+
+static size_t pc_limit = 0;
+static struct pc_shard pc_shards[PC_SHARDS];
+static int pc_npages = 0;		// in all shards
+static uint64_t pc_seq = 0;		// bumped by every drop; atomic
+static uint64_t pc_gens = 0;		// the last generation given; atomic
+
+// The operations that are passed on to, as the mode had them
+static struct fuse_operations pc_next;
+
+void pagecache_init(size_t limit)
+{
+	pc_limit = limit;
+}
+
+int pagecache_on(void)
+{
+	return pc_limit > 0;
+}
+
+static uint64_t pc_hash(dev_t dev, ino_t ino, off_t index)
+{
+	uint64_t h = (uint64_t) ino * 0x9E3779B97F4A7C15ULL;
+
+	h ^= (uint64_t) index * 0xC2B2AE3D27D4EB4FULL + dev;
+	return h ^ (h >> 29);
+}
+
+static struct pc_shard *pc_shard(uint64_t hash)
+{
+	return &pc_shards[hash % PC_SHARDS];
+}
+
+static int *pc_bucket(struct pc_shard *s, uint64_t hash)
+{
+	return &s->buckets[(hash / PC_SHARDS) % s->npages];
+}
+
+// The page with that key in s, or -1; under s->lock
+static int pc_find(struct pc_shard *s, uint64_t hash, dev_t dev, ino_t ino,
+		   off_t index)
+{
+	int i;
+
+	for (i = *pc_bucket(s, hash); i >= 0; i = s->pages[i].next) {
+		struct pc_page *p = &s->pages[i];
+
+		if (p->ino == ino && p->index == index && p->dev == dev)
+			return i;
+	}
+	return -1;
+}
+
+// Take page i out of its bucket, making it free; under s->lock
+static void pc_unchain(struct pc_shard *s, int i)
+{
+	struct pc_page *p = &s->pages[i];
+	int *link = pc_bucket(s, pc_hash(p->dev, p->ino, p->index));
+
+	while (*link != i)
+		link = &s->pages[*link].next;
+	*link = p->next;
+	p->used = 0;
+}
+
+static int pc_same(const struct pc_file *f, const struct stat *st)
+{
+	return f->size == st->st_size &&
+	       f->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// The slot of the file st is in the table, and its shard, locked
+static struct pc_file *pc_file(const struct stat *st, struct pc_shard **sp)
+{
+	uint64_t hash = pc_hash(st->st_dev, st->st_ino, -1);
+
+	*sp = pc_shard(hash);
+	pthread_mutex_lock(&(*sp)->lock);
+	return &(*sp)->files[(hash / PC_SHARDS) % PC_FILES];
+}
+
+// The generation of the pages of the file st is, as it is now
+static uint64_t pc_gen(const struct stat *st)
+{
+	struct pc_shard *s;
+	struct pc_file *f = pc_file(st, &s);
+	uint64_t gen;
+
+	if (f->gen == 0 || f->dev != st->st_dev || f->ino != st->st_ino ||
+	    !pc_same(f, st)) {
+		f->dev = st->st_dev;
+		f->ino = st->st_ino;
+		f->size = st->st_size;
+		f->mtime = st->st_mtim;
+		f->gen = __atomic_add_fetch(&pc_gens, 1, __ATOMIC_RELAXED);
+	}
+	gen = f->gen;
+	pthread_mutex_unlock(&s->lock);
+	return gen;
+}
+
+/*
+ * Record that the file st is was changed through the mount, keeping its
+ * generation: the size it had before, past which its last page may have
+ * been cut short, or -1 if it is not in the table
+ */
+static off_t pc_restamp(const struct stat *st)
+{
+	struct pc_shard *s;
+	struct pc_file *f = pc_file(st, &s);
+	off_t size = -1;
+
+	if (f->gen != 0 && f->dev == st->st_dev && f->ino == st->st_ino) {
+		size = f->size;
+		f->size = st->st_size;
+		f->mtime = st->st_mtim;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return size;
+}
+
+/*
+ * Copy what there is of size bytes from offset in into page index of the
+ * file st is, if cached in generation gen: the length of the page (so the
+ * caller can tell the end of the file), with how much was copied in
+ * *copied, or -1
+ */
+static ssize_t pc_lookup(const struct stat *st, uint64_t gen, off_t index,
+			 char *buf, size_t in, size_t size, size_t *copied)
+{
+	uint64_t hash = pc_hash(st->st_dev, st->st_ino, index);
+	struct pc_shard *s = pc_shard(hash);
+	struct pc_page *p;
+	ssize_t len = -1;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	i = pc_find(s, hash, st->st_dev, st->st_ino, index);
+	if (i >= 0 && s->pages[i].gen != gen) {
+		pc_unchain(s, i);
+		i = -1;
+	}
+	if (i >= 0) {
+		p = &s->pages[i];
+		*copied = in < p->len ? p->len - in : 0;
+		if (*copied > size)
+			*copied = size;
+		memcpy(buf, s->data + (size_t) i * PAGECACHE_PAGE + in,
+		       *copied);
+		p->referenced = 1;
+		len = p->len;
+		s->hits++;
+	} else {
+		s->misses++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return len;
+}
+
+/*
+ * Keep len bytes of decoded data as page index of the file st is, in
+ * generation gen, unless pages were dropped since pc_seq was seq
+ */
+static void pc_insert(const struct stat *st, uint64_t gen, off_t index,
+		      const char *data, size_t len, uint64_t seq)
+{
+	uint64_t hash = pc_hash(st->st_dev, st->st_ino, index);
+	struct pc_shard *s = pc_shard(hash);
+	struct pc_page *p;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	if (__atomic_load_n(&pc_seq, __ATOMIC_ACQUIRE) != seq) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	i = pc_find(s, hash, st->st_dev, st->st_ino, index);
+	if (i < 0) {
+		// The first page the hand finds that was not read lately
+		for (;;) {
+			i = s->hand;
+			s->hand = (s->hand + 1) % s->npages;
+			p = &s->pages[i];
+			if (!p->used)
+				break;
+			if (!p->referenced) {
+				pc_unchain(s, i);
+				break;
+			}
+			p->referenced = 0;
+		}
+		p->dev = st->st_dev;
+		p->ino = st->st_ino;
+		p->index = index;
+		p->used = 1;
+		p->next = *pc_bucket(s, hash);
+		*pc_bucket(s, hash) = i;
+	}
+	p = &s->pages[i];
+	p->gen = gen;
+	p->len = len;
+	p->referenced = 0;
+	memcpy(s->data + (size_t) i * PAGECACHE_PAGE, data, len);
+	pthread_mutex_unlock(&s->lock);
+}
+
+// Drop pages first to last of the file st is
+static void pc_drop(const struct stat *st, off_t first, off_t last)
+{
+	struct pc_shard *s;
+	off_t index;
+	int n, i;
+
+	__atomic_add_fetch(&pc_seq, 1, __ATOMIC_ACQ_REL);
+
+	// Looking up every page of a long range costs more than one pass
+	if (last - first >= pc_npages) {
+		for (n = 0; n < PC_SHARDS; n++) {
+			s = &pc_shards[n];
+			pthread_mutex_lock(&s->lock);
+			for (i = 0; i < s->npages; i++) {
+				struct pc_page *p = &s->pages[i];
+
+				if (p->used && p->ino == st->st_ino &&
+				    p->dev == st->st_dev &&
+				    p->index >= first && p->index <= last)
+					pc_unchain(s, i);
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+		return;
+	}
+
+	for (index = first; index <= last; index++) {
+		uint64_t hash = pc_hash(st->st_dev, st->st_ino, index);
+
+		s = pc_shard(hash);
+		pthread_mutex_lock(&s->lock);
+		i = pc_find(s, hash, st->st_dev, st->st_ino, index);
+		if (i >= 0)
+			pc_unchain(s, i);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/*
+ * After the bytes from offset to end of the file at path were changed
+ * through the mount: drop their pages (and the one the file used to end
+ * in, if it grew, which was short), and keep the others
+ */
+static void pc_changed(const char *path, off_t offset, off_t end)
+{
+	struct stat st;
+	off_t size;
+
+	if (end <= offset || path == NULL ||
+	    attr_cache_lstat(storage_rel(path), &st) < 0 ||
+	    !S_ISREG(st.st_mode))
+		return;
+	pc_drop(&st, offset / PAGECACHE_PAGE, (end - 1) / PAGECACHE_PAGE);
+	size = pc_restamp(&st);
+	if (size >= 0 && size < st.st_size && size < offset)
+		pc_drop(&st, size / PAGECACHE_PAGE, size / PAGECACHE_PAGE);
+}
+
+// After the file at path was made: forget the one its inode last belonged to
+static void pc_forget(const char *path)
+{
+	struct pc_shard *s;
+	struct pc_file *f;
+	struct stat st;
+
+	if (attr_cache_lstat(storage_rel(path), &st) < 0)
+		return;
+	f = pc_file(&st, &s);
+	if (f->dev == st.st_dev && f->ino == st.st_ino)
+		f->gen = 0;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Read the run of pages that offset is in the first of, as many as cover
+ * size bytes at most, from the next operations, keep them, and copy the
+ * part asked for into buf: the bytes copied (*eof set if the file ends in
+ * the run), or -errno
+ */
+static ssize_t pc_fill(const char *path, const struct stat *st, uint64_t gen,
+		       char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi, int *eof)
+{
+	off_t index = offset / PAGECACHE_PAGE;
+	size_t in = offset % PAGECACHE_PAGE;
+	size_t npages = (in + size + PAGECACHE_PAGE - 1) / PAGECACHE_PAGE;
+	size_t run, copied, k;
+	uint64_t seq;
+	char *data;
+	int res;
+
+	if (npages > PC_RUN)
+		npages = PC_RUN;
+	run = npages * PAGECACHE_PAGE;
+	data = bufpool_get(run);
+	if (data == NULL)
+		return -ENOMEM;
+
+	seq = __atomic_load_n(&pc_seq, __ATOMIC_ACQUIRE);
+	res = pc_next.read(path, data, run, index * PAGECACHE_PAGE, fi);
+	if (res < 0) {
+		bufpool_put(data);
+		return res;
+	}
+	for (k = 0; k * PAGECACHE_PAGE < (size_t) res; k++) {
+		size_t len = res - k * PAGECACHE_PAGE;
+
+		pc_insert(st, gen, index + k, data + k * PAGECACHE_PAGE,
+			  len < PAGECACHE_PAGE ? len : PAGECACHE_PAGE, seq);
+	}
+
+	copied = (size_t) res > in ? res - in : 0;
+	if (copied > size)
+		copied = size;
+	memcpy(buf, data + in, copied);
+	*eof = (size_t) res < run;
+	bufpool_put(data);
+	return copied;
+}
+
+static int pc_read(const char *path, char *buf, size_t size, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	struct stat st;
+	size_t done = 0;
+	uint64_t gen;
+	ssize_t res;
+	int eof = 0;
+
+	// (no path for a file unlinked while open with -o hard_remove)
+	if (path == NULL || attr_cache_lstat(storage_rel(path), &st) < 0 ||
+	    !S_ISREG(st.st_mode))
+		return pc_next.read(path, buf, size, offset, fi);
+
+	gen = pc_gen(&st);
+	while (done < size && !eof) {
+		off_t pos = offset + done;
+		size_t in = pos % PAGECACHE_PAGE;
+		size_t want = size - done;
+		size_t copied;
+
+		if (want > PAGECACHE_PAGE - in)
+			want = PAGECACHE_PAGE - in;
+		res = pc_lookup(&st, gen, pos / PAGECACHE_PAGE, buf + done,
+				in, want, &copied);
+		if (res < 0) {
+			res = pc_fill(path, &st, gen, buf + done, size - done,
+				      pos, fi, &eof);
+			if (res < 0)
+				return done > 0 ? (int) done : (int) res;
+			done += res;
+			continue;
+		}
+		done += copied;
+		if (copied == want)
+			continue;
+
+		// A short page is the end of the file, unless write-back
+		// caching keeps data past what storage has
+		if (writeback_on()) {
+			res = pc_next.read(path, buf + done, size - done,
+					   offset + done, fi);
+			if (res > 0)
+				done += res;
+		}
+		break;
+	}
+	return done;
+}
+
+static int pc_write(const char *path, const char *buf, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	res = pc_next.write(path, buf, size, offset, fi);
+	if (res > 0)
+		pc_changed(path, offset, offset + res);
+	return res;
+}
+
+static int pc_write_buf(const char *path, struct fuse_bufvec *buf,
+			off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	res = pc_next.write_buf(path, buf, offset, fi);
+	if (res > 0)
+		pc_changed(path, offset, offset + res);
+	return res;
+}
+
+/*
+ * Where the file st is ends, as far as its pages go: with write-back
+ * caching, its dirty data may go on past the end of the storage file
+ */
+static off_t pc_end(const struct stat *st)
+{
+	return writeback_on() ? INT64_MAX : st->st_size + 1;
+}
+
+static int pc_truncate(const char *path, off_t size)
+{
+	struct stat st;
+	off_t end;
+	int res;
+
+	// Everything between the old end and the new one
+	if (attr_cache_lstat(storage_rel(path), &st) < 0)
+		st.st_size = size;
+	end = pc_end(&st) > size ? pc_end(&st) : size + 1;
+	res = pc_next.truncate(path, size);
+	if (res == 0)
+		pc_changed(path, st.st_size < size ? st.st_size : size, end);
+	return res;
+}
+
+static int pc_open(const char *path, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int res;
+
+	if (!(fi->flags & O_TRUNC) ||
+	    attr_cache_lstat(storage_rel(path), &st) < 0)
+		st.st_size = -1;	// nothing to drop
+	res = pc_next.open(path, fi);
+	if (res == 0 && st.st_size >= 0)
+		pc_changed(path, 0, pc_end(&st));
+	return res;
+}
+
+static int pc_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int res;
+
+	res = pc_next.create(path, mode, fi);
+	if (res == 0)
+		pc_forget(path);
+	return res;
+}
+
+static int pc_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	res = pc_next.mknod(path, mode, rdev);
+	if (res == 0)
+		pc_forget(path);
+	return res;
+}
+
+static void pc_report(FILE *f)
+{
+	uint64_t hits = 0, misses = 0;
+	int used = 0;
+	int n, i;
+
+	for (n = 0; n < PC_SHARDS; n++) {
+		struct pc_shard *s = &pc_shards[n];
+
+		pthread_mutex_lock(&s->lock);
+		hits += s->hits;
+		misses += s->misses;
+		for (i = 0; i < s->npages; i++)
+			used += s->pages[i].used;
+		pthread_mutex_unlock(&s->lock);
+	}
+	fprintf(f, "pagecache hits %llu misses %llu hit_rate %.1f%% pages %d/%d\n",
+		(unsigned long long) hits, (unsigned long long) misses,
+		hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+		used, pc_npages);
+}
+
+// Give each shard its pages; 0, or -1 if out of memory
+static int pc_alloc(void)
+{
+	size_t per_shard = pc_limit / PAGECACHE_PAGE / PC_SHARDS;
+	int n, i;
+
+	if (per_shard < 1)
+		per_shard = 1;
+	for (n = 0; n < PC_SHARDS; n++) {
+		struct pc_shard *s = &pc_shards[n];
+
+		pthread_mutex_init(&s->lock, NULL);
+		s->npages = per_shard;
+		s->pages = calloc(per_shard, sizeof(*s->pages));
+		s->buckets = malloc(per_shard * sizeof(*s->buckets));
+		s->data = malloc(per_shard * PAGECACHE_PAGE);
+		s->files = calloc(PC_FILES, sizeof(*s->files));
+		if (s->pages == NULL || s->buckets == NULL ||
+		    s->data == NULL || s->files == NULL)
+			return -1;
+		for (i = 0; i < s->npages; i++)
+			s->buckets[i] = -1;
+		pc_npages += s->npages;
+	}
+	return 0;
+}
+
+void pagecache_operations(struct fuse_operations *ops)
+{
+	if (!pagecache_on() || !core_layered())
+		return;
+	if (pc_alloc() < 0) {
+		TRACE(TRACE_ERROR, "No memory for a %zu MiB page cache",
+		      pc_limit >> 20);
+		return;
+	}
+
+	pc_next = *ops;
+	ops->create	= pc_next.create != NULL ? pc_create : NULL;
+	ops->mknod	= pc_next.mknod != NULL ? pc_mknod : NULL;
+	ops->open	= pc_open;
+	ops->read	= pc_read;
+	ops->read_buf	= NULL;		// the data has to pass through us
+	ops->write	= pc_next.write != NULL ? pc_write : NULL;
+	ops->write_buf	= pc_next.write_buf != NULL ? pc_write_buf : NULL;
+	ops->truncate	= pc_truncate;
+	stats_add_section(pc_report);
+}
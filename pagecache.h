@@ -0,0 +1,43 @@
+/**
+ * A cache of decoded file data, for mounts with layers: reading the same
+ * part of a file again (with direct_io, or after the kernel dropped its own
+ * copy) is answered from memory, without reading it from storage or running
+ * it back up through the layers once more.
+ *
+ * Data is kept in pages of PAGECACHE_PAGE bytes, keyed by device, inode
+ * and page number, and split between shards that each have a lock of their
+ * own, so reads of different pages hardly ever wait for one another.  The
+ * cache holds at most the number of bytes given to pagecache_init(); a
+ * shard that is full reuses the page that has gone longest unread (the
+ * CLOCK approximation of LRU).  Writes, truncates and opens with O_TRUNC
+ * through the mount drop just the pages they change.  A file whose size or
+ * modification time, from the attribute cache, is found to be other than
+ * those the mount last gave it has all its pages left behind, so changes
+ * made behind the mount's back show up as soon as those do.
+ *
+ * The hits and misses are reported in /.smartfs/stats.
+ *
+ * Include this after <fuse.h>.
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stddef.h>
+
+#define PAGECACHE_PAGE (16 * 1024)
+
+// How many bytes of decoded data to keep, at most; 0 (the default) is off
+void pagecache_init(size_t limit);
+
+// Whether the cache is on
+int pagecache_on(void);
+
+/*
+ * Wraps the operations in ops that read and change file data in the cache,
+ * if it is on and there are layers to decode through.  Call once, after
+ * any other wrapper of the file operations.
+ */
+void pagecache_operations(struct fuse_operations *ops);
+
+#endif /* PAGECACHE_H */
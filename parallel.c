@@ -0,0 +1,138 @@
+/**
+ * The transform thread pool; see parallel.h.
+ *
+ * Work waits in a queue of jobs, one per parallel_run() in progress, each of
+ * which lives on its caller's stack.  Threads claim the pieces of the job at
+ * the head with an atomic counter, and take the job off the queue once they
+ * have all been claimed.  A job counts the threads still working on it, and
+ * its caller waits for that to drop to zero before it returns.
+ */
+
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define PARALLEL_MAX_THREADS 7
+
+struct parallel_job {
+	void (*fn)(void *arg, size_t i);
+	void *arg;
+	size_t n;
+	size_t next;			// the next piece to claim
+	int users;			// threads working on it besides the caller
+	struct parallel_job *next_job;
+};
+
+static int parallel_threads = -1;
+static int parallel_started = 0;
+static pthread_once_t parallel_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t parallel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parallel_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t parallel_done = PTHREAD_COND_INITIALIZER;
+static struct parallel_job *parallel_queue = NULL;
+
+void parallel_init(int threads)
+{
+	if (threads < 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+		if (threads > PARALLEL_MAX_THREADS)
+			threads = PARALLEL_MAX_THREADS;
+	}
+	parallel_threads = threads > 0 ? threads : 0;
+}
+
+// Takes job off the queue, if it is still on it; with parallel_lock held
+static void parallel_dequeue(struct parallel_job *job)
+{
+	struct parallel_job **p;
+
+	for (p = &parallel_queue; *p != NULL; p = &(*p)->next_job)
+		if (*p == job) {
+			*p = job->next_job;
+			break;
+		}
+}
+
+// Runs pieces of job until there are none left to claim
+static void parallel_work_on(struct parallel_job *job)
+{
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->n)
+		job->fn(job->arg, i);
+}
+
+static void *parallel_thread(void *unused)
+{
+	struct parallel_job *job;
+
+	(void) unused;
+	pthread_mutex_lock(&parallel_lock);
+	for (;;) {
+		while (parallel_queue == NULL)
+			pthread_cond_wait(&parallel_work, &parallel_lock);
+		job = parallel_queue;
+		job->users++;
+		pthread_mutex_unlock(&parallel_lock);
+
+		parallel_work_on(job);
+
+		pthread_mutex_lock(&parallel_lock);
+		parallel_dequeue(job);
+		if (--job->users == 0)
+			pthread_cond_broadcast(&parallel_done);
+	}
+	return NULL;
+}
+
+static void parallel_start(void)
+{
+	pthread_t thread;
+	int i;
+
+	if (parallel_threads < 0)
+		parallel_init(-1);
+	for (i = 0; i < parallel_threads; i++) {
+		if (pthread_create(&thread, NULL, parallel_thread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+	}
+	parallel_started = i;
+	TRACE(TRACE_INFO, "Transforming large requests on %d more threads", i);
+}
+
+int parallel_worth(size_t size)
+{
+	return size >= PARALLEL_MIN_SIZE && parallel_threads != 0;
+}
+
+void parallel_run(size_t n, void (*fn)(void *arg, size_t i), void *arg)
+{
+	struct parallel_job job = { fn, arg, n, 0, 0, NULL };
+	struct parallel_job **tail;
+
+	pthread_once(&parallel_once, parallel_start);
+	if (n > 1 && parallel_started > 0) {
+		pthread_mutex_lock(&parallel_lock);
+		for (tail = &parallel_queue; *tail != NULL;
+		     tail = &(*tail)->next_job)
+			;
+		*tail = &job;
+		pthread_cond_broadcast(&parallel_work);
+		pthread_mutex_unlock(&parallel_lock);
+	}
+
+	parallel_work_on(&job);
+
+	if (n > 1 && parallel_started > 0) {
+		pthread_mutex_lock(&parallel_lock);
+		parallel_dequeue(&job);
+		while (job.users > 0)
+			pthread_cond_wait(&parallel_done, &parallel_lock);
+		pthread_mutex_unlock(&parallel_lock);
+	}
+}
@@ -0,0 +1,36 @@
+/**
+ * A small persistent pool of threads for spreading the data transforms of
+ * one large request (the layers, the crypt mode's blocks) over several
+ * cores.  The thread that hands in the work takes part in it too, so a pool
+ * of n threads runs n + 1 pieces at once.
+ *
+ * The threads are only started the first time they are needed, which is
+ * after FUSE has put the process in the background.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+// A full-sized FUSE write (128 KiB) is just enough to be worth splitting
+#define PARALLEL_CHUNK    (32 * 1024)	// the piece of data each call gets
+#define PARALLEL_MIN_SIZE (4 * PARALLEL_CHUNK)	// less stays on one thread
+
+/*
+ * Sets how many threads to start: 0 runs everything on the caller's own
+ * thread, and a negative number picks one less than the number of CPUs (at
+ * most 7).  Must be called before the first parallel_run().
+ */
+void parallel_init(int threads);
+
+// Whether work on size bytes is worth splitting up
+int parallel_worth(size_t size);
+
+/*
+ * Calls fn(arg, i) once for every i from 0 to n - 1, on as many threads at
+ * once as there are, and returns when all of them have returned.
+ */
+void parallel_run(size_t n, void (*fn)(void *arg, size_t i), void *arg);
+
+#endif /* PARALLEL_H */
@@ -0,0 +1,259 @@
+/**
+ * The smartfs binary: one executable for every mode.  The mode is picked
+ * with --mode <name>, or otherwise from the name the binary was run as, so
+ * that mirrorfs, caesarfs, versfs, cryptfs and inodefs can simply be links to
+ * smartfs.  Data
+ * layers such as the cipher can be stacked under a mode within the one
+ * mount, e.g. --mode vers,caesar.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "attrcache.h"
+#include "parallel.h"
+#include "smartfs.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+
+static const struct smartfs_mode *modes[] = {
+	&mirror_mode,
+	&caesar_mode,
+	&vers_mode,
+	&crypt_mode,
+	&inode_mode,
+	NULL
+};
+
+// The mode the mount runs, and the data layers stacked under it, top first
+static const struct smartfs_mode *base = NULL;
+static const struct smartfs_mode *layers[8];
+static int nlayers = 0;
+
+static const struct smartfs_mode *find_mode(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; modes[i] != NULL; i++)
+		if (strlen(modes[i]->name) == len &&
+		    strncmp(modes[i]->name, name, len) == 0)
+			return modes[i];
+	return NULL;
+}
+
+/*
+ * "<mode>[,<layer>...]", e.g. "vers,caesar" for versioning on top of the
+ * cipher.  The mode can be left out when it is mirror.  0, or -1 if bad.
+ */
+static int parse_modes(const char *spec)
+{
+	const struct smartfs_mode *mode;
+	const char *end;
+
+	for (; *spec != '\0'; spec = *end == ',' ? end + 1 : end) {
+		end = strchr(spec, ',');
+		if (end == NULL)
+			end = spec + strlen(spec);
+		mode = find_mode(spec, end - spec);
+		if (mode == NULL)
+			return -1;
+		if (!mode->layer) {
+			if (base != NULL || nlayers > 0)
+				return -1;
+			base = mode;
+		} else if (nlayers < (int) (sizeof(layers) / sizeof(layers[0]))) {
+			layers[nlayers++] = mode;
+		} else {
+			return -1;
+		}
+	}
+	if (base == NULL)
+		base = &mirror_mode;
+	return 0;
+}
+
+// "<mode>fs", as the binary was run
+static int parse_program(const char *program)
+{
+	const char *name = strrchr(program, '/');
+	size_t len;
+
+	name = name != NULL ? name + 1 : program;
+	len = strlen(name);
+	if (len < 3 || strcmp(name + len - 2, "fs") != 0 ||
+	    find_mode(name, len - 2) == NULL)
+		return -1;
+	return parse_modes(find_mode(name, len - 2)->name);
+}
+
+int smartfs_setup_layers(char *args[], int nargs)
+{
+	int used = 0;
+	int i;
+
+	for (i = 0; i < nlayers; i++) {
+		if (used + layers[i]->nargs > nargs)
+			return -1;
+		if (layers[i]->setup(&args[used]) < 0)
+			return -1;
+		used += layers[i]->nargs;
+	}
+	return used;
+}
+
+// Appends " <text>" for each piece of text the mode and its layers give
+static void describe(char *buf, size_t size, const char *sep, int options)
+{
+	const char *text;
+	size_t len;
+	int i;
+
+	buf[0] = '\0';
+	for (i = -1; i < nlayers; i++) {
+		const struct smartfs_mode *m = i < 0 ? base : layers[i];
+
+		text = options ? m->options : m->args;
+		len = strlen(buf);
+		if (text != NULL)
+			snprintf(buf + len, size - len, "%s%s", sep, text);
+	}
+}
+
+static int usage(const char *program)
+{
+	char args[256], options[256];
+	int i;
+
+	if (base == NULL) {
+	  fprintf(stderr, "USAGE: %s --mode <", program);
+	  for (i = 0; modes[i] != NULL; i++)
+	    fprintf(stderr, "%s%s", i > 0 ? "|" : "", modes[i]->name);
+	  fprintf(stderr, ">[,<layer>...] ...\n");
+	  return 1;
+	}
+	describe(args, sizeof(args), " ", 0);
+	describe(options, sizeof(options), " | ", 1);
+	fprintf(stderr, "USAGE: %s <storage directory> <mount point>%s [ -d | -f | -s | -t <threads> | -j <threads> | -T <seconds> | -u <0|1> | -v%s ]\n",
+		program, args, options);
+	if (base->commands != NULL)
+	  fprintf(stderr, "       %s %s%s\n", program, base->commands, args);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	char program[256];
+	int nargs;
+	int res;
+
+	umask(0);
+
+	// Take --mode <modes> out wherever it appears
+	snprintf(program, sizeof(program), "%s", argv[0]);
+	for (int i = 1; i < argc; i += 1) {
+	  if (strcmp(argv[i], "--mode") != 0 || i + 1 >= argc)
+	    continue;
+	  if (parse_modes(argv[i + 1]) < 0) {
+	    fprintf(stderr, "ERROR: Bad mode %s\n", argv[i + 1]);
+	    base = NULL;
+	    return usage(argv[0]);
+	  }
+	  snprintf(program, sizeof(program), "%s --mode %s", argv[0],
+		   argv[i + 1]);
+	  memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(argv[0]));
+	  argc -= 2;
+	  break;
+	}
+	if (base == NULL && parse_program(argv[0]) < 0)
+	  return usage(argv[0]);
+
+	if (base->command != NULL) {
+	  res = base->command(argc, argv);
+	  if (res >= 0)
+	    return res;
+	}
+
+	nargs = base->nargs;
+	for (int i = 0; i < nlayers; i++)
+	  nargs += layers[i]->nargs;
+	if (argc < 3 + nargs)
+	  return usage(program);
+	storage_dir = argv[1];
+	char* mount_dir = argv[2];
+	if (storage_dir[0] != '/' || mount_dir[0] != '/') {
+	  fprintf(stderr, "ERROR: Directories must be absolute paths\n");
+	  return 1;
+	}
+	// Every path is looked up from here, so none is ever built in full
+	storage_fd = open(storage_dir, O_RDONLY | O_DIRECTORY);
+	if (storage_fd == -1) {
+	  fprintf(stderr, "ERROR: %s: %s\n", storage_dir, strerror(errno));
+	  return 1;
+	}
+	attr_cache_dir(storage_fd);
+	TRACE(TRACE_INFO, "Mounting %s at %s (%s mode)", storage_dir,
+	      mount_dir, base->name);
+	if ((base->setup != NULL && base->setup(&argv[3]) < 0) ||
+	    smartfs_setup_layers(&argv[3 + base->nargs],
+				 nargs - base->nargs) < 0)
+	  return usage(program);
+
+	int workers = 0;
+	int short_argc = 2;
+	char* short_argv[argc];
+	char timeouts[128];
+	attr_cache_init(1.0);
+	short_argv[0] = argv[0];
+	short_argv[1] = mount_dir;
+	for (int i = 3 + nargs; i < argc; i += 1) {
+	  if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+	    workers = atoi(argv[++i]);
+	    continue;
+	  }
+	  if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+	    parallel_init(atoi(argv[++i]));
+	    continue;
+	  }
+	  if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+	    uring_init(atoi(argv[++i]));
+	    continue;
+	  }
+	  if (strcmp(argv[i], "-v") == 0) {
+	    trace_level = TRACE_DEBUG;
+	    continue;
+	  }
+	  if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+	    // Cache attributes and lookups for this long, here and in the kernel
+	    attr_cache_init(atof(argv[++i]));
+	    if (base->run != NULL)
+	      continue;	// which the mode tells it itself
+	    snprintf(timeouts, sizeof(timeouts),
+		     "entry_timeout=%s,attr_timeout=%s,negative_timeout=%s",
+		     argv[i], argv[i], argv[i]);
+	    short_argv[short_argc++] = "-o";
+	    short_argv[short_argc++] = timeouts;
+	    continue;
+	  }
+	  if (base->option != NULL) {
+	    res = base->option(argc, argv, i);
+	    if (res < 0)
+	      return 1;
+	    if (res > 0) {
+	      i += res - 1;
+	      continue;
+	    }
+	  }
+	  short_argv[short_argc++] = argv[i];
+	}
+	if (base->run != NULL)
+	  return base->run(short_argc, short_argv, workers);
+	return core_run(short_argc, short_argv,
+			stats_wrap(base->operations()), workers);
+}
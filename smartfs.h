@@ -0,0 +1,155 @@
+/**
+ * The pieces shared by the smartfs modes (mirror, caesar, vers and crypt): the
+ * passthrough engine in core.c, and the description each mode gives of
+ * itself to the smartfs binary.
+ *
+ * Include this after <fuse.h>.
+ */
+
+#ifndef SMARTFS_H
+#define SMARTFS_H
+
+// The storage directory the mount mirrors, as an absolute path
+extern char* storage_dir;
+
+// The storage directory, open; AT_FDCWD outside a mount (e.g. for commands)
+extern int storage_fd;
+
+/*
+ * The storage path of a mount path: where it is relative to storage_fd, for
+ * the *at() calls ("." for the root).  Points into path, copying nothing.
+ */
+const char *storage_rel(const char *path);
+
+// Drops the cached attributes of a mount path after writing to it
+void invalidate_attrs(const char *path);
+
+/*
+ * A data layer: a transform of file contents on their way to and from the
+ * storage directory, e.g. a cipher.  Both functions work in place and must
+ * not change the size of the data; offset is where buf starts in the file.
+ * A large request is handed over in pieces, several at once from different
+ * threads.
+ */
+struct smartfs_layer {
+	const char *name;
+	void (*encode)(unsigned char *buf, size_t size, off_t offset);
+	void (*decode)(unsigned char *buf, size_t size, off_t offset);
+};
+
+// Adds a layer below those already added; 0, or -1 if there are too many
+int core_add_layer(const struct smartfs_layer *layer);
+
+// Whether there are any layers, i.e. whether stored data differs from file data
+int core_layered(void);
+
+// Runs file data down through the layers, or stored data back up
+void core_encode(char *buf, size_t size, off_t offset);
+void core_decode(char *buf, size_t size, off_t offset);
+
+// pread() of file data through the layers: the bytes read, or -errno
+ssize_t core_pread(int fd, char *buf, size_t size, off_t offset);
+
+/*
+ * The data of a write, encoded: buf itself if there are no layers, else an
+ * encoded copy which is also left in *copy for the caller to hand back with
+ * bufpool_put() (*copy is NULL otherwise).  Returns NULL if out of memory.
+ */
+const char *core_encode_copy(const char *buf, size_t size, off_t offset,
+			     char **copy);
+
+/*
+ * The data of a write_buf, encoded, in *data: in place if possible, else in
+ * a copy left in *copy for bufpool_put().  Returns the size, or -errno.
+ */
+ssize_t core_encode_bufvec(struct fuse_bufvec *buf, off_t offset,
+			   char **data, char **copy);
+
+// truncate() of path relative to dirfd: 0, or -errno
+int core_truncate_at(int dirfd, const char *path, off_t size);
+
+/*
+ * Copies length bytes between two files, in the kernel (copy_file_range,
+ * which clones the extents where the file system can) if possible, else
+ * through a bounded buffer.  0, or -errno; -EIO if in_fd ends too soon.
+ */
+int core_copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off,
+		    off_t length);
+
+/*
+ * Hides name, wherever it appears in the storage directory, from the mount:
+ * for a mode that keeps data of its own next to the files
+ */
+void core_hide_name(const char *name);
+
+// Whether any component of the mount path path is the hidden name
+int core_is_hidden(const char *path);
+
+// Fills in ops with the passthrough version of every operation
+void core_operations(struct fuse_operations *ops);
+
+/*
+ * Mounts and serves the file system with the given (FUSE) arguments, on a
+ * pool of that many workers if workers > 0.  Returns the exit status.
+ */
+int core_run(int argc, char *argv[],
+	     const struct fuse_operations *op, int workers);
+
+/*
+ * Serves the requests of a low-level session until it is unmounted, on the
+ * calling thread alone unless multithreaded, else on that many workers of
+ * our own if workers > 0.  Returns 0, or -1 on failure.
+ */
+int core_serve(struct fuse_session *se, int multithreaded, int workers);
+
+struct smartfs_mode {
+	const char *name;		// for --mode, and "<name>fs" as argv[0]
+	const char *args;		// what follows the mount point, for usage
+	int nargs;			// how many arguments that is
+	const char *options;		// the mode's own flags, for usage
+	int layer;			// a data layer that stacks under a mode
+
+	/*
+	 * Optional: runs a command line that does not mount anything (e.g.
+	 * "versfs --cat ...").  Returns the exit status, or -1 if argv is
+	 * not such a command.
+	 */
+	int (*command)(int argc, char *argv[]);
+	const char *commands;		// usage of those commands, or NULL
+
+	// Optional: takes the mode's nargs arguments; 0, or -1 if they are bad
+	int (*setup)(char *args[]);
+
+	/*
+	 * Optional: handles argv[i] if it is one of the mode's flags.
+	 * Returns how many arguments it used, 0 if it is not ours, or -1 if
+	 * it is bad.
+	 */
+	int (*option)(int argc, char *argv[], int i);
+
+	// The mode's operations; called once, after setup.  NULL for layers,
+	// whose setup adds themselves with core_add_layer()
+	const struct fuse_operations *(*operations)(void);
+
+	/*
+	 * Instead of operations, for a mode that is not built on the
+	 * high-level API: mounts and serves the file system itself with the
+	 * given (FUSE) arguments, like core_run().  Returns the exit status.
+	 */
+	int (*run)(int argc, char *argv[], int workers);
+};
+
+/*
+ * Sets up the layers given with --mode from their arguments, for commands
+ * that work on stored data outside a mount.  Returns how many arguments they
+ * took, or -1.
+ */
+int smartfs_setup_layers(char *args[], int nargs);
+
+extern const struct smartfs_mode mirror_mode;
+extern const struct smartfs_mode caesar_mode;
+extern const struct smartfs_mode vers_mode;
+extern const struct smartfs_mode crypt_mode;
+extern const struct smartfs_mode inode_mode;
+
+#endif /* SMARTFS_H */
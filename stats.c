@@ -0,0 +1,768 @@
+/**
+ * Operation statistics and the /.smartfs/stats control file; see stats.h.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "stats.h"
+
+enum stats_op {
+	OP_GETATTR, OP_ACCESS, OP_READLINK, OP_READDIR, OP_MKNOD, OP_MKDIR,
+	OP_SYMLINK, OP_UNLINK, OP_RMDIR, OP_RENAME, OP_LINK, OP_CHMOD,
+	OP_CHOWN, OP_TRUNCATE, OP_UTIMENS, OP_OPEN, OP_READ, OP_WRITE,
+	OP_STATFS, OP_RELEASE, OP_FSYNC, OP_FALLOCATE, OP_SETXATTR,
+	OP_GETXATTR, OP_LISTXATTR, OP_REMOVEXATTR,
+	STATS_OPS
+};
+
+static const char *stats_op_names[STATS_OPS] = {
+	"getattr", "access", "readlink", "readdir", "mknod", "mkdir",
+	"symlink", "unlink", "rmdir", "rename", "link", "chmod",
+	"chown", "truncate", "utimens", "open", "read", "write",
+	"statfs", "release", "fsync", "fallocate", "setxattr",
+	"getxattr", "listxattr", "removexattr",
+};
+
+/*
+ * Latencies go into log-linear buckets: four per power of two of
+ * nanoseconds, up to about ten minutes, and a percentile is reported as the
+ * middle of the bucket it falls in, so it is within about 12% of the truth.
+ */
+#define STATS_BUCKETS 160
+#define STATS_ERRNOS  134	// errno values counted individually
+
+struct stats_counters {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+// One per thread that has run an operation; never freed, only reused
+struct stats_slot {
+	struct stats_counters ops[STATS_OPS];
+	uint64_t errnos[STATS_ERRNOS + 1];	// the last counts the rest
+	int in_use;
+	struct stats_slot *next;
+};
+
+static void (*stats_sections[STATS_SECTIONS])(FILE *f);
+static int stats_nsections = 0;
+
+static const struct fuse_operations *stats_inner;
+static struct fuse_operations stats_oper;
+static struct timespec stats_started;
+
+static struct stats_slot *stats_slots = NULL;
+static pthread_mutex_t stats_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_slot *stats_self = NULL;
+
+// Only the owning thread writes a counter, so a plain load and store will do
+#define STATS_ADD(counter, n)						\
+	__atomic_store_n(&(counter),					\
+			 __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), \
+			 __ATOMIC_RELAXED)
+
+#define STATS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Hand a finished thread's slot to the next thread that needs one
+static void stats_release_slot(void *slot)
+{
+	pthread_mutex_lock(&stats_slots_lock);
+	((struct stats_slot *) slot)->in_use = 0;
+	pthread_mutex_unlock(&stats_slots_lock);
+}
+
+static void stats_make_key(void)
+{
+	pthread_key_create(&stats_key, stats_release_slot);
+}
+
+static struct stats_slot *stats_slot(void)
+{
+	struct stats_slot *slot;
+
+	if (stats_self != NULL)
+		return stats_self;
+
+	pthread_once(&stats_key_once, stats_make_key);
+	pthread_mutex_lock(&stats_slots_lock);
+	for (slot = stats_slots; slot != NULL; slot = slot->next)
+		if (!slot->in_use)
+			break;
+	if (slot == NULL) {
+		slot = calloc(1, sizeof(*slot));
+		if (slot != NULL) {
+			slot->next = stats_slots;
+			stats_slots = slot;
+		}
+	}
+	if (slot != NULL)
+		slot->in_use = 1;
+	pthread_mutex_unlock(&stats_slots_lock);
+
+	if (slot != NULL)
+		pthread_setspecific(stats_key, slot);
+	stats_self = slot;
+	return slot;
+}
+
+static int64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int stats_bucket(uint64_t ns)
+{
+	int log2;
+	int b;
+
+	if (ns < 4)
+		return ns;
+	log2 = 63 - __builtin_clzll(ns);
+	b = 4 * (log2 - 1) + ((ns >> (log2 - 2)) & 3);
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// The smallest latency, in nanoseconds, that falls in bucket b
+static double stats_bucket_floor(int b)
+{
+	if (b < 4)
+		return b;
+	return (double) (4 + b % 4) * ((uint64_t) 1 << (b / 4 - 1));
+}
+
+// What a latency in bucket b is reported as: the middle of the bucket
+static double stats_bucket_mid(int b)
+{
+	return (stats_bucket_floor(b) + stats_bucket_floor(b + 1)) / 2;
+}
+
+// Count one call that started at `start` and returned res
+static void stats_record(enum stats_op op, int64_t start, int res,
+			 uint64_t bytes)
+{
+	struct stats_slot *slot = stats_slot();
+	struct stats_counters *c;
+	int64_t ns = stats_now() - start;
+
+	if (slot == NULL)
+		return;
+	c = &slot->ops[op];
+
+	STATS_ADD(c->calls, 1);
+	STATS_ADD(c->buckets[stats_bucket(ns > 0 ? ns : 0)], 1);
+	if (res < 0) {
+		STATS_ADD(c->errors, 1);
+		STATS_ADD(slot->errnos[-res < STATS_ERRNOS ? -res :
+				       STATS_ERRNOS], 1);
+	} else {
+		STATS_ADD(c->bytes, bytes);
+	}
+}
+
+/*
+ * The report: everything counted so far, summed over threads.  Returns a
+ * malloc()ed string.
+ */
+static char *stats_report(size_t *lenp)
+{
+	static struct stats_counters sum[STATS_OPS];
+	static uint64_t errnos[STATS_ERRNOS + 1];
+	static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct stats_slot *slot;
+	struct timespec now;
+	double elapsed;
+	char *text = NULL;
+	size_t size = 0;
+	FILE *f;
+	int op, b, e;
+
+	pthread_mutex_lock(&report_lock);
+	memset(sum, 0, sizeof(sum));
+	memset(errnos, 0, sizeof(errnos));
+
+	pthread_mutex_lock(&stats_slots_lock);
+	for (slot = stats_slots; slot != NULL; slot = slot->next) {
+		for (op = 0; op < STATS_OPS; op++) {
+			struct stats_counters *c = &slot->ops[op];
+
+			sum[op].calls += STATS_GET(c->calls);
+			sum[op].errors += STATS_GET(c->errors);
+			sum[op].bytes += STATS_GET(c->bytes);
+			for (b = 0; b < STATS_BUCKETS; b++)
+				sum[op].buckets[b] += STATS_GET(c->buckets[b]);
+		}
+		for (e = 0; e <= STATS_ERRNOS; e++)
+			errnos[e] += STATS_GET(slot->errnos[e]);
+	}
+	pthread_mutex_unlock(&stats_slots_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - stats_started.tv_sec) +
+		  (now.tv_nsec - stats_started.tv_nsec) / 1e9;
+
+	f = open_memstream(&text, &size);
+	if (f == NULL) {
+		pthread_mutex_unlock(&report_lock);
+		return NULL;
+	}
+
+	fprintf(f, "uptime %.3f\n", elapsed);
+	fprintf(f, "%-12s %12s %8s %14s %12s %10s %10s %10s %10s\n",
+		"op", "calls", "errors", "bytes", "calls/s", "MB/s",
+		"p50_us", "p99_us", "p999_us");
+	for (op = 0; op < STATS_OPS; op++) {
+		const double quantiles[3] = { 0.5, 0.99, 0.999 };
+		double at[3] = { 0, 0, 0 };
+		uint64_t seen = 0;
+		int q = 0;
+
+		if (sum[op].calls == 0)
+			continue;
+
+		for (b = 0; b < STATS_BUCKETS && q < 3; b++) {
+			seen += sum[op].buckets[b];
+			while (q < 3 && seen >= quantiles[q] * sum[op].calls)
+				at[q++] = stats_bucket_mid(b) / 1000;
+		}
+
+		fprintf(f, "%-12s %12llu %8llu %14llu %12.1f %10.2f %10.1f %10.1f %10.1f\n",
+			stats_op_names[op],
+			(unsigned long long) sum[op].calls,
+			(unsigned long long) sum[op].errors,
+			(unsigned long long) sum[op].bytes,
+			sum[op].calls / elapsed, sum[op].bytes / elapsed / 1e6,
+			at[0], at[1], at[2]);
+	}
+
+	for (e = 1; e <= STATS_ERRNOS; e++) {
+		if (errnos[e] == 0)
+			continue;
+		if (e < STATS_ERRNOS)
+			fprintf(f, "errno %d %llu (%s)\n", e,
+				(unsigned long long) errnos[e], strerror(e));
+		else
+			fprintf(f, "errno other %llu\n",
+				(unsigned long long) errnos[e]);
+	}
+	for (e = 0; e < stats_nsections; e++)
+		stats_sections[e](f);
+
+	fclose(f);
+	pthread_mutex_unlock(&report_lock);
+
+	*lenp = size;
+	return text;
+}
+
+/*
+ * The control directory.  It does not show up in listings of the mount
+ * point, but can be looked up, and the report is taken when the file is
+ * opened so that it reads consistently.
+ */
+
+struct stats_snapshot {
+	size_t len;
+	char *text;
+};
+
+static int stats_is_ctl(const char *path)
+{
+	return strncmp(path, STATS_DIR, sizeof(STATS_DIR) - 1) == 0 &&
+	       (path[sizeof(STATS_DIR) - 1] == '\0' ||
+		path[sizeof(STATS_DIR) - 1] == '/');
+}
+
+static int stats_ctl_getattr(const char *path, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mtim.tv_sec = st->st_ctim.tv_sec = st->st_atim.tv_sec =
+		time(NULL);
+	if (strcmp(path, STATS_DIR) == 0) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	} else if (strcmp(path, STATS_FILE) == 0) {
+		// The size is not known until it is read; direct_io copes
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+	} else {
+		return -ENOENT;
+	}
+	return 0;
+}
+
+static int stats_ctl_open(const char *path, struct fuse_file_info *fi)
+{
+	struct stats_snapshot *snap;
+
+	if (strcmp(path, STATS_FILE) != 0)
+		return strcmp(path, STATS_DIR) == 0 ? -EISDIR : -ENOENT;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	snap = malloc(sizeof(*snap));
+	if (snap == NULL)
+		return -ENOMEM;
+	snap->text = stats_report(&snap->len);
+	if (snap->text == NULL) {
+		free(snap);
+		return -ENOMEM;
+	}
+
+	fi->fh = (uintptr_t) snap;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static int stats_ctl_read(char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+
+	if (offset >= (off_t) snap->len)
+		return 0;
+	if (size > snap->len - offset)
+		size = snap->len - offset;
+	memcpy(buf, snap->text + offset, size);
+	return size;
+}
+
+/*
+ * The wrappers.  Each times the call through to the file system and counts
+ * it; bytes are counted for reads and writes.
+ */
+
+#define STATS_CALL(op, bytes, call)					\
+	do {								\
+		int64_t start = stats_now();				\
+		res = (call);						\
+		stats_record((op), start, res, (bytes));		\
+	} while (0)
+
+static void *stats_init(struct fuse_conn_info *conn)
+{
+	clock_gettime(CLOCK_MONOTONIC, &stats_started);
+	return stats_inner->init != NULL ? stats_inner->init(conn) : NULL;
+}
+
+static int stats_getattr(const char *path, struct stat *st)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return stats_ctl_getattr(path, st);
+	STATS_CALL(OP_GETATTR, 0, stats_inner->getattr(path, st));
+	return res;
+}
+
+static int stats_access(const char *path, int mask)
+{
+	struct stat st;
+	int res;
+
+	if (stats_is_ctl(path))
+		return (mask & W_OK) ? -EACCES : stats_ctl_getattr(path, &st);
+	if (stats_inner->access == NULL)
+		return -ENOSYS;
+	STATS_CALL(OP_ACCESS, 0, stats_inner->access(path, mask));
+	return res;
+}
+
+static int stats_readlink(const char *path, char *buf, size_t size)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EINVAL;
+	STATS_CALL(OP_READLINK, 0, stats_inner->readlink(path, buf, size));
+	return res;
+}
+
+static int stats_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (strcmp(path, STATS_DIR) == 0) {
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		filler(buf, STATS_FILE + sizeof(STATS_DIR), NULL, 0);
+		return 0;
+	}
+	if (stats_is_ctl(path))
+		return -ENOTDIR;
+	STATS_CALL(OP_READDIR, 0,
+		   stats_inner->readdir(path, buf, filler, offset, fi));
+	return res;
+}
+
+// The control directory has nothing to open; the rest are not timed
+static int stats_opendir(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, STATS_DIR) == 0) {
+		fi->fh = 0;
+		return 0;
+	}
+	if (stats_is_ctl(path))
+		return -ENOTDIR;
+	return stats_inner->opendir(path, fi);
+}
+
+static int stats_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path, STATS_DIR) == 0)
+		return 0;
+	return stats_inner->releasedir(path, fi);
+}
+
+static int stats_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_MKNOD, 0, stats_inner->mknod(path, mode, rdev));
+	return res;
+}
+
+static int stats_mkdir(const char *path, mode_t mode)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_MKDIR, 0, stats_inner->mkdir(path, mode));
+	return res;
+}
+
+static int stats_symlink(const char *from, const char *to)
+{
+	int res;
+
+	if (stats_is_ctl(to))
+		return -EACCES;
+	STATS_CALL(OP_SYMLINK, 0, stats_inner->symlink(from, to));
+	return res;
+}
+
+static int stats_unlink(const char *path)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_UNLINK, 0, stats_inner->unlink(path));
+	return res;
+}
+
+static int stats_rmdir(const char *path)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_RMDIR, 0, stats_inner->rmdir(path));
+	return res;
+}
+
+static int stats_rename(const char *from, const char *to)
+{
+	int res;
+
+	if (stats_is_ctl(from) || stats_is_ctl(to))
+		return -EACCES;
+	STATS_CALL(OP_RENAME, 0, stats_inner->rename(from, to));
+	return res;
+}
+
+static int stats_link(const char *from, const char *to)
+{
+	int res;
+
+	if (stats_is_ctl(from) || stats_is_ctl(to))
+		return -EACCES;
+	STATS_CALL(OP_LINK, 0, stats_inner->link(from, to));
+	return res;
+}
+
+static int stats_chmod(const char *path, mode_t mode)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_CHMOD, 0, stats_inner->chmod(path, mode));
+	return res;
+}
+
+static int stats_chown(const char *path, uid_t uid, gid_t gid)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_CHOWN, 0, stats_inner->chown(path, uid, gid));
+	return res;
+}
+
+static int stats_truncate(const char *path, off_t size)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_TRUNCATE, 0, stats_inner->truncate(path, size));
+	return res;
+}
+
+static int stats_utimens(const char *path, const struct timespec ts[2])
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_UTIMENS, 0, stats_inner->utimens(path, ts));
+	return res;
+}
+
+static int stats_open(const char *path, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return stats_ctl_open(path, fi);
+	if (stats_inner->open == NULL)
+		return 0;
+	STATS_CALL(OP_OPEN, 0, stats_inner->open(path, fi));
+	return res;
+}
+
+static int stats_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return stats_ctl_read(buf, size, offset, fi);
+	if (stats_inner->read == NULL)
+		return -ENOSYS;
+	STATS_CALL(OP_READ, res,
+		   stats_inner->read(path, buf, size, offset, fi));
+	return res;
+}
+
+static int stats_read_buf(const char *path, struct fuse_bufvec **bufp,
+			  size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *buf;
+	int res;
+
+	if (stats_is_ctl(path)) {
+		buf = malloc(sizeof(*buf));
+		if (buf == NULL)
+			return -ENOMEM;
+		*buf = FUSE_BUFVEC_INIT(size);
+		buf->buf[0].mem = malloc(size);
+		if (buf->buf[0].mem == NULL) {
+			free(buf);
+			return -ENOMEM;
+		}
+		res = stats_ctl_read(buf->buf[0].mem, size, offset, fi);
+		buf->buf[0].size = res;
+		*bufp = buf;
+		return 0;
+	}
+	// An fd-backed buffer is only the size asked for; count that
+	STATS_CALL(OP_READ, res == 0 ? fuse_buf_size(*bufp) : 0,
+		   stats_inner->read_buf(path, bufp, size, offset, fi));
+	return res;
+}
+
+static int stats_write(const char *path, const char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EBADF;
+	STATS_CALL(OP_WRITE, res,
+		   stats_inner->write(path, buf, size, offset, fi));
+	return res;
+}
+
+static int stats_write_buf(const char *path, struct fuse_bufvec *buf,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EBADF;
+	STATS_CALL(OP_WRITE, res,
+		   stats_inner->write_buf(path, buf, offset, fi));
+	return res;
+}
+
+static int stats_statfs(const char *path, struct statvfs *st)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		path = "/";
+	STATS_CALL(OP_STATFS, 0, stats_inner->statfs(path, st));
+	return res;
+}
+
+static int stats_release(const char *path, struct fuse_file_info *fi)
+{
+	struct stats_snapshot *snap;
+	int res;
+
+	if (stats_is_ctl(path)) {
+		snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+		free(snap->text);
+		free(snap);
+		return 0;
+	}
+	if (stats_inner->release == NULL)
+		return 0;
+	STATS_CALL(OP_RELEASE, 0, stats_inner->release(path, fi));
+	return res;
+}
+
+static int stats_fsync(const char *path, int isdatasync,
+		       struct fuse_file_info *fi)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return 0;
+	STATS_CALL(OP_FSYNC, 0, stats_inner->fsync(path, isdatasync, fi));
+	return res;
+}
+
+static int stats_fallocate(const char *path, int mode, off_t offset,
+			   off_t length, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EBADF;
+	STATS_CALL(OP_FALLOCATE, 0,
+		   stats_inner->fallocate(path, mode, offset, length, fi));
+	return res;
+}
+
+static int stats_setxattr(const char *path, const char *name,
+			  const char *value, size_t size, int flags)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_SETXATTR, 0,
+		   stats_inner->setxattr(path, name, value, size, flags));
+	return res;
+}
+
+static int stats_getxattr(const char *path, const char *name, char *value,
+			  size_t size)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -ENODATA;
+	STATS_CALL(OP_GETXATTR, 0,
+		   stats_inner->getxattr(path, name, value, size));
+	return res;
+}
+
+static int stats_listxattr(const char *path, char *list, size_t size)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return 0;
+	STATS_CALL(OP_LISTXATTR, 0, stats_inner->listxattr(path, list, size));
+	return res;
+}
+
+static int stats_removexattr(const char *path, const char *name)
+{
+	int res;
+
+	if (stats_is_ctl(path))
+		return -EACCES;
+	STATS_CALL(OP_REMOVEXATTR, 0, stats_inner->removexattr(path, name));
+	return res;
+}
+
+void stats_add_section(void (*report)(FILE *f))
+{
+	if (stats_nsections < STATS_SECTIONS)
+		stats_sections[stats_nsections++] = report;
+}
+
+const struct fuse_operations *stats_wrap(const struct fuse_operations *ops)
+{
+	stats_inner = ops;
+	clock_gettime(CLOCK_MONOTONIC, &stats_started);
+
+	// Keep the flags and anything we do not time as the file system has them
+	stats_oper = *ops;
+	stats_oper.init = stats_init;
+
+	// The control directory needs these whether or not the file system has
+	// them; the rest are only wrapped if they are there to call
+	stats_oper.getattr = stats_getattr;
+	stats_oper.access = stats_access;
+	stats_oper.open = stats_open;
+	stats_oper.read = stats_read;
+	stats_oper.release = stats_release;
+#define STATS_WRAP(name) if (ops->name != NULL) stats_oper.name = stats_##name
+	STATS_WRAP(readlink);
+	STATS_WRAP(opendir);
+	STATS_WRAP(readdir);
+	STATS_WRAP(releasedir);
+	STATS_WRAP(mknod);
+	STATS_WRAP(mkdir);
+	STATS_WRAP(symlink);
+	STATS_WRAP(unlink);
+	STATS_WRAP(rmdir);
+	STATS_WRAP(rename);
+	STATS_WRAP(link);
+	STATS_WRAP(chmod);
+	STATS_WRAP(chown);
+	STATS_WRAP(truncate);
+	STATS_WRAP(utimens);
+	STATS_WRAP(read_buf);
+	STATS_WRAP(write);
+	STATS_WRAP(write_buf);
+	STATS_WRAP(statfs);
+	STATS_WRAP(fsync);
+	STATS_WRAP(fallocate);
+	STATS_WRAP(setxattr);
+	STATS_WRAP(getxattr);
+	STATS_WRAP(listxattr);
+	STATS_WRAP(removexattr);
+#undef STATS_WRAP
+
+	return &stats_oper;
+}
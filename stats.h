@@ -0,0 +1,42 @@
+/**
+ * Per-operation counters and latency histograms for the file systems.
+ *
+ * stats_wrap() puts a thin layer in front of a file system's
+ * fuse_operations that times every call and counts its result into
+ * per-thread counters, which only their own thread writes, so recording
+ * needs no locks or atomic read-modify-writes.  The totals can be read at
+ * any time from the virtual file /.smartfs/stats in the mount point:
+ *
+ *   $ cat <mount point>/.smartfs/stats
+ *
+ * which has a line per operation (calls, errors, bytes, calls and MB per
+ * second since mounting, and the 50th, 99th and 99.9th percentile latency
+ * in microseconds) followed by how often each errno was returned, and then
+ * whatever lines the caches and the like added with stats_add_section().
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+struct fuse_operations;
+
+#define STATS_DIR  "/.smartfs"
+#define STATS_FILE STATS_DIR "/stats"
+
+/*
+ * Returns a table that calls through to ops, timing each call.  ops must
+ * outlive the file system.
+ */
+const struct fuse_operations *stats_wrap(const struct fuse_operations *ops);
+
+#define STATS_SECTIONS 8	// the most that can be added
+
+/*
+ * Adds report to what is called at the end of each report, to write lines
+ * of its own (e.g. a cache's hit rate) to f.  Call before mounting.
+ */
+void stats_add_section(void (*report)(FILE *f));
+
+#endif /* STATS_H */
@@ -0,0 +1,49 @@
+/**
+ * The tracer behind TRACE(); see trace.h.
+ */
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+int trace_level = TRACE_INFO;
+
+static const char *trace_names[] = { "ERROR", "INFO", "DEBUG" };
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t trace_second;		// the second being counted
+static unsigned trace_lines;		// lines printed in it
+static unsigned long trace_dropped;	// lines suppressed since last report
+
+void trace_printf(int level, const char *fmt, ...)
+{
+	time_t now = time(NULL);
+	va_list ap;
+
+	pthread_mutex_lock(&trace_lock);
+	if (now != trace_second) {
+		if (trace_dropped > 0)
+			fprintf(stderr, "INFO: %lu trace messages suppressed\n",
+				trace_dropped);
+		trace_second = now;
+		trace_lines = 0;
+		trace_dropped = 0;
+	}
+	// Errors always get through
+	if (trace_lines >= TRACE_RATE && level != TRACE_ERROR) {
+		trace_dropped++;
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	trace_lines++;
+
+	fprintf(stderr, "%s: ", trace_names[level]);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,31 @@
+/**
+ * Level-gated, rate-limited logging for the file systems.  TRACE() costs one
+ * comparison when its level is turned off, so it can be left in hot paths;
+ * when it is on, no more than TRACE_RATE lines a second reach stderr and the
+ * rest are counted and reported as suppressed.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+enum trace_level {
+	TRACE_ERROR,
+	TRACE_INFO,
+	TRACE_DEBUG,
+};
+
+#define TRACE_RATE 100		// lines per second
+
+// Messages above this level are dropped; TRACE_INFO unless -v is given
+extern int trace_level;
+
+#define TRACE(level, ...)						\
+	do {								\
+		if ((level) <= trace_level)				\
+			trace_printf((level), __VA_ARGS__);		\
+	} while (0)
+
+void trace_printf(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#endif /* TRACE_H */
@@ -0,0 +1,391 @@
+/**
+ * Batched storage calls; see uring.h.
+ *
+ * This talks to the kernel directly (io_uring_setup(), io_uring_enter() and
+ * the two rings mapped from the ring's descriptor) rather than through
+ * liburing, which is just as short for the four calls needed here.  Every
+ * thread's ring has room for one batch, so a submission never has to wait
+ * for space; the ring is closed when the thread exits.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	URING_OP_OPENAT,
+	URING_OP_PREAD,
+	URING_OP_FSTATAT,
+	URING_OP_CLOSE,
+};
+
+// The io_uring operations the calls map to, by URING_OP_*
+static const unsigned char uring_opcodes[] = {
+	IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_STATX, IORING_OP_CLOSE,
+};
+
+struct uring_ring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct statx stx[URING_BATCH];	// where statx() answers for fstatat()
+	int broken;		// io_uring_enter() failed: plain calls from now
+};
+
+static int uring_enabled = 1;	// cleared for good if the kernel says no
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct uring_ring *uring_self = NULL;
+
+void uring_init(int enable)
+{
+	uring_enabled = enable;
+}
+
+static void uring_destroy(struct uring_ring *r)
+{
+	if (r->sqes != NULL)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != NULL)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	free(r);
+}
+
+static void uring_release(void *p)
+{
+	uring_destroy(p);
+}
+
+static void uring_make_key(void)
+{
+	pthread_key_create(&uring_key, uring_release);
+}
+
+static void *uring_map(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return p != MAP_FAILED ? p : NULL;
+}
+
+// Whether the kernel knows every operation in uring_opcodes
+static int uring_probe(int fd)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+		      256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	size_t i;
+	int ok;
+
+	if (probe == NULL)
+		return 0;
+	ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		     probe, 256) == 0;
+	for (i = 0; ok && i < sizeof(uring_opcodes); i++) {
+		unsigned op = uring_opcodes[i];
+
+		ok = op <= probe->last_op &&
+		     (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ok;
+}
+
+static struct uring_ring *uring_create(void)
+{
+	struct io_uring_params p;
+	struct uring_ring *r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, URING_BATCH, &p);
+	if (r->fd == -1) {
+		TRACE(TRACE_INFO, "No io_uring (%s), storage calls are made "
+		      "one by one", strerror(errno));
+		free(r);
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_NODROP) || !uring_probe(r->fd)) {
+		TRACE(TRACE_INFO, "io_uring is too old, storage calls are "
+		      "made one by one");
+		close(r->fd);
+		free(r);
+		return NULL;
+	}
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->sq_ring = uring_map(r->fd, r->sq_ring_size,
+				       IORING_OFF_SQ_RING);
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->sq_ring = uring_map(r->fd, r->sq_ring_size,
+				       IORING_OFF_SQ_RING);
+		r->cq_ring = uring_map(r->fd, r->cq_ring_size,
+				       IORING_OFF_CQ_RING);
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = uring_map(r->fd, r->sqes_size, IORING_OFF_SQES);
+	if (r->sq_ring == NULL || r->cq_ring == NULL || r->sqes == NULL) {
+		uring_destroy(r);
+		return NULL;
+	}
+
+	r->sq_head  = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+	r->sq_tail  = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+	r->sq_mask  = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+	r->cq_head  = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+	r->cq_tail  = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+	r->cq_mask  = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring +
+					   p.cq_off.cqes);
+	return r;
+}
+
+// This thread's ring, or NULL if batches are plain calls
+static struct uring_ring *uring_ring(void)
+{
+	if (uring_self != NULL || !uring_enabled)
+		return uring_self;
+
+	pthread_once(&uring_key_once, uring_make_key);
+	uring_self = uring_create();
+	if (uring_self == NULL)
+		uring_enabled = 0;	// nor will it work on other threads
+	else
+		pthread_setspecific(uring_key, uring_self);
+	return uring_self;
+}
+
+void uring_begin(struct uring_batch *b)
+{
+	b->n = 0;
+}
+
+static int uring_add(struct uring_batch *b, int op, int fd, const char *path,
+		     void *buf, size_t size, off_t offset, int flags,
+		     mode_t mode)
+{
+	struct uring_call *c;
+
+	if (b->n == URING_BATCH)
+		return -1;
+	c = &b->calls[b->n];
+	c->op = op;
+	c->fd = fd;
+	c->path = path;
+	c->buf = buf;
+	c->size = size;
+	c->offset = offset;
+	c->flags = flags;
+	c->mode = mode;
+	b->res[b->n] = -EINPROGRESS;
+	return b->n++;
+}
+
+int uring_openat(struct uring_batch *b, int dirfd, const char *path,
+		 int flags, mode_t mode)
+{
+	return uring_add(b, URING_OP_OPENAT, dirfd, path, NULL, 0, 0, flags,
+			 mode);
+}
+
+int uring_pread(struct uring_batch *b, int fd, void *buf, size_t size,
+		off_t offset)
+{
+	return uring_add(b, URING_OP_PREAD, fd, NULL, buf, size, offset, 0, 0);
+}
+
+int uring_fstatat(struct uring_batch *b, int dirfd, const char *path,
+		  struct stat *st, int flags)
+{
+	return uring_add(b, URING_OP_FSTATAT, dirfd, path, st, 0, 0, flags, 0);
+}
+
+int uring_close(struct uring_batch *b, int fd)
+{
+	return uring_add(b, URING_OP_CLOSE, fd, NULL, NULL, 0, 0, 0, 0);
+}
+
+// Make one call the ordinary way
+static long uring_call(const struct uring_call *c)
+{
+	long res = -1;
+
+	switch (c->op) {
+	case URING_OP_OPENAT:
+		res = openat(c->fd, c->path, c->flags, c->mode);
+		break;
+	case URING_OP_PREAD:
+		res = pread(c->fd, c->buf, c->size, c->offset);
+		break;
+	case URING_OP_FSTATAT:
+		res = fstatat(c->fd, c->path, c->buf, c->flags);
+		break;
+	case URING_OP_CLOSE:
+		res = close(c->fd);
+		break;
+	}
+	return res == -1 ? -errno : res;
+}
+
+static void uring_stat(struct stat *st, const struct statx *stx)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void uring_prep(struct uring_ring *r, struct io_uring_sqe *sqe,
+		       const struct uring_call *c, int i)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = uring_opcodes[c->op];
+	sqe->fd = c->fd;
+	sqe->user_data = i;
+	switch (c->op) {
+	case URING_OP_OPENAT:
+		sqe->addr = (uintptr_t) c->path;
+		sqe->len = c->mode;
+		sqe->open_flags = c->flags;
+		break;
+	case URING_OP_PREAD:
+		sqe->addr = (uintptr_t) c->buf;
+		sqe->len = c->size;
+		sqe->off = c->offset;
+		break;
+	case URING_OP_FSTATAT:
+		sqe->addr = (uintptr_t) c->path;
+		sqe->len = STATX_BASIC_STATS;
+		sqe->statx_flags = c->flags;
+		sqe->off = (uintptr_t) &r->stx[i];
+		break;
+	}
+}
+
+// Fill in the answers the ring has for b: how many there were
+static int uring_reap(struct uring_ring *r, struct uring_batch *b)
+{
+	unsigned head = *r->cq_head;
+	int done = 0;
+	int i;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+		i = cqe->user_data;
+		b->res[i] = cqe->res;
+		if (b->calls[i].op == URING_OP_FSTATAT && cqe->res == 0)
+			uring_stat(b->calls[i].buf, &r->stx[i]);
+		head++;
+		done++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+/*
+ * Give up on the ring after io_uring_enter() failed with the calls of b
+ * queued up to tail.  What the kernel has taken it may still be working
+ * on, into the caller's buffers, so it is waited for; the rest is taken
+ * back and made here.
+ */
+static void uring_break(struct uring_ring *r, struct uring_batch *b,
+			unsigned tail, int done)
+{
+	struct timespec wait = { 0, 1000000 };
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	int taken = b->n - (int) (tail - head);
+	int i;
+
+	r->broken = 1;
+	__atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+	for (i = taken; i < b->n; i++)
+		b->res[i] = uring_call(&b->calls[i]);
+	while ((done += uring_reap(r, b)) < taken)
+		nanosleep(&wait, NULL);
+}
+
+void uring_submit(struct uring_batch *b)
+{
+	struct uring_ring *r = uring_ring();
+	unsigned tail;
+	int done = 0;
+	int i;
+
+	if (r == NULL || r->broken || b->n == 1) {
+		// A lone call gains nothing from the ring
+		for (i = 0; i < b->n; i++)
+			b->res[i] = uring_call(&b->calls[i]);
+		return;
+	}
+
+	tail = *r->sq_tail;
+	for (i = 0; i < b->n; i++, tail++) {
+		unsigned slot = tail & *r->sq_mask;
+
+		uring_prep(r, &r->sqes[slot], &b->calls[i], i);
+		r->sq_array[slot] = slot;
+	}
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (done < b->n) {
+		unsigned pending = tail - __atomic_load_n(r->sq_head,
+							  __ATOMIC_ACQUIRE);
+
+		if (syscall(__NR_io_uring_enter, r->fd, pending, b->n - done,
+			    IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			// Cannot happen with a ring this size; don't hang
+			TRACE(TRACE_ERROR, "io_uring_enter: %s, storage calls "
+			      "are made one by one", strerror(errno));
+			uring_break(r, b, tail, done);
+			return;
+		}
+		done += uring_reap(r, b);
+	}
+}
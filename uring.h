@@ -0,0 +1,66 @@
+/**
+ * Batches of the storage system calls one request needs, handed to the
+ * kernel together through io_uring: one io_uring_enter() runs all of them,
+ * and the kernel works on them side by side, so probing or opening a dozen
+ * version files costs about as long as one on fast (or far away) storage.
+ *
+ * Each thread has a ring of its own, set up the first time it submits a
+ * batch.  Where io_uring is missing (an old kernel, or a sandbox that
+ * forbids it) or is turned off, a batch simply makes its calls one after
+ * another, so callers need not care which it was.
+ *
+ * The calls of one batch run in no particular order, so none may depend on
+ * another: open in one batch, then read and close in the next ones.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define URING_BATCH 16		// the most calls in one batch
+
+// One call of a batch, as the functions below add it
+struct uring_call {
+	int op;			// URING_OP_*, in uring.c
+	int fd;			// the file, or the directory path is in
+	const char *path;
+	void *buf;		// what is read into, or the struct stat
+	size_t size;
+	off_t offset;
+	int flags;
+	mode_t mode;
+};
+
+struct uring_batch {
+	int n;
+	struct uring_call calls[URING_BATCH];
+	long res[URING_BATCH];	// what each call returned, or -errno
+};
+
+/*
+ * 0 makes every batch plain system calls; 1 (the default) uses io_uring
+ * where the kernel has it.  Must be called before the first uring_submit().
+ */
+void uring_init(int enable);
+
+// Start an empty batch
+void uring_begin(struct uring_batch *b);
+
+/*
+ * Add a call to the batch, returning its index in b->res, or -1 if the
+ * batch is full.  path, buf and st must stay put until uring_submit().
+ */
+int uring_openat(struct uring_batch *b, int dirfd, const char *path,
+		 int flags, mode_t mode);
+int uring_pread(struct uring_batch *b, int fd, void *buf, size_t size,
+		off_t offset);
+int uring_fstatat(struct uring_batch *b, int dirfd, const char *path,
+		  struct stat *st, int flags);
+int uring_close(struct uring_batch *b, int fd);
+
+// Make every call of the batch, and return once all have returned
+void uring_submit(struct uring_batch *b);
+
+#endif /* URING_H */
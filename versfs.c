@@ -1,6 +1,9 @@
 /**
  * A user-level file system that maintains, within the storage directory, a
- * versioned history of each file in the mount point.
+ * versioned history of each file in the mount point.  The storage file holds
+ * the newest contents; each older version is kept as a delta against the
+ * version after it.  When layers are stacked below (e.g. caesar), both hold
+ * the data as the layers left it, so versions never exist in plain form.
  */
 
 #define FUSE_USE_VERSION 26
@@ -10,7 +13,7 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite()/utimensat() */
+/* For pread()/pwrite() */
 #define _XOPEN_SOURCE 700
 #endif
 
@@ -23,604 +26,4690 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
 #include <sys/time.h>
-#ifdef HAVE_SETXATTR
-#include <sys/xattr.h>
-#endif
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "attrcache.h"
+#include "bufpool.h"
+#include "chunkstore.h"
+#include "compress.h"
+#include "smartfs.h"
+#include "trace.h"
+#include "uring.h"
+
+/*
+ * Version stores
+ *
+ * Everything versfs keeps about a file lives out of the way, in a directory
+ * of its own: "<dir>/.versfs/<name>/" for the file "<dir>/<name>".  Each
+ * directory of the storage directory has one ".versfs" directory holding the
+ * stores of its files, which the mount never shows (see core_hide_name()),
+ * so listing a directory costs no more than the files it shows, however many
+ * versions they have, and any name (e.g. "driver.verilog") is a file's own.
+ * A store holds the version files, named by their numbers, the journal of
+ * them ("journal"), and the versions being built ("tmp" and "gc").  Stores
+ * from before the journals have an index file ("index") instead, which is
+ * read once and replaced by a journal.  Renaming a file
+ * only has to rename its store, and a directory takes its ".versfs" along.
+ *
+ * Storage directories written before the stores had "<file>.verN",
+ * "<file>.verindex" and so on next to the files.  They are moved into the
+ * stores when such a directory is first mounted (and, file by file, by
+ * --cat).
+ *
+ * The chunks that versions are kept in with -r chunk (see below) are shared
+ * by every file, and live in the store of ".versfs" at the top: no file can
+ * have that name.
+ */
+
+#define VERS_STORE_NAME  ".versfs"
+#define VERS_INDEX_NAME  "index"
+#define VERS_JOURNAL_NAME "journal"
+#define VERS_JOURNAL_NEW  "journal.new"
+#define VERS_TMP_NAME    "tmp"
+#define VERS_GC_NAME     "gc"
+#define VERS_CHUNKS_PATH VERS_STORE_NAME "/" VERS_STORE_NAME
 
-static char* storage_dir = NULL;
-static char  storage_path[256];
+// Room for a path within the store of path (with a leaf of up to 15 bytes)
+#define VERS_PATH_SIZE(path) \
+	(strlen(path) + sizeof("/" VERS_STORE_NAME "//") + 16)
 
+// Room for the paths of a batch of versions, on the stack of a request
+#define VERS_BATCH_ROOM 4096
 
-char* prepend_storage_dir (char* pre_path, const char* path) {
-  strcpy(pre_path, storage_dir);
-  strcat(pre_path, path);
-  return pre_path;
+// Room for name (or its first len bytes) within dir
+#define VERS_CHILD_SIZE(dir, len) (strlen(dir) + (len) + 2)
+
+/*
+ * Writes the path of the first len bytes of name within dir, where "." is
+ * the storage directory itself (whose files are just "name")
+ */
+static void vers_child_path(char *buf, const char *dir, const char *name,
+			    size_t len)
+{
+	if (strcmp(dir, ".") == 0)
+		sprintf(buf, "%.*s", (int) len, name);
+	else
+		sprintf(buf, "%s/%.*s", dir, (int) len, name);
 }
 
+// How many versions of path go in a batch: URING_BATCH, unless their paths
+// would not fit in VERS_BATCH_ROOM, but at least one
+static int vers_batch(const char *path)
+{
+	size_t n = VERS_BATCH_ROOM / VERS_PATH_SIZE(path);
+
+	return n > URING_BATCH ? URING_BATCH : n > 0 ? (int) n : 1;
+}
 
-static int vers_getattr(const char *path, struct stat *stbuf)
+// opendir() of a storage path
+static DIR *vers_opendir(const char *path)
 {
-	int res;
-	
-	path = prepend_storage_dir(storage_path, path);
-	res = lstat(path, stbuf);
-	if (res == -1)
-		return -errno;
+	DIR *dp;
+	int fd;
 
-	return 0;
+	fd = openat(storage_fd, path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return NULL;
+	dp = fdopendir(fd);
+	if (dp == NULL)
+		close(fd);
+	return dp;
 }
 
-static int vers_access(const char *path, int mask)
+/*
+ * Writes the path of leaf within the store of the file at path, or of the
+ * store itself if leaf is NULL
+ */
+static void vers_store_path(char *buf, size_t bufsize, const char *path,
+			    const char *leaf)
 {
-	int res;
+	const char *name = strrchr(path, '/');
+	int dir_len = name != NULL ? name - path : 0;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = access(path, mask);
-	if (res == -1)
-		return -errno;
+	name = name != NULL ? name + 1 : path;
+	snprintf(buf, bufsize, "%.*s%s" VERS_STORE_NAME "/%s%s%s", dir_len,
+		 path, dir_len > 0 || path[0] == '/' ? "/" : "", name,
+		 leaf != NULL ? "/" : "", leaf != NULL ? leaf : "");
+}
 
-	return 0;
+static void vers_sync_queue(const char *path);
+
+// Sync the directory that path is in, soon, now that path is in it
+static void vers_sync_parent(const char *path)
+{
+	char dir[strlen(path) + 2];
+	char *slash;
+
+	strcpy(dir, path);
+	slash = strrchr(dir, '/');
+	if (slash != NULL)
+		*slash = '\0';
+	else
+		strcpy(dir, ".");
+	vers_sync_queue(dir);
 }
 
-static int vers_readlink(const char *path, char *buf, size_t size)
+// Create the store of the file at path (and its directory's ".versfs")
+static int vers_store_make(const char *path)
 {
-	int res;
+	char store_path[VERS_PATH_SIZE(path)];
+	char *slash;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = readlink(path, buf, size - 1);
-	if (res == -1)
+	vers_store_path(store_path, sizeof(store_path), path, NULL);
+	if (mkdirat(storage_fd, store_path, 0755) == 0) {
+		vers_sync_parent(store_path);
+		return 0;
+	}
+	if (errno == EEXIST)
+		return 0;
+	if (errno != ENOENT)
 		return -errno;
 
-	buf[res] = '\0';
+	slash = strrchr(store_path, '/');
+	*slash = '\0';
+	if (mkdirat(storage_fd, store_path, 0755) == 0)
+		vers_sync_parent(store_path);
+	else if (errno != EEXIST)
+		return -errno;
+	*slash = '/';
+	if (mkdirat(storage_fd, store_path, 0755) == 0)
+		vers_sync_parent(store_path);
+	else if (errno != EEXIST)
+		return -errno;
 	return 0;
 }
 
+static void vers_version_unlink(int dir_fd, const char *name);
 
-static int vers_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+// Remove the store of the file at path, and everything in it
+static void vers_store_remove(const char *path)
 {
-	// NOTE: THIS FUNC HAS BEEN MODIFIED TO NOT LIST VERSION FILES IN /mnt
-	DIR *dp;
+	char store_path[VERS_PATH_SIZE(path)];
 	struct dirent *de;
+	DIR *dp;
 
-	(void) offset;
-	(void) fi;
-
-	path = prepend_storage_dir(storage_path, path);
-	dp = opendir(path);
+	vers_store_path(store_path, sizeof(store_path), path, NULL);
+	dp = vers_opendir(store_path);
 	if (dp == NULL)
-		return -errno;
-
+		return;
 	while ((de = readdir(dp)) != NULL) {
-
-		// Don't list (skip) if version file suffix found in directory
-		if (strstr(de->d_name, ".ver") != NULL) continue;
-
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
+		// The versions give back their chunks; a tmp or gc is still
+		// its builder's to give back
+		if (strspn(de->d_name, "0123456789") == strlen(de->d_name))
+			vers_version_unlink(dirfd(dp), de->d_name);
+		else
+			unlinkat(dirfd(dp), de->d_name, 0);  // "." and ".." fail
 	}
-
 	closedir(dp);
-	return 0;
+	unlinkat(storage_fd, store_path, AT_REMOVEDIR);
 }
 
-static int vers_mknod(const char *path, mode_t mode, dev_t rdev)
+static int vers_dots(const char *name)
 {
-	int res;
-
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	path = prepend_storage_dir(storage_path, path);
-	if (S_ISREG(mode)) {
-		res = open(path, O_CREAT | O_EXCL | O_WRONLY, mode);
-		if (res >= 0)
-			res = close(res);
-	} else if (S_ISFIFO(mode))
-		res = mkfifo(path, mode);
-	else
-		res = mknod(path, mode, rdev);
-	if (res == -1)
-		return -errno;
-
-	return 0;
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
 }
 
-static int vers_mkdir(const char *path, mode_t mode)
+/*
+ * Move what an older storage directory kept next to the file dir/name into
+ * its store, or, if name is NULL, that of every file in dir and below.
+ * Versions that were still being built are dropped, as a crash would have.
+ */
+static void vers_store_upgrade(const char *dir, const char *name)
 {
-	int res;
+	const char *suffix, *p;
+	struct dirent *de;
+	struct stat st;
+	mode_t mode;
+	size_t len;
+	int pass;
+	DIR *dp;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = mkdir(path, mode);
-	if (res == -1)
-		return -errno;
+	// Below first, so dir's own .versfs marks the whole tree as done
+	for (pass = name != NULL; pass < 2; pass++) {
+		dp = vers_opendir(dir);
+		if (dp == NULL)
+			return;
+		while ((de = readdir(dp)) != NULL) {
+			char path[VERS_CHILD_SIZE(dir, strlen(de->d_name))];
+			char file[sizeof(path)];
+			char store_path[sizeof(path) + VERS_PATH_SIZE("")];
 
-	return 0;
+			if (vers_dots(de->d_name) ||
+			    strcmp(de->d_name, VERS_STORE_NAME) == 0)
+				continue;
+			vers_child_path(path, dir, de->d_name,
+					strlen(de->d_name));
+
+			if (pass == 0) {
+				mode = de->d_type << 12;
+				if (mode == 0 &&
+				    fstatat(storage_fd, path, &st,
+					    AT_SYMLINK_NOFOLLOW) == 0)
+					mode = st.st_mode;
+				if (S_ISDIR(mode))
+					vers_store_upgrade(path, NULL);
+				continue;
+			}
+
+			// "<file>.verN", ".verindex", ".vertmp[.z]" or ".vergc"
+			suffix = NULL;
+			for (p = de->d_name; (p = strstr(p, ".ver")) != NULL;
+			     p++)
+				suffix = p;
+			if (suffix == NULL)
+				continue;
+			len = suffix - de->d_name;
+			if (name != NULL && (strlen(name) != len ||
+					     strncmp(de->d_name, name, len) != 0))
+				continue;
+			vers_child_path(file, dir, de->d_name, len);
+			suffix += 4;
+
+			// Anything else is a file of its own
+			if (fstatat(storage_fd, file, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1 ||
+			    !S_ISREG(st.st_mode))
+				continue;
+			if (strcmp(suffix, "tmp") == 0 ||
+			    strcmp(suffix, "tmp.z") == 0 ||
+			    strcmp(suffix, "gc") == 0) {
+				unlinkat(storage_fd, path, 0);
+				continue;
+			}
+			if (strcmp(suffix, "index") == 0)
+				suffix = VERS_INDEX_NAME;
+			else if (suffix[0] == '\0' ||
+				 strspn(suffix, "0123456789") != strlen(suffix))
+				continue;
+
+			vers_store_path(store_path, sizeof(store_path), file,
+					suffix);
+			if (vers_store_make(file) < 0 ||
+			    renameat(storage_fd, path, storage_fd,
+				     store_path) == -1)
+				TRACE(TRACE_ERROR, "Could not move %s into its "
+				      "store: %s", path, strerror(errno));
+		}
+		closedir(dp);
+	}
 }
 
-static int vers_unlink(const char *path)
+// A storage directory from before the stores gets them first
+static void vers_store_setup(void)
 {
-	/*
-	* NOTE: for my implementation of unlink, I assume the user
-	* wants to just delete all the versions when they rm a file
-	* ... I think this is closest to how Unix-based systems handle 
-	* rm - there's no trash can or undo button.
-	*/ 
+	if (faccessat(storage_fd, VERS_STORE_NAME, F_OK, 0) == 0 ||
+	    errno != ENOENT)
+		return;
+	TRACE(TRACE_INFO, "Moving the versions in %s into stores",
+	      storage_dir);
+	vers_store_upgrade(".", NULL);
+	if (mkdirat(storage_fd, VERS_STORE_NAME, 0755) == -1 &&
+	    errno != EEXIST)
+		TRACE(TRACE_ERROR, "Could not create %s/%s: %s",
+		      storage_dir, VERS_STORE_NAME, strerror(errno));
+}
 
-	int res;
 
-	path = prepend_storage_dir(storage_path, path);
+/*
+ * Version index
+ *
+ * Versions of a file are numbered from 1, so knowing the newest number is
+ * enough to list all of them.  Rather than probing the store for 1, 2, ...
+ * with access() on every operation, we remember that number per file in a
+ * small hash table keyed by storage path.  Entries are loaded lazily the
+ * first time a file is touched, from the last record of the store's journal
+ * (see below) so a remount does not have to rescan.
+ *
+ * The table is shared between FUSE worker threads and guarded by
+ * vers_index_lock; every vers_*() call below that is not static to the
+ * table itself takes it.
+ */
+
+static void vers_upgrade_legacy(const char *path, int latest);
 
-	char new_path[265]; // size of path length and then some extra
-	strcpy(new_path, path); // set new_path to original path 
+struct vers_entry {
+	char *path;		// storage path of the base file
+	int latest;		// newest version number, 0 if there are none
+	struct vers_entry *next;
+};
 
-	// append version counter to file name
-	int counter = 1; 
-	sprintf(new_path, "%s.ver%d", path, counter);
-	int ret = access(new_path, F_OK);
+#define VERS_RECORD_DROPPED 1		// vers_record flags
+#define VERS_SIZE_UNKNOWN   UINT64_MAX
 
-	while (ret == 0) // iterate through all existing versions and unlink
-	{
-		unlink(new_path);
-		counter++;			
-		sprintf(new_path, "%s.ver%d", path, counter);
-		ret = access(new_path, F_OK);
-	}
+// What the journal of a store (see below) keeps of one version file
+struct vers_record {
+	uint32_t number;	// N of version file N, which holds version N-1
+	uint32_t flags;
+	int64_t  time;		// when version N-1 was replaced, in ns
+	uint64_t size;		// of version N-1
+	uint64_t stored;	// bytes in version file N
+	unsigned char reserved[32];	// unused
+};
 
-	res = unlink(path); // unlink original path
+static int vers_journal_latest(const char *path);
+static int vers_journal_record(const char *version_path,
+			       struct vers_record *r);
+static int vers_journal_append(const char *path, int number,
+			       const struct vers_record *r);
+static void vers_journal_sync(const char *path, int latest);
+static int vers_journal_recover(const char *path);
+static int vers_sync_data(const char *path);
 
-	if (res == -1)
-		return -errno;
+static struct vers_entry **vers_index = NULL;
+static size_t vers_index_size  = 0;
+static size_t vers_index_count = 0;
+static pthread_mutex_t vers_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static int vers_index_read_only = 0;	// --cat: stores are only read
 
-	return 0;
+static size_t vers_hash(const char *path)
+{
+	// FNV-1a
+	size_t h = 2166136261u;
+	for (; *path; path++) {
+		h ^= (unsigned char) *path;
+		h *= 16777619u;
+	}
+	return h;
 }
 
-static int vers_rmdir(const char *path)
+static void vers_version_path(char *buf, size_t bufsize, const char *path,
+			      int version)
 {
-	int res;
+	char leaf[16];
 
-	path = prepend_storage_dir(storage_path, path);
-	res = rmdir(path);
-	if (res == -1)
-		return -errno;
+	snprintf(leaf, sizeof(leaf), "%d", version);
+	vers_store_path(buf, bufsize, path, leaf);
+}
 
-	return 0;
+static void vers_index_path(char *buf, size_t bufsize, const char *path)
+{
+	vers_store_path(buf, bufsize, path, VERS_INDEX_NAME);
 }
 
-static int vers_symlink(const char *from, const char *to)
+static void vers_index_grow(void)
 {
-	int res;
-	char storage_from[256];
-	char storage_to[256];
+	size_t new_size = vers_index_size ? vers_index_size * 2 : 1024;
+	struct vers_entry **new_index = calloc(new_size, sizeof(*new_index));
+	size_t i;
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = symlink(storage_from, storage_to);
-	if (res == -1)
-		return -errno;
+	if (new_index == NULL)
+		return;	// keep using the old table, just with longer chains
 
-	return 0;
+	for (i = 0; i < vers_index_size; i++) {
+		struct vers_entry *e = vers_index[i];
+		while (e != NULL) {
+			struct vers_entry *next = e->next;
+			size_t b = vers_hash(e->path) & (new_size - 1);
+			e->next = new_index[b];
+			new_index[b] = e;
+			e = next;
+		}
+	}
+	free(vers_index);
+	vers_index = new_index;
+	vers_index_size = new_size;
 }
 
-static int vers_rename(const char *from, const char *to)
+/*
+ * How many of versions first, first + 1, ... (up to n of them, at most
+ * URING_BATCH) there are in a row, looked for a batch at a time
+ */
+static int vers_probe(const char *path, int first, int n)
 {
-	int res;
-	char storage_from[256];
-	char storage_to[256];
+	const int batch = vers_batch(path);
+	char version_path[batch][VERS_PATH_SIZE(path)];
+	struct stat st[URING_BATCH];
+	struct uring_batch b;
+	int found = 0;
+	int i, m;
 
-	// size of path length and then some extra
-	// change this in each iteration of loop and use to rename version files
-	char version_file_from[265]; 
-	char version_file_to[265];
-
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
+	while (found < n) {
+		m = n - found < batch ? n - found : batch;
+		uring_begin(&b);
+		for (i = 0; i < m; i++) {
+			vers_version_path(version_path[i],
+					  sizeof(version_path[i]), path,
+					  first + found + i);
+			uring_fstatat(&b, storage_fd, version_path[i], &st[i],
+				      0);
+		}
+		uring_submit(&b);
+		for (i = 0; i < m && b.res[i] == 0; i++)
+			;
+		found += i;
+		if (i < m)
+			break;
+	}
+	return found;
+}
 
-	strcpy(version_file_from, storage_from); // copy in the path  
-	strcpy(version_file_to, storage_to); // set new_path to the default directory path 
+// Work out the newest version of a file we have not seen yet this mount
+static int vers_index_load(const char *path)
+{
+	char index_path[VERS_PATH_SIZE(path)];
+	char version_path[VERS_PATH_SIZE(path)];
+	char line[16];
+	int latest = vers_journal_latest(path);
+	int journaled = latest;
+	int found, n;
+	int fd = -1;
+	ssize_t len;
 
-	// append version number to file name
-	int counter = 1; 
-	sprintf(version_file_from, "%s.ver%d", storage_from, counter);
-	sprintf(version_file_to, "%s.ver%d", storage_to, counter);
+	// A store from before the journals has its index file instead
+	if (latest < 0) {
+		latest = 0;
+		vers_index_path(index_path, sizeof(index_path), path);
+		fd = openat(storage_fd, index_path, O_RDONLY);
+	}
+	if (fd != -1) {
+		len = read(fd, line, sizeof(line) - 1);
+		if (len > 0) {
+			line[len] = '\0';
+			latest = atoi(line);
+		}
+		close(fd);
+	}
 
-	// Test if version file exists
-	int ret = access(version_file_from, F_OK);
+	// Don't trust a persisted number whose version file is gone: a
+	// crash lost its rename, and maybe those of the ones before
+	if (latest > 0) {
+		vers_version_path(version_path, sizeof(version_path), path, latest);
+		if (faccessat(storage_fd, version_path, F_OK, 0) != 0)
+			latest = journaled = journaled > 0 ?
+					     vers_journal_recover(path) : 0;
+	}
 
-	// Increment version number until we get to one that doesn't exist
-	while (ret == 0) 
-	{
-		rename(version_file_from, version_file_to);
-		counter++;			
-		sprintf(version_file_from, "%s.ver%d", storage_from, counter);
-		sprintf(version_file_to, "%s.ver%d", storage_to, counter);
-		ret = access(version_file_from, F_OK);
+	// Pick up any versions written without updating the index (or
+	// scan from the start if there was no usable index at all).  A
+	// good index usually leaves nothing to find, so only a scan probes
+	// many versions at once from the start.
+	for (n = latest > 0 ? 1 : URING_BATCH; ; n = URING_BATCH) {
+		found = vers_probe(path, latest + 1, n);
+		latest += found;
+		if (found < n)
+			break;
 	}
-	
-	res = rename(storage_from, storage_to);
-	if (res == -1)
-		return -errno;
 
-	return 0;
+	// The mount may be running, and it is the one to write to the store
+	if (vers_index_read_only)
+		return latest;
+	vers_upgrade_legacy(path, latest);
+	if (latest > 0 && latest != journaled)
+		vers_journal_sync(path, latest);
+	return latest;
 }
 
-static int vers_link(const char *from, const char *to)
+// Find the index entry for a storage path, if it has been loaded
+static struct vers_entry *vers_find(const char *path)
 {
-	int res;
-	char storage_from[256];
-	char storage_to[256];
+	struct vers_entry *e;
 
-	prepend_storage_dir(storage_from, from);
-	prepend_storage_dir(storage_to,   to  );
-	res = link(storage_from, storage_to);
-	if (res == -1)
-		return -errno;
-
-	return 0;
+	if (vers_index_size == 0)
+		return NULL;
+	e = vers_index[vers_hash(path) & (vers_index_size - 1)];
+	for (; e != NULL; e = e->next)
+		if (strcmp(e->path, path) == 0)
+			return e;
+	return NULL;
 }
 
-static int vers_chmod(const char *path, mode_t mode)
+static void vers_index_insert(struct vers_entry *e)
 {
-	int res;
-
-	path = prepend_storage_dir(storage_path, path);
-	res = chmod(path, mode);
-	if (res == -1)
-		return -errno;
+	size_t b;
 
-	return 0;
+	if (vers_index_count >= vers_index_size)
+		vers_index_grow();
+	b = vers_hash(e->path) & (vers_index_size - 1);
+	e->next = vers_index[b];
+	vers_index[b] = e;
+	vers_index_count++;
 }
 
-static int vers_chown(const char *path, uid_t uid, gid_t gid)
+static void vers_index_remove(struct vers_entry *e)
 {
-	int res;
-
-	path = prepend_storage_dir(storage_path, path);
-	res = lchown(path, uid, gid);
-	if (res == -1)
-		return -errno;
-
-	return 0;
+	struct vers_entry **p = &vers_index[vers_hash(e->path) &
+					    (vers_index_size - 1)];
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+	vers_index_count--;
 }
 
-static int vers_truncate(const char *path, off_t size)
+/*
+ * Find the index entry for a storage path, loading it on first touch.  Called
+ * with vers_index_lock held; the lock is dropped while the version files are
+ * probed so other files are not held up behind the scan.
+ */
+static struct vers_entry *vers_lookup(const char *path)
 {
+	struct vers_entry *e = vers_find(path);
+	struct vers_entry *raced;
+	int latest;
 
-	/*
-	 * NOTE: When a file is truncated, TWO version files are created
-	 * This is because truncate is intertwined with write and both create a version file each
-	 *
-	 * This shouldn't be a problem so I left it as-is
-	 */
-
-
-	path = prepend_storage_dir(storage_path, path);
-
-	// Iterate through and see what version files exist
-	// We create a new version file under a new name and increment the counter
-
-	// new path represents the lowest version number file that DOESN'T exist yet. 
-	// it gets updated with each iteration of the loop
-	
-	char new_path[265];	// size of path length and then some
-	strcpy(new_path, path); // set new_path to original path 
-
-	// Append version number to file path
-	int counter = 1; 
-	sprintf(new_path, "%s.ver%d", path, counter);
-	int ret = access(new_path, F_OK);
+	if (e != NULL)
+		return e;
 
-	// Iterate until we get to a version that doesn't exist 
-	while (ret == 0)
-	{
-		counter++;			
-		sprintf(new_path, "%s.ver%d", path, counter);
-		ret = access(new_path, F_OK);
+	pthread_mutex_unlock(&vers_index_lock);
+	latest = vers_index_load(path);
+	e = malloc(sizeof(*e));
+	if (e != NULL) {
+		e->path = strdup(path);
+		e->latest = latest;
 	}
-		
-	int orig_fd = open(path, O_RDONLY); // open original file to read from
+	pthread_mutex_lock(&vers_index_lock);
 
-	// Create a new version file to hold the truncated info
-	int fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC);
-	
-	char temp_buf[size];
-
-	// read original file into buffer (but only a certain number of bytes - this truncates it)
-	int read_res = read(orig_fd, temp_buf, size); 
-
-	if (read_res == -1)
-		return -errno;
-
-	// Write out our new, shorter, version file
-	int write_res = write(fd, temp_buf, size);
-
-	if (write_res == -1)
-		return -errno;
+	if (e == NULL || e->path == NULL) {
+		free(e);
+		return NULL;
+	}
 
-	close(orig_fd);
-	close(fd);
+	// Someone else may have loaded it while we were scanning
+	raced = vers_find(path);
+	if (raced != NULL) {
+		free(e->path);
+		free(e);
+		return raced;
+	}
 
-	return 0;
+	if (vers_index_count >= vers_index_size)
+		vers_index_grow();
+	if (vers_index_size == 0) {
+		free(e->path);
+		free(e);
+		return NULL;
+	}
+	vers_index_insert(e);
+	return e;
 }
 
-#ifdef HAVE_UTIMENSAT
-static int vers_utimens(const char *path, const struct timespec ts[2])
+/*
+ * Returns the newest version number of a file (0 if it has none).  Versions
+ * are numbered 1 through this number, though the retention policy may have
+ * dropped some of them (see below); the file of the newest is always there.
+ */
+static int vers_latest(const char *path)
 {
-	int res;
+	struct vers_entry *e;
+	int latest;
 
-	/* don't use utime/utimes since they follow symlinks */
-	path = prepend_storage_dir(storage_path, path);
-	res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
-	if (res == -1)
-		return -errno;
+	pthread_mutex_lock(&vers_index_lock);
+	e = vers_lookup(path);
+	latest = e != NULL ? e->latest : -1;
+	pthread_mutex_unlock(&vers_index_lock);
 
-	return 0;
+	return latest >= 0 ? latest : vers_index_load(path);
 }
-#endif
 
-static int vers_open(const char *path, struct fuse_file_info *fi)
+/*
+ * Gives a finished version file the next version number of a file: makes it
+ * durable, renames tmp_path to N in the file's store and records N in the
+ * index and the journal.  Only the rename, the bump of the index and the
+ * append to the journal are done under the index lock, so N is taken, made
+ * visible and journalled at once, and in order; syncing the data and reading
+ * its record come before, and syncing the store and the journal after.
+ * Returns N, or -errno.
+ */
+static int vers_publish(const char *path, const char *tmp_path)
 {
+	char version_path[VERS_PATH_SIZE(path)];
+	char store_path[VERS_PATH_SIZE(path)];
+	struct vers_record r;
+	struct vers_entry *e;
+	int recorded, stale = 0;
 	int res;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = open(path, fi->flags);
-	if (res == -1)
-		return -errno;
+	// Syncing and reading it need not hold anybody up
+	res = vers_sync_data(tmp_path);
+	if (res < 0)
+		return res;
+	recorded = vers_journal_record(tmp_path, &r) == 0;
 
-	close(res);
+	pthread_mutex_lock(&vers_index_lock);
+	e = vers_lookup(path);
+	if (e == NULL) {
+		res = -ENOMEM;
+	} else {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  e->latest + 1);
+		if (renameat(storage_fd, tmp_path, storage_fd,
+			     version_path) == -1) {
+			res = -errno;
+		} else {
+			res = ++e->latest;
+			stale = !recorded ||
+				vers_journal_append(path, res, &r) < 0;
+		}
+	}
+	pthread_mutex_unlock(&vers_index_lock);
 
-	return 0;
+	// Journalled afresh without the lock, if it has to be
+	if (stale)
+		vers_journal_sync(path, res);
+
+	// The rename and the record are made durable with others'
+	if (res > 0) {
+		vers_store_path(store_path, sizeof(store_path), path, NULL);
+		vers_sync_queue(store_path);
+		vers_store_path(store_path, sizeof(store_path), path,
+				VERS_JOURNAL_NAME);
+		vers_sync_queue(store_path);
+	}
+	return res;
 }
 
-static int vers_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+// Drop a file from the index once it and all its versions are gone
+static void vers_forget(const char *path)
 {
-	int fd;
-	int res;
-	int i;
-	char temp_buf[size];
+	char journal_path[VERS_PATH_SIZE(path)];
+	struct vers_entry *e;
 
-	(void) fi;
-	path = prepend_storage_dir(storage_path, path);
+	pthread_mutex_lock(&vers_index_lock);
+	e = vers_find(path);
+	if (e != NULL)
+		vers_index_remove(e);
+	pthread_mutex_unlock(&vers_index_lock);
 
-	char new_path[265]; // size of path length and then some	
-	strcpy(new_path, path); // set new_path to original path 
+	if (e != NULL) {
+		free(e->path);
+		free(e);
+	}
+	vers_store_path(journal_path, sizeof(journal_path), path,
+			VERS_JOURNAL_NAME);
+	unlinkat(storage_fd, journal_path, 0);
+}
 
-	int counter = 1; // append to file name
+/*
+ * Re-key index entries after a rename.  Renaming a directory moves every
+ * file below it, so any entry under "from/" is re-keyed as well.
+ */
+static void vers_move(const char *from, const char *to)
+{
+	size_t from_len = strlen(from);
+	struct vers_entry *moved = NULL;
+	struct vers_entry *e;
+	size_t i;
 
-	sprintf(new_path, "%s.ver%d", path, counter);
-	int ret = access(new_path, F_OK);
+	pthread_mutex_lock(&vers_index_lock);
+	for (i = 0; i < vers_index_size; i++) {
+		struct vers_entry **p = &vers_index[i];
+		while ((e = *p) != NULL) {
+			if (strncmp(e->path, from, from_len) == 0 &&
+			    (e->path[from_len] == '\0' ||
+			     e->path[from_len] == '/')) {
+				*p = e->next;
+				vers_index_count--;
+				e->next = moved;
+				moved = e;
+			} else {
+				p = &e->next;
+			}
+		}
+	}
 
-	// keep track of current highest version number path that exists
-	// We end up reading from this path at the end of function	
-	char* read_path;
+	while ((e = moved) != NULL) {
+		char *new_path = malloc(strlen(to) + strlen(e->path) - from_len + 1);
+		moved = e->next;
+		if (new_path == NULL) {
+			// Forget it; it will be reloaded from disk next time
+			free(e->path);
+			free(e);
+			continue;
+		}
+		strcpy(new_path, to);
+		strcat(new_path, e->path + from_len);
+		free(e->path);
+		e->path = new_path;
 
-	// Look through version number files incrementally until we get to one that doesnt exist
-	while (ret == 0)
-	{
-		strcpy(read_path, new_path); // update read_path 
-		counter++;			
-		sprintf(new_path, "%s.ver%d", path, counter);
-		ret = access(new_path, F_OK);
+		// A file may already be indexed under the new name
+		struct vers_entry *old = vers_find(new_path);
+		if (old != NULL) {
+			vers_index_remove(old);
+			free(old->path);
+			free(old);
+		}
+		vers_index_insert(e);
 	}
-	
-	// Open the highest number version file	
-	fd = open(read_path, O_RDONLY);
+	pthread_mutex_unlock(&vers_index_lock);
+}
 
-	if (fd == -1)
-		return -errno;
 
-	res = read(fd, temp_buf, size);
-	if (res == -1)
-		res = -errno;
-		
-	// Move data from temporary buffer into provided one. 
-	for (i = 0; i < size; i += 1) {
-	  buf[i] = temp_buf[i];
-	}
+/*
+ * Version store
+ *
+ * The base file in the storage directory always holds the newest contents of
+ * a file (the "head"), so reads never have to look at version files at all.
+ * Each version file N records only what version N changed: the size of version
+ * N-1, and the bytes version N-1 had in every block that version N overwrote
+ * or cut off.  Appending to a file, or rewriting bytes with what was already
+ * there, therefore costs next to nothing.  Version k is rebuilt by starting
+ * from the head and undoing versions latest, latest - 1, ..., k + 1.
+ *
+ * Version files are compressed (see compress.h) unless -z none is given or
+ * this was built without LZ4; the head never is, so reading and writing the
+ * current contents costs nothing extra.  Either kind is read back through a
+ * struct vers_file, so a store can hold a mix of both.
+ *
+ * Where the storage directory supports reflinks (Btrfs, XFS, ...), a version
+ * is instead a snapshot: the first change of a session clones the whole head
+ * into the version file, which costs no copying and no space until blocks of
+ * the head are overwritten, and nothing more is saved for the rest of the
+ * session.  A snapshot holds version N-1 in full, after a VERS_FULL_DATA
+ * header; rebuilding version k starts from the oldest snapshot newer than it
+ * (or the head) and undoes only the deltas in between.
+ *
+ * With -r chunk, a version is the same kind of snapshot, but as a list of
+ * chunks (see chunkstore.h): the first change of a session cuts the head
+ * into chunks, stores those the storage directory does not have yet, and
+ * lists them all (a struct chunk_ref each) after a VERS_CHUNK_MAGIC header.
+ * Versions that are much the same, of one file or of several, so share all
+ * but the chunks where they differ.  A version file that lists chunks gives
+ * them back when it is unlinked.
+ *
+ * Version files written before this format (plain copies, without the magic)
+ * are still understood: they hold their version in full.
+ */
 
-	close(fd);
-	return res;
-}
+#define VERS_DELTA_MAGIC "VERSDLT1"
+#define VERS_FULL_MAGIC  "VERSFUL1"
+#define VERS_CHUNK_MAGIC "VERSCHK1"
+#define VERS_FULL_DATA   4096		// where a snapshot's data starts
+#define VERS_BLOCK_SIZE  4096		// granularity of change detection
+#define VERS_COPY_CHUNK  (64 * 1024)	// bounded buffer for copies
+#define VERS_FILE_LOCKS  64		// stripes of per-file locks
+#define VERS_CHUNK_READ  (1024 * 1024)	// of the data being cut into chunks
+#define VERS_CHUNK_BATCH 128		// chunk_refs written or read at once
 
-static int vers_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
-{
-	// Write and replace file, saving old version
-	// In an appropriately named file
+struct vers_delta_header {
+	char     magic[8];
+	uint64_t prev_size;	// size of version N-1
+	uint64_t size;		// size of version N
+	uint32_t extents;	// number of extents that follow
+	uint32_t reserved;
+};
+
+// Each extent is followed by `length` bytes of version N-1's data
+struct vers_delta_extent {
+	uint64_t offset;
+	uint64_t length;
+};
+
+// A delta (or snapshot) that is being written out
+struct vers_delta {
 	int fd;
-	int res;
-	int i;
-	char temp_buf[size];
+	off_t pos;		// where the next extent (or chunk_ref) goes
+	int full;		// a snapshot, holding all of version N-1
+	struct vers_delta_header header;
+};
 
-	(void) fi;
-	path = prepend_storage_dir(storage_path, path); // path is to the storage dir
+// A file being read from the store: the head, or a version, compressed or not
+struct vers_file {
+	int fd;
+	int compressed;
+	struct compress_file z;
+};
 
-	char new_path[265]; //size of max path length and then some extra
-	strcpy(new_path, path); // set new_path to the default directory path 
+static int vers_compress = -1;	// -1 until -z is given, then 0 or 1
+static int vers_reflink  = -1;	// -1 until known (or given with -r)
+static int vers_chunks   = 0;	// -r chunk
 
-	// append version number to file name
-	int counter = 1; 
-	sprintf(new_path, "%s.ver%d", path, counter);
+// Opens a version file, or the head if version is 0 (never compressed)
+static int vers_file_open(struct vers_file *f, const char *path, int version)
+{
+	int res;
 
-	// Test if version file exists
-	int ret = access(new_path, F_OK);
+	f->fd = openat(storage_fd, path, O_RDONLY);
+	if (f->fd == -1)
+		return -errno;
 
-	// Increment version number until we get to one that doesn't exist
-	while (ret == 0) 
-	{
-		counter++;			
-		sprintf(new_path, "%s.ver%d", path, counter);
-		ret = access(new_path, F_OK);
+	f->compressed = 0;
+	if (version == 0)
+		return 0;
+	res = compress_open(&f->z, f->fd);
+	f->compressed = res == 0;
+	if (res < 0 && res != -EINVAL) {
+		close(f->fd);
+		return res;
 	}
-	
-	// Create version file with the given version number
-	fd = open(new_path, O_CREAT | O_RDWR | O_APPEND);
+	return 0;
+}
 
-	// Copy data and write out to new version file
-	for (i = 0; i < size; i += 1) {
-	  temp_buf[i] = buf[i];
-	}
-	res = pwrite(fd, temp_buf, size, offset);
+static ssize_t vers_file_pread(struct vers_file *f, void *buf, size_t size,
+			       off_t offset)
+{
+	ssize_t res;
 
+	if (f->compressed)
+		return compress_pread(&f->z, buf, size, offset);
+	res = pread(f->fd, buf, size, offset);
 	if (res == -1)
 		res = -errno;
-
-	close(fd);
 	return res;
 }
 
-static int vers_statfs(const char *path, struct statvfs *stbuf)
+// The size of what the file holds, once decompressed
+static off_t vers_file_size(struct vers_file *f)
 {
-	int res;
+	struct stat st;
 
-	path = prepend_storage_dir(storage_path, path);
-	res = statvfs(path, stbuf);
-	if (res == -1)
+	if (f->compressed)
+		return f->z.header.size;
+	if (fstat(f->fd, &st) == -1)
 		return -errno;
-
-	return 0;
+	return st.st_size;
 }
 
-static int vers_release(const char *path, struct fuse_file_info *fi)
+static void vers_file_close(struct vers_file *f)
 {
-	(void) path;
-	(void) fi;
-	return 0;
+	if (f->compressed)
+		compress_close(&f->z);
+	close(f->fd);
 }
 
-static int vers_fsync(const char *path, int isdatasync,
-		     struct fuse_file_info *fi)
+// pwrite() all of size bytes: 0, or -errno (-EIO if it wrote fewer)
+static int vers_pwrite(int fd, const void *buf, size_t size, off_t offset)
 {
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+	ssize_t n = pwrite(fd, buf, size, offset);
+
+	if (n == (ssize_t) size)
+		return 0;
+	return n == -1 ? -errno : -EIO;
 }
 
-#ifdef HAVE_POSIX_FALLOCATE
-static int vers_fallocate(const char *path, int mode,
-			off_t offset, off_t length, struct fuse_file_info *fi)
+/*
+ * Copy length bytes into a file: by the kernel if they are stored as they
+ * are, else through a bounded buffer
+ */
+static int vers_copy(struct vers_file *in, off_t in_off, int out_fd,
+		     off_t out_off, off_t length)
 {
-	int fd;
-	int res;
+	char *buf;
+	int res = 0;
 
-	(void) fi;
-
-	if (mode)
-		return -EOPNOTSUPP;
+	if (!in->compressed)
+		return core_copy_range(in->fd, in_off, out_fd, out_off, length);
 
-	path = prepend_storage_dir(storage_path, path);
-	fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
+	buf = bufpool_get(VERS_COPY_CHUNK);
+	if (buf == NULL)
+		return -ENOMEM;
 
-	res = -posix_fallocate(fd, offset, length);
+	while (length > 0) {
+		size_t want = length < VERS_COPY_CHUNK ? length : VERS_COPY_CHUNK;
+		ssize_t n = vers_file_pread(in, buf, want, in_off);
+		if (n < 0) {
+			res = n;
+			break;
+		}
+		if (n == 0) {
+			res = -EIO;	// the source is shorter than it claimed
+			break;
+		}
+		res = vers_pwrite(out_fd, buf, n, out_off);
+		if (res < 0)
+			break;
+		in_off  += n;
+		out_off += n;
+		length  -= n;
+	}
 
-	close(fd);
+	bufpool_put(buf);
 	return res;
 }
-#endif
 
-#ifdef HAVE_SETXATTR
-/* xattr operations are optional and can safely be left unimplemented */
-static int vers_setxattr(const char *path, const char *name, const char *value,
-			size_t size, int flags)
+/*
+ * Reads the header of a version file; returns 0 if it is a delta, 1 if it is
+ * a snapshot, 2 if it is a list of chunks and -1 if it is none of those
+ */
+static int vers_read_header(struct vers_file *f,
+			    struct vers_delta_header *header)
 {
-	path = prepend_storage_dir(storage_path, path);
-	int res = lsetxattr(path, name, value, size, flags);
-	if (res == -1)
-		return -errno;
-	return 0;
+	if (vers_file_pread(f, header, sizeof(*header), 0) != sizeof(*header))
+		return -1;
+	if (memcmp(header->magic, VERS_DELTA_MAGIC, sizeof(header->magic)) == 0)
+		return 0;
+	if (memcmp(header->magic, VERS_FULL_MAGIC, sizeof(header->magic)) == 0)
+		return 1;
+	if (memcmp(header->magic, VERS_CHUNK_MAGIC, sizeof(header->magic)) == 0)
+		return 2;
+	return -1;
 }
 
-static int vers_getxattr(const char *path, const char *name, char *value,
-			size_t size)
+/*
+ * Give back the chunks the version file open on fd lists, if it is such a
+ * file, as it goes
+ */
+static void vers_chunks_release(int fd)
 {
-	path = prepend_storage_dir(storage_path, path);
-	int res = lgetxattr(path, name, value, size);
-	if (res == -1)
-		return -errno;
-	return res;
+	struct chunk_ref refs[VERS_CHUNK_BATCH];
+	struct vers_delta_header header;
+	off_t pos = sizeof(header);
+	uint32_t i, j, n;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, VERS_CHUNK_MAGIC, sizeof(header.magic)) != 0)
+		return;
+	for (i = 0; i < header.extents; i += n) {
+		n = header.extents - i < VERS_CHUNK_BATCH ?
+		    header.extents - i : VERS_CHUNK_BATCH;
+		if (pread(fd, refs, n * sizeof(refs[0]), pos) !=
+		    (ssize_t) (n * sizeof(refs[0])))
+			break;
+		pos += n * sizeof(refs[0]);
+		for (j = 0; j < n; j++)
+			chunk_unref(&refs[j]);
+	}
 }
 
-static int vers_listxattr(const char *path, char *list, size_t size)
+// Unlink name, a version file (or other file of a store) in dir_fd
+static void vers_version_unlink(int dir_fd, const char *name)
 {
-	path = prepend_storage_dir(storage_path, path);
-	int res = llistxattr(path, list, size);
-	if (res == -1)
-		return -errno;
+	int fd = openat(dir_fd, name, O_RDONLY);
+
+	if (unlinkat(dir_fd, name, 0) == 0 && fd != -1)
+		vers_chunks_release(fd);
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * Copy the version a list of chunks (with this header) holds to out_fd at
+ * out_off
+ */
+static int vers_chunks_copy(struct vers_file *f,
+			    const struct vers_delta_header *header,
+			    int out_fd, off_t out_off)
+{
+	struct chunk_ref refs[VERS_CHUNK_BATCH];
+	off_t pos = sizeof(*header);
+	off_t end = out_off + header->prev_size;
+	uint32_t i, j, n;
+	char *buf;
+	int res = 0;
+
+	buf = bufpool_get(CHUNK_MAX);
+	if (buf == NULL)
+		return -ENOMEM;
+	for (i = 0; i < header->extents && res == 0; i += n) {
+		n = header->extents - i < VERS_CHUNK_BATCH ?
+		    header->extents - i : VERS_CHUNK_BATCH;
+		if (vers_file_pread(f, refs, n * sizeof(refs[0]), pos) !=
+		    (ssize_t) (n * sizeof(refs[0]))) {
+			res = -EIO;
+			break;
+		}
+		pos += n * sizeof(refs[0]);
+		for (j = 0; j < n && res == 0; j++) {
+			if (refs[j].size > CHUNK_MAX)
+				res = -EIO;
+			else
+				res = chunk_get(&refs[j], buf);
+			if (res == 0)
+				res = vers_pwrite(out_fd, buf, refs[j].size,
+						  out_off);
+			out_off += refs[j].size;
+		}
+	}
+	bufpool_put(buf);
+	if (res == 0 && out_off != end)
+		res = -EIO;		// the chunks do not add up
+	if (res == 0 && ftruncate(out_fd, out_off) == -1)
+		res = -errno;
+	return res;
+}
+
+/*
+ * Version journal
+ *
+ * Each store keeps a journal of its version files, so that what versions
+ * there are, and when they were replaced, is known without looking at the
+ * files themselves: a header, then a struct vers_record for each file,
+ * appended as it is published, so in order of number and of time.  It is read
+ * through a mapping, and a record is found by either with a binary search.
+ * The times are those of the files, but never older than the record before.
+ *
+ * Unlinking a version file only flags its record as dropped, and folding
+ * versions into another writes over the record of that one; once half the
+ * records are of dropped versions the journal is written afresh without them,
+ * to "journal.new" and renamed into place.  All writes to a journal hold
+ * vers_index_lock.  A crash can leave a record half written at the end, which
+ * the next one is written over, or versions after the last record, which the
+ * index finds when it loads and adds to the journal; one that is missing or
+ * out of step with the files is written afresh from them.
+ */
+
+struct vers_journal_header {
+	char     magic[8];
+	uint32_t record_size;	// sizeof(struct vers_record)
+	uint32_t reserved[13];
+};
+
+// A journal, mapped to be read
+struct vers_journal {
+	void *map;
+	size_t len;
+	const struct vers_record *r;
+	size_t n;		// whole records
+};
+
+#define VERS_JOURNAL_MAGIC "VERSJNL1"
+
+static void vers_journal_path(char *buf, size_t bufsize, const char *path)
+{
+	vers_store_path(buf, bufsize, path, VERS_JOURNAL_NAME);
+}
+
+static int vers_journal_check(const struct vers_journal_header *h)
+{
+	return memcmp(h->magic, VERS_JOURNAL_MAGIC, sizeof(h->magic)) == 0 &&
+	       h->record_size == sizeof(struct vers_record);
+}
+
+// Map the journal of the file at path: 0, or -errno
+static int vers_journal_map(const char *path, struct vers_journal *j)
+{
+	char journal_path[VERS_PATH_SIZE(path)];
+	struct stat st;
+	int fd;
+	int res = 0;
+
+	vers_journal_path(journal_path, sizeof(journal_path), path);
+	fd = openat(storage_fd, journal_path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (fstat(fd, &st) == -1)
+		res = -errno;
+	else if (st.st_size < (off_t) sizeof(struct vers_journal_header))
+		res = -EINVAL;
+	if (res == 0) {
+		j->len = st.st_size;
+		j->map = mmap(NULL, j->len, PROT_READ, MAP_SHARED, fd, 0);
+		if (j->map == MAP_FAILED)
+			res = -errno;
+	}
+	close(fd);
+	if (res == 0 && !vers_journal_check(j->map)) {
+		munmap(j->map, j->len);
+		res = -EINVAL;
+	}
+	if (res < 0)
+		return res;
+
+	j->r = (const struct vers_record *)
+	       ((const char *) j->map + sizeof(struct vers_journal_header));
+	j->n = (j->len - sizeof(struct vers_journal_header)) /
+	       sizeof(struct vers_record);
+	return 0;
+}
+
+static void vers_journal_unmap(struct vers_journal *j)
+{
+	munmap(j->map, j->len);
+}
+
+// The record of version file number, or NULL if there is none
+static const struct vers_record *vers_journal_find(const struct vers_journal *j,
+						   int number)
+{
+	size_t lo = 0, hi = j->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (j->r[mid].number < (uint32_t) number)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < j->n && j->r[lo].number == (uint32_t) number ?
+	       &j->r[lo] : NULL;
+}
+
+/*
+ * The record of the version there was at time (in ns), or if that was
+ * dropped, the next one kept: NULL if it is the head
+ */
+static const struct vers_record *vers_journal_at(const struct vers_journal *j,
+						 int64_t time)
+{
+	size_t lo = 0, hi = j->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (j->r[mid].time <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < j->n; lo++)
+		if (!(j->r[lo].flags & VERS_RECORD_DROPPED))
+			return &j->r[lo];
+	return NULL;
+}
+
+// The number of the last record of the journal of the file at path, or -errno
+static int vers_journal_latest(const char *path)
+{
+	struct vers_journal j;
+	int res = vers_journal_map(path, &j);
+
+	if (res < 0)
+		return res;
+	res = j.n > 0 ? (int) j.r[j.n - 1].number : 0;
+	vers_journal_unmap(&j);
+	return res;
+}
+
+// Fill in r, but for its number, from the version file at version_path:
+// 0, or -errno
+static int vers_journal_record(const char *version_path, struct vers_record *r)
+{
+	struct vers_delta_header header;
+	struct vers_file f;
+	struct stat st;
+	int kind;
+	int res;
+
+	memset(r, 0, sizeof(*r));
+	res = vers_file_open(&f, version_path, 1);
+	if (res < 0)
+		return res;
+	if (fstat(f.fd, &st) == -1) {
+		res = -errno;
+		vers_file_close(&f);
+		return res;
+	}
+	kind = vers_read_header(&f, &header);
+	r->time = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	r->size = kind >= 0 ? header.prev_size : VERS_SIZE_UNKNOWN;
+	r->stored = st.st_size;
+	vers_file_close(&f);
+	return 0;
+}
+
+// Write r[0..n) out as the journal of the file at path, in place of its own
+static int vers_journal_write(const char *path, const struct vers_record *r,
+			      size_t n)
+{
+	char journal_path[VERS_PATH_SIZE(path)];
+	char new_path[VERS_PATH_SIZE(path)];
+	struct vers_journal_header h;
+	int fd;
+	int res = 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, VERS_JOURNAL_MAGIC, sizeof(h.magic));
+	h.record_size = sizeof(*r);
+
+	vers_store_path(new_path, sizeof(new_path), path, VERS_JOURNAL_NEW);
+	fd = openat(storage_fd, new_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -errno;
+	if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+	    write(fd, r, n * sizeof(*r)) != (ssize_t) (n * sizeof(*r)))
+		res = -EIO;
+	if (res == 0 && fdatasync(fd) == -1)
+		res = -errno;
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+	vers_journal_path(journal_path, sizeof(journal_path), path);
+	if (res == 0 && renameat(storage_fd, new_path, storage_fd,
+				 journal_path) == -1)
+		res = -errno;
+	if (res < 0)
+		unlinkat(storage_fd, new_path, 0);
+	else
+		vers_sync_parent(journal_path);
+	return res;
+}
+
+/*
+ * The records of those of version files first..latest of the file at path
+ * that are there, read from the files, in *n; NULL if out of
+ * memory.  This can take a while, so it is done without vers_index_lock.
+ */
+static struct vers_record *vers_journal_collect(const char *path, int first,
+						int latest, size_t *n)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	struct vers_record *r;
+	int64_t time = INT64_MIN;
+	int i;
+
+	*n = 0;
+	r = malloc((latest >= first ? latest - first + 1 : 1) * sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	for (i = first; i <= latest; i++) {
+		vers_version_path(version_path, sizeof(version_path), path, i);
+		if (vers_journal_record(version_path, &r[*n]) < 0)
+			continue;	// dropped by the retention rules
+		r[*n].number = i;
+		if (r[*n].time < time)
+			r[*n].time = time;
+		time = r[*n].time;
+		(*n)++;
+	}
+	return r;
+}
+
+/*
+ * Append the record r of version file number, just published, to the journal
+ * of the file at path; called with vers_index_lock held.  Returns 0, or -1 if
+ * there is no journal or it is not in step with the files, which is left to
+ * vers_journal_sync().
+ */
+static int vers_journal_append(const char *path, int number,
+			       const struct vers_record *r)
+{
+	char journal_path[VERS_PATH_SIZE(path)];
+	struct vers_journal_header h;
+	struct vers_record rec, last;
+	struct stat st;
+	off_t end;
+	int fd;
+
+	rec = *r;
+	rec.number = number;
+	vers_journal_path(journal_path, sizeof(journal_path), path);
+	fd = openat(storage_fd, journal_path, O_RDWR);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 ||
+	    pread(fd, &h, sizeof(h), 0) != sizeof(h) || !vers_journal_check(&h))
+		goto stale;
+
+	// What a crash left of a record is written over; the one before
+	// must be of the version before
+	end = st.st_size - (st.st_size - sizeof(h)) % sizeof(rec);
+	if (end > (off_t) sizeof(h)) {
+		if (pread(fd, &last, sizeof(last), end - sizeof(last)) !=
+		    sizeof(last) || last.number + 1 != rec.number)
+			goto stale;
+		if (rec.time < last.time)
+			rec.time = last.time;
+	} else if (rec.number != 1) {
+		goto stale;
+	}
+	if (pwrite(fd, &rec, sizeof(rec), end) != sizeof(rec))
+		TRACE(TRACE_ERROR, "Could not add to the journal of %s: %s",
+		      path, strerror(errno));
+	close(fd);
+	return 0;
+
+stale:
+	close(fd);
+	return -1;
+}
+
+/*
+ * The number of the last record of the journal of the file at path, which
+ * has latest versions, or -1 if it is to be written afresh: there is none,
+ * or the version file of its last record is gone
+ */
+static int vers_journal_last(const char *path, int latest)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	int last = vers_journal_latest(path);
+
+	if (last > latest) {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  last);
+		if (faccessat(storage_fd, version_path, F_OK, 0) != 0)
+			last = -1;
+	}
+	return last < 0 ? -1 : last;
+}
+
+/*
+ * Bring the journal of the file at path up to latest, its newest version
+ * (or the index's, if that is newer by now): add the versions after the last
+ * record, or journal them all if there is no journal, or its last version is
+ * gone.  The records are made without vers_index_lock, so that other files
+ * are not held up behind the reading, and are only written with it if the
+ * journal is still as they were made from.
+ */
+static void vers_journal_sync(const char *path, int latest)
+{
+	char index_path[VERS_PATH_SIZE(path)];
+	struct vers_record *r;
+	struct vers_entry *e;
+	size_t n, i;
+	int afresh = 0;
+	int last;
+	int res;
+
+	for (;;) {
+		last = afresh ? -1 : vers_journal_last(path, latest);
+		r = vers_journal_collect(path, last < 0 ? 1 : last + 1,
+					 latest, &n);
+		if (r == NULL)
+			return;
+
+		pthread_mutex_lock(&vers_index_lock);
+		e = vers_find(path);
+		if ((e != NULL && e->latest > latest) ||
+		    (!afresh && vers_journal_last(path, latest) != last)) {
+			// Published to (or synced) meanwhile: once more
+			if (e != NULL && e->latest > latest)
+				latest = e->latest;
+			pthread_mutex_unlock(&vers_index_lock);
+			free(r);
+			continue;
+		}
+		for (i = 0; last >= 0 && i < n; i++) {
+			if (vers_journal_append(path, r[i].number,
+						&r[i]) < 0)
+				break;
+		}
+		if (last >= 0 && i < n) {
+			// A version file after the last record is gone
+			pthread_mutex_unlock(&vers_index_lock);
+			free(r);
+			afresh = 1;
+			continue;
+		}
+		if (last < 0) {
+			res = vers_journal_write(path, r, n);
+			if (res < 0) {
+				TRACE(TRACE_ERROR, "Could not write the "
+				      "journal of %s: %s", path,
+				      strerror(-res));
+			} else {
+				vers_index_path(index_path, sizeof(index_path),
+						path);
+				unlinkat(storage_fd, index_path, 0);
+			}
+		}
+		pthread_mutex_unlock(&vers_index_lock);
+		free(r);
+		return;
+	}
+}
+
+/*
+ * After a crash, find the newest version of the file at path whose file is
+ * there, going back through the journal, and cut off the records after it
+ * (unless the stores are only read): its number, or 0 if there is none
+ */
+static int vers_journal_recover(const char *path)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	struct vers_journal j;
+	size_t n;
+	int latest = 0;
+
+	pthread_mutex_lock(&vers_index_lock);
+	if (vers_journal_map(path, &j) == 0) {
+		for (n = j.n; n > 0; n--) {
+			if (j.r[n - 1].flags & VERS_RECORD_DROPPED)
+				continue;
+			vers_version_path(version_path, sizeof(version_path),
+					  path, j.r[n - 1].number);
+			if (faccessat(storage_fd, version_path, F_OK, 0) == 0)
+				break;
+		}
+		latest = n > 0 ? (int) j.r[n - 1].number : 0;
+
+		// Afresh, as it may be mapped by someone reading its end
+		if (n < j.n && !vers_index_read_only) {
+			TRACE(TRACE_INFO, "%s lost its newest versions in a "
+			      "crash", path);
+			if (vers_journal_write(path, j.r, n) < 0)
+				TRACE(TRACE_ERROR, "Could not cut back the "
+				      "journal of %s", path);
+		}
+		vers_journal_unmap(&j);
+	}
+	pthread_mutex_unlock(&vers_index_lock);
+	return latest;
+}
+
+/*
+ * Write over the record of version file number of the file at path: with
+ * what the file holds now (a fold or the chunks put it there), or, if
+ * dropped, to say it is gone
+ */
+static void vers_journal_update(const char *path, int number, int dropped)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	char journal_path[VERS_PATH_SIZE(path)];
+	const struct vers_record *old;
+	struct vers_record rec;
+	struct vers_journal j;
+	int fd;
+	int res = 0;
+
+	if (!dropped) {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  number);
+		res = vers_journal_record(version_path, &rec);
+	}
+	pthread_mutex_lock(&vers_index_lock);
+	if (res == 0)
+		res = vers_journal_map(path, &j);
+	if (res == 0) {
+		old = vers_journal_find(&j, number);
+		if (dropped && old != NULL) {
+			rec = *old;
+			rec.flags |= VERS_RECORD_DROPPED;
+		} else if (old != NULL) {
+			rec.number = old->number;
+			rec.flags = old->flags;
+			rec.time = old->time;
+		}
+		vers_journal_path(journal_path, sizeof(journal_path), path);
+		fd = old != NULL ? openat(storage_fd, journal_path, O_WRONLY) :
+				   -1;
+		if (fd != -1) {
+			if (pwrite(fd, &rec, sizeof(rec),
+				   (const char *) old - (const char *) j.map) !=
+			    sizeof(rec))
+				TRACE(TRACE_ERROR, "Could not update the "
+				      "journal of %s: %s", path,
+				      strerror(errno));
+			close(fd);
+		}
+		vers_journal_unmap(&j);
+	}
+	pthread_mutex_unlock(&vers_index_lock);
+}
+
+// Write the journal of the file at path afresh if half of it is dropped
+static void vers_journal_compact(const char *path)
+{
+	struct vers_record *kept;
+	struct vers_journal j;
+	size_t i, n = 0;
+
+	pthread_mutex_lock(&vers_index_lock);
+	if (vers_journal_map(path, &j) < 0) {
+		pthread_mutex_unlock(&vers_index_lock);
+		return;
+	}
+	for (i = 0; i < j.n; i++)
+		n += !(j.r[i].flags & VERS_RECORD_DROPPED);
+	kept = n * 2 <= j.n && j.n > 0 ? malloc((n + 1) * sizeof(*kept)) :
+					 NULL;
+	if (kept != NULL) {
+		for (i = 0, n = 0; i < j.n; i++)
+			if (!(j.r[i].flags & VERS_RECORD_DROPPED))
+				kept[n++] = j.r[i];
+	}
+	vers_journal_unmap(&j);
+	if (kept != NULL && vers_journal_write(path, kept, n) < 0)
+		TRACE(TRACE_ERROR, "Could not compact the journal of %s",
+		      path);
+	pthread_mutex_unlock(&vers_index_lock);
+	free(kept);
+}
+
+/*
+ * Durability
+ *
+ * A version is built in the store's tmp, whose data (and that of the chunks
+ * it lists) is synced before it is renamed to its number, so whatever a
+ * crash leaves of it is the whole version or nothing.  What makes the rename
+ * and the journal's record of it durable in turn is an fsync() of the store
+ * and of the journal, and those are left to a thread of their own: each
+ * round it syncs everything queued since the last one, once however many
+ * versions were published into it meanwhile, so a directory's fsync() is
+ * shared by every commit that waits for the same round (group commit).
+ * fsync() of a file through the mount waits for the round that covers its
+ * version; other commits do not wait at all.  Making a store or a journal
+ * afresh queues the directory it is in likewise.
+ *
+ * After a crash, the journal can have records of versions whose renames did
+ * not make it, and lack those of versions that did.  Loading the index goes
+ * back through the journal to the last record whose file is there, cuts off
+ * the rest, and adds whatever versions there are after it, so recovering
+ * reads the journal rather than every version file.
+ */
+
+struct vers_sync {
+	char *path;		// a file or directory to fsync()
+	struct vers_sync *next;
+};
+
+static struct vers_sync *vers_sync_pending = NULL;
+static unsigned long vers_sync_rounds = 0;	// begun
+static unsigned long vers_sync_done = 0;	// and finished
+static int vers_sync_running = 0;		// whether the thread is
+static pthread_mutex_t vers_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vers_sync_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t vers_sync_over = PTHREAD_COND_INITIALIZER;
+
+static int vers_sync_path(const char *path)
+{
+	int fd = openat(storage_fd, path, O_RDONLY);
+	int res = 0;
+
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -errno;	// gone since
+	if (fsync(fd) == -1)
+		res = -errno;
+	close(fd);
+	return res;
+}
+
+// Make the data of the file at path, and of the chunks it may list, durable
+static int vers_sync_data(const char *path)
+{
+	int fd;
+	int res = 0;
+
+	if (chunk_store_on())
+		res = chunk_sync();
+	fd = openat(storage_fd, path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	if (res == 0 && fdatasync(fd) == -1)
+		res = -errno;
+	close(fd);
+	return res;
+}
+
+// Sync path in the next round (or now, if there is no thread to)
+static void vers_sync_queue(const char *path)
+{
+	struct vers_sync *s = NULL;
+	int now = 1;
+	int res;
+
+	pthread_mutex_lock(&vers_sync_lock);
+	if (vers_sync_running) {
+		for (s = vers_sync_pending; s != NULL; s = s->next)
+			if (strcmp(s->path, path) == 0)
+				break;
+		now = 0;
+		if (s == NULL) {
+			s = malloc(sizeof(*s));
+			if (s != NULL && (s->path = strdup(path)) == NULL) {
+				free(s);
+				s = NULL;
+			}
+			if (s != NULL) {
+				s->next = vers_sync_pending;
+				vers_sync_pending = s;
+				pthread_cond_signal(&vers_sync_wake);
+			}
+			now = s == NULL;
+		}
+	}
+	pthread_mutex_unlock(&vers_sync_lock);
+
+	res = now ? vers_sync_path(path) : 0;
+	if (res < 0)
+		TRACE(TRACE_ERROR, "Could not sync %s: %s", path,
+		      strerror(-res));
+}
+
+// Wait for everything queued so far to be synced
+static void vers_sync_wait(void)
+{
+	unsigned long round;
+
+	pthread_mutex_lock(&vers_sync_lock);
+	round = vers_sync_rounds + (vers_sync_pending != NULL);
+	while (vers_sync_done < round)
+		pthread_cond_wait(&vers_sync_over, &vers_sync_lock);
+	pthread_mutex_unlock(&vers_sync_lock);
+}
+
+static void *vers_sync_thread(void *unused)
+{
+	struct vers_sync *s, *next;
+	unsigned long round;
+	int res;
+
+	(void) unused;
+	pthread_mutex_lock(&vers_sync_lock);
+	for (;;) {
+		while (vers_sync_pending == NULL)
+			pthread_cond_wait(&vers_sync_wake, &vers_sync_lock);
+		s = vers_sync_pending;
+		vers_sync_pending = NULL;
+		round = ++vers_sync_rounds;
+		pthread_mutex_unlock(&vers_sync_lock);
+
+		for (; s != NULL; s = next) {
+			next = s->next;
+			res = vers_sync_path(s->path);
+			if (res < 0)
+				TRACE(TRACE_ERROR, "Could not sync %s: %s",
+				      s->path, strerror(-res));
+			free(s->path);
+			free(s);
+		}
+
+		pthread_mutex_lock(&vers_sync_lock);
+		vers_sync_done = round;
+		pthread_cond_broadcast(&vers_sync_over);
+	}
+	return NULL;
+}
+
+static void vers_sync_start(void)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, vers_sync_thread, NULL) != 0) {
+		TRACE(TRACE_ERROR, "Failed to start the sync thread");
+		return;
+	}
+	pthread_detach(thread);
+	pthread_mutex_lock(&vers_sync_lock);
+	vers_sync_running = 1;
+	pthread_mutex_unlock(&vers_sync_lock);
+}
+
+// Where a version is built up before it is given a number
+static void vers_tmp_path(char *buf, size_t bufsize, const char *path)
+{
+	vers_store_path(buf, bufsize, path, VERS_TMP_NAME);
+}
+
+// Start building a delta in a new file at tmp_path
+static int vers_delta_create(struct vers_delta *d, const char *tmp_path)
+{
+	d->fd = openat(storage_fd, tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (d->fd == -1)
+		return -errno;
+
+	memset(&d->header, 0, sizeof(d->header));
+	memcpy(d->header.magic, VERS_DELTA_MAGIC, sizeof(d->header.magic));
+	d->pos = sizeof(d->header);
+	d->full = 0;
+	return 0;
+}
+
+// Start building a delta in the file's temporary version file
+static int vers_delta_begin(struct vers_delta *d, const char *path)
+{
+	char tmp_path[VERS_PATH_SIZE(path)];
+	int res;
+
+	vers_tmp_path(tmp_path, sizeof(tmp_path), path);
+	res = vers_delta_create(d, tmp_path);
+	if (res == -ENOENT && vers_store_make(path) == 0)
+		res = vers_delta_create(d, tmp_path);
+	return res;
+}
+
+/*
+ * Start a snapshot instead: clone the first size bytes of the head into the
+ * temporary version file.  Returns -EOPNOTSUPP if the storage directory
+ * cannot clone.
+ */
+static int vers_snapshot_begin(struct vers_delta *d, const char *path,
+			       int head_fd, off_t size)
+{
+	struct file_clone_range range = { .src_fd = head_fd,
+					  .dest_offset = VERS_FULL_DATA };
+	char tmp_path[VERS_PATH_SIZE(path)];
+	int res = 0;
+
+	vers_tmp_path(tmp_path, sizeof(tmp_path), path);
+	d->fd = openat(storage_fd, tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (d->fd == -1 && errno == ENOENT && vers_store_make(path) == 0)
+		d->fd = openat(storage_fd, tmp_path,
+			       O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (d->fd == -1)
+		return -errno;
+
+	// The whole file, as offsets and lengths must fall on block
+	// boundaries, and then cut back to what the version had
+	if (ioctl(d->fd, FICLONERANGE, &range) == -1)
+		res = errno == EXDEV || errno == EINVAL || errno == ENOTTY ||
+		      errno == ENOSYS ? -EOPNOTSUPP : -errno;
+	else if (ftruncate(d->fd, VERS_FULL_DATA + size) == -1)
+		res = -errno;
+	if (res < 0) {
+		close(d->fd);
+		d->fd = -1;
+		unlinkat(storage_fd, tmp_path, 0);
+		return res;
+	}
+
+	memset(&d->header, 0, sizeof(d->header));
+	memcpy(d->header.magic, VERS_FULL_MAGIC, sizeof(d->header.magic));
+	d->pos = VERS_FULL_DATA + size;
+	d->full = 1;
+	return 0;
+}
+
+/*
+ * Cut the first size bytes in in_fd into chunks and list them in a new file
+ * at list_path, which is left open in d with a header that says no more than
+ * that they come to size bytes.  On failure nothing is left of it, and any
+ * chunks taken are given back.
+ */
+static int vers_chunks_create(struct vers_delta *d, const char *list_path,
+			      int in_fd, off_t size)
+{
+	struct chunk_ref refs[VERS_CHUNK_BATCH];
+	unsigned char *buf;
+	size_t have = 0, at = 0, len;
+	off_t pos = 0;		// in in_fd, of what is not in buf yet
+	uint32_t n = 0;
+	ssize_t got;
+	int res = 0;
+
+	buf = bufpool_get(VERS_CHUNK_READ);
+	if (buf == NULL)
+		return -ENOMEM;
+	d->fd = openat(storage_fd, list_path, O_RDWR | O_CREAT | O_TRUNC,
+		       0644);
+	if (d->fd == -1) {
+		bufpool_put(buf);
+		return -errno;
+	}
+	memset(&d->header, 0, sizeof(d->header));
+	memcpy(d->header.magic, VERS_CHUNK_MAGIC, sizeof(d->header.magic));
+	d->header.prev_size = size;
+	d->header.size = size;
+	d->pos = sizeof(d->header);
+	d->full = 1;
+
+	while (res == 0 && (at < have || pos < size)) {
+		// Keep a whole chunk's worth in the buffer, but at the end
+		if (have - at < CHUNK_MAX && pos < size) {
+			memmove(buf, buf + at, have - at);
+			have -= at;
+			at = 0;
+			len = VERS_CHUNK_READ - have;
+			if ((off_t) len > size - pos)
+				len = size - pos;
+			got = pread(in_fd, buf + have, len, pos);
+			if (got <= 0)
+				res = got == 0 ? -EIO : -errno;
+			have += got > 0 ? got : 0;
+			pos += got > 0 ? got : 0;
+			continue;
+		}
+
+		len = chunk_cut(buf + at, have - at);
+		res = chunk_put(buf + at, len, &refs[n]);
+		if (res < 0)
+			break;
+		at += len;
+		d->header.extents++;
+		if (++n == VERS_CHUNK_BATCH || (at == have && pos == size)) {
+			res = vers_pwrite(d->fd, refs, n * sizeof(refs[0]),
+					  d->pos);
+			if (res < 0)
+				break;
+			d->pos += n * sizeof(refs[0]);
+			n = 0;
+		}
+	}
+	bufpool_put(buf);
+
+	// Chunks not written down yet are given back by hand
+	while (res < 0 && n > 0) {
+		chunk_unref(&refs[--n]);
+		d->header.extents--;
+	}
+	got = vers_pwrite(d->fd, &d->header, sizeof(d->header), 0);
+	if (res == 0)
+		res = got;
+	if (res < 0) {
+		vers_chunks_release(d->fd);
+		close(d->fd);
+		d->fd = -1;
+		unlinkat(storage_fd, list_path, 0);
+	}
+	return res;
+}
+
+/*
+ * Start a snapshot as a list of chunks instead, of the first size bytes of
+ * the head, in the temporary version file
+ */
+static int vers_chunks_begin(struct vers_delta *d, const char *path,
+			     int head_fd, off_t size)
+{
+	char tmp_path[VERS_PATH_SIZE(path)];
+	int res;
+
+	vers_tmp_path(tmp_path, sizeof(tmp_path), path);
+	res = vers_chunks_create(d, tmp_path, head_fd, size);
+	if (res == -ENOENT && vers_store_make(path) == 0)
+		res = vers_chunks_create(d, tmp_path, head_fd, size);
+	return res;
+}
+
+/*
+ * Record that version N-1 had `length` bytes of `data` at `offset`, or if
+ * data is NULL, the bytes head_fd has there now
+ */
+static int vers_delta_add(struct vers_delta *d, off_t offset,
+			  const char *data, int head_fd, size_t length)
+{
+	struct vers_delta_extent extent = { offset, length };
+	int res;
+
+	res = vers_pwrite(d->fd, &extent, sizeof(extent), d->pos);
+	if (res < 0)
+		return res;
+	if (data == NULL) {
+		res = core_copy_range(head_fd, offset, d->fd,
+				      d->pos + sizeof(extent), length);
+		if (res < 0)
+			return res;
+	} else {
+		res = vers_pwrite(d->fd, data, length,
+				  d->pos + sizeof(extent));
+		if (res < 0)
+			return res;
+	}
+	d->pos += sizeof(extent) + length;
+	d->header.extents++;
+	return 0;
+}
+
+/*
+ * Throw a delta away.  path is NULL if the temporary file has already been
+ * unlinked (and may by now belong to someone else).
+ */
+static void vers_delta_discard(struct vers_delta *d, const char *path)
+{
+	char tmp_path[VERS_PATH_SIZE(path)];
+
+	vers_chunks_release(d->fd);
+	close(d->fd);
+	d->fd = -1;
+	if (path != NULL) {
+		vers_tmp_path(tmp_path, sizeof(tmp_path), path);
+		unlinkat(storage_fd, tmp_path, 0);
+	}
+}
+
+/*
+ * Replace a finished delta with a compressed copy of itself, if that is any
+ * smaller.  Failing to compress is not fatal: the delta is simply kept as it
+ * is.
+ */
+static void vers_delta_compress(struct vers_delta *d, const char *tmp_path)
+{
+	char z_path[strlen(tmp_path) + 3];
+	struct stat st;
+	int fd;
+	int res;
+
+	sprintf(z_path, "%s.z", tmp_path);
+	fd = openat(storage_fd, z_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return;
+	res = compress_copy(d->fd, d->pos, fd);
+	if (res == 0 && fstat(fd, &st) == -1)
+		res = -errno;
+	if (close(fd) == -1 && res == 0)
+		res = -errno;
+	if (res == 0 && st.st_size < d->pos &&
+	    renameat(storage_fd, z_path, storage_fd, tmp_path) == 0)
+		return;
+	if (res < 0)
+		TRACE(TRACE_ERROR, "Keeping %s uncompressed: %s", tmp_path,
+		      strerror(-res));
+	unlinkat(storage_fd, z_path, 0);
+}
+
+// Finish a delta and publish it as the file's next version
+static int vers_delta_publish(struct vers_delta *d, const char *path,
+			      off_t prev_size, off_t size)
+{
+	char tmp_path[VERS_PATH_SIZE(path)];
+	int res;
+
+	d->header.prev_size = prev_size;
+	d->header.size = size;
+	res = vers_pwrite(d->fd, &d->header, sizeof(d->header), 0);
+	if (res < 0) {
+		vers_delta_discard(d, path);
+		return res;
+	}
+
+	vers_tmp_path(tmp_path, sizeof(tmp_path), path);
+	if (vers_compress && !d->full)		// that would undo the sharing
+		vers_delta_compress(d, tmp_path);
+	close(d->fd);
+	d->fd = -1;
+
+	res = vers_publish(path, tmp_path);
+	if (res < 0)
+		vers_version_unlink(storage_fd, tmp_path);
+	return res < 0 ? res : 0;
+}
+
+/*
+ * Write sessions
+ *
+ * Rather than one version per write() call, every change made to a file while
+ * it is open for writing goes into a single version, committed when the last
+ * writer closes the file or calls fsync(), or sooner according to the commit
+ * policy given with -c:
+ *
+ *   -c close             one version per open/close session (the default)
+ *   -c time=<seconds>    also commit once a session has been open that long
+ *   -c bytes=<n>[k|m|g]  also commit once that much has been written
+ *
+ * (the last two can be combined, e.g. -c time=60,bytes=64m).  While a session
+ * is open its delta is built up in the store's "tmp": the first time a block
+ * that existed when the session began is changed, its old contents are saved
+ * there.  Sessions are shared by every handle writing a file and are found by
+ * inode, so they follow the file across renames.
+ */
+
+struct vers_session {
+	dev_t dev;
+	ino_t ino;
+	int refs;		// handles (or a truncate) using the session
+	char *path;		// current storage path of the file
+	int unlinked;		// file is gone, so discard instead of committing
+	struct vers_delta delta;// fd is -1 until a block has been saved
+	off_t prev_size;	// size of the file when the session began
+	unsigned char *saved;	// bitmap of the blocks below prev_size saved
+	off_t written;		// bytes written during the session
+	time_t started;
+	struct vers_session *next;
+};
+
+static time_t vers_commit_interval = 0;	// 0 commits only at close/fsync
+static off_t  vers_commit_bytes    = 0;	// likewise
+
+static struct vers_session *vers_sessions = NULL;
+static pthread_mutex_t vers_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A session (and any change to a file, which always goes through one) is
+ * only touched with the file's lock held, picked by hashing the inode.  The
+ * file lock is always taken before vers_sessions_lock and vers_gc_lock (the
+ * retention thread's, see below).
+ */
+static pthread_mutex_t vers_file_locks[VERS_FILE_LOCKS] = {
+	[0 ... VERS_FILE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static pthread_mutex_t vers_gc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t *vers_file_lock(dev_t dev, ino_t ino)
+{
+	return &vers_file_locks[(ino ^ dev) % VERS_FILE_LOCKS];
+}
+
+// (Re)start a session from the current state of the file
+static int vers_session_reset(struct vers_session *s, off_t size)
+{
+	size_t nblocks = (size + VERS_BLOCK_SIZE - 1) / VERS_BLOCK_SIZE;
+
+	free(s->saved);
+	s->saved = calloc(nblocks / 8 + 1, 1);
+	if (s->saved == NULL)
+		return -ENOMEM;
+	s->delta.fd = -1;
+	s->prev_size = size;
+	s->written = 0;
+	s->started = time(NULL);
+	return 0;
+}
+
+// Find the session of the file open on head_fd, starting one if need be
+static struct vers_session *vers_session_get(const char *path, int head_fd)
+{
+	struct vers_session *s;
+	struct stat st;
+
+	if (fstat(head_fd, &st) == -1)
+		return NULL;
+
+	pthread_mutex_lock(&vers_sessions_lock);
+	for (s = vers_sessions; s != NULL; s = s->next)
+		if (s->dev == st.st_dev && s->ino == st.st_ino)
+			break;
+	if (s != NULL) {
+		s->refs++;
+	} else {
+		s = calloc(1, sizeof(*s));
+		if (s != NULL) {
+			s->path = strdup(path);
+			if (s->path == NULL ||
+			    vers_session_reset(s, st.st_size) < 0) {
+				free(s->path);
+				free(s);
+				s = NULL;
+			}
+		}
+		if (s != NULL) {
+			s->dev = st.st_dev;
+			s->ino = st.st_ino;
+			s->refs = 1;
+			s->next = vers_sessions;
+			vers_sessions = s;
+		}
+	}
+	pthread_mutex_unlock(&vers_sessions_lock);
+
+	return s;
+}
+
+// Find an existing session by inode; called with the file lock held
+static struct vers_session *vers_session_find(dev_t dev, ino_t ino)
+{
+	struct vers_session *s;
+
+	pthread_mutex_lock(&vers_sessions_lock);
+	for (s = vers_sessions; s != NULL; s = s->next)
+		if (s->dev == dev && s->ino == ino)
+			break;
+	pthread_mutex_unlock(&vers_sessions_lock);
+
+	return s;
+}
+
+static int vers_block_saved(struct vers_session *s, off_t blk)
+{
+	return s->saved[blk / 8] & (1 << (blk % 8));
+}
+
+/*
+ * Snapshot the head when the session first changes old data, in chunks or
+ * if the storage directory can clone; returns -EOPNOTSUPP if it cannot
+ */
+static int vers_session_snapshot(struct vers_session *s, int head_fd)
+{
+	int res;
+
+	if (vers_chunks)
+		return vers_chunks_begin(&s->delta, s->path, head_fd,
+					 s->prev_size);
+	if (vers_reflink == 0)
+		return -EOPNOTSUPP;
+
+	res = vers_snapshot_begin(&s->delta, s->path, head_fd, s->prev_size);
+	if (res == -EOPNOTSUPP) {
+		if (vers_reflink == 1) {
+			TRACE(TRACE_ERROR, "Cannot clone %s, saving a delta",
+			      s->path);
+		} else {
+			TRACE(TRACE_INFO, "No reflinks in %s, versions are "
+			      "saved as deltas", storage_dir);
+			vers_reflink = 0;
+		}
+	}
+	return res;
+}
+
+/*
+ * Add old data to the session's delta, creating the delta file on first use.
+ * A session that got a snapshot instead has nothing more to save.
+ */
+static int vers_session_add(struct vers_session *s, off_t offset,
+			    const char *data, int head_fd, size_t length)
+{
+	int res;
+
+	if (s->delta.fd == -1) {
+		res = vers_session_snapshot(s, head_fd);
+		if (res == -EOPNOTSUPP)
+			res = vers_delta_begin(&s->delta, s->path);
+		if (res < 0)
+			return res;
+	}
+	if (s->delta.full)
+		return 0;
+	return vers_delta_add(&s->delta, offset, data, head_fd, length);
+}
+
+/*
+ * Save the old contents of every block touching [from, to) that existed when
+ * the session began and has not been saved yet.  If buf (the new data for
+ * [from, to)) is given, blocks it does not actually change are skipped.
+ * Without it (a truncate) there is nothing to compare, so the old data goes
+ * straight from the head to the delta, without passing through us.
+ */
+static int vers_session_save(struct vers_session *s, int head_fd,
+			     off_t from, off_t to, const char *buf)
+{
+	struct stat st;
+	char *old = NULL;
+	off_t limit;
+	off_t start, end, off;
+	int res = 0;
+
+	if (fstat(head_fd, &st) == -1)
+		return -errno;
+
+	// Blocks past what is left of the file as it began have no old data
+	limit = s->prev_size < st.st_size ? s->prev_size : st.st_size;
+	if (from >= limit || from >= to)
+		return 0;
+
+	// Nothing is kept of unlinked files, or left to save after a snapshot
+	if (s->unlinked || (s->delta.fd != -1 && s->delta.full))
+		return 0;
+
+	if (buf != NULL) {
+		old = bufpool_get(VERS_COPY_CHUNK);
+		if (old == NULL)
+			return -ENOMEM;
+	}
+
+	start = from - from % VERS_BLOCK_SIZE;
+	while (res == 0 && start < to && start < limit) {
+		off_t run_start = -1;
+		ssize_t n;
+
+		if (vers_block_saved(s, start / VERS_BLOCK_SIZE)) {
+			start += VERS_BLOCK_SIZE;
+			continue;
+		}
+
+		// Read up to a chunk's worth of whole blocks in one go
+		end = start + VERS_COPY_CHUNK;
+		if (end > to)
+			end = to + (VERS_BLOCK_SIZE - 1) -
+			      (to + VERS_BLOCK_SIZE - 1) % VERS_BLOCK_SIZE;
+		if (end > limit)
+			end = limit;
+		n = buf == NULL ? end - start :
+		    pread(head_fd, old, end - start, start);
+		if (n != end - start) {
+			res = n == -1 ? -errno : -EIO;
+			break;
+		}
+
+		for (off = start; res == 0 && off < end;
+		     off += VERS_BLOCK_SIZE) {
+			off_t blk = off / VERS_BLOCK_SIZE;
+			off_t a = off > from ? off : from;
+			off_t b = off + VERS_BLOCK_SIZE;
+			int changed = 0;
+
+			if (b > end)
+				b = end;
+			if (b > to)
+				b = to;
+
+			// Only the part of the block being written can differ
+			if (!vers_block_saved(s, blk))
+				changed = buf == NULL ||
+					  memcmp(old + (a - start),
+						 buf + (a - from), b - a) != 0;
+
+			if (changed) {
+				if (run_start == -1)
+					run_start = off;
+				s->saved[blk / 8] |= 1 << (blk % 8);
+			} else if (run_start != -1) {
+				res = vers_session_add(s, run_start,
+						       old == NULL ? NULL :
+						       old + (run_start - start),
+						       head_fd, off - run_start);
+				run_start = -1;
+			}
+		}
+		if (res == 0 && run_start != -1)
+			res = vers_session_add(s, run_start,
+					       old == NULL ? NULL :
+					       old + (run_start - start),
+					       head_fd, end - run_start);
+		start = end;
+	}
+
+	bufpool_put(old);
+	return res;
+}
+
+/*
+ * Commit whatever the session has collected as a new version and start
+ * afresh.  A session that changed nothing creates no version.
+ */
+static int vers_session_commit(struct vers_session *s, int head_fd)
+{
+	struct stat st;
+	int res = 0;
+
+	if (fstat(head_fd, &st) == -1)
+		return -errno;
+
+	if (s->unlinked) {
+		if (s->delta.fd != -1)
+			vers_delta_discard(&s->delta, NULL);
+	} else if (s->delta.fd != -1 || st.st_size != s->prev_size) {
+		if (s->delta.fd == -1)
+			res = vers_delta_begin(&s->delta, s->path);
+		if (res == 0)
+			res = vers_delta_publish(&s->delta, s->path,
+						 s->prev_size, st.st_size);
+	}
+
+	if (res == 0)
+		res = vers_session_reset(s, st.st_size);
+	return res;
+}
+
+// Commit early if the session has run past the commit policy's limits
+static int vers_session_check(struct vers_session *s, int head_fd)
+{
+	if ((vers_commit_bytes > 0 && s->written >= vers_commit_bytes) ||
+	    (vers_commit_interval > 0 &&
+	     time(NULL) - s->started >= vers_commit_interval))
+		return vers_session_commit(s, head_fd);
+	return 0;
+}
+
+// Drop a reference to a session, committing it if it was the last one
+static int vers_session_put(struct vers_session *s, int head_fd)
+{
+	struct vers_session **p;
+	int res = 0;
+	int last;
+
+	pthread_mutex_lock(vers_file_lock(s->dev, s->ino));
+	pthread_mutex_lock(&vers_sessions_lock);
+	last = --s->refs == 0;
+	if (last) {
+		for (p = &vers_sessions; *p != s; p = &(*p)->next)
+			;
+		*p = s->next;
+	}
+	pthread_mutex_unlock(&vers_sessions_lock);
+
+	if (last) {
+		res = vers_session_commit(s, head_fd);
+		if (s->delta.fd != -1)
+			vers_delta_discard(&s->delta,
+					   s->unlinked ? NULL : s->path);
+	}
+	pthread_mutex_unlock(vers_file_lock(s->dev, s->ino));
+
+	if (last) {
+		free(s->saved);
+		free(s->path);
+		free(s);
+	}
+	return res;
+}
+
+/*
+ * Move the store of a file that has just been renamed from from to to, and
+ * its session (if any) with it, or if to is NULL remove it: the file is gone,
+ * though a session may still be writing to it through a descriptor.  st is
+ * what lstat() said about the file before it went.
+ */
+static void vers_store_move(const char *from, const char *to,
+			    const struct stat *st)
+{
+	char store_from[VERS_PATH_SIZE(from)];
+	char store_to[to != NULL ? VERS_PATH_SIZE(to) : 1];
+	struct vers_session *s;
+	char *new_path = NULL;
+	int res;
+
+	if (!S_ISREG(st->st_mode))
+		return;
+
+	pthread_mutex_lock(vers_file_lock(st->st_dev, st->st_ino));
+	pthread_mutex_lock(&vers_gc_lock);
+	s = vers_session_find(st->st_dev, st->st_ino);
+	if (to != NULL) {
+		vers_store_path(store_from, sizeof(store_from), from, NULL);
+		vers_store_path(store_to, sizeof(store_to), to, NULL);
+		res = renameat(storage_fd, store_from, storage_fd, store_to);
+
+		// There may be no .versfs to go into yet, or an old store
+		// left behind under the new name
+		if (res == -1 && errno == ENOENT &&
+		    faccessat(storage_fd, store_from, F_OK, 0) == 0 &&
+		    vers_store_make(to) == 0)
+			res = renameat(storage_fd, store_from, storage_fd,
+				       store_to);
+		if (res == -1 && (errno == ENOTEMPTY || errno == EEXIST)) {
+			vers_store_remove(to);
+			res = renameat(storage_fd, store_from, storage_fd,
+				       store_to);
+		}
+		if (res == -1 && errno != ENOENT)
+			TRACE(TRACE_ERROR, "Could not move the versions of %s "
+			      "to %s: %s", from, to, strerror(errno));
+		new_path = strdup(to);
+	} else {
+		vers_store_remove(from);
+	}
+
+	if (s != NULL && !s->unlinked) {
+		if (new_path != NULL) {
+			free(s->path);
+			s->path = new_path;
+			new_path = NULL;
+		} else if (to == NULL) {
+			s->unlinked = 1;	// never published
+		}
+	}
+	pthread_mutex_unlock(&vers_gc_lock);
+	pthread_mutex_unlock(vers_file_lock(st->st_dev, st->st_ino));
+	free(new_path);
+}
+
+/*
+ * Point the sessions of files below a directory just renamed from from at
+ * their new paths: their stores went along with the directory
+ */
+static void vers_sessions_move(const char *from, const char *to)
+{
+	size_t from_len = strlen(from);
+	struct { dev_t dev; ino_t ino; } *moved = NULL;
+	size_t n = 0, max = 0, i;
+	void *more;
+	struct vers_session *s;
+
+	// Collect them first, as each is changed under its file's lock
+	pthread_mutex_lock(&vers_sessions_lock);
+	for (s = vers_sessions; s != NULL; s = s->next) {
+		if (strncmp(s->path, from, from_len) != 0 ||
+		    s->path[from_len] != '/')
+			continue;
+		if (n == max) {
+			max = max > 0 ? max * 2 : 8;
+			more = realloc(moved, max * sizeof(*moved));
+			if (more == NULL)
+				break;
+			moved = more;
+		}
+		moved[n].dev = s->dev;
+		moved[n].ino = s->ino;
+		n++;
+	}
+	pthread_mutex_unlock(&vers_sessions_lock);
+	if (s != NULL)
+		TRACE(TRACE_ERROR, "Could not move the sessions below %s",
+		      from);
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_t *lock = vers_file_lock(moved[i].dev,
+						       moved[i].ino);
+		char *new_path;
+
+		pthread_mutex_lock(lock);
+		pthread_mutex_lock(&vers_gc_lock);
+		s = vers_session_find(moved[i].dev, moved[i].ino);
+		if (s != NULL && !s->unlinked &&
+		    strncmp(s->path, from, from_len) == 0 &&
+		    s->path[from_len] == '/' &&
+		    (new_path = malloc(strlen(to) + strlen(s->path) -
+				       from_len + 1)) != NULL) {
+			strcpy(new_path, to);
+			strcat(new_path, s->path + from_len);
+			free(s->path);
+			s->path = new_path;
+		}
+		pthread_mutex_unlock(&vers_gc_lock);
+		pthread_mutex_unlock(lock);
+	}
+	free(moved);
+}
+
+/*
+ * Turn the contents of out_fd from version N into version N-1, where they
+ * start base bytes into the file
+ */
+static int vers_undo(struct vers_file *delta, int out_fd, off_t base)
+{
+	struct vers_delta_header header;
+	struct vers_delta_extent extent;
+	off_t pos = sizeof(header);
+	uint32_t i;
+	int res;
+
+	if (vers_read_header(delta, &header) != 0)
+		return -EIO;
+
+	for (i = 0; i < header.extents; i++) {
+		if (vers_file_pread(delta, &extent, sizeof(extent), pos) !=
+		    sizeof(extent))
+			return -EIO;
+		pos += sizeof(extent);
+		res = vers_copy(delta, pos, out_fd, base + extent.offset,
+				extent.length);
+		if (res < 0)
+			return res;
+		pos += extent.length;
+	}
+
+	if (ftruncate(out_fd, base + header.prev_size) == -1)
+		return -errno;
+	return 0;
+}
+
+/*
+ * The oldest of versions first..last that is a snapshot (of either kind),
+ * last + 1 if none is, or -errno.  Snapshots are never compressed, so it
+ * takes no more than the first bytes of each version file, and every batch
+ * of them is opened, read and closed with one submission each rather than a
+ * call per file.
+ */
+static int vers_oldest_snapshot(const char *path, int first, int last)
+{
+	const int batch = vers_batch(path);
+	char version_path[batch][VERS_PATH_SIZE(path)];
+	char magic[URING_BATCH][sizeof(VERS_FULL_MAGIC) - 1];
+	int fds[URING_BATCH];
+	struct uring_batch b;
+	int found = last + 1;
+	int res = 0;
+	int i, n;
+
+	for (; first <= last && found > last && res == 0; first += n) {
+		n = last - first < batch ? last - first + 1 : batch;
+		uring_begin(&b);
+		for (i = 0; i < n; i++) {
+			vers_version_path(version_path[i],
+					  sizeof(version_path[i]), path,
+					  first + i);
+			uring_openat(&b, storage_fd, version_path[i], O_RDONLY,
+				     0);
+		}
+		uring_submit(&b);
+
+		// A short read leaves the magic unmatched, so no need to
+		// look at what the reads returned
+		for (i = 0; i < n; i++) {
+			fds[i] = b.res[i];
+			if (fds[i] < 0 && fds[i] != -ENOENT && res == 0)
+				res = fds[i];
+			memset(magic[i], 0, sizeof(magic[i]));
+		}
+		uring_begin(&b);
+		for (i = 0; i < n; i++)
+			if (fds[i] >= 0)
+				uring_pread(&b, fds[i], magic[i],
+					    sizeof(magic[i]), 0);
+		uring_submit(&b);
+
+		uring_begin(&b);
+		for (i = 0; i < n; i++)
+			if (fds[i] >= 0)
+				uring_close(&b, fds[i]);
+		uring_submit(&b);
+
+		for (i = 0; i < n && found > last; i++)
+			if (fds[i] >= 0 &&
+			    (memcmp(magic[i], VERS_FULL_MAGIC,
+				    sizeof(magic[i])) == 0 ||
+			     memcmp(magic[i], VERS_CHUNK_MAGIC,
+				    sizeof(magic[i])) == 0))
+				found = first + i;
+	}
+	return res < 0 ? res : found;
+}
+
+/*
+ * Rebuilds the given version of a file into out_fd, which should refer to an
+ * empty regular file.  Version 0 is the file as it was before its first
+ * recorded change.
+ */
+static int vers_materialize(const char *path, int version, int out_fd)
+{
+	struct vers_delta_header header;
+	char version_path[VERS_PATH_SIZE(path)];
+	struct vers_file f;
+	int latest = vers_latest(path);
+	int from = latest + 1;		// the head
+	off_t start = 0;
+	off_t size;
+	int res;
+	int i;
+
+	if (version < 0 || version > latest)
+		return -ENOENT;
+
+	// Versions the retention policy dropped have no file of their own
+	if (version < latest) {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  version + 1);
+		if (faccessat(storage_fd, version_path, F_OK, 0) != 0)
+			return -ENOENT;
+	}
+
+	// Old-style versions are stored whole
+	if (version > 0) {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  version);
+		res = vers_file_open(&f, version_path, version);
+		if (res == -ENOENT)
+			goto deltas;
+		if (res < 0)
+			return res;
+		if (vers_read_header(&f, &header) < 0) {
+			size = vers_file_size(&f);
+			res = size < 0 ? size : vers_copy(&f, 0, out_fd, 0, size);
+			vers_file_close(&f);
+			return res;
+		}
+		vers_file_close(&f);
+	}
+
+deltas:
+	// Start from the oldest snapshot newer than version, if any
+	from = vers_oldest_snapshot(path, version + 1, latest);
+	if (from < 0)
+		return from;
+	if (from <= latest)
+		start = VERS_FULL_DATA;
+
+	if (from > latest) {
+		res = vers_file_open(&f, path, 0);
+	} else {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  from);
+		res = vers_file_open(&f, version_path, from);
+	}
+	if (res < 0)
+		return res;
+	posix_fadvise(f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	size = vers_file_size(&f);
+	if (from <= latest && vers_read_header(&f, &header) == 2)
+		res = vers_chunks_copy(&f, &header, out_fd, 0);
+	else
+		res = size < 0 ? size :
+		      vers_copy(&f, start, out_fd, 0, size - start);
+	vers_file_close(&f);
+
+	for (i = from - 1; i > version && res == 0; i--) {
+		vers_version_path(version_path, sizeof(version_path), path, i);
+		res = vers_file_open(&f, version_path, i);
+		if (res == -ENOENT) {
+			res = 0;
+			continue;
+		}
+		if (res < 0)
+			return res;
+		res = vers_undo(&f, out_fd, 0);
+		vers_file_close(&f);
+	}
+	return res;
+}
+
+/*
+ * Files last written by the old scheme have an empty base file and their
+ * newest contents in a plain version file.  Copy that into the base file so it
+ * can serve as the head.
+ */
+static void vers_upgrade_legacy(const char *path, int latest)
+{
+	struct vers_delta_header header;
+	char version_path[VERS_PATH_SIZE(path)];
+	struct stat vst, bst;
+	struct vers_file v;
+	int bfd;
+
+	if (latest <= 0)
+		return;
+
+	vers_version_path(version_path, sizeof(version_path), path, latest);
+	if (vers_file_open(&v, version_path, latest) < 0)
+		return;
+	if (v.compressed || vers_read_header(&v, &header) >= 0 ||
+	    fstat(v.fd, &vst) == -1) {
+		vers_file_close(&v);
+		return;
+	}
+
+	bfd = openat(storage_fd, path, O_WRONLY);
+	if (bfd != -1 && fstat(bfd, &bst) == 0 &&
+	    (bst.st_size != vst.st_size || bst.st_mtime < vst.st_mtime)) {
+		if (ftruncate(bfd, 0) == 0)
+			vers_copy(&v, 0, bfd, 0, vst.st_size);
+	}
+	if (bfd != -1)
+		close(bfd);
+	vers_file_close(&v);
+}
+
+
+/*
+ * Retention
+ *
+ * Without -k every version is kept for as long as its file is.  -k gives
+ * rules for which old versions to keep, much as backup tools have; a version
+ * is kept if any of the rules keeps it:
+ *
+ *   last=<n>     the n newest versions
+ *   age=<t>      those replaced less than t ago (t in s, m, h, d or w)
+ *   hourly=<n>   the newest version of each of the last n hours with one
+ *   daily=<n>    likewise for days
+ *   weekly=<n>   and (ISO) weeks
+ *
+ * e.g. -k last=10,hourly=24,daily=30,weekly=52.  The head is always there,
+ * and so is the version before it, whose file is the one the index is
+ * checked against.  The time of version N-1 is when it was replaced, which is
+ * when version file N was last written.  Versions in the old whole-file
+ * format are never dropped.
+ *
+ * The rules are applied by a thread of its own every every=<seconds> (10
+ * minutes by default), never on the way of a request.  It finds the files
+ * that have versions by their stores, and drops versions
+ *   - from the oldest end, by unlinking their files, which nothing newer
+ *     needs, and
+ *   - from the middle, by folding the deltas of a run of dropped versions
+ *     into that of the next older kept one, which then undoes the whole run.
+ * Either way the other versions keep their numbers, so there are gaps: version
+ * N-1 is there exactly when version file N is (or N-1 is the newest).  A
+ * folded delta is written as the store's "gc" and renamed into place before
+ * the deltas it replaces are unlinked.  It holds everything they did, so it
+ * undoes any of the versions in the run, and a crash in between leaves a
+ * chain that still works.  The copying is paced to rate=<n>[k|m|g] bytes a
+ * second (4 MiB by default, 0 for no limit).
+ *
+ * Renaming and unlinking a file move or remove its store, so they hold
+ * vers_gc_lock while they do; the thread takes it only to check that what it
+ * read is still there, and to swap in the result.
+ *
+ * Where versions are kept in chunks, the same thread then moves the chunks
+ * still wanted out of every pack that has become at least half garbage
+ * (chunk_compact()), at the same pace, whether there are rules or not.
+ */
+
+#define VERS_GC_CHUNK  (1024 * 1024)	// copied between checks of the rate
+
+static int    vers_keep_last   = 0;
+static time_t vers_keep_age    = 0;
+static int    vers_keep_hourly = 0;
+static int    vers_keep_daily  = 0;
+static int    vers_keep_weekly = 0;
+static int    vers_retention   = 0;	// whether any rule was given
+static off_t  vers_gc_rate     = 4 * 1024 * 1024;
+static time_t vers_gc_every    = 600;
+
+static struct timespec vers_gc_started;	// when the pace was last set
+static off_t vers_gc_done;		// bytes copied since then
+
+// One version file of a file being looked after
+struct vers_gc_version {
+	int number;		// N of version file N, which holds version N-1
+	struct stat st;		// but for the times, only once it is opened
+	int keep;
+};
+
+// Sleep for as long as it takes to keep the copying down to vers_gc_rate
+static void vers_gc_pace(off_t bytes)
+{
+	struct timespec now, wait;
+	double elapsed, due;
+
+	if (vers_gc_rate <= 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - vers_gc_started.tv_sec) +
+		  (now.tv_nsec - vers_gc_started.tv_nsec) / 1e9;
+	vers_gc_done += bytes;
+	due = (double) vers_gc_done / vers_gc_rate;
+
+	// Time spent idle does not save up into a burst of more than a second
+	if (elapsed > due + 1) {
+		vers_gc_started = now;
+		vers_gc_done = bytes;
+		due = (double) bytes / vers_gc_rate;
+		elapsed = 0;
+	}
+	if (due > elapsed) {
+		wait.tv_sec = (time_t) (due - elapsed);
+		wait.tv_nsec = (long) ((due - elapsed - wait.tv_sec) * 1e9);
+		nanosleep(&wait, NULL);
+	}
+}
+
+// vers_copy() in pieces, at the pace of vers_gc_rate
+static int vers_gc_copy(struct vers_file *in, off_t in_off, int out_fd,
+			off_t out_off, off_t length)
+{
+	int res = 0;
+
+	while (res == 0 && length > 0) {
+		off_t n = length < VERS_GC_CHUNK ? length : VERS_GC_CHUNK;
+		res = vers_copy(in, in_off, out_fd, out_off, n);
+		vers_gc_pace(n);
+		in_off  += n;
+		out_off += n;
+		length  -= n;
+	}
+	return res;
+}
+
+// vers_delta_add() of length bytes at pos in another version file
+static int vers_gc_add(struct vers_delta *d, off_t offset,
+		       struct vers_file *in, off_t pos, off_t length)
+{
+	struct vers_delta_extent extent = { offset, length };
+	int res;
+
+	res = vers_pwrite(d->fd, &extent, sizeof(extent), d->pos);
+	if (res < 0)
+		return res;
+	res = vers_gc_copy(in, pos, d->fd, d->pos + sizeof(extent), length);
+	if (res < 0)
+		return res;
+	d->pos += sizeof(extent) + length;
+	d->header.extents++;
+	return 0;
+}
+
+// Whether version file N of path is still the one that was looked at
+static int vers_gc_same(const char *path, const struct vers_gc_version *v)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	struct stat st;
+
+	vers_version_path(version_path, sizeof(version_path), path, v->number);
+	return fstatat(storage_fd, version_path, &st, 0) == 0 &&
+	       st.st_dev == v->st.st_dev && st.st_ino == v->st.st_ino;
+}
+
+static void vers_gc_unlink(const char *path, const struct vers_gc_version *v)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+
+	vers_version_path(version_path, sizeof(version_path), path, v->number);
+	vers_version_unlink(storage_fd, version_path);
+}
+
+// The key of the hour, day or week t falls in
+static long vers_gc_period(time_t t, int period)
+{
+	char week[16];
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	if (period == 'h')
+		return ((long) tm.tm_year * 366 + tm.tm_yday) * 24 + tm.tm_hour;
+	if (period == 'd')
+		return (long) tm.tm_year * 366 + tm.tm_yday;
+	strftime(week, sizeof(week), "%G%V", &tm);
+	return atol(week);
+}
+
+// Keep the newest version of each of the most recent count periods
+static void vers_gc_keep_periods(struct vers_gc_version *v, int n, int count,
+				 int period)
+{
+	long last = 0;
+	int i;
+
+	for (i = n - 1; i >= 0 && count > 0; i--) {
+		long key = vers_gc_period(v[i].st.st_mtime, period);
+		if (i == n - 1 || key != last) {
+			v[i].keep = 1;
+			last = key;
+			count--;
+		}
+	}
+}
+
+// Mark the versions (oldest first) that the rules keep
+static void vers_gc_mark(struct vers_gc_version *v, int n)
+{
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < n; i++)
+		v[i].keep = i >= n - vers_keep_last ||
+			    (vers_keep_age > 0 &&
+			     v[i].st.st_mtime > now - vers_keep_age);
+	vers_gc_keep_periods(v, n, vers_keep_hourly, 'h');
+	vers_gc_keep_periods(v, n, vers_keep_daily,  'd');
+	vers_gc_keep_periods(v, n, vers_keep_weekly, 'w');
+}
+
+/*
+ * Fold the deltas of run[0..n) (oldest first) into the delta for the version
+ * before them, base, as one file at gc_path that undoes them all: a delta
+ * with the data of each block from the oldest of them that has it.
+ */
+static int vers_gc_fold_deltas(struct vers_file *base,
+			       struct vers_file *run, int n,
+			       struct vers_delta_header *headers,
+			       const char *gc_path)
+{
+	struct vers_delta_extent extent;
+	struct vers_delta d;
+	unsigned char *covered;
+	off_t size = headers[0].prev_size;	// what it all comes to
+	off_t pos, off, end, blk, start;
+	uint32_t e;
+	int i;
+	int res;
+
+	covered = calloc((size + VERS_BLOCK_SIZE - 1) / VERS_BLOCK_SIZE / 8 + 1,
+			 1);
+	if (covered == NULL)
+		return -ENOMEM;
+	res = vers_delta_create(&d, gc_path);
+
+	for (i = -1; i < n && res == 0; i++) {
+		struct vers_file *f = i < 0 ? base : &run[i];
+
+		pos = sizeof(struct vers_delta_header);
+		for (e = 0; e < headers[i + 1].extents && res == 0; e++) {
+			if (vers_file_pread(f, &extent, sizeof(extent), pos) !=
+			    sizeof(extent)) {
+				res = -EIO;
+				break;
+			}
+			pos += sizeof(extent);
+
+			// Each stretch of blocks not yet covered by an older
+			// delta becomes an extent of its own
+			end = extent.offset + extent.length;
+			if (end > size)
+				end = size;
+			for (off = extent.offset; off < end && res == 0; ) {
+				blk = off / VERS_BLOCK_SIZE;
+				if (covered[blk / 8] & (1 << (blk % 8))) {
+					off = (blk + 1) * VERS_BLOCK_SIZE;
+					continue;
+				}
+				start = off;
+				while (off < end &&
+				       !(covered[off / VERS_BLOCK_SIZE / 8] &
+					 (1 << (off / VERS_BLOCK_SIZE % 8)))) {
+					blk = off / VERS_BLOCK_SIZE;
+					covered[blk / 8] |= 1 << (blk % 8);
+					off = (blk + 1) * VERS_BLOCK_SIZE;
+				}
+				if (off > end)
+					off = end;
+				res = vers_gc_add(&d, start, f,
+						  pos + (start - extent.offset),
+						  off - start);
+			}
+			pos += extent.length;
+		}
+	}
+	free(covered);
+
+	if (res == 0) {
+		d.header.prev_size = size;
+		d.header.size = headers[n].size;
+		res = vers_pwrite(d.fd, &d.header, sizeof(d.header), 0);
+	}
+	if (res == 0 && vers_compress)
+		vers_delta_compress(&d, gc_path);
+	if (d.fd != -1)
+		close(d.fd);
+	return res;
+}
+
+/*
+ * Fold them, where run[full] is the oldest snapshot among them, into a
+ * snapshot of the version before them all: a copy of that snapshot, with the
+ * deltas in between undone.  One in chunks is put together in a temporary
+ * file and cut into chunks again.
+ */
+static int vers_gc_fold_snapshot(struct vers_file *base,
+				 struct vers_file *run, int full,
+				 struct vers_delta_header *headers, int n,
+				 const char *gc_path)
+{
+	struct vers_delta_header header = headers[full + 1];
+	int chunked = memcmp(header.magic, VERS_CHUNK_MAGIC,
+			     sizeof(header.magic)) == 0;
+	off_t size = vers_file_size(&run[full]);
+	off_t data = chunked ? 0 : VERS_FULL_DATA;
+	struct vers_delta d;
+	FILE *tmp = NULL;
+	int fd;
+	int i;
+	int res;
+
+	if (chunked) {
+		tmp = tmpfile();
+		fd = tmp != NULL ? fileno(tmp) : -1;
+	} else {
+		fd = openat(storage_fd, gc_path, O_RDWR | O_CREAT | O_TRUNC,
+			    0644);
+	}
+	if (fd == -1)
+		return -errno;
+
+	if (chunked) {
+		res = vers_chunks_copy(&run[full], &header, fd, 0);
+		vers_gc_pace(header.prev_size);
+	} else {
+		res = size < 0 ? size : vers_gc_copy(&run[full], 0, fd, 0,
+						     size);
+	}
+	for (i = full - 1; i >= -1 && res == 0; i--) {
+		struct vers_file *f = i < 0 ? base : &run[i];
+		res = vers_undo(f, fd, data);
+		vers_gc_pace(vers_file_size(f));
+	}
+
+	if (chunked) {
+		if (res == 0)
+			res = vers_chunks_create(&d, gc_path, fd,
+						 headers[0].prev_size);
+		vers_gc_pace(headers[0].prev_size);
+		fclose(tmp);
+		if (res < 0)
+			return res;
+		header = d.header;
+		fd = d.fd;
+	}
+	header.prev_size = headers[0].prev_size;
+	header.size = headers[n].size;
+	if (res == 0)
+		res = vers_pwrite(fd, &header, sizeof(header), 0);
+	close(fd);
+	return res;
+}
+
+/*
+ * Drop the versions of run[0..n) (oldest first), folding them into base,
+ * the file of the version before them
+ */
+static void vers_gc_fold(const char *path, struct vers_gc_version *base,
+			 struct vers_gc_version *run, int n)
+{
+	struct vers_delta_header *headers = NULL;
+	struct timespec times[2];
+	char version_path[VERS_PATH_SIZE(path)];
+	char store_path[VERS_PATH_SIZE(path)];
+	char gc_path[VERS_PATH_SIZE(path)];
+	struct vers_file *files;
+	int opened = -2;		// the last one open; base is -1
+	int full = n;			// the oldest snapshot, -1 for base
+	int swap = 0;
+	int i;
+	int res = -ENOMEM;
+
+	files = malloc((n + 1) * sizeof(*files));
+	headers = malloc((n + 1) * sizeof(*headers));
+	if (files == NULL || headers == NULL)
+		goto out;
+
+	// files[0] and headers[0] are those of base
+	for (i = -1; i < n; i++) {
+		struct vers_gc_version *v = i < 0 ? base : &run[i];
+		vers_version_path(version_path, sizeof(version_path), path,
+				  v->number);
+		res = vers_file_open(&files[i + 1], version_path, v->number);
+		if (res < 0)
+			goto out;
+		opened = i;
+		res = fstat(files[i + 1].fd, &v->st) == -1 ? -errno : 0;
+		if (res < 0)
+			goto out;
+		res = vers_read_header(&files[i + 1], &headers[i + 1]);
+		if (res < 0)
+			goto out;	// left alone in the old format
+		if (res >= 1 && full == n)
+			full = i;
+	}
+
+	vers_store_path(gc_path, sizeof(gc_path), path, VERS_GC_NAME);
+	if (full < 0) {
+		res = 0;		// base is a snapshot, and stays as it is
+	} else {
+		if (full < n)
+			res = vers_gc_fold_snapshot(&files[0], &files[1], full,
+						    headers, n, gc_path);
+		else
+			res = vers_gc_fold_deltas(&files[0], &files[1], n,
+						  headers, gc_path);
+		swap = 1;
+
+		// Version times are those of their files, so keep base's
+		times[0] = base->st.st_atim;
+		times[1] = base->st.st_mtim;
+		if (res == 0 && utimensat(storage_fd, gc_path, times, 0) == -1)
+			res = -errno;
+		if (res == 0)
+			res = vers_sync_data(gc_path);
+	}
+
+	if (res == 0) {
+		pthread_mutex_lock(&vers_gc_lock);
+		for (i = -1; i < n && res == 0; i++)
+			if (!vers_gc_same(path, i < 0 ? base : &run[i]))
+				res = -ESTALE;
+		if (res == 0 && swap) {
+			vers_version_path(version_path, sizeof(version_path),
+					  path, base->number);
+			if (renameat(storage_fd, gc_path, storage_fd,
+				     version_path) == -1)
+				res = -errno;
+
+			// What replaced base is there for good before what
+			// it replaces goes
+			vers_store_path(store_path, sizeof(store_path), path,
+					NULL);
+			if (res == 0)
+				res = vers_sync_path(store_path);
+		}
+		for (i = 0; i < n && res == 0; i++)
+			vers_gc_unlink(path, &run[i]);
+		pthread_mutex_unlock(&vers_gc_lock);
+	}
+	if (res == 0 && swap)
+		vers_journal_update(path, base->number, 0);
+	for (i = 0; i < n && res == 0; i++)
+		vers_journal_update(path, run[i].number, 1);
+	if (res == 0) {
+		vers_store_path(store_path, sizeof(store_path), path, NULL);
+		vers_sync_queue(store_path);
+	}
+	if (res < 0 && swap)
+		vers_version_unlink(storage_fd, gc_path);
+	if (res < 0 && res != -ESTALE)
+		TRACE(TRACE_ERROR, "Could not drop versions of %s: %s", path,
+		      strerror(-res));
+
+out:
+	for (i = -1; i <= opened; i++)
+		vers_file_close(&files[i + 1]);
+	free(files);
+	free(headers);
+}
+
+/*
+ * Look at the files of versions first..last (a batch of them at once) into
+ * v, in order, and return how many of them there are, for a store without a
+ * journal
+ */
+static int vers_gc_stat(const char *path, int first, int last,
+			struct vers_gc_version *v)
+{
+	const int batch = vers_batch(path);
+	char version_path[batch][VERS_PATH_SIZE(path)];
+	struct stat st[URING_BATCH];
+	struct uring_batch b;
+	int i, n = 0;
+
+	uring_begin(&b);
+	for (i = 0; i < batch && first + i <= last; i++) {
+		vers_version_path(version_path[i], sizeof(version_path[i]),
+				  path, first + i);
+		uring_fstatat(&b, storage_fd, version_path[i], &st[i], 0);
+	}
+	uring_submit(&b);
+	for (i = 0; i < b.n; i++) {
+		if (b.res[i] == 0) {
+			v[n].st = st[i];
+			v[n].number = first + i;
+			n++;
+		}
+	}
+	return n;
+}
+
+// Apply the retention rules to one file
+static void vers_gc_file(const char *path)
+{
+	struct vers_gc_version *v;
+	struct vers_file f;
+	struct vers_delta_header header;
+	struct vers_journal jn;
+	char version_path[VERS_PATH_SIZE(path)];
+	int latest = vers_latest(path);
+	int n = 0;
+	int i, j;
+	size_t k;
+
+	if (latest <= 1)
+		return;
+	v = malloc(latest * sizeof(*v));
+	if (v == NULL)
+		return;
+
+	// The journal has the times the rules go by
+	if (vers_journal_map(path, &jn) == 0) {
+		for (k = 0; k < jn.n && jn.r[k].number <= (uint32_t) latest;
+		     k++) {
+			if (jn.r[k].flags & VERS_RECORD_DROPPED)
+				continue;
+			memset(&v[n].st, 0, sizeof(v[n].st));
+			v[n].st.st_mtim.tv_sec = jn.r[k].time / 1000000000;
+			v[n].st.st_mtim.tv_nsec = jn.r[k].time % 1000000000;
+			v[n].number = jn.r[k].number;
+			n++;
+		}
+		vers_journal_unmap(&jn);
+	} else {
+		for (i = 1; i <= latest; i += vers_batch(path))
+			n += vers_gc_stat(path, i, latest, &v[n]);
+	}
+	vers_gc_mark(v, n);
+	if (n > 0)
+		v[n - 1].keep = 1;	// the version before the head
+
+	// From the oldest end the files simply go, unless they hold a
+	// version in full the old way
+	for (i = 0; i < n && !v[i].keep; i++) {
+		vers_version_path(version_path, sizeof(version_path), path,
+				  v[i].number);
+		if (vers_file_open(&f, version_path, v[i].number) < 0)
+			break;
+		j = vers_read_header(&f, &header);
+		if (fstat(f.fd, &v[i].st) == -1)
+			j = -1;
+		vers_file_close(&f);
+		if (j < 0)
+			break;
+		pthread_mutex_lock(&vers_gc_lock);
+		j = vers_gc_same(path, &v[i]);
+		if (j)
+			vers_gc_unlink(path, &v[i]);
+		pthread_mutex_unlock(&vers_gc_lock);
+		if (j)
+			vers_journal_update(path, v[i].number, 1);
+	}
+	if (i > 0) {
+		vers_store_path(version_path, sizeof(version_path), path, NULL);
+		vers_sync_queue(version_path);
+	}
+	while (i < n && !v[i].keep)
+		i++;
+
+	// Past the first version kept, each run of dropped ones is folded
+	// into the one before it
+	for (; i < n; i = j) {
+		for (j = i + 1; j < n && !v[j].keep; j++)
+			;
+		if (j > i + 1)
+			vers_gc_fold(path, &v[i], &v[i + 1], j - i - 1);
+	}
+	free(v);
+	vers_journal_compact(path);
+}
+
+// Call fn for every file with versions in dir and below
+static void vers_walk(const char *dir, void (*fn)(const char *path))
+{
+	char store_path[VERS_CHILD_SIZE(dir, strlen(VERS_STORE_NAME))];
+	struct dirent *de;
+	struct stat st;
+	mode_t mode;
+	DIR *dp;
+
+	// The files that have versions are those with a store
+	vers_child_path(store_path, dir, VERS_STORE_NAME,
+			strlen(VERS_STORE_NAME));
+	dp = vers_opendir(store_path);
+	if (dp != NULL) {
+		while ((de = readdir(dp)) != NULL) {
+			char path[VERS_CHILD_SIZE(dir, strlen(de->d_name))];
+
+			// The chunks' store is no file's
+			if (vers_dots(de->d_name) ||
+			    strcmp(de->d_name, VERS_STORE_NAME) == 0)
+				continue;
+			vers_child_path(path, dir, de->d_name,
+					strlen(de->d_name));
+			fn(path);
+		}
+		closedir(dp);
+	}
+
+	dp = vers_opendir(dir);
+	if (dp == NULL)
+		return;
+	while ((de = readdir(dp)) != NULL) {
+		char path[VERS_CHILD_SIZE(dir, strlen(de->d_name))];
+
+		if (vers_dots(de->d_name) ||
+		    strcmp(de->d_name, VERS_STORE_NAME) == 0)
+			continue;
+		vers_child_path(path, dir, de->d_name, strlen(de->d_name));
+		// d_type is the file type bits of st_mode, shifted down;
+		// some file systems leave it unknown
+		mode = de->d_type << 12;
+		if (mode == 0 &&
+		    fstatat(storage_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			mode = st.st_mode;
+		if (S_ISDIR(mode))
+			vers_walk(path, fn);
+	}
+	closedir(dp);
+}
+
+// Compact the packs of chunks that have enough garbage, at the pace set
+static void vers_gc_chunks(void)
+{
+	off_t freed;
+
+	while ((freed = chunk_compact(vers_gc_pace)) > 0)
+		;
+	if (freed < 0)
+		TRACE(TRACE_ERROR, "Could not compact the chunks: %s",
+		      strerror(-freed));
+}
+
+static void *vers_gc_thread(void *unused)
+{
+	(void) unused;
+	for (;;) {
+		if (vers_retention)
+			vers_walk(".", vers_gc_file);
+		vers_gc_chunks();
+		sleep(vers_gc_every);
+	}
+	return NULL;
+}
+
+
+// The read-only tree of versions, /.versions (see below)
+static int vers_in_view(const char *path);
+static int vers_view_open(const char *path, struct fuse_file_info *fi);
+
+static int vers_unlink(const char *path)
+{
+	/*
+	* NOTE: for my implementation of unlink, I assume the user
+	* wants to just delete all the versions when they rm a file
+	* ... I think this is closest to how Unix-based systems handle 
+	* rm - there's no trash can or undo button.
+	*/ 
+
+	struct stat st;
+	int res;
+
+	if (vers_in_view(path))
+		return -EROFS;
+	path = storage_rel(path);
+
+	res = fstatat(storage_fd, path, &st, AT_SYMLINK_NOFOLLOW);
+	if (res == 0)
+		res = unlinkat(storage_fd, path, 0); // unlink original path
+
+	if (res == -1)
+		return -errno;
+
+	// and every version with it
+	vers_store_move(path, NULL, &st);
+	vers_forget(path);
+
+	attr_cache_invalidate_entry(path);
+
+	return 0;
+}
+
+static int vers_rmdir(const char *path)
+{
+	char store_path[VERS_PATH_SIZE(path)];
+	int res;
+
+	if (vers_in_view(path))
+		return -EROFS;
+	path = storage_rel(path);
+
+	// The stores of the files that were in it went with them
+	sprintf(store_path, "%s/" VERS_STORE_NAME, path);
+	unlinkat(storage_fd, store_path, AT_REMOVEDIR);
+
+	res = unlinkat(storage_fd, path, AT_REMOVEDIR);
+	if (res == -1)
+		return -errno;
+
+	attr_cache_invalidate_entry(path);
+
+	return 0;
+}
+
+static int vers_rename(const char *from, const char *to)
+{
+	int res;
+	char store_path[VERS_PATH_SIZE(to)];
+	struct stat st_from, st_to;
+	int exists, replaced;
+
+	if (core_is_hidden(to))
+		return -EPERM;
+	if (vers_in_view(from) || vers_in_view(to))
+		return -EROFS;
+	from = storage_rel(from);
+	to   = storage_rel(to);
+
+	if (fstatat(storage_fd, from, &st_from, AT_SYMLINK_NOFOLLOW) == -1)
+		return -errno;
+	exists = fstatat(storage_fd, to, &st_to, AT_SYMLINK_NOFOLLOW) == 0;
+	replaced = exists && (st_from.st_dev != st_to.st_dev ||
+			      st_from.st_ino != st_to.st_ino);
+
+	// An empty directory being replaced may still hold an empty .versfs
+	if (replaced && S_ISDIR(st_to.st_mode)) {
+		sprintf(store_path, "%s/" VERS_STORE_NAME, to);
+		unlinkat(storage_fd, store_path, AT_REMOVEDIR);
+	}
+
+	res = renameat(storage_fd, from, storage_fd, to);
+	if (res == -1)
+		return -errno;
+	if (exists && !replaced)
+		return 0;	// two links to one file: nothing moved
+
+	// Directories carry their files' versions along with them
+	if (S_ISDIR(st_from.st_mode)) {
+		vers_sessions_move(from, to);
+		vers_move(from, to);
+		attr_cache_invalidate_all();
+		return 0;
+	}
+	attr_cache_invalidate_entry(from);
+	attr_cache_invalidate_entry(to);
+
+	// A file that was replaced is gone, versions and all, and whatever
+	// is being written to the one renamed follows it
+	if (replaced)
+		vers_store_move(to, NULL, &st_to);
+	vers_store_move(from, to, &st_from);
+	vers_move(from, to);
+
+	return 0;
+}
+
+static int vers_truncate(const char *path, off_t size)
+{
+	/*
+	 * NOTE: Opening a file with O_TRUNC and writing to it creates TWO
+	 * versions: one for the truncate and one for the write.
+	 *
+	 * This shouldn't be a problem so I left it as-is
+	 */
+
+	struct vers_session *s;
+	int fd;
+	int res;
+
+	if (vers_in_view(path))
+		return -EROFS;
+	path = storage_rel(path);
+
+	fd = openat(storage_fd, path, O_RDWR);
+	if (fd == -1)
+		return -errno;
+
+	// Truncating a file nobody has open is a session of its own
+	s = vers_session_get(path, fd);
+	if (s == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	// Save what the truncate cuts off, then cut it
+	pthread_mutex_lock(vers_file_lock(s->dev, s->ino));
+	res = vers_session_save(s, fd, size, s->prev_size, NULL);
+	if (res == 0 && ftruncate(fd, size) == -1)
+		res = -errno;
+	attr_cache_invalidate(path);
+	pthread_mutex_unlock(vers_file_lock(s->dev, s->ino));
+
+	if (vers_session_put(s, fd) < 0 && res == 0)
+		res = -EIO;
+	close(fd);
+	return res;
+}
+
+/*
+ * Open files
+ *
+ * Each open file handle keeps a descriptor on the head, which reads are
+ * served from directly.  Writes need to see what they overwrite, so the head
+ * is opened for reading as well whenever that is allowed.
+ */
+
+struct vers_handle {
+	int fd;			// the head (base file)
+	struct vers_session *session;	// NULL if opened read-only
+};
+
+static struct vers_handle *vers_fh(struct fuse_file_info *fi)
+{
+	return (struct vers_handle *) (uintptr_t) fi->fh;
+}
+
+static int vers_open(const char *path, struct fuse_file_info *fi)
+{
+	struct vers_handle *h;
+	int flags = fi->flags & ~O_TRUNC;	// truncation must be recorded
+	int res;
+
+	if (vers_in_view(path))
+		return vers_view_open(path, fi);
+	path = storage_rel(path);
+
+	res = -1;
+	if ((flags & O_ACCMODE) == O_WRONLY)
+		res = openat(storage_fd, path, (flags & ~O_ACCMODE) | O_RDWR);
+	if (res == -1)
+		res = openat(storage_fd, path, flags);
+	if (res == -1)
+		return -errno;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		close(res);
+		return -ENOMEM;
+	}
+	h->fd = res;
+	h->session = NULL;
+
+	// Reads are served straight from the head, usually front to back, so
+	// let the kernel read further ahead of us than it would by default
+	posix_fadvise(h->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		h->session = vers_session_get(path, h->fd);
+		if (h->session == NULL) {
+			close(h->fd);
+			free(h);
+			return -ENOMEM;
+		}
+	}
+
+	fi->fh = (uintptr_t) h;
+
+	return 0;
+}
+
+static int vers_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	struct vers_handle *h = vers_fh(fi);
+	int res;
+
+	(void) path;
+
+	// The newest version is always the head itself, read in place at the
+	// offset asked for
+	res = core_pread(h->fd, buf, size, offset);
+
+	return res;
+}
+
+/*
+ * The head is stored unchanged, so rather than copying through a buffer of
+ * our own, hand FUSE the descriptor and let it splice straight from the
+ * storage file to /dev/fuse.
+ */
+static int vers_read_buf(const char *path, struct fuse_bufvec **bufp,
+			 size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+
+	(void) path;
+
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = vers_fh(fi)->fd;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+	return 0;
+}
+
+static int vers_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	// Write into the head, first saving what it overwrites into the
+	// session's next version
+	// Versions are kept of the head as stored, i.e. after the layers below
+	struct vers_handle *h = vers_fh(fi);
+	struct vers_session *s = h->session;
+	const char *data;
+	char *copy;
+	int res;
+
+	if (s == NULL)
+		return -EBADF;
+
+	data = core_encode_copy(buf, size, offset, &copy);
+	if (data == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(vers_file_lock(s->dev, s->ino));
+	res = vers_session_save(s, h->fd, offset, offset + size, data);
+	if (res == 0) {
+		res = pwrite(h->fd, data, size, offset);
+		if (res == -1) {
+			res = -errno;
+		} else {
+			s->written += res;
+			if (vers_session_check(s, h->fd) < 0)
+				res = -EIO;
+		}
+	}
+	pthread_mutex_unlock(vers_file_lock(s->dev, s->ino));
+
+	bufpool_put(copy);
+	if (res > 0)
+		invalidate_attrs(path);
+	return res;
+}
+
+// Like vers_write, but splicing the data from /dev/fuse into the head
+static int vers_write_buf(const char *path, struct fuse_bufvec *buf,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	struct fuse_bufvec mem = FUSE_BUFVEC_INIT(0);
+	struct vers_handle *h = vers_fh(fi);
+	struct vers_session *s = h->session;
+	char *data = NULL;
+	char *copy = NULL;
+	int res;
+
+	if (s == NULL)
+		return -EBADF;
+
+	if (core_layered()) {
+		// The layers need the data in memory, to encode it there
+		res = core_encode_bufvec(buf, offset, &data, &copy);
+		if (res < 0)
+			return res;
+		mem.buf[0].size = res;
+		mem.buf[0].mem = data;
+		buf = &mem;
+		dst.buf[0].size = res;
+	} else if (buf->count == 1 && buf->off == 0 &&
+		   !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		// Unchanged blocks can only be spotted if the data is in memory
+		data = buf->buf[0].mem;
+	}
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = h->fd;
+	dst.buf[0].pos = offset;
+
+	pthread_mutex_lock(vers_file_lock(s->dev, s->ino));
+	res = vers_session_save(s, h->fd, offset, offset + dst.buf[0].size,
+				data);
+	if (res == 0)
+		res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (res > 0) {
+		s->written += res;
+		if (vers_session_check(s, h->fd) < 0)
+			res = -EIO;
+	}
+	pthread_mutex_unlock(vers_file_lock(s->dev, s->ino));
+
+	bufpool_put(copy);
+	if (res > 0)
+		invalidate_attrs(path);
+	return res;
+}
+
+static int vers_release(const char *path, struct fuse_file_info *fi)
+{
+	struct vers_handle *h = vers_fh(fi);
+
+	(void) path;
+	// The last writer to close the file commits its version
+	if (h->session != NULL)
+		vers_session_put(h->session, h->fd);
+	close(h->fd);
+	free(h);
+	return 0;
+}
+
+static int vers_fsync(const char *path, int isdatasync,
+		     struct fuse_file_info *fi)
+{
+	struct vers_handle *h = vers_fh(fi);
+	struct vers_session *s = h->session;
+	int res;
+
+	(void) path;
+
+	// Anything fsync()ed is kept as a version of its own
+	if (s != NULL) {
+		pthread_mutex_lock(vers_file_lock(s->dev, s->ino));
+		res = vers_session_commit(s, h->fd);
+		pthread_mutex_unlock(vers_file_lock(s->dev, s->ino));
+		if (res < 0)
+			return res;
+		vers_sync_wait();
+	}
+
+	if (isdatasync)
+		res = fdatasync(h->fd);
+	else
+		res = fsync(h->fd);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static int vers_fallocate(const char *path, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	struct vers_handle *h = vers_fh(fi);
+	int res;
+
+	if (mode)
+		return -EOPNOTSUPP;
+
+	res = -posix_fallocate(h->fd, offset, length);
+	if (res == 0)
+		invalidate_attrs(path);
 	return res;
 }
+#endif
+
+
+/*
+ * Browsing versions
+ *
+ * /.versions in the mount is a read-only tree of every older version there
+ * is: /.versions/<path>/<N> is version N of the file at <path>, as versfs
+ * --cat would rebuild it, so history can be looked at and diffed in place.
+ * Directories show up in it as themselves and files as directories of
+ * their versions.  Like /.smartfs, it is left out of the root's listing,
+ * and anything of that name at the top of the storage directory is hidden
+ * behind it.
+ *
+ * Nothing is copied until a version is opened.  It is then rebuilt, with
+ * the file's lock held so that no commit changes it underneath, into a
+ * temporary file that the reads are served from and that goes when it is
+ * closed.  Which versions there are, their sizes and their times (when they
+ * were replaced) come from the file's journal; the owner and the mode are
+ * the file's, less the write bits.
+ *
+ * /.versions/<path>/@<time> is a symbolic link to the version there was at
+ * that time (the next one kept if that was dropped), or to the file itself
+ * if it has not changed since: <time> is seconds since the epoch, or local
+ * time as YYYY-MM-DD[THH:MM[:SS]].  The version is found by a binary search
+ * of the journal, so these are never listed but can be asked for at will.
+ */
+
+#define VERS_VIEW_DIR "/.versions"
+
+enum vers_view_kind {
+	VERS_VIEW_NONE,		// not in /.versions
+	VERS_VIEW_TREE,		// a directory
+	VERS_VIEW_FILE,		// a file, as a directory of its versions
+	VERS_VIEW_VERSION,	// one version of a file
+	VERS_VIEW_LINK,		// the version of a file there was at a time
+};
+
+// Room for where a link in the versions of the file at rel points
+#define VERS_VIEW_TARGET_SIZE(rel) (3 * strlen(rel) + 8)
+
+static int vers_in_view(const char *path)
+{
+	return strncmp(path, VERS_VIEW_DIR, sizeof(VERS_VIEW_DIR) - 1) == 0 &&
+	       (path[sizeof(VERS_VIEW_DIR) - 1] == '\0' ||
+		path[sizeof(VERS_VIEW_DIR) - 1] == '/');
+}
+
+// Parse the <time> of an @<time> link
+static int vers_view_time(const char *arg, time_t *t)
+{
+	static const char *formats[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d",
+	};
+	const char *end;
+	struct tm tm;
+	size_t i;
+
+	if (arg[0] != '\0' && strspn(arg, "0123456789") == strlen(arg) &&
+	    strlen(arg) <= 11) {
+		*t = (time_t) strtoll(arg, NULL, 10);
+		return 0;
+	}
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(arg, formats[i], &tm);
+		if (end != NULL && *end == '\0') {
+			tm.tm_isdst = -1;
+			*t = mktime(&tm);
+			return *t == (time_t) -1 ? -EINVAL : 0;
+		}
+	}
+	return -EINVAL;
+}
 
-static int vers_removexattr(const char *path, const char *name)
+// The version of the file at path there was at t, or -1 for the head
+static int vers_view_at(const char *path, time_t t)
 {
-	path = prepend_storage_dir(storage_path, path);
-	int res = lremovexattr(path, name);
-	if (res == -1)
+	const struct vers_record *r;
+	struct vers_journal j;
+	int latest = vers_latest(path);
+	int version = -1;
+
+	if (latest > 0 && vers_journal_map(path, &j) == 0) {
+		r = vers_journal_at(&j, (int64_t) t * 1000000000);
+		if (r != NULL && r->number <= (uint32_t) latest)
+			version = r->number - 1;
+		vers_journal_unmap(&j);
+	}
+	return version;
+}
+
+/*
+ * What the mount path path is in /.versions (VERS_VIEW_NONE if it is not in
+ * it), or -errno.  rel, of at least strlen(path) + 1 bytes, gets the
+ * storage path of the directory or file, *version the version (-1 for a
+ * link to the head) and st the attributes of rel.
+ */
+static int vers_view_find(const char *path, char *rel, int *version,
+			  struct stat *st)
+{
+	const char *sub = path + sizeof(VERS_VIEW_DIR) - 1;
+	int kind = VERS_VIEW_VERSION;
+	time_t t = 0;
+	char *name;
+
+	if (!vers_in_view(path))
+		return VERS_VIEW_NONE;
+	if (core_is_hidden(sub))
+		return -ENOENT;
+	strcpy(rel, storage_rel(sub));
+	if (fstatat(storage_fd, rel, st, AT_SYMLINK_NOFOLLOW) == 0) {
+		if (S_ISDIR(st->st_mode))
+			return VERS_VIEW_TREE;
+		return S_ISREG(st->st_mode) ? VERS_VIEW_FILE : -ENOENT;
+	}
+	if (errno != ENOTDIR)
+		return -errno;
+
+	// Below a file: one of its versions, or the one at a time
+	name = strrchr(rel, '/');
+	if (name == NULL)
+		return -ENOENT;
+	if (name[1] == '@') {
+		if (vers_view_time(name + 2, &t) < 0)
+			return -ENOENT;
+		kind = VERS_VIEW_LINK;
+	} else if (name[1] == '\0' ||
+		   strspn(name + 1, "0123456789") != strlen(name + 1) ||
+		   strlen(name + 1) > 9) {
+		return -ENOENT;
+	}
+	*version = atoi(name + 1);
+	*name = '\0';
+	if (fstatat(storage_fd, rel, st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    !S_ISREG(st->st_mode))
+		return -ENOENT;
+	if (kind == VERS_VIEW_LINK) {
+		*version = vers_view_at(rel, t);
+		return kind;
+	}
+	// The newest is the file itself
+	return *version < vers_latest(rel) ? VERS_VIEW_VERSION : -ENOENT;
+}
+
+// Where the link for version (-1 for the head) of the file at rel points
+static void vers_view_target(char *buf, size_t bufsize, const char *rel,
+			     int version)
+{
+	const char *p;
+
+	if (version >= 0) {
+		snprintf(buf, bufsize, "%d", version);
+		return;
+	}
+
+	// Up from /.versions/<rel> to the top, and down to the file
+	buf[0] = '\0';
+	strcat(buf, "../../");
+	for (p = strchr(rel, '/'); p != NULL; p = strchr(p + 1, '/'))
+		strcat(buf, "../");
+	strcat(buf, rel);
+}
+
+/*
+ * Rebuilds version of the file at path (whose attributes are st) into a
+ * temporary file: its descriptor, or -errno
+ */
+static int vers_view_build(const char *path, int version,
+			   const struct stat *st)
+{
+	pthread_mutex_t *lock = vers_file_lock(st->st_dev, st->st_ino);
+	FILE *tmp = tmpfile();
+	int fd, res;
+
+	if (tmp == NULL)
+		return -errno;
+	pthread_mutex_lock(lock);
+	res = vers_materialize(path, version, fileno(tmp));
+
+	// The retention thread may have folded the versions it was reading
+	// into an older one, which holds them all
+	if (res == -ENOENT && ftruncate(fileno(tmp), 0) == 0)
+		res = vers_materialize(path, version, fileno(tmp));
+	pthread_mutex_unlock(lock);
+
+	fd = res == 0 ? dup(fileno(tmp)) : -1;
+	if (res == 0 && fd == -1)
+		res = -errno;
+	fclose(tmp);
+	return res < 0 ? res : fd;
+}
+
+// The attributes of version of the file at path, whose own are st
+static int vers_view_version_stat(const char *path, int version,
+				  struct stat *st)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	struct vers_delta_header header;
+	const struct vers_record *r;
+	struct vers_journal j;
+	struct vers_file f;
+	struct stat vst;
+	off_t size = -1;
+	int fd, res;
+
+	if (vers_journal_map(path, &j) == 0) {
+		r = vers_journal_find(&j, version + 1);
+		if (r != NULL && !(r->flags & VERS_RECORD_DROPPED) &&
+		    r->size != VERS_SIZE_UNKNOWN) {
+			size = r->size;
+			vst.st_mtim.tv_sec = r->time / 1000000000;
+			vst.st_mtim.tv_nsec = r->time % 1000000000;
+			vst.st_atim = vst.st_mtim;
+		}
+		vers_journal_unmap(&j);
+	}
+
+	// Else version files but those from before the headers give it up
+	// front
+	vers_version_path(version_path, sizeof(version_path), path,
+			  version + 1);
+	if (size < 0 && fstatat(storage_fd, version_path, &vst, 0) == -1)
 		return -errno;
+	if (size < 0) {
+		res = vers_file_open(&f, version_path, version + 1);
+		if (res < 0)
+			return res;
+		if (vers_read_header(&f, &header) >= 0)
+			size = header.prev_size;
+		vers_file_close(&f);
+	}
+	if (size < 0) {
+		fd = vers_view_build(path, version, st);
+		if (fd < 0)
+			return fd;
+		size = lseek(fd, 0, SEEK_END);
+		close(fd);
+	}
+
+	st->st_mode = S_IFREG | (st->st_mode & 0444);
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blocks = (size + 511) / 512;
+	st->st_atim = vst.st_atim;
+	st->st_mtim = vst.st_mtim;
+	st->st_ctim = vst.st_mtim;
 	return 0;
 }
-#endif /* HAVE_SETXATTR */
-
-static struct fuse_operations vers_oper = {
-	.getattr	= vers_getattr,
-	.access		= vers_access,
-	.readlink	= vers_readlink,
-	.readdir	= vers_readdir,
-	.mknod		= vers_mknod,
-	.mkdir		= vers_mkdir,
-	.symlink	= vers_symlink,
-	.unlink		= vers_unlink,
-	.rmdir		= vers_rmdir,
-	.rename		= vers_rename,
-	.link		= vers_link,
-	.chmod		= vers_chmod,
-	.chown		= vers_chown,
-	.truncate	= vers_truncate,
-#ifdef HAVE_UTIMENSAT
-	.utimens	= vers_utimens,
-#endif
-	.open		= vers_open,
-	.read		= vers_read,
-	.write		= vers_write,
-	.statfs		= vers_statfs,
-	.release	= vers_release,
-	.fsync		= vers_fsync,
-#ifdef HAVE_POSIX_FALLOCATE
-	.fallocate	= vers_fallocate,
-#endif
-#ifdef HAVE_SETXATTR
-	.setxattr	= vers_setxattr,
-	.getxattr	= vers_getxattr,
-	.listxattr	= vers_listxattr,
-	.removexattr	= vers_removexattr,
-#endif
+
+static int vers_view_getattr(const char *path, struct stat *st)
+{
+	char rel[strlen(path) + 1];
+	char target[VERS_VIEW_TARGET_SIZE(path)];
+	int version;
+	int kind = vers_view_find(path, rel, &version, st);
+
+	switch (kind) {
+	case VERS_VIEW_TREE:
+		st->st_mode &= ~0222;
+		return 0;
+	case VERS_VIEW_FILE:
+		// Whoever can read the file can list its versions
+		st->st_mode = S_IFDIR | (st->st_mode & 0444) |
+			      ((st->st_mode & 0444) >> 2);
+		st->st_nlink = 2;
+		return 0;
+	case VERS_VIEW_VERSION:
+		return vers_view_version_stat(rel, version, st);
+	case VERS_VIEW_LINK:
+		vers_view_target(target, sizeof(target), rel, version);
+		st->st_mode = S_IFLNK | 0777;
+		st->st_nlink = 1;
+		st->st_size = strlen(target);
+		st->st_blocks = 0;
+		return 0;
+	}
+	return kind;
+}
+
+static int vers_view_readlink(const char *path, char *buf, size_t size)
+{
+	char rel[strlen(path) + 1];
+	char target[VERS_VIEW_TARGET_SIZE(path)];
+	struct stat st;
+	int version;
+	int kind = vers_view_find(path, rel, &version, &st);
+
+	if (kind < 0)
+		return kind;
+	if (kind != VERS_VIEW_LINK)
+		return -EINVAL;
+	vers_view_target(target, sizeof(target), rel, version);
+	strncpy(buf, target, size - 1);
+	buf[size - 1] = '\0';
+	return 0;
+}
+
+static int vers_view_readdir(const char *path, void *buf,
+			     fuse_fill_dir_t filler)
+{
+	char rel[strlen(path) + 1];
+	char store_path[VERS_PATH_SIZE(path)];
+	char name[16];
+	struct vers_journal j;
+	struct dirent *de;
+	struct stat st;
+	mode_t mode;
+	int version, latest;
+	int kind = vers_view_find(path, rel, &version, &st);
+	size_t i;
+	DIR *dp;
+
+	if (kind == VERS_VIEW_VERSION || kind == VERS_VIEW_LINK)
+		return -ENOTDIR;
+	if (kind < 0)
+		return kind;
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+
+	if (kind == VERS_VIEW_TREE) {
+		dp = vers_opendir(rel);
+		if (dp == NULL)
+			return -errno;
+		while ((de = readdir(dp)) != NULL) {
+			if (vers_dots(de->d_name) ||
+			    strcmp(de->d_name, VERS_STORE_NAME) == 0)
+				continue;
+			mode = de->d_type << 12;	// as in vers_walk()
+			if (mode == 0 &&
+			    fstatat(dirfd(dp), de->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) == 0)
+				mode = st.st_mode;
+			if ((S_ISDIR(mode) || S_ISREG(mode)) &&
+			    filler(buf, de->d_name, NULL, 0))
+				break;
+		}
+		closedir(dp);
+		return 0;
+	}
+
+	// File N holds version N-1
+	latest = vers_latest(rel);
+	if (latest <= 0)
+		return 0;
+	if (vers_journal_map(rel, &j) == 0) {
+		for (i = 0; i < j.n && j.r[i].number <= (uint32_t) latest;
+		     i++) {
+			if (j.r[i].number < 1 ||
+			    (j.r[i].flags & VERS_RECORD_DROPPED))
+				continue;
+			snprintf(name, sizeof(name), "%d", j.r[i].number - 1);
+			if (filler(buf, name, NULL, 0))
+				break;
+		}
+		vers_journal_unmap(&j);
+		return 0;
+	}
+	vers_store_path(store_path, sizeof(store_path), rel, NULL);
+	dp = vers_opendir(store_path);
+	if (dp == NULL)
+		return errno == ENOENT ? 0 : -errno;
+	while ((de = readdir(dp)) != NULL) {
+		if (strspn(de->d_name, "0123456789") != strlen(de->d_name) ||
+		    strlen(de->d_name) > 9 || atoi(de->d_name) < 1)
+			continue;
+		snprintf(name, sizeof(name), "%d", atoi(de->d_name) - 1);
+		if (filler(buf, name, NULL, 0))
+			break;
+	}
+	closedir(dp);
+	return 0;
+}
+
+static int vers_view_open(const char *path, struct fuse_file_info *fi)
+{
+	char rel[strlen(path) + 1];
+	struct vers_handle *h;
+	struct stat st;
+	int version, fd;
+	int kind = vers_view_find(path, rel, &version, &st);
+
+	if (kind < 0)
+		return kind;
+	if (kind == VERS_VIEW_LINK)
+		return -ELOOP;
+	if (kind != VERS_VIEW_VERSION)
+		return -EISDIR;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+		return -EROFS;
+
+	fd = vers_view_build(rel, version, &st);
+	if (fd < 0)
+		return fd;
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	h->fd = fd;
+	h->session = NULL;
+
+	// A version never changes, so whatever the kernel kept of it holds
+	fi->fh = (uintptr_t) h;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+/*
+ * The operations of the mount that /.versions takes over, or refuses, and
+ * passes everything else on from
+ */
+static struct fuse_operations vers_core;
+
+static int vers_getattr(const char *path, struct stat *st)
+{
+	if (vers_in_view(path))
+		return vers_view_getattr(path, st);
+	return vers_core.getattr(path, st);
+}
+
+static int vers_access(const char *path, int mask)
+{
+	struct stat st;
+	int res;
+
+	if (!vers_in_view(path))
+		return vers_core.access(path, mask);
+	res = vers_view_getattr(path, &st);
+	if (res == 0 && (mask & W_OK))
+		res = -EROFS;
+	if (res == 0 && (mask & X_OK) && !S_ISDIR(st.st_mode))
+		res = -EACCES;
+	return res;
+}
+
+static int vers_dir_open(const char *path, struct fuse_file_info *fi)
+{
+	struct stat st;
+	int res;
+
+	if (!vers_in_view(path))
+		return vers_core.opendir(path, fi);
+	res = vers_view_getattr(path, &st);
+	if (res == 0 && !S_ISDIR(st.st_mode))
+		res = -ENOTDIR;
+	fi->fh = 0;
+	return res;
+}
+
+// What the root's listing is filled through, to leave .versions out of it
+struct vers_root_fill {
+	void *buf;
+	fuse_fill_dir_t filler;
 };
 
-int main(int argc, char *argv[])
+static int vers_root_filler(void *buf, const char *name,
+			    const struct stat *st, off_t offset)
+{
+	struct vers_root_fill *f = buf;
+
+	if (strcmp(name, VERS_VIEW_DIR + 1) == 0)
+		return 0;
+	return f->filler(f->buf, name, st, offset);
+}
+
+static int vers_dir_read(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct vers_root_fill f = { buf, filler };
+
+	if (vers_in_view(path))
+		return vers_view_readdir(path, buf, filler);
+	if (strcmp(path, "/") == 0)
+		return vers_core.readdir(path, &f, vers_root_filler, offset,
+					 fi);
+	return vers_core.readdir(path, buf, filler, offset, fi);
+}
+
+static int vers_dir_release(const char *path, struct fuse_file_info *fi)
+{
+	if (vers_in_view(path))
+		return 0;
+	return vers_core.releasedir(path, fi);
+}
+
+static int vers_readlink(const char *path, char *buf, size_t size)
+{
+	if (vers_in_view(path))
+		return vers_view_readlink(path, buf, size);
+	return vers_core.readlink(path, buf, size);
+}
+
+static int vers_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.mknod(path, mode, rdev);
+}
+
+static int vers_mkdir(const char *path, mode_t mode)
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.mkdir(path, mode);
+}
+
+static int vers_symlink(const char *from, const char *to)
+{
+	if (vers_in_view(to))
+		return -EROFS;
+	return vers_core.symlink(from, to);
+}
+
+static int vers_link(const char *from, const char *to)
+{
+	if (vers_in_view(from) || vers_in_view(to))
+		return -EROFS;
+	return vers_core.link(from, to);
+}
+
+static int vers_chmod(const char *path, mode_t mode)
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.chmod(path, mode);
+}
+
+static int vers_chown(const char *path, uid_t uid, gid_t gid)
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.chown(path, uid, gid);
+}
+
+static int vers_utimens(const char *path, const struct timespec ts[2])
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.utimens(path, ts);
+}
+
+static int vers_setxattr(const char *path, const char *name,
+			 const char *value, size_t size, int flags)
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.setxattr(path, name, value, size, flags);
+}
+
+static int vers_getxattr(const char *path, const char *name, char *value,
+			 size_t size)
+{
+	if (vers_in_view(path))
+		return -ENODATA;
+	return vers_core.getxattr(path, name, value, size);
+}
+
+static int vers_listxattr(const char *path, char *list, size_t size)
+{
+	if (vers_in_view(path))
+		return 0;
+	return vers_core.listxattr(path, list, size);
+}
+
+static int vers_removexattr(const char *path, const char *name)
+{
+	if (vers_in_view(path))
+		return -EROFS;
+	return vers_core.removexattr(path, name);
+}
+
+/*
+ * Open the chunks of the storage directory the file at path is in, to read,
+ * if it has any: that is the nearest directory above it with a store of
+ * chunks in its .versfs.
+ */
+static void vers_cat_chunks(const char *path)
+{
+	char *dir = realpath(path, NULL);
+	char *slash;
+	int res;
+
+	while (dir != NULL && (slash = strrchr(dir, '/')) != NULL) {
+		char chunks_path[strlen(dir) + sizeof(VERS_CHUNKS_PATH) + 1];
+
+		*slash = '\0';
+		sprintf(chunks_path, "%s/" VERS_CHUNKS_PATH, dir);
+		if (faccessat(AT_FDCWD, chunks_path, F_OK, 0) == 0) {
+			res = chunk_store_open(AT_FDCWD, chunks_path, 0);
+			if (res < 0)
+				fprintf(stderr, "ERROR: %s: %s\n", chunks_path,
+					strerror(-res));
+			break;
+		}
+	}
+	free(dir);
+}
+
+/*
+ * "versfs --cat <storage file> <version>" writes a version of a file to
+ * stdout, rebuilding it from the head and the deltas in between.  The mount
+ * does not need to be running, and if it is, is left to be the one to write
+ * to the stores: --cat only reads them.
+ */
+static int vers_cat(const char *path, int version)
+{
+	FILE *tmp = tmpfile();
+	char *buf = malloc(VERS_COPY_CHUNK);
+	const char *name = strrchr(path, '/');
+	char dir[strlen(path) + 2];
+	off_t offset = 0;
+	ssize_t n;
+	int res;
+
+	if (tmp == NULL || buf == NULL) {
+	  fprintf(stderr, "ERROR: Out of memory or temporary space\n");
+	  return 1;
+	}
+
+	// It may not have been mounted since versions got stores
+	if (name == NULL)
+	  strcpy(dir, ".");
+	else
+	  sprintf(dir, "%.*s", (int) (name - path), path);
+	vers_store_upgrade(dir[0] != '\0' ? dir : "/",
+			   name != NULL ? name + 1 : path);
+	vers_cat_chunks(path);
+	vers_index_read_only = 1;
+
+	res = vers_materialize(path, version, fileno(tmp));
+	if (res < 0) {
+	  fprintf(stderr, "ERROR: %s version %d: %s\n", path, version,
+		  strerror(-res));
+	  return 1;
+	}
+
+	lseek(fileno(tmp), 0, SEEK_SET);
+	while ((n = read(fileno(tmp), buf, VERS_COPY_CHUNK)) > 0) {
+		// Versions are stored as the layers below left them
+		core_decode(buf, n, offset);
+		offset += n;
+		if (write(STDOUT_FILENO, buf, n) != n) {
+			n = -1;
+			break;
+		}
+	}
+
+	free(buf);
+	fclose(tmp);
+	return n == 0 ? 0 : 1;
+}
+
+/*
+ * "versfs --chunk <storage directory>" turns the versions of every file in a
+ * storage directory that is not mounted into lists of chunks, from the
+ * newest down, each rebuilt in a temporary file and cut up into the store's
+ * gc before it takes the place of its version file.  Every version then
+ * holds all of itself, and shares all it has in common with the others.
+ */
+static int vers_chunk_count = 0;	// versions turned into chunks
+static int vers_chunk_errors = 0;
+
+static void vers_chunk_file(const char *path)
+{
+	char version_path[VERS_PATH_SIZE(path)];
+	char gc_path[VERS_PATH_SIZE(path)];
+	struct vers_delta_header header;
+	struct timespec times[2];
+	struct vers_delta d;
+	struct vers_file f;
+	struct stat st, built;
+	off_t size;		// of version N, the one after
+	FILE *tmp;
+	int latest = vers_latest(path);
+	int kind, n;
+	int res;
+
+	if (latest <= 0 || fstatat(storage_fd, path, &st, 0) == -1)
+		return;
+	size = st.st_size;
+	vers_store_path(gc_path, sizeof(gc_path), path, VERS_GC_NAME);
+
+	// File N holds version N-1, which takes no more than the files after
+	for (n = latest; n >= 1; n--) {
+		vers_version_path(version_path, sizeof(version_path), path, n);
+		if (vers_file_open(&f, version_path, n) < 0)
+			continue;	// dropped by the retention rules
+		kind = vers_read_header(&f, &header);
+		res = fstat(f.fd, &st) == -1 ? -errno : 0;
+		vers_file_close(&f);
+		if (kind == 2) {
+			size = header.prev_size;
+			continue;
+		}
+
+		tmp = tmpfile();
+		if (res == 0 && tmp == NULL)
+			res = -errno;
+		if (res == 0)
+			res = vers_materialize(path, n - 1, fileno(tmp));
+		if (res == 0 && fstat(fileno(tmp), &built) == -1)
+			res = -errno;
+		if (res == 0 && (res = vers_chunks_create(&d, gc_path,
+							  fileno(tmp),
+							  built.st_size)) == 0) {
+			d.header.size = size;
+			size = built.st_size;
+			res = vers_pwrite(d.fd, &d.header, sizeof(d.header),
+					  0);
+			close(d.fd);
+
+			// Version times are those of their files
+			times[0] = st.st_atim;
+			times[1] = st.st_mtim;
+			if (res == 0 &&
+			    utimensat(storage_fd, gc_path, times, 0) == -1)
+				res = -errno;
+			if (res == 0)
+				res = vers_sync_data(gc_path);
+			if (res == 0 && renameat(storage_fd, gc_path,
+						 storage_fd, version_path) == -1)
+				res = -errno;
+			if (res < 0)
+				vers_version_unlink(storage_fd, gc_path);
+		}
+		if (tmp != NULL)
+			fclose(tmp);
+		if (res < 0) {
+			fprintf(stderr, "ERROR: %s version %d: %s\n", path,
+				n - 1, strerror(-res));
+			vers_chunk_errors++;
+			break;	// the older ones are rebuilt from this one
+		}
+		vers_journal_update(path, n, 0);
+		vers_chunk_count++;
+	}
+}
+
+static int vers_chunk_all(const char *dir)
 {
-	umask(0);
-	if (argc < 3) {
-	  fprintf(stderr, "USAGE: %s <storage directory> <mount point> [ -d | -f | -s ]\n", argv[0]);
+	off_t freed;
+	int res;
+
+	storage_dir = (char *)dir;
+	storage_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (storage_fd == -1) {
+	  fprintf(stderr, "ERROR: %s: %s\n", dir, strerror(errno));
+	  return 1;
+	}
+	vers_store_setup();
+	res = chunk_store_open(storage_fd, VERS_CHUNKS_PATH, CHUNK_WRITE |
+			       (compress_supported() ? CHUNK_COMPRESS : 0));
+	if (res < 0) {
+	  fprintf(stderr, "ERROR: %s/%s: %s\n", dir, VERS_CHUNKS_PATH,
+		  strerror(-res));
 	  return 1;
 	}
-	storage_dir = argv[1];
-	char* mount_dir = argv[2];
-	if (storage_dir[0] != '/' || mount_dir[0] != '/') {
-	  fprintf(stderr, "ERROR: Directories must be absolute paths\n");
+
+	vers_walk(".", vers_chunk_file);
+	while ((freed = chunk_compact(NULL)) > 0)
+	  ;
+	if (freed < 0)
+	  fprintf(stderr, "ERROR: Could not compact the chunks: %s\n",
+		  strerror(-freed));
+	printf("%d versions now in chunks\n", vers_chunk_count);
+	return vers_chunk_errors > 0 || freed < 0;
+}
+
+// Parse a size for -c and -k: "<n>[k|m|g]"
+static int vers_parse_size(const char *arg, off_t *size)
+{
+	char *end;
+
+	*size = strtoll(arg, &end, 10);
+	if (end == arg || *size < 0)
+		return -EINVAL;
+	if (*end == 'k' || *end == 'K')
+		*size <<= 10, end++;
+	else if (*end == 'm' || *end == 'M')
+		*size <<= 20, end++;
+	else if (*end == 'g' || *end == 'G')
+		*size <<= 30, end++;
+	return *end == '\0' ? 0 : -EINVAL;
+}
+
+// Parse a length of time for -k: "<n>[s|m|h|d|w]", in seconds by default
+static int vers_parse_time(const char *arg, time_t *t)
+{
+	char *end;
+
+	*t = strtol(arg, &end, 10);
+	if (end == arg || *t < 0)
+		return -EINVAL;
+	if (*end == 'm')
+		*t *= 60, end++;
+	else if (*end == 'h')
+		*t *= 60 * 60, end++;
+	else if (*end == 'd')
+		*t *= 24 * 60 * 60, end++;
+	else if (*end == 'w')
+		*t *= 7 * 24 * 60 * 60, end++;
+	else if (*end == 's')
+		end++;
+	return *end == '\0' ? 0 : -EINVAL;
+}
+
+// Parse a count for -k: a number of versions, hours, days or weeks
+static int vers_parse_count(const char *arg, int *count)
+{
+	char *end;
+
+	*count = strtol(arg, &end, 10);
+	return end == arg || *end != '\0' || *count < 0 ? -EINVAL : 0;
+}
+
+/*
+ * Parse a commit policy for -c: "close", or a comma-separated list of
+ * "time=<seconds>" and "bytes=<n>[k|m|g]"
+ */
+static int vers_parse_policy(const char *policy)
+{
+	char *copy = strdup(policy);
+	char *item, *save, *end;
+	int res = 0;
+
+	if (copy == NULL)
+		return -ENOMEM;
+
+	for (item = strtok_r(copy, ",", &save); item != NULL && res == 0;
+	     item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "close") == 0) {
+			vers_commit_interval = 0;
+			vers_commit_bytes = 0;
+		} else if (strncmp(item, "time=", 5) == 0) {
+			vers_commit_interval = strtol(item + 5, &end, 10);
+			if (end == item + 5 || *end != '\0' ||
+			    vers_commit_interval < 0)
+				res = -EINVAL;
+		} else if (strncmp(item, "bytes=", 6) == 0) {
+			res = vers_parse_size(item + 6, &vers_commit_bytes);
+		} else {
+			res = -EINVAL;
+		}
+	}
+
+	free(copy);
+	return res;
+}
+
+/*
+ * Parse a retention policy for -k: "all", or a comma-separated list of the
+ * rules above, and of "rate=<n>[k|m|g]" and "every=<seconds>"
+ */
+static int vers_parse_retention(const char *policy)
+{
+	char *copy = strdup(policy);
+	char *item, *save;
+	int res = 0;
+
+	if (copy == NULL)
+		return -ENOMEM;
+
+	for (item = strtok_r(copy, ",", &save); item != NULL && res == 0;
+	     item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "all") == 0) {
+			vers_keep_last = vers_keep_hourly = 0;
+			vers_keep_daily = vers_keep_weekly = 0;
+			vers_keep_age = 0;
+			vers_retention = 0;
+			continue;
+		}
+		vers_retention = 1;
+		if (strncmp(item, "last=", 5) == 0) {
+			res = vers_parse_count(item + 5, &vers_keep_last);
+		} else if (strncmp(item, "age=", 4) == 0) {
+			res = vers_parse_time(item + 4, &vers_keep_age);
+		} else if (strncmp(item, "hourly=", 7) == 0) {
+			res = vers_parse_count(item + 7, &vers_keep_hourly);
+		} else if (strncmp(item, "daily=", 6) == 0) {
+			res = vers_parse_count(item + 6, &vers_keep_daily);
+		} else if (strncmp(item, "weekly=", 7) == 0) {
+			res = vers_parse_count(item + 7, &vers_keep_weekly);
+		} else if (strncmp(item, "rate=", 5) == 0) {
+			res = vers_parse_size(item + 5, &vers_gc_rate);
+		} else if (strncmp(item, "every=", 6) == 0) {
+			res = vers_parse_time(item + 6, &vers_gc_every);
+			if (res == 0 && vers_gc_every == 0)
+				res = -EINVAL;
+		} else {
+			res = -EINVAL;
+		}
+	}
+
+	free(copy);
+	return res;
+}
+
+// "--cat <storage file> <version>" or "--chunk <storage directory>"
+static int vers_command(int argc, char *argv[])
+{
+	if (argc == 3 && strcmp(argv[1], "--chunk") == 0)
+	  return vers_chunk_all(argv[2]);
+	if (argc < 4 || strcmp(argv[1], "--cat") != 0)
+	  return -1;
+	// Followed by whatever the layers (if any) need to decode the data
+	if (smartfs_setup_layers(&argv[4], argc - 4) != argc - 4) {
+	  fprintf(stderr, "ERROR: Wrong arguments for the layers\n");
 	  return 1;
 	}
-	fprintf(stderr, "DEBUG: Mounting %s at %s\n", storage_dir, argv[2]);
-	int short_argc = argc - 1;
-	char* short_argv[short_argc];
-	short_argv[0] = argv[0];
-	for (int i = 2; i < argc; i += 1) {
-	  short_argv[i - 1] = argv[i];
+	return vers_cat(argv[2], atoi(argv[3]));
+}
+
+// "-c <policy>", "-k <retention>", "-r reflink|delta|chunk" or "-z lz4|none"
+static int vers_option(int argc, char *argv[], int i)
+{
+	if (i + 1 >= argc)
+	  return 0;
+	if (strcmp(argv[i], "-c") == 0) {
+	  if (vers_parse_policy(argv[i + 1]) < 0) {
+	    fprintf(stderr, "ERROR: Bad commit policy %s\n", argv[i + 1]);
+	    return -1;
+	  }
+	  return 2;
+	}
+	if (strcmp(argv[i], "-k") == 0) {
+	  if (vers_parse_retention(argv[i + 1]) < 0) {
+	    fprintf(stderr, "ERROR: Bad retention policy %s\n", argv[i + 1]);
+	    return -1;
+	  }
+	  return 2;
+	}
+	if (strcmp(argv[i], "-r") == 0) {
+	  vers_chunks = 0;
+	  if (strcmp(argv[i + 1], "reflink") == 0) {
+	    vers_reflink = 1;
+	  } else if (strcmp(argv[i + 1], "delta") == 0) {
+	    vers_reflink = 0;
+	  } else if (strcmp(argv[i + 1], "chunk") == 0) {
+	    vers_chunks = 1;
+	  } else {
+	    fprintf(stderr, "ERROR: Bad version kind %s\n", argv[i + 1]);
+	    return -1;
+	  }
+	  return 2;
+	}
+	if (strcmp(argv[i], "-z") == 0) {
+	  if (strcmp(argv[i + 1], "none") == 0) {
+	    vers_compress = 0;
+	  } else if (strcmp(argv[i + 1], "lz4") == 0 && compress_supported()) {
+	    vers_compress = 1;
+	  } else {
+	    fprintf(stderr, "ERROR: Compression %s is not available\n",
+		    argv[i + 1]);
+	    return -1;
+	  }
+	  return 2;
+	}
+	return 0;
+}
+
+static struct fuse_operations vers_oper;
+
+// Once FUSE has put us in the background, start syncing new versions and
+// looking after old ones
+static void *vers_init(struct fuse_conn_info *conn)
+{
+	pthread_t thread;
+	void *res = vers_core.init(conn);
+
+	vers_sync_start();
+	if (vers_retention || chunk_store_on()) {
+		if (pthread_create(&thread, NULL, vers_gc_thread, NULL) == 0)
+			pthread_detach(thread);
+		else
+			TRACE(TRACE_ERROR, "Failed to start the retention thread");
+	}
+	return res;
+}
+
+static const struct fuse_operations *vers_operations(void)
+{
+	int res;
+
+	if (vers_compress < 0)
+		vers_compress = compress_supported();
+
+	vers_store_setup();
+
+	// Once there are chunks, versions made with -r delta still share them
+	if (vers_chunks ||
+	    faccessat(storage_fd, VERS_CHUNKS_PATH, F_OK, 0) == 0) {
+		res = chunk_store_open(storage_fd, VERS_CHUNKS_PATH,
+				       CHUNK_WRITE |
+				       (vers_compress ? CHUNK_COMPRESS : 0));
+		if (res < 0) {
+			TRACE(TRACE_ERROR, "Could not open %s/%s: %s",
+			      storage_dir, VERS_CHUNKS_PATH, strerror(-res));
+			vers_chunks = 0;
+		}
 	}
-	return fuse_main(short_argc, short_argv, &vers_oper, NULL);
+
+	core_hide_name(VERS_STORE_NAME);
+	core_operations(&vers_oper);
+	vers_core		= vers_oper;
+	vers_oper.init		= vers_init;
+	vers_oper.getattr	= vers_getattr;
+	vers_oper.access	= vers_access;
+	vers_oper.readlink	= vers_readlink;
+	vers_oper.opendir	= vers_dir_open;
+	vers_oper.readdir	= vers_dir_read;
+	vers_oper.releasedir	= vers_dir_release;
+	vers_oper.mknod		= vers_mknod;
+	vers_oper.mkdir		= vers_mkdir;
+	vers_oper.symlink	= vers_symlink;
+	vers_oper.link		= vers_link;
+	vers_oper.chmod		= vers_chmod;
+	vers_oper.chown		= vers_chown;
+	vers_oper.utimens	= vers_core.utimens ? vers_utimens : NULL;
+	vers_oper.setxattr	= vers_core.setxattr ? vers_setxattr : NULL;
+	vers_oper.getxattr	= vers_core.getxattr ? vers_getxattr : NULL;
+	vers_oper.listxattr	= vers_core.listxattr ? vers_listxattr : NULL;
+	vers_oper.removexattr	= vers_core.removexattr ? vers_removexattr :
+						       NULL;
+	vers_oper.unlink	= vers_unlink;
+	vers_oper.rmdir		= vers_rmdir;
+	vers_oper.rename	= vers_rename;
+	vers_oper.truncate	= vers_truncate;
+	vers_oper.open		= vers_open;
+	vers_oper.read		= vers_read;
+	vers_oper.read_buf	= core_layered() ? NULL : vers_read_buf;
+	vers_oper.write		= vers_write;
+	vers_oper.write_buf	= vers_write_buf;
+	vers_oper.release	= vers_release;
+	vers_oper.fsync		= vers_fsync;
+#ifdef HAVE_POSIX_FALLOCATE
+	vers_oper.fallocate	= vers_fallocate;
+#endif
+	return &vers_oper;
 }
+
+const struct smartfs_mode vers_mode = {
+	.name		= "vers",
+	.options	= "-c <policy> | -k <retention> | "
+			  "-r reflink|delta|chunk | -z lz4|none",
+	.command	= vers_command,
+	.commands	= "--cat <storage file> <version> | "
+			  "--chunk <storage directory>",
+	.option		= vers_option,
+	.operations	= vers_operations,
+};
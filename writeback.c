@@ -0,0 +1,604 @@
+/**
+ * Write-back caching; see writeback.h.
+ *
+ * Files are found by device and inode number in a small hash table, so the
+ * handles of one file (and getattr, which only has a path) all get to the
+ * same ranges.  A file is in the table for as long as it has handles open.
+ * Deferred data is always written through the descriptor of the handle
+ * that last wrote to the file: that handle is writable, and it cannot be
+ * released without flushing the file first, so it is open for as long as
+ * there is anything to write.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef linux
+/* For pread()/pwrite() */
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <fuse.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bufpool.h"
+#include "smartfs.h"
+#include "trace.h"
+#include "writeback.h"
+
+#define WB_BUCKETS    256	// of the table of files
+#define WB_MAX_RANGES 256	// then the file is flushed, however little
+
+// Dirty data from offset on, in a buffer of room bytes
+struct wb_range {
+	off_t offset;
+	size_t size;
+	size_t room;
+	char *data;
+};
+
+struct wb_file {
+	dev_t dev;
+	ino_t ino;
+	int refs;			// handles open on it; under wb_lock
+	struct wb_file *next;
+
+	pthread_mutex_t lock;		// guards everything below
+	struct wb_range *ranges;	// sorted, apart and not touching
+	int nranges;
+	int room;
+	size_t dirty;			// bytes in the ranges
+	off_t end;			// where the last range ends, or 0
+	int fd;				// what to flush through
+	int error;			// of a deferred write on release, or 0
+};
+
+struct wb_handle {
+	int fd;
+	struct wb_file *file;
+};
+
+static size_t wb_limit = 0;
+static size_t wb_dirty = 0;		// of all files; atomic
+static struct wb_file *wb_files[WB_BUCKETS];
+static int wb_open = 0;			// files in the table; under wb_lock
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The operations that are passed on to, as core_operations() had them
+static struct fuse_operations wb_next;
+
+void writeback_init(size_t limit)
+{
+	wb_limit = limit;
+}
+
+int writeback_on(void)
+{
+	return wb_limit > 0;
+}
+
+static struct wb_handle *wb_fh(struct fuse_file_info *fi)
+{
+	return (struct wb_handle *) (uintptr_t) fi->fh;
+}
+
+static struct wb_file **wb_bucket(dev_t dev, ino_t ino)
+{
+	return &wb_files[(dev * 31 + ino) % WB_BUCKETS];
+}
+
+// The file with that device and inode number; under wb_lock
+static struct wb_file *wb_find(dev_t dev, ino_t ino)
+{
+	struct wb_file *f;
+
+	for (f = *wb_bucket(dev, ino); f != NULL; f = f->next)
+		if (f->dev == dev && f->ino == ino)
+			return f;
+	return NULL;
+}
+
+// Take a reference to the file st is about, adding it if need be
+static struct wb_file *wb_get(const struct stat *st)
+{
+	struct wb_file **bucket = wb_bucket(st->st_dev, st->st_ino);
+	struct wb_file *f;
+
+	pthread_mutex_lock(&wb_lock);
+	f = wb_find(st->st_dev, st->st_ino);
+	if (f == NULL) {
+		f = calloc(1, sizeof(*f));
+		if (f != NULL) {
+			f->dev = st->st_dev;
+			f->ino = st->st_ino;
+			f->fd = -1;
+			pthread_mutex_init(&f->lock, NULL);
+			f->next = *bucket;
+			*bucket = f;
+			wb_open++;
+		}
+	}
+	if (f != NULL)
+		f->refs++;
+	pthread_mutex_unlock(&wb_lock);
+	return f;
+}
+
+// Drop a reference; the file must have nothing left to write
+static void wb_put(struct wb_file *f)
+{
+	struct wb_file **p;
+
+	pthread_mutex_lock(&wb_lock);
+	if (--f->refs > 0) {
+		pthread_mutex_unlock(&wb_lock);
+		return;
+	}
+	for (p = wb_bucket(f->dev, f->ino); *p != f; p = &(*p)->next)
+		;
+	*p = f->next;
+	wb_open--;
+	pthread_mutex_unlock(&wb_lock);
+
+	pthread_mutex_destroy(&f->lock);
+	free(f->ranges);
+	free(f);
+}
+
+static void wb_set_dirty(struct wb_file *f, size_t dirty)
+{
+	if (dirty >= f->dirty)
+		__atomic_add_fetch(&wb_dirty, dirty - f->dirty,
+				   __ATOMIC_RELAXED);
+	else
+		__atomic_sub_fetch(&wb_dirty, f->dirty - dirty,
+				   __ATOMIC_RELAXED);
+	f->dirty = dirty;
+	__atomic_store_n(&f->end, f->nranges > 0 ?
+			 f->ranges[f->nranges - 1].offset +
+			 (off_t) f->ranges[f->nranges - 1].size : 0,
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Add a write to the ranges, merging it with every range it overlaps or
+ * touches; those always add up to one run with it, with no gaps.
+ * 0, or -ENOMEM.
+ */
+static int wb_add(struct wb_file *f, const char *buf, size_t size,
+		  off_t offset)
+{
+	off_t end = offset + size;
+	struct wb_range *r;
+	size_t dirty = f->dirty;
+	off_t start, stop;
+	int first, last, lo, hi, i;
+
+	// The first range that ends at or after offset
+	lo = 0;
+	hi = f->nranges;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		struct wb_range *m = &f->ranges[mid];
+
+		if (m->offset + (off_t) m->size < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	for (last = first;
+	     last < f->nranges && f->ranges[last].offset <= end; last++)
+		;
+
+	if (first == last) {
+		if (f->nranges == f->room) {
+			int room = f->room > 0 ? f->room * 2 : 8;
+
+			r = realloc(f->ranges, room * sizeof(*r));
+			if (r == NULL)
+				return -ENOMEM;
+			f->ranges = r;
+			f->room = room;
+		}
+		r = &f->ranges[first];
+		memmove(r + 1, r, (f->nranges - first) * sizeof(*r));
+		r->data = malloc(size);
+		if (r->data == NULL) {
+			memmove(r, r + 1, (f->nranges - first) * sizeof(*r));
+			return -ENOMEM;
+		}
+		memcpy(r->data, buf, size);
+		r->offset = offset;
+		r->size = r->room = size;
+		f->nranges++;
+		wb_set_dirty(f, dirty + size);
+		return 0;
+	}
+
+	r = &f->ranges[first];
+	start = r->offset < offset ? r->offset : offset;
+	stop = f->ranges[last - 1].offset +
+	       (off_t) f->ranges[last - 1].size;
+	if (stop < end)
+		stop = end;
+
+	if (r->offset > start || r->room < (size_t) (stop - start)) {
+		// Grow it, by half as much again so appends stay cheap
+		size_t room = stop - start;
+		char *data;
+
+		if (r->offset == start && room < r->room + r->room / 2)
+			room = r->room + r->room / 2;
+		if (r->offset == start) {
+			data = realloc(r->data, room);
+		} else {
+			data = malloc(room);
+			if (data != NULL) {
+				memcpy(data + (r->offset - start), r->data,
+				       r->size);
+				free(r->data);
+			}
+		}
+		if (data == NULL)
+			return -ENOMEM;
+		r->data = data;
+		r->room = room;
+	}
+
+	dirty -= r->size;
+	for (i = first + 1; i < last; i++) {
+		memcpy(r->data + (f->ranges[i].offset - start),
+		       f->ranges[i].data, f->ranges[i].size);
+		dirty -= f->ranges[i].size;
+		free(f->ranges[i].data);
+	}
+	memcpy(r->data + (offset - start), buf, size);
+	r->offset = start;
+	r->size = stop - start;
+	memmove(r + 1, &f->ranges[last], (f->nranges - last) * sizeof(*r));
+	f->nranges -= last - first - 1;
+	wb_set_dirty(f, dirty + r->size);
+	return 0;
+}
+
+// Forget what the ranges hold past size, as a truncate does
+static void wb_trim(struct wb_file *f, off_t size)
+{
+	size_t dirty = f->dirty;
+
+	while (f->nranges > 0) {
+		struct wb_range *r = &f->ranges[f->nranges - 1];
+
+		if (r->offset + (off_t) r->size <= size)
+			break;
+		if (r->offset < size) {
+			dirty -= r->size - (size - r->offset);
+			r->size = size - r->offset;
+			break;
+		}
+		dirty -= r->size;
+		free(r->data);
+		f->nranges--;
+	}
+	wb_set_dirty(f, dirty);
+}
+
+static int wb_pwrite_all(int fd, const char *data, size_t size, off_t offset)
+{
+	ssize_t n;
+
+	while (size > 0) {
+		n = pwrite(fd, data, size, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			return -errno;
+		data += n;
+		size -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+// Write data straight to storage, through the layers
+static int wb_write_through(int fd, const char *buf, size_t size,
+			    off_t offset)
+{
+	const char *data;
+	char *copy;
+	int res;
+
+	data = core_encode_copy(buf, size, offset, &copy);
+	if (data == NULL)
+		return -ENOMEM;
+	res = wb_pwrite_all(fd, data, size, offset);
+	bufpool_put(copy);
+	return res;
+}
+
+/*
+ * Write all the ranges out, front to back, and empty them; under f->lock.
+ * Returns 0, or the error of this or an earlier deferred write.
+ */
+static int wb_flush(struct wb_file *f)
+{
+	int res = 0;
+	int i;
+
+	for (i = 0; i < f->nranges; i++) {
+		struct wb_range *r = &f->ranges[i];
+
+		if (res == 0)
+			res = wb_write_through(f->fd, r->data, r->size,
+					       r->offset);
+		free(r->data);
+	}
+	if (res < 0 && f->nranges > 0)
+		TRACE(TRACE_ERROR, "Could not write back %zu bytes: %s",
+		      f->dirty, strerror(-res));
+	f->nranges = 0;
+	wb_set_dirty(f, 0);
+
+	if (res == 0)
+		res = f->error;
+	f->error = 0;
+	return res;
+}
+
+/*
+ * Operations
+ */
+
+static int wb_getattr(const char *path, struct stat *stbuf)
+{
+	struct wb_file *f;
+	off_t end;
+	int res;
+
+	res = wb_next.getattr(path, stbuf);
+	if (res < 0 || !S_ISREG(stbuf->st_mode) ||
+	    __atomic_load_n(&wb_open, __ATOMIC_RELAXED) == 0)
+		return res;
+
+	// The file is as long as its dirty data says, if that is longer
+	pthread_mutex_lock(&wb_lock);
+	f = wb_find(stbuf->st_dev, stbuf->st_ino);
+	end = f != NULL ? __atomic_load_n(&f->end, __ATOMIC_RELAXED) : 0;
+	pthread_mutex_unlock(&wb_lock);
+	if (end > stbuf->st_size)
+		stbuf->st_size = end;
+	return 0;
+}
+
+static int wb_truncate(const char *path, off_t size)
+{
+	struct wb_file *f = NULL;
+	struct stat st;
+	int res;
+
+	// What is still to be written past size would come back to life
+	if (__atomic_load_n(&wb_open, __ATOMIC_RELAXED) > 0 &&
+	    fstatat(storage_fd, storage_rel(path), &st, 0) == 0 &&
+	    S_ISREG(st.st_mode))
+		f = wb_get(&st);
+	if (f != NULL)
+		pthread_mutex_lock(&f->lock);
+	res = wb_next.truncate(path, size);
+	if (f != NULL) {
+		if (res == 0)
+			wb_trim(f, size);
+		pthread_mutex_unlock(&f->lock);
+		wb_put(f);
+	}
+	return res;
+}
+
+static int wb_open_file(const char *path, struct fuse_file_info *fi)
+{
+	struct wb_handle *h;
+	struct stat st;
+	int flags = fi->flags;
+	int res;
+
+	// The file's ranges go out through whichever handle wrote last,
+	// at their own offsets (the kernel has already put appends at
+	// the end), and reading back over them needs read access where
+	// the file allows it
+	if ((flags & O_ACCMODE) == O_WRONLY)
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	flags &= ~O_APPEND;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL)
+		return -ENOMEM;
+	h->fd = openat(storage_fd, storage_rel(path), flags);
+	if (h->fd == -1 && errno == EACCES &&
+	    (fi->flags & O_ACCMODE) == O_WRONLY)
+		h->fd = openat(storage_fd, storage_rel(path),
+			       fi->flags & ~O_APPEND);
+	if (h->fd == -1) {
+		res = -errno;
+		free(h);
+		return res;
+	}
+	h->file = fstat(h->fd, &st) == 0 ? wb_get(&st) : NULL;
+	if (h->file == NULL) {
+		close(h->fd);
+		free(h);
+		return -ENOMEM;
+	}
+
+	// Whatever was written before the truncate is gone
+	if (flags & O_TRUNC) {
+		pthread_mutex_lock(&h->file->lock);
+		wb_trim(h->file, 0);
+		pthread_mutex_unlock(&h->file->lock);
+	}
+
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
+
+static int wb_read(const char *path, char *buf, size_t size, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	struct wb_handle *h = wb_fh(fi);
+	struct wb_file *f = h->file;
+	off_t end = offset + size;
+	ssize_t res;
+	size_t have;
+	int i;
+
+	TRACE(TRACE_DEBUG, "Reading from %s", path);
+
+	pthread_mutex_lock(&f->lock);
+	if (f->nranges == 0) {
+		pthread_mutex_unlock(&f->lock);
+		return core_pread(h->fd, buf, size, offset);
+	}
+
+	// Storage first, then the dirty data laid over it, which may go
+	// on past the end of the stored file (the gap reading as zeroes)
+	res = core_pread(h->fd, buf, size, offset);
+	if (res < 0) {
+		pthread_mutex_unlock(&f->lock);
+		return res;
+	}
+	have = res;
+	if (f->end > offset + (off_t) have) {
+		size_t upto = (f->end < end ? f->end : end) - offset;
+
+		memset(buf + have, 0, upto - have);
+		have = upto;
+	}
+	for (i = 0; i < f->nranges; i++) {
+		struct wb_range *r = &f->ranges[i];
+		off_t from = r->offset > offset ? r->offset : offset;
+		off_t to = r->offset + (off_t) r->size;
+
+		if (to > end)
+			to = end;
+		if (from < to)
+			memcpy(buf + (from - offset),
+			       r->data + (from - r->offset), to - from);
+	}
+	pthread_mutex_unlock(&f->lock);
+	return have;
+}
+
+static int wb_write(const char *path, const char *buf, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	struct wb_handle *h = wb_fh(fi);
+	struct wb_file *f = h->file;
+	int res;
+
+	TRACE(TRACE_DEBUG, "Writing to %s", path);
+
+	pthread_mutex_lock(&f->lock);
+	f->fd = h->fd;
+	res = wb_add(f, buf, size, offset);
+	if (res < 0) {
+		// Nowhere to keep it: write everything out, this too
+		res = wb_flush(f);
+		if (res == 0)
+			res = wb_write_through(h->fd, buf, size, offset);
+	} else if (__atomic_load_n(&wb_dirty, __ATOMIC_RELAXED) > wb_limit ||
+		   f->nranges > WB_MAX_RANGES) {
+		res = wb_flush(f);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	invalidate_attrs(path);
+	return res < 0 ? res : (int) size;
+}
+
+static int wb_flush_file(const char *path, struct fuse_file_info *fi)
+{
+	struct wb_file *f = wb_fh(fi)->file;
+	int res;
+
+	pthread_mutex_lock(&f->lock);
+	res = wb_flush(f);
+	pthread_mutex_unlock(&f->lock);
+
+	if (path != NULL)
+		invalidate_attrs(path);
+	return res;
+}
+
+static int wb_release(const char *path, struct fuse_file_info *fi)
+{
+	struct wb_handle *h = wb_fh(fi);
+	struct wb_file *f = h->file;
+
+	// A flush has happened already, unless writing went on after it
+	pthread_mutex_lock(&f->lock);
+	f->error = wb_flush(f);		// for any other handle to report
+	pthread_mutex_unlock(&f->lock);
+	if (path != NULL)
+		invalidate_attrs(path);
+	close(h->fd);
+	wb_put(h->file);
+	free(h);
+	return 0;
+}
+
+static int wb_fsync(const char *path, int isdatasync,
+		    struct fuse_file_info *fi)
+{
+	struct wb_handle *h = wb_fh(fi);
+	int res;
+
+	res = wb_flush_file(path, fi);
+	if (res == 0 && (isdatasync ? fdatasync(h->fd) : fsync(h->fd)) == -1)
+		res = -errno;
+	return res;
+}
+
+#ifdef HAVE_POSIX_FALLOCATE
+static int wb_fallocate(const char *path, int mode, off_t offset,
+			off_t length, struct fuse_file_info *fi)
+{
+	int res;
+
+	if (mode)
+		return -EOPNOTSUPP;
+
+	res = -posix_fallocate(wb_fh(fi)->fd, offset, length);
+	if (res == 0)
+		invalidate_attrs(path);
+	return res;
+}
+#endif
+
+void writeback_operations(struct fuse_operations *ops)
+{
+	if (!writeback_on())
+		return;
+
+	wb_next = *ops;
+	ops->getattr	= wb_getattr;
+	ops->truncate	= wb_truncate;
+	ops->open	= wb_open_file;
+	ops->read	= wb_read;
+	ops->read_buf	= NULL;		// the dirty data is laid over it
+	ops->write	= wb_write;
+	ops->write_buf	= NULL;
+	ops->flush	= wb_flush_file;
+	ops->release	= wb_release;
+	ops->fsync	= wb_fsync;
+#ifdef HAVE_POSIX_FALLOCATE
+	ops->fallocate	= wb_fallocate;
+#endif
+}
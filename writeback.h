@@ -0,0 +1,36 @@
+/**
+ * Write-back caching for the passthrough operations.  Writes are kept in
+ * memory, per file, as ranges of dirty data sorted by offset; a write next
+ * to or over others is merged into one range with them, so a stream of small
+ * writes (a log, a database going page by page) reaches the storage
+ * directory as a few large, sequential ones.  Every handle of a file shares
+ * its ranges, so reads through any of them, and getattr, see the data at
+ * once.
+ *
+ * A file's ranges go to storage, in order of offset, when it is flushed
+ * (on every close()), fsync()ed or released, and when the dirty data of all
+ * files together goes over the limit given to writeback_init(): then the
+ * file being written to is flushed there and then.  A failure to write data
+ * later than it was handed to us is returned by the next flush or fsync.
+ *
+ * Include this after <fuse.h>.
+ */
+
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stddef.h>
+
+// How many bytes of dirty data to keep in all, at most; 0 (the default) is off
+void writeback_init(size_t limit);
+
+// Whether write-back caching is on
+int writeback_on(void);
+
+/*
+ * Replaces the operations in ops that move file data (as core_operations()
+ * fills them in) with write-back ones, if it is on.  Call once.
+ */
+void writeback_operations(struct fuse_operations *ops);
+
+#endif /* WRITEBACK_H */